@@ -0,0 +1,967 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "anasys_core.h"
+#include "anasys_catalog.h"
+
+#include <libxml/xmlreader.h>
+
+#define strequal(a, b) xmlStrEqual((a), (const xmlChar*)(b))
+
+#define CATALOG_MAGIC "ANASYSCT"
+#define CATALOG_MAGIC_SIZE (sizeof(CATALOG_MAGIC) - 1)
+#define CATALOG_VERSION 1
+
+/* String id or value code of nothing. */
+#define NO_VALUE G_MAXUINT32
+
+/* A file and its rows, which are consecutive. */
+typedef struct {
+    guint32 path;
+    guint64 size;
+    gint64 mtime;
+    guint32 first_row;
+    guint32 nrows;
+} CatalogFile;
+
+/* A distinct Tag Value; number is NaN when it does not start with one. */
+typedef struct {
+    gdouble number;
+    guint32 unit;
+    guint32 text;
+} CatalogValue;
+
+/* A Tag Name: the dictionary of its values and the code of the value of
+ * each row.  The lookup from text to code is only kept while building. */
+typedef struct {
+    guint32 name;
+    GArray *values;
+    GArray *codes;
+    GHashTable *lookup;
+} CatalogColumn;
+
+struct _AnasysCatalog {
+    GPtrArray *strings;
+    GHashTable *string_ids;
+    GArray *files;
+    GArray *row_file;
+    GArray *row_channel;
+    GArray *row_datachannel;
+    GArray *row_label;
+    GPtrArray *columns;
+    GHashTable *column_ids;
+};
+
+/* A HeightMap found by scan_file(), added once the whole file is read. */
+typedef struct {
+    guint id;
+    gchar *datachannel;
+    gchar *label;
+    GPtrArray *tags;
+    gboolean has_data;
+} ScannedMap;
+
+static AnasysCatalog* catalog_new         (void);
+static guint32        catalog_intern      (AnasysCatalog *catalog,
+                                           const gchar *str);
+static const gchar*   catalog_string      (const AnasysCatalog *catalog,
+                                           guint32 id);
+static guint          catalog_add_row     (AnasysCatalog *catalog,
+                                           guint file,
+                                           guint id,
+                                           const gchar *datachannel,
+                                           const gchar *label);
+static void           catalog_set_tag     (AnasysCatalog *catalog,
+                                           guint row,
+                                           const gchar *name,
+                                           const gchar *text);
+static CatalogColumn* column_new          (AnasysCatalog *catalog,
+                                           guint32 name);
+static void           column_free         (gpointer p);
+static void           scan_directory      (AnasysCatalog *catalog,
+                                           const gchar *directory,
+                                           const AnasysCatalog *previous,
+                                           GHashTable *previous_files);
+static void           add_file            (AnasysCatalog *catalog,
+                                           const gchar *filename,
+                                           const AnasysCatalog *previous,
+                                           GHashTable *previous_files);
+static gboolean       scan_file           (const gchar *filename,
+                                           GPtrArray *maps);
+static void           scanned_map_free    (gpointer p);
+static void           copy_rows           (AnasysCatalog *catalog,
+                                           guint file,
+                                           const AnasysCatalog *previous,
+                                           const CatalogFile *old);
+static gint           compare_names       (gconstpointer a,
+                                           gconstpointer b);
+static void           parse_value         (const gchar *text,
+                                           gdouble *number,
+                                           gchar **unit);
+static gboolean       is_data_file        (const gchar *filename);
+
+static AnasysCatalog*
+catalog_new(void)
+{
+    AnasysCatalog *catalog = g_new0(AnasysCatalog, 1);
+
+    catalog->strings = g_ptr_array_new_with_free_func(g_free);
+    catalog->string_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    catalog->files = g_array_new(FALSE, FALSE, sizeof(CatalogFile));
+    catalog->row_file = g_array_new(FALSE, FALSE, sizeof(guint32));
+    catalog->row_channel = g_array_new(FALSE, FALSE, sizeof(guint32));
+    catalog->row_datachannel = g_array_new(FALSE, FALSE, sizeof(guint32));
+    catalog->row_label = g_array_new(FALSE, FALSE, sizeof(guint32));
+    catalog->columns = g_ptr_array_new_with_free_func(column_free);
+    catalog->column_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    return catalog;
+}
+
+void
+anasys_catalog_free(AnasysCatalog *catalog)
+{
+    if (!catalog)
+        return;
+    g_hash_table_destroy(catalog->column_ids);
+    g_ptr_array_free(catalog->columns, TRUE);
+    g_array_free(catalog->row_label, TRUE);
+    g_array_free(catalog->row_datachannel, TRUE);
+    g_array_free(catalog->row_channel, TRUE);
+    g_array_free(catalog->row_file, TRUE);
+    g_array_free(catalog->files, TRUE);
+    g_hash_table_destroy(catalog->string_ids);
+    g_ptr_array_free(catalog->strings, TRUE);
+    g_free(catalog);
+}
+
+/* Catalog the HeightMaps of all .axd and .axz files under directory.  Files
+ * whose size and modification time are those recorded in previous, if
+ * given, are taken from it instead of being read again.  Files that are
+ * not Analysis Studio documents or cannot be read are left out. */
+AnasysCatalog*
+anasys_catalog_build(const gchar *directory, const AnasysCatalog *previous,
+                     GError **error)
+{
+    AnasysCatalog *catalog;
+    GHashTable *previous_files = NULL;
+    guint i;
+
+    if (!g_file_test(directory, G_FILE_TEST_IS_DIR)) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "`%s' is not a directory.", directory);
+        return NULL;
+    }
+    anasys_init();
+    if (previous) {
+        previous_files = g_hash_table_new(g_str_hash, g_str_equal);
+        for (i = 0; i < previous->files->len; i++) {
+            g_hash_table_insert(previous_files,
+                                (gpointer)anasys_catalog_get_file(previous,
+                                                                  i),
+                                GUINT_TO_POINTER(i + 1));
+        }
+    }
+    catalog = catalog_new();
+    scan_directory(catalog, directory, previous, previous_files);
+    if (previous_files)
+        g_hash_table_destroy(previous_files);
+    return catalog;
+}
+
+guint
+anasys_catalog_get_n_files(const AnasysCatalog *catalog)
+{
+    return catalog->files->len;
+}
+
+const gchar*
+anasys_catalog_get_file(const AnasysCatalog *catalog, guint i)
+{
+    g_return_val_if_fail(i < catalog->files->len, NULL);
+    return catalog_string(catalog,
+                          g_array_index(catalog->files, CatalogFile, i).path);
+}
+
+guint
+anasys_catalog_get_n_rows(const AnasysCatalog *catalog)
+{
+    return catalog->row_file->len;
+}
+
+/* The index of the file of the row, for anasys_catalog_get_file(). */
+guint
+anasys_catalog_get_row_file(const AnasysCatalog *catalog, guint row)
+{
+    g_return_val_if_fail(row < catalog->row_file->len, 0);
+    return g_array_index(catalog->row_file, guint32, row);
+}
+
+guint
+anasys_catalog_get_channel_id(const AnasysCatalog *catalog, guint row)
+{
+    g_return_val_if_fail(row < catalog->row_channel->len, 0);
+    return g_array_index(catalog->row_channel, guint32, row);
+}
+
+const gchar*
+anasys_catalog_get_data_channel(const AnasysCatalog *catalog, guint row)
+{
+    g_return_val_if_fail(row < catalog->row_datachannel->len, NULL);
+    return catalog_string(catalog,
+                          g_array_index(catalog->row_datachannel, guint32,
+                                        row));
+}
+
+const gchar*
+anasys_catalog_get_label(const AnasysCatalog *catalog, guint row)
+{
+    g_return_val_if_fail(row < catalog->row_label->len, NULL);
+    return catalog_string(catalog,
+                          g_array_index(catalog->row_label, guint32, row));
+}
+
+guint
+anasys_catalog_get_n_tags(const AnasysCatalog *catalog)
+{
+    return catalog->columns->len;
+}
+
+const gchar*
+anasys_catalog_get_tag_name(const AnasysCatalog *catalog, guint tag)
+{
+    const CatalogColumn *column;
+
+    g_return_val_if_fail(tag < catalog->columns->len, NULL);
+    column = g_ptr_array_index(catalog->columns, tag);
+    return catalog_string(catalog, column->name);
+}
+
+/* The column of the Tag Name, or -1 if no HeightMap has it. */
+gint
+anasys_catalog_find_tag(const AnasysCatalog *catalog, const gchar *name)
+{
+    return GPOINTER_TO_UINT(g_hash_table_lookup(catalog->column_ids,
+                                                name)) - 1;
+}
+
+/* The value of a Tag of a row.  Returns FALSE if the HeightMap does not
+ * have it.  The number is NaN and the unit NULL for values that do not
+ * start with a number. */
+gboolean
+anasys_catalog_get_value(const AnasysCatalog *catalog,
+                         guint tag, guint row,
+                         gdouble *number, const gchar **unit,
+                         const gchar **text)
+{
+    const CatalogColumn *column;
+    const CatalogValue *value;
+    guint32 code;
+
+    g_return_val_if_fail(tag < catalog->columns->len, FALSE);
+    g_return_val_if_fail(row < catalog->row_file->len, FALSE);
+    column = g_ptr_array_index(catalog->columns, tag);
+    if ((code = g_array_index(column->codes, guint32, row)) == NO_VALUE)
+        return FALSE;
+    value = &g_array_index(column->values, CatalogValue, code);
+    if (number)
+        *number = value->number;
+    if (unit)
+        *unit = catalog_string(catalog, value->unit);
+    if (text)
+        *text = catalog_string(catalog, value->text);
+    return TRUE;
+}
+
+/* Keep the rows whose value matches, given a match for each distinct
+ * value.  With rows NULL all rows are considered and a new array is
+ * returned, otherwise rows is filtered in place. */
+static GArray*
+select_rows(const CatalogColumn *column, const gboolean *matches,
+            GArray *rows)
+{
+    const guint32 *codes = (const guint32*)column->codes->data;
+    guint32 *r;
+    guint i, j, n;
+
+    if (!rows) {
+        n = column->codes->len;
+        rows = g_array_new(FALSE, FALSE, sizeof(guint));
+        for (i = 0; i < n; i++) {
+            if (codes[i] != NO_VALUE && matches[codes[i]])
+                g_array_append_val(rows, i);
+        }
+        return rows;
+    }
+    r = (guint32*)rows->data;
+    for (i = j = 0; i < rows->len; i++) {
+        if (r[i] < column->codes->len
+            && codes[r[i]] != NO_VALUE && matches[codes[r[i]]])
+            r[j++] = r[i];
+    }
+    g_array_set_size(rows, j);
+    return rows;
+}
+
+/* Select rows whose Tag is a number in [min, max].  If unit is not NULL,
+ * the unit must be the same too. */
+GArray*
+anasys_catalog_select_number(const AnasysCatalog *catalog, guint tag,
+                             gdouble min, gdouble max, const gchar *unit,
+                             GArray *rows)
+{
+    const CatalogColumn *column;
+    const CatalogValue *value;
+    gboolean *matches;
+    guint i;
+
+    g_return_val_if_fail(tag < catalog->columns->len, rows);
+    column = g_ptr_array_index(catalog->columns, tag);
+    matches = g_new(gboolean, MAX(column->values->len, 1));
+    for (i = 0; i < column->values->len; i++) {
+        value = &g_array_index(column->values, CatalogValue, i);
+        matches[i] = (value->number >= min && value->number <= max
+                      && (!unit
+                          || !g_strcmp0(catalog_string(catalog, value->unit),
+                                        unit)));
+    }
+    rows = select_rows(column, matches, rows);
+    g_free(matches);
+    return rows;
+}
+
+/* Select rows whose Tag is the text, ignoring ASCII case. */
+GArray*
+anasys_catalog_select_text(const AnasysCatalog *catalog, guint tag,
+                           const gchar *text, GArray *rows)
+{
+    const CatalogColumn *column;
+    const CatalogValue *value;
+    gboolean *matches;
+    guint i;
+
+    g_return_val_if_fail(tag < catalog->columns->len, rows);
+    column = g_ptr_array_index(catalog->columns, tag);
+    matches = g_new(gboolean, MAX(column->values->len, 1));
+    for (i = 0; i < column->values->len; i++) {
+        value = &g_array_index(column->values, CatalogValue, i);
+        matches[i] = !g_ascii_strcasecmp(catalog_string(catalog, value->text),
+                                         text);
+    }
+    rows = select_rows(column, matches, rows);
+    g_free(matches);
+    return rows;
+}
+
+static guint32
+catalog_intern(AnasysCatalog *catalog, const gchar *str)
+{
+    gpointer id;
+    gchar *copy;
+
+    if (!str)
+        return NO_VALUE;
+    if ((id = g_hash_table_lookup(catalog->string_ids, str)))
+        return GPOINTER_TO_UINT(id) - 1;
+    copy = g_strdup(str);
+    g_ptr_array_add(catalog->strings, copy);
+    g_hash_table_insert(catalog->string_ids, copy,
+                        GUINT_TO_POINTER(catalog->strings->len));
+    return catalog->strings->len - 1;
+}
+
+static const gchar*
+catalog_string(const AnasysCatalog *catalog, guint32 id)
+{
+    if (id >= catalog->strings->len)
+        return NULL;
+    return g_ptr_array_index(catalog->strings, id);
+}
+
+/* Add a row with no Tags. */
+static guint
+catalog_add_row(AnasysCatalog *catalog, guint file, guint id,
+                const gchar *datachannel, const gchar *label)
+{
+    CatalogColumn *column;
+    guint32 value;
+    guint i;
+
+    value = file;
+    g_array_append_val(catalog->row_file, value);
+    value = id;
+    g_array_append_val(catalog->row_channel, value);
+    value = catalog_intern(catalog, datachannel);
+    g_array_append_val(catalog->row_datachannel, value);
+    value = catalog_intern(catalog, label);
+    g_array_append_val(catalog->row_label, value);
+    value = NO_VALUE;
+    for (i = 0; i < catalog->columns->len; i++) {
+        column = g_ptr_array_index(catalog->columns, i);
+        g_array_append_val(column->codes, value);
+    }
+    g_array_index(catalog->files, CatalogFile, file).nrows++;
+    return catalog->row_file->len - 1;
+}
+
+/* Set a Tag of a row, adding the column and the value to its dictionary
+ * as needed. */
+static void
+catalog_set_tag(AnasysCatalog *catalog, guint row,
+                const gchar *name, const gchar *text)
+{
+    CatalogColumn *column;
+    CatalogValue value;
+    gpointer p;
+    gchar *unit;
+    guint32 code;
+
+    if (!name || !text)
+        return;
+    if ((p = g_hash_table_lookup(catalog->column_ids, name)))
+        column = g_ptr_array_index(catalog->columns, GPOINTER_TO_UINT(p) - 1);
+    else
+        column = column_new(catalog, catalog_intern(catalog, name));
+
+    value.text = catalog_intern(catalog, text);
+    if ((p = g_hash_table_lookup(column->lookup, GUINT_TO_POINTER(value.text))))
+        code = GPOINTER_TO_UINT(p) - 1;
+    else {
+        parse_value(text, &value.number, &unit);
+        value.unit = catalog_intern(catalog, unit);
+        g_free(unit);
+        g_array_append_val(column->values, value);
+        code = column->values->len - 1;
+        g_hash_table_insert(column->lookup, GUINT_TO_POINTER(value.text),
+                            GUINT_TO_POINTER(code + 1));
+    }
+    g_array_index(column->codes, guint32, row) = code;
+}
+
+/* A new column, with no value in the rows so far. */
+static CatalogColumn*
+column_new(AnasysCatalog *catalog, guint32 name)
+{
+    CatalogColumn *column = g_new0(CatalogColumn, 1);
+    guint32 value = NO_VALUE;
+    guint i;
+
+    column->name = name;
+    column->values = g_array_new(FALSE, FALSE, sizeof(CatalogValue));
+    column->codes = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+                                      catalog->row_file->len);
+    for (i = 0; i < catalog->row_file->len; i++)
+        g_array_append_val(column->codes, value);
+    column->lookup = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_ptr_array_add(catalog->columns, column);
+    g_hash_table_insert(catalog->column_ids,
+                        (gpointer)catalog_string(catalog, name),
+                        GUINT_TO_POINTER(catalog->columns->len));
+    return column;
+}
+
+static void
+column_free(gpointer p)
+{
+    CatalogColumn *column = (CatalogColumn*)p;
+
+    g_array_free(column->values, TRUE);
+    g_array_free(column->codes, TRUE);
+    if (column->lookup)
+        g_hash_table_destroy(column->lookup);
+    g_free(column);
+}
+
+static gint
+compare_names(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(*(const gchar* const*)a, *(const gchar* const*)b);
+}
+
+/* Walk the directory tree in name order, so that rebuilding an unchanged
+ * tree gives the same catalog.  Symbolic links to directories are not
+ * followed. */
+static void
+scan_directory(AnasysCatalog *catalog, const gchar *directory,
+               const AnasysCatalog *previous, GHashTable *previous_files)
+{
+    GPtrArray *names;
+    const gchar *name;
+    gchar *path;
+    GDir *dir;
+    guint i;
+
+    if (!(dir = g_dir_open(directory, 0, NULL)))
+        return;
+    names = g_ptr_array_new_with_free_func(g_free);
+    while ((name = g_dir_read_name(dir)))
+        g_ptr_array_add(names, g_strdup(name));
+    g_dir_close(dir);
+    g_ptr_array_sort(names, compare_names);
+    for (i = 0; i < names->len; i++) {
+        path = g_build_filename(directory, g_ptr_array_index(names, i), NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            if (!g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+                scan_directory(catalog, path, previous, previous_files);
+        }
+        else if (is_data_file(path))
+            add_file(catalog, path, previous, previous_files);
+        g_free(path);
+    }
+    g_ptr_array_free(names, TRUE);
+}
+
+static void
+add_file(AnasysCatalog *catalog, const gchar *filename,
+         const AnasysCatalog *previous, GHashTable *previous_files)
+{
+    const CatalogFile *old = NULL;
+    const ScannedMap *map;
+    CatalogFile file;
+    GPtrArray *maps;
+    GStatBuf st;
+    guint i, j, fileno, row;
+
+    if (g_stat(filename, &st) != 0)
+        return;
+    memset(&file, 0, sizeof(file));
+    file.size = st.st_size;
+    file.mtime = st.st_mtime;
+    file.first_row = catalog->row_file->len;
+    if (previous_files
+        && (i = GPOINTER_TO_UINT(g_hash_table_lookup(previous_files,
+                                                     filename)))) {
+        old = &g_array_index(previous->files, CatalogFile, i-1);
+        if (old->size != file.size || old->mtime != file.mtime)
+            old = NULL;
+    }
+
+    if (old) {
+        file.path = catalog_intern(catalog, filename);
+        g_array_append_val(catalog->files, file);
+        copy_rows(catalog, catalog->files->len - 1, previous, old);
+        return;
+    }
+
+    maps = g_ptr_array_new_with_free_func(scanned_map_free);
+    if (scan_file(filename, maps)) {
+        file.path = catalog_intern(catalog, filename);
+        g_array_append_val(catalog->files, file);
+        fileno = catalog->files->len - 1;
+        for (i = 0; i < maps->len; i++) {
+            map = g_ptr_array_index(maps, i);
+            if (!map->has_data)
+                continue;
+            row = catalog_add_row(catalog, fileno, map->id,
+                                  map->datachannel, map->label);
+            for (j = 0; j + 1 < map->tags->len; j += 2) {
+                catalog_set_tag(catalog, row,
+                                g_ptr_array_index(map->tags, j),
+                                g_ptr_array_index(map->tags, j+1));
+            }
+        }
+    }
+    g_ptr_array_free(maps, TRUE);
+}
+
+/* Take the rows of a file over from the previous catalog. */
+static void
+copy_rows(AnasysCatalog *catalog, guint file,
+          const AnasysCatalog *previous, const CatalogFile *old)
+{
+    const gchar *text;
+    guint i, k, row;
+
+    for (i = old->first_row; i < old->first_row + old->nrows; i++) {
+        row = catalog_add_row(catalog, file,
+                              anasys_catalog_get_channel_id(previous, i),
+                              anasys_catalog_get_data_channel(previous, i),
+                              anasys_catalog_get_label(previous, i));
+        for (k = 0; k < previous->columns->len; k++) {
+            if (anasys_catalog_get_value(previous, k, i, NULL, NULL, &text))
+                catalog_set_tag(catalog, row,
+                                anasys_catalog_get_tag_name(previous, k),
+                                text);
+        }
+    }
+}
+
+/* Stream through the document collecting the DataChannel, Label and Tags
+ * of HeightMaps.  Everything else is skipped over without building any
+ * tree, the payloads included.  HeightMaps are counted as the core counts
+ * them, by position.  Returns FALSE for files that are not Analysis Studio
+ * documents or fail to parse. */
+static gboolean
+scan_file(const gchar *filename, GPtrArray *maps)
+{
+    xmlTextReader *reader;
+    ScannedMap *map = NULL;
+    const xmlChar *name;
+    xmlChar *doctype, *version, *tagname, *tagvalue;
+    gboolean in_maps = FALSE, in_tags = FALSE, skip = FALSE, ok = FALSE;
+    guint id = 0;
+    gint ret, depth;
+
+    reader = xmlReaderForFile(filename, NULL,
+                              XML_PARSE_NOERROR | XML_PARSE_NOWARNING
+                              | XML_PARSE_HUGE);
+    if (!reader)
+        return FALSE;
+    while ((ret = skip ? xmlTextReaderNext(reader)
+                       : xmlTextReaderRead(reader)) == 1) {
+        skip = FALSE;
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+            continue;
+        depth = xmlTextReaderDepth(reader);
+        name = xmlTextReaderConstLocalName(reader);
+        if (depth == 0) {
+            doctype = xmlTextReaderGetAttribute(reader,
+                                                (const xmlChar*)"DocType");
+            version = xmlTextReaderGetAttribute(reader,
+                                                (const xmlChar*)"Version");
+            ok = (strequal(name, "Document")
+                  && !(strequal(doctype, "IR") - strequal(version, "1.0")));
+            xmlFree(doctype);
+            xmlFree(version);
+            if (!ok)
+                break;
+        }
+        else if (depth == 1) {
+            in_maps = strequal(name, "HeightMaps");
+            skip = !in_maps;
+        }
+        else if (depth == 2 && in_maps) {
+            map = g_new0(ScannedMap, 1);
+            map->id = ++id;
+            map->datachannel
+                = (gchar*)xmlTextReaderGetAttribute(reader,
+                                                    (const xmlChar*)"DataChannel");
+            map->label
+                = (gchar*)xmlTextReaderGetAttribute(reader,
+                                                    (const xmlChar*)"Label");
+            map->tags = g_ptr_array_new_with_free_func(xmlFree);
+            g_ptr_array_add(maps, map);
+        }
+        else if (depth == 3 && map) {
+            in_tags = strequal(name, "Tags");
+            if (strequal(name, "SampleBase64")
+                && !xmlTextReaderIsEmptyElement(reader))
+                map->has_data = TRUE;
+            skip = !in_tags;
+        }
+        else if (depth == 4 && in_tags && strequal(name, "Tag")) {
+            tagname = xmlTextReaderGetAttribute(reader,
+                                                (const xmlChar*)"Name");
+            tagvalue = xmlTextReaderGetAttribute(reader,
+                                                 (const xmlChar*)"Value");
+            if (tagname && tagvalue) {
+                g_ptr_array_add(map->tags, tagname);
+                g_ptr_array_add(map->tags, tagvalue);
+            }
+            else {
+                xmlFree(tagname);
+                xmlFree(tagvalue);
+            }
+            skip = TRUE;
+        }
+        else
+            skip = TRUE;
+    }
+    xmlFreeTextReader(reader);
+    return ok && ret == 0;
+}
+
+static void
+scanned_map_free(gpointer p)
+{
+    ScannedMap *map = (ScannedMap*)p;
+
+    xmlFree(map->datachannel);
+    xmlFree(map->label);
+    g_ptr_array_free(map->tags, TRUE);
+    g_free(map);
+}
+
+/* Split a Tag Value such as "1466 cm-1" or "-2.5V" into the number and
+ * the unit after it.  Values that do not start like a number, or go on
+ * with anything but a single word starting with a letter, e.g. dates, are
+ * only text: the number is NaN and the unit NULL. */
+static void
+parse_value(const gchar *text, gdouble *number, gchar **unit)
+{
+    const gchar *p = text;
+    gchar *end, *rest;
+
+    *number = NAN;
+    *unit = NULL;
+    while (g_ascii_isspace(*p))
+        p++;
+    if (!g_ascii_isdigit(*p) && *p != '-' && *p != '+' && *p != '.')
+        return;
+    *number = g_ascii_strtod(p, &end);
+    if (end == p) {
+        *number = NAN;
+        return;
+    }
+    rest = g_strstrip(g_strdup(end));
+    if (!*rest) {
+        g_free(rest);
+        return;
+    }
+    if (strpbrk(rest, " \t\r\n")
+        || !(g_unichar_isalpha(g_utf8_get_char_validated(rest, -1))
+             || *rest == '%' || g_str_has_prefix(rest, "\xc2\xb0"))) {
+        *number = NAN;
+        g_free(rest);
+        return;
+    }
+    *unit = rest;
+}
+
+static gboolean
+is_data_file(const gchar *filename)
+{
+    gchar *lower = g_ascii_strdown(filename, -1);
+    gboolean ok;
+
+    ok = g_str_has_suffix(lower, ".axd") || g_str_has_suffix(lower, ".axz");
+    g_free(lower);
+    return ok;
+}
+
+static inline void
+put_u32(GByteArray *buffer, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static inline void
+put_u64(GByteArray *buffer, guint64 value)
+{
+    value = GUINT64_TO_LE(value);
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static inline void
+put_array(GByteArray *buffer, const GArray *array)
+{
+    guint i;
+
+    for (i = 0; i < array->len; i++)
+        put_u32(buffer, g_array_index(array, guint32, i));
+}
+
+static inline gboolean
+get_u32(const guchar **p, const guchar *end, guint32 *value)
+{
+    if ((gsize)(end - *p) < sizeof(guint32))
+        return FALSE;
+    memcpy(value, *p, sizeof(guint32));
+    *value = GUINT32_FROM_LE(*value);
+    *p += sizeof(guint32);
+    return TRUE;
+}
+
+static inline gboolean
+get_u64(const guchar **p, const guchar *end, guint64 *value)
+{
+    if ((gsize)(end - *p) < sizeof(guint64))
+        return FALSE;
+    memcpy(value, *p, sizeof(guint64));
+    *value = GUINT64_FROM_LE(*value);
+    *p += sizeof(guint64);
+    return TRUE;
+}
+
+/* Read n ids, each of which must be below limit or NO_VALUE. */
+static gboolean
+get_array(const guchar **p, const guchar *end, GArray *array, guint n,
+          guint32 limit)
+{
+    guint32 value;
+    guint i;
+
+    if ((gsize)(end - *p)/sizeof(guint32) < n)
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        get_u32(p, end, &value);
+        if (value >= limit && value != NO_VALUE)
+            return FALSE;
+        g_array_append_val(array, value);
+    }
+    return TRUE;
+}
+
+/* The catalog file holds the magic, version and counts, then the strings,
+ * the files, the row columns and the Tag columns, each a dictionary and
+ * the codes of all rows.  Numbers are 32bit little endian, except for file
+ * stamps and Tag numbers, which are 64bit. */
+gboolean
+anasys_catalog_save(const AnasysCatalog *catalog, const gchar *filename,
+                    GError **error)
+{
+    GByteArray *buffer = g_byte_array_new();
+    const CatalogColumn *column;
+    const CatalogValue *value;
+    const CatalogFile *file;
+    const gchar *str;
+    union { gdouble d; guint64 u; } number;
+    gboolean ok;
+    guint i, j, len;
+
+    g_byte_array_append(buffer, (const guint8*)CATALOG_MAGIC,
+                        CATALOG_MAGIC_SIZE);
+    put_u32(buffer, CATALOG_VERSION);
+    put_u32(buffer, catalog->strings->len);
+    put_u32(buffer, catalog->files->len);
+    put_u32(buffer, catalog->row_file->len);
+    put_u32(buffer, catalog->columns->len);
+    for (i = 0; i < catalog->strings->len; i++) {
+        str = g_ptr_array_index(catalog->strings, i);
+        len = strlen(str);
+        put_u32(buffer, len);
+        g_byte_array_append(buffer, (const guint8*)str, len);
+    }
+    for (i = 0; i < catalog->files->len; i++) {
+        file = &g_array_index(catalog->files, CatalogFile, i);
+        put_u32(buffer, file->path);
+        put_u64(buffer, file->size);
+        put_u64(buffer, file->mtime);
+        put_u32(buffer, file->first_row);
+        put_u32(buffer, file->nrows);
+    }
+    put_array(buffer, catalog->row_file);
+    put_array(buffer, catalog->row_channel);
+    put_array(buffer, catalog->row_datachannel);
+    put_array(buffer, catalog->row_label);
+    for (i = 0; i < catalog->columns->len; i++) {
+        column = g_ptr_array_index(catalog->columns, i);
+        put_u32(buffer, column->name);
+        put_u32(buffer, column->values->len);
+        for (j = 0; j < column->values->len; j++) {
+            value = &g_array_index(column->values, CatalogValue, j);
+            number.d = value->number;
+            put_u64(buffer, number.u);
+            put_u32(buffer, value->unit);
+            put_u32(buffer, value->text);
+        }
+        put_array(buffer, column->codes);
+    }
+
+    ok = g_file_set_contents(filename, (const gchar*)buffer->data,
+                             buffer->len, error);
+    g_byte_array_free(buffer, TRUE);
+    return ok;
+}
+
+AnasysCatalog*
+anasys_catalog_load(const gchar *filename, GError **error)
+{
+    AnasysCatalog *catalog = NULL;
+    CatalogColumn *column;
+    CatalogValue value;
+    CatalogFile file;
+    const guchar *p, *end;
+    union { gdouble d; guint64 u; } number;
+    guint32 version, nstrings, nfiles, nrows, ncolumns, n, i, j, len, name;
+    guint64 mtime;
+    gchar *buffer = NULL;
+    gsize size;
+    gboolean ok = FALSE;
+
+    if (!g_file_get_contents(filename, &buffer, &size, error))
+        return NULL;
+
+    p = (const guchar*)buffer;
+    end = p + size;
+    if (size < CATALOG_MAGIC_SIZE
+        || memcmp(p, CATALOG_MAGIC, CATALOG_MAGIC_SIZE))
+        goto end;
+    p += CATALOG_MAGIC_SIZE;
+    if (!get_u32(&p, end, &version) || version != CATALOG_VERSION
+        || !get_u32(&p, end, &nstrings) || !get_u32(&p, end, &nfiles)
+        || !get_u32(&p, end, &nrows) || !get_u32(&p, end, &ncolumns))
+        goto end;
+
+    catalog = catalog_new();
+    for (i = 0; i < nstrings; i++) {
+        if (!get_u32(&p, end, &len) || len > (gsize)(end - p))
+            goto end;
+        g_ptr_array_add(catalog->strings, g_strndup((const gchar*)p, len));
+        p += len;
+    }
+    for (i = 0; i < nfiles; i++) {
+        if (!get_u32(&p, end, &file.path) || file.path >= nstrings
+            || !get_u64(&p, end, &file.size) || !get_u64(&p, end, &mtime)
+            || !get_u32(&p, end, &file.first_row)
+            || !get_u32(&p, end, &file.nrows)
+            || file.first_row > nrows || file.nrows > nrows - file.first_row)
+            goto end;
+        file.mtime = mtime;
+        g_array_append_val(catalog->files, file);
+    }
+    if (!get_array(&p, end, catalog->row_file, nrows, nfiles)
+        || !get_array(&p, end, catalog->row_channel, nrows, G_MAXUINT32)
+        || !get_array(&p, end, catalog->row_datachannel, nrows, nstrings)
+        || !get_array(&p, end, catalog->row_label, nrows, nstrings))
+        goto end;
+    for (i = 0; i < ncolumns; i++) {
+        if (!get_u32(&p, end, &name) || name >= nstrings
+            || g_hash_table_lookup(catalog->column_ids,
+                                   catalog_string(catalog, name))
+            || !get_u32(&p, end, &n))
+            goto end;
+        column = column_new(catalog, name);
+        g_hash_table_destroy(column->lookup);
+        column->lookup = NULL;
+        for (j = 0; j < n; j++) {
+            if (!get_u64(&p, end, &number.u)
+                || !get_u32(&p, end, &value.unit)
+                || !get_u32(&p, end, &value.text)
+                || (value.unit >= nstrings && value.unit != NO_VALUE)
+                || value.text >= nstrings)
+                goto end;
+            value.number = number.d;
+            g_array_append_val(column->values, value);
+        }
+        g_array_set_size(column->codes, 0);
+        if (!get_array(&p, end, column->codes, nrows, n))
+            goto end;
+    }
+    ok = (p == end);
+
+end:
+    g_free(buffer);
+    if (!ok) {
+        anasys_catalog_free(catalog);
+        if (error && !*error)
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_FORMAT,
+                        "File `%s' is not a valid catalog.", filename);
+        return NULL;
+    }
+    return catalog;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
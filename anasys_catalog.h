@@ -0,0 +1,95 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Catalog of the HeightMaps in a directory tree of Analysis Studio files.
+ *
+ * Building a catalog streams through each file and only looks at the Tags
+ * of HeightMaps with data; payloads are skipped, never decoded.  Each
+ * HeightMap becomes a row with its file, id (as anasys_channel_get_id()),
+ * DataChannel and Label, and each distinct Tag Name a column.  Tag Values
+ * starting with a number are split into the number and the unit following
+ * it, e.g. "1466 cm-1"; all values also keep their text.
+ *
+ * Columns are dictionary encoded, a row holding the index of its value
+ * among the distinct values of the column, so a query only compares each
+ * distinct value once and then scans an array of integers.  Saved catalogs
+ * are loaded whole, no data file is opened to query them.  Rebuilding with
+ * the previous catalog only rescans files that changed.
+ */
+
+#ifndef __ANASYS_CATALOG_H__
+#define __ANASYS_CATALOG_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _AnasysCatalog AnasysCatalog;
+
+AnasysCatalog* anasys_catalog_build           (const gchar *directory,
+                                               const AnasysCatalog *previous,
+                                               GError **error);
+AnasysCatalog* anasys_catalog_load            (const gchar *filename,
+                                               GError **error);
+gboolean       anasys_catalog_save            (const AnasysCatalog *catalog,
+                                               const gchar *filename,
+                                               GError **error);
+void           anasys_catalog_free            (AnasysCatalog *catalog);
+guint          anasys_catalog_get_n_files     (const AnasysCatalog *catalog);
+const gchar*   anasys_catalog_get_file        (const AnasysCatalog *catalog,
+                                               guint i);
+guint          anasys_catalog_get_n_rows      (const AnasysCatalog *catalog);
+guint          anasys_catalog_get_row_file    (const AnasysCatalog *catalog,
+                                               guint row);
+guint          anasys_catalog_get_channel_id  (const AnasysCatalog *catalog,
+                                               guint row);
+const gchar*   anasys_catalog_get_data_channel(const AnasysCatalog *catalog,
+                                               guint row);
+const gchar*   anasys_catalog_get_label       (const AnasysCatalog *catalog,
+                                               guint row);
+guint          anasys_catalog_get_n_tags      (const AnasysCatalog *catalog);
+const gchar*   anasys_catalog_get_tag_name    (const AnasysCatalog *catalog,
+                                               guint tag);
+gint           anasys_catalog_find_tag        (const AnasysCatalog *catalog,
+                                               const gchar *name);
+gboolean       anasys_catalog_get_value       (const AnasysCatalog *catalog,
+                                               guint tag,
+                                               guint row,
+                                               gdouble *number,
+                                               const gchar **unit,
+                                               const gchar **text);
+GArray*        anasys_catalog_select_number   (const AnasysCatalog *catalog,
+                                               guint tag,
+                                               gdouble min,
+                                               gdouble max,
+                                               const gchar *unit,
+                                               GArray *rows);
+GArray*        anasys_catalog_select_text     (const AnasysCatalog *catalog,
+                                               guint tag,
+                                               const gchar *text,
+                                               GArray *rows);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
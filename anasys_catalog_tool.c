@@ -0,0 +1,177 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * anasys-catalog CATALOG -d DIRECTORY
+ *     Build or update the catalog of the HeightMaps under DIRECTORY.
+ * anasys-catalog CATALOG [NAME=VALUE | NAME=MIN:MAX]...
+ *     Print the file, id, DataChannel and Label of the HeightMaps whose
+ *     Tags match all conditions.  VALUE is compared as a number if it
+ *     starts with one, with the unit after it if given, e.g.
+ *     IRWavenumber=1466cm-1, otherwise as text, e.g. ScanMode=Contact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "anasys_core.h"
+#include "anasys_catalog.h"
+
+static gboolean build       (const gchar *filename,
+                             const gchar *directory);
+static gboolean query       (const gchar *filename,
+                             gchar **conditions,
+                             gint n);
+static GArray*  select_rows (const AnasysCatalog *catalog,
+                             const gchar *condition,
+                             GArray *rows,
+                             GError **error);
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2 || (argc > 2 && !strcmp(argv[2], "-d") && argc != 4)) {
+        fprintf(stderr,
+                "Usage: %s CATALOG -d DIRECTORY\n"
+                "       %s CATALOG [NAME=VALUE | NAME=MIN:MAX]...\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+    if (argc == 4 && !strcmp(argv[2], "-d"))
+        return build(argv[1], argv[3]) ? 0 : 1;
+    return query(argv[1], argv + 2, argc - 2) ? 0 : 1;
+}
+
+/* Update the catalog if there is a readable one already. */
+static gboolean
+build(const gchar *filename, const gchar *directory)
+{
+    AnasysCatalog *previous, *catalog;
+    GError *error = NULL;
+    gboolean ok;
+
+    previous = anasys_catalog_load(filename, NULL);
+    catalog = anasys_catalog_build(directory, previous, &error);
+    anasys_catalog_free(previous);
+    if (!catalog) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    ok = anasys_catalog_save(catalog, filename, &error);
+    if (!ok) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+    else
+        printf("%u HeightMaps in %u files\n",
+               anasys_catalog_get_n_rows(catalog),
+               anasys_catalog_get_n_files(catalog));
+    anasys_catalog_free(catalog);
+    return ok;
+}
+
+static gboolean
+query(const gchar *filename, gchar **conditions, gint n)
+{
+    AnasysCatalog *catalog;
+    GArray *rows = NULL;
+    GError *error = NULL;
+    guint i, row, nrows;
+    gint k;
+
+    if (!(catalog = anasys_catalog_load(filename, &error))) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    for (k = 0; k < n; k++) {
+        if (!(rows = select_rows(catalog, conditions[k], rows, &error))) {
+            fprintf(stderr, "%s\n", error->message);
+            g_error_free(error);
+            anasys_catalog_free(catalog);
+            return FALSE;
+        }
+    }
+
+    nrows = rows ? rows->len : anasys_catalog_get_n_rows(catalog);
+    for (i = 0; i < nrows; i++) {
+        row = rows ? g_array_index(rows, guint, i) : i;
+        printf("%s\t%u\t%s\t%s\n",
+               anasys_catalog_get_file(catalog,
+                                       anasys_catalog_get_row_file(catalog,
+                                                                   row)),
+               anasys_catalog_get_channel_id(catalog, row),
+               anasys_catalog_get_data_channel(catalog, row),
+               anasys_catalog_get_label(catalog, row));
+    }
+    if (rows)
+        g_array_free(rows, TRUE);
+    anasys_catalog_free(catalog);
+    return TRUE;
+}
+
+/* Apply one NAME=... condition.  An unknown Tag matches nothing. */
+static GArray*
+select_rows(const AnasysCatalog *catalog, const gchar *condition,
+            GArray *rows, GError **error)
+{
+    const gchar *value = strchr(condition, '='), *text;
+    gchar *name, *end, *unit;
+    gdouble min, max;
+    gint tag;
+
+    if (!value || value == condition) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_FORMAT,
+                    "Condition `%s' is not NAME=VALUE.", condition);
+        if (rows)
+            g_array_free(rows, TRUE);
+        return NULL;
+    }
+    name = g_strndup(condition, value - condition);
+    text = ++value;
+    tag = anasys_catalog_find_tag(catalog, name);
+    g_free(name);
+    if (tag < 0) {
+        if (rows)
+            g_array_set_size(rows, 0);
+        return rows ? rows : g_array_new(FALSE, FALSE, sizeof(guint));
+    }
+
+    min = g_ascii_strtod(value, &end);
+    if (end == value)
+        return anasys_catalog_select_text(catalog, tag, text, rows);
+    max = min;
+    if (*end == ':') {
+        value = end + 1;
+        max = g_ascii_strtod(value, &end);
+        if (end == value)
+            return anasys_catalog_select_text(catalog, tag, text, rows);
+    }
+    unit = g_strstrip(g_strdup(end));
+    rows = anasys_catalog_select_number(catalog, tag, min, max,
+                                        *unit ? unit : NULL, rows);
+    g_free(unit);
+    return rows;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,2689 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "anasys_core.h"
+#include "anasys_gzindex.h"
+#include "anasys_grid.h"
+#include "anasys_parse.h"
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#ifdef G_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Only ever pass ASCII strings.  So the typecasting, mean to catch signed vs.
+ * unsigned char problems, is not useful, just annoying. */
+#define strequal(a, b) xmlStrEqual((a), (const xmlChar*)(b))
+
+/* Element and attribute names the reader knows, so that each is dispatched
+ * with a single lookup in name_table, a perfect hash of schema_names. */
+typedef enum {
+    NAME_OTHER = 0,
+    NAME_DOCUMENT,
+    NAME_DOC_TYPE,
+    NAME_VERSION,
+    NAME_HEIGHT_MAPS,
+    NAME_RENDERED_SPECTRA,
+    NAME_AFM_CHANNEL_VIEWS,
+    NAME_DATA_TYPE,
+    NAME_DATA_CHANNEL,
+    NAME_LABEL,
+    NAME_POSITION,
+    NAME_SIZE,
+    NAME_RESOLUTION,
+    NAME_X,
+    NAME_Y,
+    NAME_UNITS,
+    NAME_UNIT_PREFIX,
+    NAME_TAGS,
+    NAME_NAME,
+    NAME_VALUE,
+    NAME_SAMPLE_BASE64,
+    NAME_IR_RENDERED_SPECTRA,
+    NAME_DATA_POINTS,
+    NAME_START_WAVENUMBER,
+    NAME_END_WAVENUMBER,
+    NAME_POLARIZATION,
+    NAME_LOCATION,
+    NAME_DATA_CHANNELS,
+    NAME_BACKGROUND_ID,
+    NAME_BACKGROUNDS,
+    NAME_IR_BACKGROUND,
+    NAME_ID,
+    NAME_NNAMES
+} AnasysName;
+
+/* Base64 text that cannot be located group by group is decoded, and text
+ * left to the index inflated, this many 4-character groups at a time. */
+#define DECODE_GROUPS (1 << 14)
+
+/* Segments hold files with their payloads decoded, the data of each at an
+ * offset aligned so that they can be used right where they are mapped. */
+#define SEGMENT_MAGIC "ANASYSSG"
+#define SEGMENT_MAGIC_SIZE (sizeof(SEGMENT_MAGIC) - 1)
+#define SEGMENT_VERSION 1
+#define SEGMENT_ALIGN 64
+#define SEGMENT_NO_STRING G_MAXUINT32
+
+/* Decoding of base64 text in pieces, pos being the number of bytes decoded
+ * so far. */
+typedef struct {
+    gint state;
+    guint save;
+    gsize pos;
+    guchar *chunk;
+} Base64Stream;
+
+/* Base64 text of a payload.  It points right into the text node of the
+ * document when the element has just one, otherwise it is a copy.  Payloads
+ * left out of the document by the index are inflated from offset.  Those of
+ * segments are already decoded, raw points to their bytes in the mapping. */
+typedef struct {
+    const gchar *raw;
+    const gchar *text;
+    xmlChar *copy;
+    gsize len;
+    gsize size;
+    gboolean regular;
+    const AnasysGzIndex *index;
+    guint64 offset;
+} AnasysPayload;
+
+/* Data decoded by the get_data functions.  They are on the heap, or mapped
+ * from offset in the scratch file when size, the mapped length, is
+ * nonzero. */
+typedef struct {
+    gfloat *data;
+    gsize size;
+    guint64 offset;
+} AnasysBuffer;
+
+/* Unused space in the scratch file. */
+typedef struct {
+    guint64 offset;
+    guint64 size;
+} ScratchExtent;
+
+struct _AnasysChannel {
+    AnasysFile *file;
+    guint id;
+    gchar *datachannel;
+    gchar *label;
+    gchar *unit;
+    gdouble unit_multiplier;
+    guint xres;
+    guint yres;
+    gdouble xreal;
+    gdouble yreal;
+    gdouble x;
+    gdouble y;
+    gdouble scan_angle;
+    GPtrArray *meta;
+    AnasysPayload payload;
+    AnasysBuffer buffer;
+};
+
+struct _AnasysSpectrum {
+    AnasysFile *file;
+    guint id;
+    gchar *datachannel;
+    gchar *label;
+    gchar *polarization;
+    gdouble x;
+    gdouble y;
+    gdouble start;
+    gdouble end;
+    guint npoints;
+    gchar *background_id;
+    AnasysPayload payload;
+    AnasysBuffer buffer;
+};
+
+/* Backgrounds can be shared by files through the cache, so they are counted
+ * references and never change once read.  Elements with element children,
+ * like Table, and Base64 elements are arrays, the rest metadata. */
+struct _AnasysBackground {
+    volatile gint refcount;
+    gchar *id;
+    GPtrArray *meta;
+    GPtrArray *array_names;
+    GPtrArray *arrays;
+};
+
+/* Documents split for parallel parsing keep the elements cut out of doc in
+ * height_map_docs and spectra_docs.  The lock guards the budget, the heap
+ * use and the scratch file, which are shared by all get_data calls.  Files
+ * opened from segments have no document but the mapped segment. */
+struct _AnasysFile {
+    volatile gint refcount;
+    xmlDoc *doc;
+    GPtrArray *height_map_docs;
+    GPtrArray *spectra_docs;
+    AnasysGzIndex *index;
+    gchar *primary_channel;
+    GPtrArray *channels;
+    GPtrArray *spectra;
+    GPtrArray *backgrounds;
+    AnasysGrid *spectrum_grid;
+    GMutex lock;
+    guint64 budget;
+    guint64 resident;
+    gint scratch;
+    guint64 scratch_size;
+    GArray *holes;
+    gpointer segment;
+    gsize segment_size;
+};
+
+static AnasysFile*     file_new             (void);
+static void            write_segment_header (const AnasysFile *file,
+                                             GByteArray *header);
+static gboolean        write_segment_data   (FILE *fh,
+                                             const AnasysPayload *payload,
+                                             GError **error);
+static gboolean        read_segment_header  (AnasysFile *file,
+                                             const guchar **p,
+                                             const guchar *end,
+                                             gsize datasize);
+static gboolean        read_segment_payload (AnasysFile *file,
+                                             const guchar **p,
+                                             const guchar *end,
+                                             gsize datasize,
+                                             AnasysPayload *payload);
+static AnasysName      name_lookup          (const xmlChar *name);
+static void            find_attributes      (const xmlNode *node,
+                                             AnasysName name1,
+                                             const xmlAttr **attr1,
+                                             AnasysName name2,
+                                             const xmlAttr **attr2);
+static const gchar*    attr_text            (const xmlAttr *attr,
+                                             xmlChar **copy);
+static const gchar*    peek_text            (xmlDoc *doc,
+                                             const xmlNode *children,
+                                             xmlChar **copy);
+static void            read_height_maps     (AnasysFile *file,
+                                             const xmlNode *curNode);
+static AnasysChannel*  read_channel         (AnasysFile *file,
+                                             const xmlNode *childNode,
+                                             guint id);
+static void            read_xy              (AnasysChannel *channel,
+                                             const xmlNode *node,
+                                             AnasysName name);
+static void            read_spectra         (AnasysFile *file,
+                                             const xmlNode *curNode);
+static void            read_rendered_spectra(AnasysFile *file,
+                                             const xmlNode *childNode,
+                                             guint *specID);
+static void            read_backgrounds     (AnasysFile *file,
+                                             const xmlNode *curNode,
+                                             GArray *parsed);
+static AnasysBackground* read_background    (xmlDoc *doc,
+                                             const xmlNode *node);
+static gchar*          read_primary_channel (xmlDoc *doc,
+                                             const xmlNode *curNode);
+static AnasysGrid*     index_spectra        (const AnasysFile *file);
+static gboolean        channel_contains     (const AnasysChannel *channel,
+                                             gdouble x,
+                                             gdouble y);
+static void            channel_get_extent   (const AnasysChannel *channel,
+                                             gdouble *ex,
+                                             gdouble *ey);
+static gint            compare_indices      (gconstpointer a,
+                                             gconstpointer b);
+static void            channel_free         (gpointer p);
+static void            spectrum_free        (gpointer p);
+static void            background_unref     (gpointer p);
+static gpointer        background_cache_lookup(const gchar *checksum);
+static AnasysBackground* background_cache_insert(const gchar *checksum,
+                                             AnasysBackground *background);
+static void            free_parsed_backgrounds(GArray *parsed);
+static gchar*          get_node_text        (xmlDoc *doc,
+                                             const xmlNode *node);
+static void            get_payload          (const AnasysFile *file,
+                                             const xmlNode *node,
+                                             AnasysPayload *payload);
+static gboolean        read_payload         (const AnasysPayload *payload,
+                                             gsize from,
+                                             gsize to,
+                                             guchar *dest,
+                                             GError **error);
+static gboolean        read_deferred_payload(const AnasysPayload *payload,
+                                             gsize from,
+                                             gsize to,
+                                             guchar *dest,
+                                             GError **error);
+static void            decode_stream        (Base64Stream *stream,
+                                             const gchar *text,
+                                             gsize len,
+                                             gsize from,
+                                             gsize to,
+                                             guchar *dest);
+static gfloat*         buffer_alloc         (AnasysFile *file,
+                                             AnasysBuffer *buffer,
+                                             gsize n);
+static void            buffer_free          (AnasysFile *file,
+                                             AnasysBuffer *buffer,
+                                             gsize n);
+static gboolean        scratch_map          (AnasysFile *file,
+                                             AnasysBuffer *buffer,
+                                             gsize bytes);
+static void            scratch_unmap        (AnasysFile *file,
+                                             AnasysBuffer *buffer);
+static void            floats_from_le       (gfloat *data,
+                                             gsize n);
+static gdouble         unit_prefix_multiplier(const gchar *prefix);
+static gdouble         parse_scan_angle     (const gchar *value);
+static void            put_u32              (GByteArray *buffer,
+                                             guint32 value);
+static void            put_u64              (GByteArray *buffer,
+                                             guint64 value);
+static void            put_double           (GByteArray *buffer,
+                                             gdouble value);
+static void            put_string           (GByteArray *buffer,
+                                             const gchar *str);
+static gboolean        get_u32              (const guchar **p,
+                                             const guchar *end,
+                                             guint32 *value);
+static gboolean        get_u64              (const guchar **p,
+                                             const guchar *end,
+                                             guint64 *value);
+static gboolean        get_double           (const guchar **p,
+                                             const guchar *end,
+                                             gdouble *value);
+static gboolean        get_string           (const guchar **p,
+                                             const guchar *end,
+                                             gchar **str);
+static gboolean        get_strings          (const guchar **p,
+                                             const guchar *end,
+                                             GPtrArray *strings);
+
+GQuark
+anasys_error_quark(void)
+{
+    static GQuark error_domain = 0;
+
+    if (!error_domain)
+        error_domain = g_quark_from_static_string("anasys-error-quark");
+
+    return error_domain;
+}
+
+/* In the order of AnasysName. */
+static const gchar *const schema_names[NAME_NNAMES] = {
+    NULL, "Document", "DocType", "Version", "HeightMaps", "RenderedSpectra",
+    "AFMChannelViews", "DataType", "DataChannel", "Label", "Position", "Size",
+    "Resolution", "X", "Y", "Units", "UnitPrefix", "Tags", "Name", "Value",
+    "SampleBase64", "IRRenderedSpectra", "DataPoints", "StartWavenumber",
+    "EndWavenumber", "Polarization", "Location", "DataChannels",
+    "BackgroundID", "Backgrounds", "IRBackground", "ID",
+};
+
+/* Collision-free for schema_names, which init_parser() checks. */
+#define NAME_HASH(name, len) \
+    (((len) + 2*(name)[0] + 13*(name)[(len) - 1]) & 0x7f)
+
+static guchar name_table[0x80];
+
+/* Backgrounds shared by files opened with ANASYS_OPEN_SHARE_BACKGROUNDS, by
+ * checksum of their text.  The oldest are dropped beyond the cache size. */
+#define BACKGROUND_CACHE_SIZE 16
+
+static GMutex background_lock;
+static GHashTable *background_cache;
+static GQueue background_order = G_QUEUE_INIT;
+
+/* A call of anasys_run_workers(), shared by its helper threads.  Helpers
+ * that start only once the work is done leave at once; the caller waits for
+ * those running and the last one to leave frees it. */
+typedef struct {
+    GThreadFunc worker;
+    gpointer data;
+    GMutex lock;
+    GCond cond;
+    guint refcount;
+    guint running;
+    gboolean done;
+} WorkerCall;
+
+/* The threads of all parallel work in the process. */
+static GThreadPool *worker_pool;
+
+static gpointer
+init_parser(G_GNUC_UNUSED gpointer data)
+{
+    const guchar *name;
+    guint i, h;
+
+    xmlInitParser();
+    for (i = 1; i < NAME_NNAMES; i++) {
+        name = (const guchar*)schema_names[i];
+        h = NAME_HASH(name, strlen(schema_names[i]));
+        g_assert(!name_table[h]);
+        name_table[h] = i;
+    }
+    return NULL;
+}
+
+/* Initialise libxml.  This is done by anasys_file_open() too, but users
+ * running several threads should call it from the main thread first.  It is
+ * never cleaned up as others may be using libxml. */
+void
+anasys_init(void)
+{
+    static GOnce once = G_ONCE_INIT;
+
+    g_once(&once, init_parser, NULL);
+}
+
+static void
+worker_call_unref(WorkerCall *call)
+{
+    guint refcount;
+
+    g_mutex_lock(&call->lock);
+    refcount = --call->refcount;
+    g_mutex_unlock(&call->lock);
+    if (refcount)
+        return;
+    g_mutex_clear(&call->lock);
+    g_cond_clear(&call->cond);
+    g_free(call);
+}
+
+static void
+run_helper(gpointer item, G_GNUC_UNUSED gpointer user_data)
+{
+    WorkerCall *call = (WorkerCall*)item;
+    gboolean done;
+
+    g_mutex_lock(&call->lock);
+    if (!(done = call->done))
+        call->running++;
+    g_mutex_unlock(&call->lock);
+    if (!done) {
+        call->worker(call->data);
+        g_mutex_lock(&call->lock);
+        if (!--call->running)
+            g_cond_signal(&call->cond);
+        g_mutex_unlock(&call->lock);
+    }
+    worker_call_unref(call);
+}
+
+static gpointer
+create_worker_pool(G_GNUC_UNUSED gpointer data)
+{
+    worker_pool = g_thread_pool_new(run_helper, NULL,
+                                    MAX(g_get_num_processors(), 1), FALSE,
+                                    NULL);
+    return NULL;
+}
+
+/* Run worker(data) in up to nworkers threads at once, this one included,
+ * and return when they are all done.  The workers must take their items
+ * from data until none are left, as any one of them may have to do all the
+ * work: the helper threads come from one pool for the whole process, which
+ * may be busy, also with the very work that calls this. */
+void
+anasys_run_workers(GThreadFunc worker, gpointer data, guint nworkers)
+{
+    static GOnce once = G_ONCE_INIT;
+    WorkerCall *call;
+    guint i;
+
+    nworkers = MIN(nworkers, MAX(g_get_num_processors(), 1));
+    g_once(&once, create_worker_pool, NULL);
+    if (nworkers < 2 || !worker_pool) {
+        worker(data);
+        return;
+    }
+
+    call = g_new0(WorkerCall, 1);
+    call->worker = worker;
+    call->data = data;
+    g_mutex_init(&call->lock);
+    g_cond_init(&call->cond);
+    call->refcount = nworkers;
+    for (i = 1; i < nworkers; i++)
+        g_thread_pool_push(worker_pool, call, NULL);
+    worker(data);
+
+    g_mutex_lock(&call->lock);
+    call->done = TRUE;
+    while (call->running)
+        g_cond_wait(&call->cond, &call->lock);
+    g_mutex_unlock(&call->lock);
+    worker_call_unref(call);
+}
+
+typedef struct {
+    GFunc func;
+    gpointer *items;
+    guint n;
+    gpointer user_data;
+    volatile gint next;
+} ParallelItems;
+
+static gpointer
+run_items(gpointer user_data)
+{
+    ParallelItems *job = (ParallelItems*)user_data;
+    guint i;
+
+    while ((i = g_atomic_int_add(&job->next, 1)) < job->n)
+        job->func(job->items[i], job->user_data);
+    return NULL;
+}
+
+/* Run func on each of n items, in parallel like anasys_run_workers(). */
+void
+anasys_run_parallel(GFunc func, gpointer *items, guint n,
+                    gpointer user_data)
+{
+    ParallelItems job;
+
+    job.func = func;
+    job.items = items;
+    job.n = n;
+    job.user_data = user_data;
+    job.next = 0;
+    anasys_run_workers(run_items, &job, n);
+}
+
+AnasysFile*
+anasys_file_open(const gchar *filename, GError **error)
+{
+    return anasys_file_open_full(filename, 0, error);
+}
+
+/* Parse a file with its own parser context, so that files opened in
+ * parallel share no parser state.  The document is kept as long as the
+ * file, the payloads live in it, unless they are left to the index. */
+AnasysFile*
+anasys_file_open_full(const gchar *filename, AnasysOpenFlags flags,
+                      GError **error)
+{
+    AnasysFile *file;
+    AnasysGzIndex *index = NULL, *built;
+    AnasysGzReader *reader = NULL;
+    GPtrArray *height_map_docs = NULL, *spectra_docs = NULL;
+    GArray *parsed_backgrounds = NULL;
+    xmlParserCtxt *ctxt;
+    xmlDoc *doc = NULL;
+    xmlNode *curNode, *rootElement = NULL;
+    const xmlAttr *doctypeAttr, *versionAttr;
+    xmlChar *copy1, *copy2;
+    gboolean ok = TRUE;
+
+    anasys_init();
+    if (!(ctxt = xmlNewParserCtxt())) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot create XML parser context.");
+        return NULL;
+    }
+    if ((flags & ANASYS_OPEN_INDEX) && anasys_gz_is_compressed(filename)) {
+        index = anasys_gz_index_load(filename);
+        reader = anasys_gz_reader_new(filename, index, NULL);
+    }
+    if (reader) {
+        doc = xmlCtxtReadIO(ctxt, anasys_gz_reader_read, NULL, reader,
+                            filename, NULL, ANASYS_PARSE_OPTIONS);
+        if ((built = anasys_gz_reader_free(reader, NULL))) {
+            /* Failing to write the sidecar only costs speed next time. */
+            anasys_gz_index_save(built, NULL);
+            anasys_gz_index_free(built);
+        }
+    }
+    /* Whatever goes wrong with the index, the file is still readable the
+     * usual way. */
+    if (!doc) {
+        anasys_gz_index_free(index);
+        index = NULL;
+        if (flags & (ANASYS_OPEN_PARALLEL | ANASYS_OPEN_SHARE_BACKGROUNDS))
+            doc = anasys_parse_document(ctxt, filename,
+                                        flags & ANASYS_OPEN_PARALLEL,
+                                        (flags & ANASYS_OPEN_SHARE_BACKGROUNDS)
+                                        ? background_cache_lookup : NULL,
+                                        background_unref,
+                                        &height_map_docs, &spectra_docs,
+                                        &parsed_backgrounds);
+        else
+            doc = xmlCtxtReadFile(ctxt, filename, NULL,
+                                  ANASYS_PARSE_OPTIONS);
+    }
+    xmlFreeParserCtxt(ctxt);
+    if (doc)
+        rootElement = xmlDocGetRootElement(doc);
+    if (rootElement
+        && rootElement->type == XML_ELEMENT_NODE
+        && name_lookup(rootElement->name) == NAME_DOCUMENT) {
+        find_attributes(rootElement, NAME_DOC_TYPE, &doctypeAttr,
+                        NAME_VERSION, &versionAttr);
+        if (!g_strcmp0(attr_text(doctypeAttr, &copy1), "IR")
+            - !g_strcmp0(attr_text(versionAttr, &copy2), "1.0"))
+            ok = FALSE;
+        xmlFree(copy1);
+        xmlFree(copy2);
+    }
+    if (!rootElement || !ok) {
+        anasys_gz_index_free(index);
+        if (height_map_docs)
+            g_ptr_array_free(height_map_docs, TRUE);
+        if (spectra_docs)
+            g_ptr_array_free(spectra_docs, TRUE);
+        free_parsed_backgrounds(parsed_backgrounds);
+        xmlFreeDoc(doc);
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_FORMAT,
+                    "File `%s' is not an Analysis Studio XML document.",
+                    filename);
+        return NULL;
+    }
+
+    file = file_new();
+    file->doc = doc;
+    file->height_map_docs = height_map_docs;
+    file->spectra_docs = spectra_docs;
+    file->index = index;
+    for (curNode = rootElement->children; curNode; curNode = curNode->next) {
+        if (curNode->type != XML_ELEMENT_NODE)
+            continue;
+        switch (name_lookup(curNode->name)) {
+            case NAME_HEIGHT_MAPS:
+            read_height_maps(file, curNode);
+            break;
+
+            case NAME_RENDERED_SPECTRA:
+            read_spectra(file, curNode);
+            break;
+
+            case NAME_BACKGROUNDS:
+            read_backgrounds(file, curNode, parsed_backgrounds);
+            break;
+
+            case NAME_AFM_CHANNEL_VIEWS:
+            if (!file->primary_channel)
+                file->primary_channel = read_primary_channel(doc, curNode);
+            break;
+
+            default:
+            break;
+        }
+    }
+    free_parsed_backgrounds(parsed_backgrounds);
+    file->spectrum_grid = index_spectra(file);
+    return file;
+}
+
+/* Write the file, all its payloads decoded, into a segment for
+ * anasys_file_open_segment().  It holds the magic, version and header size,
+ * then all the file tells about its channels, spectra and backgrounds, and
+ * then the data, as in the payloads, at offsets past the header aligned to
+ * SEGMENT_ALIGN.  Numbers are little endian.  The segment is removed again
+ * unless all payloads decode. */
+gboolean
+anasys_file_write_segment(const AnasysFile *file, const gchar *filename,
+                          GError **error)
+{
+    static const guchar zeros[SEGMENT_ALIGN];
+    const AnasysChannel *channel;
+    const AnasysSpectrum *spectrum;
+    GByteArray *header = g_byte_array_new();
+    guint64 size;
+    gsize pad;
+    gboolean ok;
+    FILE *fh;
+    guint i;
+
+    write_segment_header(file, header);
+    size = GUINT64_TO_LE(header->len);
+    memcpy(header->data + SEGMENT_MAGIC_SIZE + sizeof(guint32), &size,
+           sizeof(guint64));
+    if (!(fh = g_fopen(filename, "wb"))) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot create file `%s'.", filename);
+        g_byte_array_free(header, TRUE);
+        return FALSE;
+    }
+    pad = (SEGMENT_ALIGN - header->len % SEGMENT_ALIGN) % SEGMENT_ALIGN;
+    ok = (fwrite(header->data, 1, header->len, fh) == header->len
+          && fwrite(zeros, 1, pad, fh) == pad);
+    g_byte_array_free(header, TRUE);
+    if (!ok)
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot write file `%s'.", filename);
+    for (i = 0; ok && i < file->channels->len; i++) {
+        channel = g_ptr_array_index(file->channels, i);
+        ok = write_segment_data(fh, &channel->payload, error);
+    }
+    for (i = 0; ok && i < file->spectra->len; i++) {
+        spectrum = g_ptr_array_index(file->spectra, i);
+        ok = write_segment_data(fh, &spectrum->payload, error);
+    }
+    if (fclose(fh) != 0 && ok) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot write file `%s'.", filename);
+        ok = FALSE;
+    }
+    if (!ok)
+        g_unlink(filename);
+    return ok;
+}
+
+#ifdef G_OS_UNIX
+/* Open a segment written by anasys_file_write_segment().  It is mapped
+ * read-only and the data are used right where they are, so all processes
+ * opening the same segment share its pages.  The segment must not be
+ * changed while open, though it can be replaced or removed. */
+AnasysFile*
+anasys_file_open_segment(const gchar *filename, GError **error)
+{
+    AnasysFile *file;
+    const guchar *p, *end;
+    struct stat st;
+    guint32 version;
+    guint64 size;
+    gpointer segment;
+    gint fd;
+
+    anasys_init();
+    if ((fd = g_open(filename, O_RDONLY, 0)) < 0) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot open file `%s'.", filename);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !st.st_size
+        || (guint64)st.st_size > G_MAXSIZE
+        || (segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                           fd, 0)) == MAP_FAILED) {
+        close(fd);
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot map file `%s'.", filename);
+        return NULL;
+    }
+    close(fd);
+
+    file = file_new();
+    file->segment = segment;
+    file->segment_size = st.st_size;
+    p = (const guchar*)segment;
+    end = p + st.st_size;
+    if (file->segment_size < SEGMENT_MAGIC_SIZE
+        || memcmp(p, SEGMENT_MAGIC, SEGMENT_MAGIC_SIZE))
+        goto fail;
+    p += SEGMENT_MAGIC_SIZE;
+    if (!get_u32(&p, end, &version) || version != SEGMENT_VERSION
+        || !get_u64(&p, end, &size)
+        || size < (gsize)(p - (const guchar*)segment)
+        || size > file->segment_size)
+        goto fail;
+    end = (const guchar*)segment + size;
+    size = (size + SEGMENT_ALIGN-1)/SEGMENT_ALIGN*SEGMENT_ALIGN;
+    if (size > file->segment_size
+        || !read_segment_header(file, &p, end, file->segment_size - size))
+        goto fail;
+    file->spectrum_grid = index_spectra(file);
+    return file;
+
+fail:
+    anasys_file_unref(file);
+    g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_FORMAT,
+                "File `%s' is not a valid segment.", filename);
+    return NULL;
+}
+#else
+AnasysFile*
+anasys_file_open_segment(const gchar *filename, GError **error)
+{
+    g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                "Cannot map file `%s'.", filename);
+    return NULL;
+}
+#endif
+
+AnasysFile*
+anasys_file_ref(AnasysFile *file)
+{
+    g_atomic_int_inc(&file->refcount);
+    return file;
+}
+
+void
+anasys_file_unref(AnasysFile *file)
+{
+    if (!file || !g_atomic_int_dec_and_test(&file->refcount))
+        return;
+    g_ptr_array_free(file->channels, TRUE);
+    g_ptr_array_free(file->spectra, TRUE);
+    g_ptr_array_free(file->backgrounds, TRUE);
+    anasys_grid_free(file->spectrum_grid);
+    g_free(file->primary_channel);
+    xmlFreeDoc(file->doc);
+    if (file->height_map_docs)
+        g_ptr_array_free(file->height_map_docs, TRUE);
+    if (file->spectra_docs)
+        g_ptr_array_free(file->spectra_docs, TRUE);
+    anasys_gz_index_free(file->index);
+#ifdef G_OS_UNIX
+    if (file->scratch >= 0)
+        close(file->scratch);
+    if (file->segment)
+        munmap(file->segment, file->segment_size);
+#endif
+    g_array_free(file->holes, TRUE);
+    g_mutex_clear(&file->lock);
+    g_free(file);
+}
+
+/* Keep at most bytes of data decoded by the get_data functions on the heap.
+ * Data beyond are decoded into a temporary scratch file mapped into memory,
+ * so that the system can page them out instead of holding them all.  The
+ * default, G_MAXUINT64, keeps everything on the heap; data already decoded
+ * stay where they are.  Where files cannot be mapped the budget is ignored. */
+void
+anasys_file_set_memory_budget(AnasysFile *file, guint64 bytes)
+{
+    g_mutex_lock(&file->lock);
+    file->budget = bytes;
+    g_mutex_unlock(&file->lock);
+}
+
+/* DataType of the first configured AFMChannelView, which is the channel
+ * Analysis Studio shows the file with, or NULL. */
+const gchar*
+anasys_file_get_primary_channel(const AnasysFile *file)
+{
+    return file->primary_channel;
+}
+
+guint
+anasys_file_get_n_channels(const AnasysFile *file)
+{
+    return file->channels->len;
+}
+
+AnasysChannel*
+anasys_file_get_channel(const AnasysFile *file, guint i)
+{
+    g_return_val_if_fail(i < file->channels->len, NULL);
+    return g_ptr_array_index(file->channels, i);
+}
+
+guint
+anasys_file_get_n_spectra(const AnasysFile *file)
+{
+    return file->spectra->len;
+}
+
+AnasysSpectrum*
+anasys_file_get_spectrum(const AnasysFile *file, guint i)
+{
+    g_return_val_if_fail(i < file->spectra->len, NULL);
+    return g_ptr_array_index(file->spectra, i);
+}
+
+guint
+anasys_file_get_n_backgrounds(const AnasysFile *file)
+{
+    return file->backgrounds->len;
+}
+
+const AnasysBackground*
+anasys_file_get_background(const AnasysFile *file, guint i)
+{
+    g_return_val_if_fail(i < file->backgrounds->len, NULL);
+    return g_ptr_array_index(file->backgrounds, i);
+}
+
+/* Indices of the spectra located in the rectangle, edges included, in file
+ * order.  Free the array with g_array_free(). */
+GArray*
+anasys_file_find_spectra(const AnasysFile *file,
+                         gdouble xmin, gdouble ymin,
+                         gdouble xmax, gdouble ymax)
+{
+    GArray *indices = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    anasys_grid_find_rect(file->spectrum_grid, xmin, ymin, xmax, ymax,
+                          indices);
+    g_array_sort(indices, compare_indices);
+    return indices;
+}
+
+/* Indices of the spectra located at most radius from (x, y), in file
+ * order.  Free the array with g_array_free(). */
+GArray*
+anasys_file_find_spectra_near(const AnasysFile *file,
+                              gdouble x, gdouble y, gdouble radius)
+{
+    GArray *indices = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    anasys_grid_find_near(file->spectrum_grid, x, y, radius, indices);
+    g_array_sort(indices, compare_indices);
+    return indices;
+}
+
+/* Index of the spectrum located nearest to (x, y), or -1 if there are no
+ * spectra. */
+gint
+anasys_file_find_nearest_spectrum(const AnasysFile *file,
+                                  gdouble x, gdouble y)
+{
+    return anasys_grid_find_nearest(file->spectrum_grid, x, y);
+}
+
+/* The position of the HeightMap in the file, counted from 1.  HeightMaps
+ * without data are not channels but still count. */
+guint
+anasys_channel_get_id(const AnasysChannel *channel)
+{
+    return channel->id;
+}
+
+const gchar*
+anasys_channel_get_data_channel(const AnasysChannel *channel)
+{
+    return channel->datachannel;
+}
+
+const gchar*
+anasys_channel_get_label(const AnasysChannel *channel)
+{
+    return channel->label;
+}
+
+const gchar*
+anasys_channel_get_unit(const AnasysChannel *channel)
+{
+    return channel->unit;
+}
+
+gdouble
+anasys_channel_get_unit_multiplier(const AnasysChannel *channel)
+{
+    return channel->unit_multiplier;
+}
+
+void
+anasys_channel_get_resolution(const AnasysChannel *channel,
+                              guint *xres, guint *yres)
+{
+    if (xres)
+        *xres = channel->xres;
+    if (yres)
+        *yres = channel->yres;
+}
+
+void
+anasys_channel_get_size(const AnasysChannel *channel,
+                        gdouble *xreal, gdouble *yreal)
+{
+    if (xreal)
+        *xreal = channel->xreal;
+    if (yreal)
+        *yreal = channel->yreal;
+}
+
+/* The position is that of the centre of the scan. */
+void
+anasys_channel_get_position(const AnasysChannel *channel,
+                            gdouble *x, gdouble *y)
+{
+    if (x)
+        *x = channel->x;
+    if (y)
+        *y = channel->y;
+}
+
+/* The scan angle normalised to (-180, 180]. */
+gdouble
+anasys_channel_get_scan_angle(const AnasysChannel *channel)
+{
+    return channel->scan_angle;
+}
+
+/* Metadata are all the simple elements and Tags of the HeightMap, in file
+ * order; elements with children give keys Parent_Child. */
+guint
+anasys_channel_get_n_meta(const AnasysChannel *channel)
+{
+    return channel->meta->len/2;
+}
+
+void
+anasys_channel_get_meta(const AnasysChannel *channel, guint i,
+                        const gchar **key, const gchar **value)
+{
+    g_return_if_fail(2*i < channel->meta->len);
+    if (key)
+        *key = g_ptr_array_index(channel->meta, 2*i);
+    if (value)
+        *value = g_ptr_array_index(channel->meta, 2*i + 1);
+}
+
+const gchar*
+anasys_channel_find_meta(const AnasysChannel *channel, const gchar *key)
+{
+    guint i;
+
+    for (i = 0; i < channel->meta->len; i += 2) {
+        if (g_strcmp0(g_ptr_array_index(channel->meta, i), key) == 0)
+            return g_ptr_array_index(channel->meta, i + 1);
+    }
+    return NULL;
+}
+
+/* Number of bytes actually encoded in the payload; it should be four per
+ * pixel. */
+gsize
+anasys_channel_get_payload_size(const AnasysChannel *channel)
+{
+    return channel->payload.size;
+}
+
+/* Decode the data into a buffer owned by the channel.  It stays until
+ * anasys_channel_free_data() or until the file is released, on the heap or
+ * in the scratch file as the memory budget allows.  Data of segments are
+ * used where mapped. */
+const gfloat*
+anasys_channel_get_data(AnasysChannel *channel, GError **error)
+{
+    AnasysFile *file = channel->file;
+    gsize n = (gsize)channel->xres*channel->yres;
+    gfloat *data;
+
+    if (channel->payload.raw && G_BYTE_ORDER == G_LITTLE_ENDIAN
+        && channel->payload.size == n*sizeof(gfloat))
+        return (const gfloat*)channel->payload.raw;
+    if (channel->buffer.data)
+        return channel->buffer.data;
+    data = buffer_alloc(file, &channel->buffer, n);
+    if (!anasys_channel_read_data(channel, data, error)) {
+        buffer_free(file, &channel->buffer, n);
+        return NULL;
+    }
+    return data;
+}
+
+void
+anasys_channel_free_data(AnasysChannel *channel)
+{
+    buffer_free(channel->file, &channel->buffer,
+                (gsize)channel->xres*channel->yres);
+}
+
+/* Decode the data into buffer with room for xres*yres values, row by row
+ * from the top as stored in the file. */
+gboolean
+anasys_channel_read_data(const AnasysChannel *channel, gfloat *buffer,
+                         GError **error)
+{
+    return anasys_channel_read_rows(channel, 0, channel->yres, buffer, error);
+}
+
+/* Decode nrows rows from row on into buffer with room for nrows*xres
+ * values.  Only the part of the payload holding them is decoded, so a large
+ * channel can be read a few rows at a time. */
+gboolean
+anasys_channel_read_rows(const AnasysChannel *channel, guint row, guint nrows,
+                         gfloat *buffer, GError **error)
+{
+    gsize n = (gsize)channel->xres*channel->yres;
+    gsize rowsize = channel->xres*sizeof(gfloat);
+
+    g_return_val_if_fail(row <= channel->yres
+                         && nrows <= channel->yres - row, FALSE);
+    if (channel->payload.size != n*sizeof(gfloat)) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                    "Expected data size %" G_GSIZE_FORMAT " bytes, "
+                    "but real size is %" G_GSIZE_FORMAT " bytes.",
+                    n*sizeof(gfloat), channel->payload.size);
+        return FALSE;
+    }
+    if (!read_payload(&channel->payload, row*rowsize, (row + nrows)*rowsize,
+                      (guchar*)buffer, error))
+        return FALSE;
+    floats_from_le(buffer, (gsize)nrows*channel->xres);
+    return TRUE;
+}
+
+/* Indices of the spectra located within the area the channel was scanned,
+ * edges included, in file order.  Free the array with g_array_free(). */
+GArray*
+anasys_channel_find_spectra(const AnasysChannel *channel)
+{
+    GArray *indices = g_array_new(FALSE, FALSE, sizeof(guint));
+    const AnasysSpectrum *spectrum;
+    gdouble ex, ey;
+    guint i, j;
+
+    channel_get_extent(channel, &ex, &ey);
+    anasys_grid_find_rect(channel->file->spectrum_grid,
+                          channel->x - ex, channel->y - ey,
+                          channel->x + ex, channel->y + ey, indices);
+    /* Rotated scans only cover part of their bounding box. */
+    for (i = j = 0; i < indices->len; i++) {
+        spectrum = g_ptr_array_index(channel->file->spectra,
+                                     g_array_index(indices, guint, i));
+        if (channel_contains(channel, spectrum->x, spectrum->y))
+            g_array_index(indices, guint, j++) = g_array_index(indices,
+                                                              guint, i);
+    }
+    g_array_set_size(indices, j);
+    g_array_sort(indices, compare_indices);
+    return indices;
+}
+
+/* The position of the DataChannels element among all spectra in the file,
+ * counted from 1. */
+guint
+anasys_spectrum_get_id(const AnasysSpectrum *spectrum)
+{
+    return spectrum->id;
+}
+
+const gchar*
+anasys_spectrum_get_data_channel(const AnasysSpectrum *spectrum)
+{
+    return spectrum->datachannel;
+}
+
+const gchar*
+anasys_spectrum_get_label(const AnasysSpectrum *spectrum)
+{
+    return spectrum->label;
+}
+
+const gchar*
+anasys_spectrum_get_polarization(const AnasysSpectrum *spectrum)
+{
+    return spectrum->polarization;
+}
+
+void
+anasys_spectrum_get_location(const AnasysSpectrum *spectrum,
+                             gdouble *x, gdouble *y)
+{
+    if (x)
+        *x = spectrum->x;
+    if (y)
+        *y = spectrum->y;
+}
+
+/* Wavenumbers of the first and last point. */
+void
+anasys_spectrum_get_wavenumbers(const AnasysSpectrum *spectrum,
+                                gdouble *start, gdouble *end)
+{
+    if (start)
+        *start = spectrum->start;
+    if (end)
+        *end = spectrum->end;
+}
+
+/* Number of points actually stored, which need not be the declared
+ * DataPoints. */
+guint
+anasys_spectrum_get_n_points(const AnasysSpectrum *spectrum)
+{
+    return spectrum->npoints;
+}
+
+/* The background of the file with the BackgroundID of the spectrum. */
+const AnasysBackground*
+anasys_spectrum_get_background(const AnasysSpectrum *spectrum)
+{
+    const AnasysBackground *background;
+    guint i;
+
+    if (!spectrum->background_id)
+        return NULL;
+    for (i = 0; i < spectrum->file->backgrounds->len; i++) {
+        background = g_ptr_array_index(spectrum->file->backgrounds, i);
+        if (g_strcmp0(background->id, spectrum->background_id) == 0)
+            return background;
+    }
+    return NULL;
+}
+
+/* Indices of the channels whose scanned area contains the Location of the
+ * spectrum, in file order.  Free the array with g_array_free(). */
+GArray*
+anasys_spectrum_find_channels(const AnasysSpectrum *spectrum)
+{
+    GArray *indices = g_array_new(FALSE, FALSE, sizeof(guint));
+    guint i;
+
+    for (i = 0; i < spectrum->file->channels->len; i++) {
+        if (channel_contains(g_ptr_array_index(spectrum->file->channels, i),
+                             spectrum->x, spectrum->y))
+            g_array_append_val(indices, i);
+    }
+    return indices;
+}
+
+const gfloat*
+anasys_spectrum_get_data(AnasysSpectrum *spectrum, GError **error)
+{
+    gfloat *data;
+
+    if (spectrum->payload.raw && G_BYTE_ORDER == G_LITTLE_ENDIAN
+        && spectrum->payload.size == spectrum->npoints*sizeof(gfloat))
+        return (const gfloat*)spectrum->payload.raw;
+    if (spectrum->buffer.data)
+        return spectrum->buffer.data;
+    data = buffer_alloc(spectrum->file, &spectrum->buffer, spectrum->npoints);
+    if (!anasys_spectrum_read_data(spectrum, 0, spectrum->npoints, data,
+                                   error)) {
+        buffer_free(spectrum->file, &spectrum->buffer, spectrum->npoints);
+        return NULL;
+    }
+    return data;
+}
+
+void
+anasys_spectrum_free_data(AnasysSpectrum *spectrum)
+{
+    buffer_free(spectrum->file, &spectrum->buffer, spectrum->npoints);
+}
+
+/* Decode the points [from, to) into buffer.  Only the part of the payload
+ * holding them is decoded. */
+gboolean
+anasys_spectrum_read_data(const AnasysSpectrum *spectrum,
+                          guint from, guint to, gfloat *buffer,
+                          GError **error)
+{
+    g_return_val_if_fail(from <= to && to <= spectrum->npoints, FALSE);
+    if (!read_payload(&spectrum->payload,
+                      from*sizeof(gfloat), to*sizeof(gfloat),
+                      (guchar*)buffer, error))
+        return FALSE;
+    floats_from_le(buffer, to - from);
+    return TRUE;
+}
+
+const gchar*
+anasys_background_get_id(const AnasysBackground *background)
+{
+    return background->id;
+}
+
+guint
+anasys_background_get_n_meta(const AnasysBackground *background)
+{
+    return background->meta->len/2;
+}
+
+void
+anasys_background_get_meta(const AnasysBackground *background, guint i,
+                           const gchar **key, const gchar **value)
+{
+    g_return_if_fail(2*i < background->meta->len);
+    if (key)
+        *key = g_ptr_array_index(background->meta, 2*i);
+    if (value)
+        *value = g_ptr_array_index(background->meta, 2*i + 1);
+}
+
+const gchar*
+anasys_background_find_meta(const AnasysBackground *background,
+                            const gchar *key)
+{
+    guint i;
+
+    for (i = 0; i < background->meta->len; i += 2) {
+        if (g_strcmp0(g_ptr_array_index(background->meta, i), key) == 0)
+            return g_ptr_array_index(background->meta, i + 1);
+    }
+    return NULL;
+}
+
+/* An array of the background, such as Table or AttenuatorPower, or NULL if
+ * it has none of that name.  Base64 arrays keep their element names. */
+const gdouble*
+anasys_background_find_array(const AnasysBackground *background,
+                             const gchar *name, guint *n)
+{
+    GArray *values;
+    guint i;
+
+    for (i = 0; i < background->arrays->len; i++) {
+        if (g_strcmp0(g_ptr_array_index(background->array_names, i),
+                      name) == 0) {
+            values = g_ptr_array_index(background->arrays, i);
+            if (n)
+                *n = values->len;
+            return (const gdouble*)values->data;
+        }
+    }
+    if (n)
+        *n = 0;
+    return NULL;
+}
+
+static AnasysFile*
+file_new(void)
+{
+    AnasysFile *file = g_new0(AnasysFile, 1);
+
+    file->refcount = 1;
+    file->channels = g_ptr_array_new_with_free_func(channel_free);
+    file->spectra = g_ptr_array_new_with_free_func(spectrum_free);
+    file->backgrounds = g_ptr_array_new_with_free_func(background_unref);
+    g_mutex_init(&file->lock);
+    file->budget = G_MAXUINT64;
+    file->scratch = -1;
+    file->holes = g_array_new(FALSE, FALSE, sizeof(ScratchExtent));
+    return file;
+}
+
+static AnasysName
+name_lookup(const xmlChar *name)
+{
+    const gchar *s = (const gchar*)name;
+    gsize len;
+    guint i;
+
+    if (!s || !(len = strlen(s)))
+        return NAME_OTHER;
+    i = name_table[NAME_HASH(name, len)];
+    return (i && !strcmp(schema_names[i], s)) ? i : NAME_OTHER;
+}
+
+/* Find two attributes in a single pass over those of node.  Pass NAME_OTHER
+ * for name2 if only one is wanted. */
+static void
+find_attributes(const xmlNode *node,
+                AnasysName name1, const xmlAttr **attr1,
+                AnasysName name2, const xmlAttr **attr2)
+{
+    const xmlAttr *attr;
+    AnasysName name;
+
+    *attr1 = NULL;
+    if (attr2)
+        *attr2 = NULL;
+    for (attr = node->properties; attr; attr = attr->next) {
+        if ((name = name_lookup(attr->name)) == NAME_OTHER)
+            continue;
+        if (name == name1)
+            *attr1 = attr;
+        else if (name == name2)
+            *attr2 = attr;
+    }
+}
+
+/* Like xmlGetProp(), an attribute with no value is empty, but not copied
+ * unless it has to be. */
+static const gchar*
+attr_text(const xmlAttr *attr, xmlChar **copy)
+{
+    *copy = NULL;
+    if (!attr)
+        return NULL;
+    if (!attr->children)
+        return "";
+    return peek_text(attr->doc, attr->children, copy);
+}
+
+/* The HeightMaps of a split document are in documents of their own, the
+ * marker stands for them all. */
+static void
+read_height_maps(AnasysFile *file, const xmlNode *curNode)
+{
+    AnasysChannel *channel;
+    xmlNode *childNode;
+    xmlDoc *fragment;
+    guint i, id = 0;
+
+    for (childNode = curNode->children;
+         childNode;
+         childNode = childNode->next) {
+        if (childNode->type == XML_PI_NODE
+            && strequal(childNode->name, ANASYS_HEIGHT_MAPS_MARKER)
+            && file->height_map_docs) {
+            for (i = 0; i < file->height_map_docs->len; i++) {
+                fragment = g_ptr_array_index(file->height_map_docs, i);
+                channel = read_channel(file,
+                                       anasys_parse_get_element(fragment),
+                                       ++id);
+                if (channel)
+                    g_ptr_array_add(file->channels, channel);
+            }
+        }
+        if (childNode->type != XML_ELEMENT_NODE)
+            continue;
+        if ((channel = read_channel(file, childNode, ++id)))
+            g_ptr_array_add(file->channels, channel);
+    }
+}
+
+static inline void
+add_meta(AnasysChannel *channel, gchar *key, gchar *value)
+{
+    g_ptr_array_add(channel->meta, key);
+    g_ptr_array_add(channel->meta, value);
+}
+
+static AnasysChannel*
+read_channel(AnasysFile *file, const xmlNode *childNode, guint id)
+{
+    xmlDoc *doc = file->doc;
+    AnasysChannel *channel;
+    const xmlAttr *attr1, *attr2;
+    const gchar *name, *value;
+    xmlChar *copy1, *copy2;
+    xmlNode *subNode, *tempNode, *tagNode;
+    AnasysName element;
+
+    channel = g_new0(AnasysChannel, 1);
+    channel->file = file;
+    channel->id = id;
+    channel->unit_multiplier = 1.0;
+    channel->meta = g_ptr_array_new_with_free_func(g_free);
+    find_attributes(childNode, NAME_DATA_CHANNEL, &attr1, NAME_LABEL, &attr2);
+    channel->datachannel = g_strdup(attr_text(attr1, &copy1));
+    channel->label = g_strdup(attr_text(attr2, &copy2));
+    xmlFree(copy1);
+    xmlFree(copy2);
+
+    for (tempNode = childNode->children;
+         tempNode;
+         tempNode = tempNode->next) {
+        if (tempNode->type != XML_ELEMENT_NODE)
+            continue;
+        switch ((element = name_lookup(tempNode->name))) {
+            case NAME_POSITION:
+            case NAME_SIZE:
+            case NAME_RESOLUTION:
+            read_xy(channel, tempNode, element);
+            break;
+
+            case NAME_UNITS:
+            g_free(channel->unit);
+            channel->unit = get_node_text(doc, tempNode);
+            add_meta(channel, g_strdup("Units"), g_strdup(channel->unit));
+            break;
+
+            case NAME_UNIT_PREFIX:
+            value = peek_text(doc, tempNode->children, &copy1);
+            channel->unit_multiplier = unit_prefix_multiplier(value);
+            xmlFree(copy1);
+            break;
+
+            case NAME_TAGS:
+            for (tagNode = tempNode->children;
+                 tagNode;
+                 tagNode = tagNode->next) {
+                if (tagNode->type != XML_ELEMENT_NODE)
+                    continue;
+                find_attributes(tagNode, NAME_NAME, &attr1,
+                                NAME_VALUE, &attr2);
+                name = attr_text(attr1, &copy1);
+                value = attr_text(attr2, &copy2);
+                if (!g_strcmp0(name, "ScanAngle"))
+                    channel->scan_angle = parse_scan_angle(value);
+                add_meta(channel, g_strdup(name), g_strdup(value));
+                xmlFree(copy1);
+                xmlFree(copy2);
+            }
+            break;
+
+            case NAME_SAMPLE_BASE64:
+            get_payload(file, tempNode, &channel->payload);
+            break;
+
+            default:
+            name = (const gchar*)tempNode->name;
+            if (xmlChildElementCount(tempNode) == 0) {
+                add_meta(channel, g_strdup(name),
+                         get_node_text(doc, tempNode));
+                break;
+            }
+            for (subNode = tempNode->children;
+                 subNode;
+                 subNode = subNode->next) {
+                if (subNode->type != XML_ELEMENT_NODE)
+                    continue;
+                add_meta(channel,
+                         g_strconcat(name, "_", subNode->name, NULL),
+                         get_node_text(doc, subNode));
+            }
+            break;
+        }
+    }
+
+    /* The size in bytes must be representable, which matters only where
+     * gsize has 32 bits. */
+    if (!channel->payload.text || !channel->xres || !channel->yres
+        || channel->xres > G_MAXSIZE/sizeof(gfloat)/channel->yres) {
+        channel_free(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+/* The X and Y of Position, Size and Resolution, all of their children going
+ * to the metadata too. */
+static void
+read_xy(AnasysChannel *channel, const xmlNode *node, AnasysName name)
+{
+    const xmlNode *xyNode;
+    AnasysName xy;
+    gchar *key;
+
+    for (xyNode = node->children; xyNode; xyNode = xyNode->next) {
+        if (xyNode->type != XML_ELEMENT_NODE)
+            continue;
+        key = get_node_text(channel->file->doc, xyNode);
+        xy = name_lookup(xyNode->name);
+        if (name == NAME_POSITION && xy == NAME_X)
+            channel->x = g_ascii_strtod(key, NULL);
+        else if (name == NAME_POSITION && xy == NAME_Y)
+            channel->y = g_ascii_strtod(key, NULL);
+        else if (name == NAME_SIZE && xy == NAME_X)
+            channel->xreal = g_ascii_strtod(key, NULL);
+        else if (name == NAME_SIZE && xy == NAME_Y)
+            channel->yreal = g_ascii_strtod(key, NULL);
+        else if (key && name == NAME_RESOLUTION && xy == NAME_X)
+            channel->xres = MAX(atoi(key), 0);
+        else if (key && name == NAME_RESOLUTION && xy == NAME_Y)
+            channel->yres = MAX(atoi(key), 0);
+        add_meta(channel,
+                 g_strconcat(schema_names[name], "_", xyNode->name, NULL),
+                 key);
+    }
+}
+
+/* The IRRenderedSpectra of a split document are in documents of their own,
+ * the marker stands for them all. */
+static void
+read_spectra(AnasysFile *file, const xmlNode *curNode)
+{
+    xmlNode *childNode;
+    xmlDoc *fragment;
+    guint i, specID = 0;
+
+    for (childNode = curNode->children;
+         childNode;
+         childNode = childNode->next) {
+        if (childNode->type == XML_PI_NODE
+            && strequal(childNode->name, ANASYS_SPECTRA_MARKER)
+            && file->spectra_docs) {
+            for (i = 0; i < file->spectra_docs->len; i++) {
+                fragment = g_ptr_array_index(file->spectra_docs, i);
+                read_rendered_spectra(file,
+                                      anasys_parse_get_element(fragment),
+                                      &specID);
+            }
+        }
+        if (childNode->type != XML_ELEMENT_NODE)
+            continue;
+        if (name_lookup(childNode->name) != NAME_IR_RENDERED_SPECTRA)
+            continue;
+        read_rendered_spectra(file, childNode, &specID);
+    }
+}
+
+static void
+read_rendered_spectra(AnasysFile *file, const xmlNode *childNode,
+                      guint *specID)
+{
+    AnasysSpectrum *spectrum;
+    xmlDoc *doc = file->doc;
+    const gchar *key;
+    const xmlAttr *attr;
+    xmlChar *copy;
+    xmlNode *dcNode;
+    xmlNode *locNode;
+    xmlNode *subNode;
+    gdouble location_x;
+    gdouble location_y;
+    gdouble startWavenum;
+    gdouble endWavenum;
+    guint32 numDataPoints;
+    gchar *label = NULL;
+    gchar *polarization = NULL;
+    gchar *background_id = NULL;
+
+    location_x = 0.0;
+    location_y = 0.0;
+    startWavenum = 0.0;
+    endWavenum = 0.0;
+    numDataPoints = 0;
+
+    for (subNode = childNode->children; subNode; subNode = subNode->next) {
+        if (subNode->type != XML_ELEMENT_NODE)
+            continue;
+        switch (name_lookup(subNode->name)) {
+            case NAME_LABEL:
+            g_free(label);
+            label = get_node_text(doc, subNode);
+            break;
+
+            case NAME_DATA_POINTS:
+            key = peek_text(doc, subNode->children, &copy);
+            numDataPoints = key ? (guint32)atoi(key) : 0;
+            xmlFree(copy);
+            break;
+
+            case NAME_START_WAVENUMBER:
+            key = peek_text(doc, subNode->children, &copy);
+            startWavenum = g_ascii_strtod(key, NULL);
+            xmlFree(copy);
+            break;
+
+            case NAME_END_WAVENUMBER:
+            key = peek_text(doc, subNode->children, &copy);
+            endWavenum = g_ascii_strtod(key, NULL);
+            xmlFree(copy);
+            break;
+
+            case NAME_POLARIZATION:
+            g_free(polarization);
+            polarization = get_node_text(doc, subNode);
+            break;
+
+            case NAME_BACKGROUND_ID:
+            g_free(background_id);
+            background_id = get_node_text(doc, subNode);
+            break;
+
+            case NAME_LOCATION:
+            for (locNode = subNode->children;
+                 locNode;
+                 locNode = locNode->next) {
+                if (locNode->type != XML_ELEMENT_NODE)
+                    continue;
+                key = peek_text(doc, locNode->children, &copy);
+                switch (name_lookup(locNode->name)) {
+                    case NAME_X:
+                    location_x = g_ascii_strtod(key, NULL);
+                    break;
+
+                    case NAME_Y:
+                    location_y = g_ascii_strtod(key, NULL);
+                    break;
+
+                    default:
+                    break;
+                }
+                xmlFree(copy);
+            }
+            break;
+
+            case NAME_DATA_CHANNELS:
+            spectrum = g_new0(AnasysSpectrum, 1);
+            spectrum->file = file;
+            spectrum->id = ++*specID;
+            for (dcNode = subNode->children;
+                 dcNode;
+                 dcNode = dcNode->next) {
+                if (dcNode->type == XML_ELEMENT_NODE
+                    && name_lookup(dcNode->name) == NAME_SAMPLE_BASE64) {
+                    get_payload(file, dcNode, &spectrum->payload);
+                    break;
+                }
+            }
+            if (!spectrum->payload.text || numDataPoints < 1
+                || spectrum->payload.size/sizeof(gfloat) > G_MAXUINT) {
+                spectrum_free(spectrum);
+                break;
+            }
+            find_attributes(subNode, NAME_DATA_CHANNEL, &attr,
+                            NAME_OTHER, NULL);
+            spectrum->datachannel = g_strdup(attr_text(attr, &copy));
+            xmlFree(copy);
+            spectrum->label = g_strdup(label);
+            spectrum->polarization = g_strdup(polarization);
+            spectrum->background_id = g_strdup(background_id);
+            spectrum->x = location_x;
+            spectrum->y = location_y;
+            spectrum->start = startWavenum;
+            spectrum->end = endWavenum;
+            spectrum->npoints = spectrum->payload.size/sizeof(gfloat);
+            g_ptr_array_add(file->spectra, spectrum);
+            break;
+
+            default:
+            break;
+        }
+    }
+    g_free(label);
+    g_free(polarization);
+    g_free(background_id);
+}
+
+/* The IRBackgrounds cut out of a split document are parsed, or known from
+ * the cache already, and the marker stands for them all. */
+static void
+read_backgrounds(AnasysFile *file, const xmlNode *curNode, GArray *parsed)
+{
+    AnasysParsedBackground *item;
+    AnasysBackground *background;
+    xmlNode *childNode;
+    guint i;
+
+    for (childNode = curNode->children;
+         childNode;
+         childNode = childNode->next) {
+        if (childNode->type == XML_PI_NODE
+            && strequal(childNode->name, ANASYS_BACKGROUNDS_MARKER)
+            && parsed) {
+            for (i = 0; i < parsed->len; i++) {
+                item = &g_array_index(parsed, AnasysParsedBackground, i);
+                if ((background = item->known))
+                    item->known = NULL;
+                else {
+                    background
+                        = read_background(file->doc,
+                                          anasys_parse_get_element(item->doc));
+                    background = background_cache_insert(item->checksum,
+                                                         background);
+                }
+                g_ptr_array_add(file->backgrounds, background);
+            }
+        }
+        if (childNode->type != XML_ELEMENT_NODE
+            || name_lookup(childNode->name) != NAME_IR_BACKGROUND)
+            continue;
+        g_ptr_array_add(file->backgrounds,
+                        read_background(file->doc, childNode));
+    }
+}
+
+static AnasysBackground*
+read_background(xmlDoc *doc, const xmlNode *node)
+{
+    AnasysBackground *background;
+    const xmlNode *subNode, *itemNode;
+    const gchar *text;
+    xmlChar *copy;
+    GArray *values;
+    gfloat *floats;
+    gdouble value;
+    gsize i, len;
+
+    background = g_new0(AnasysBackground, 1);
+    background->refcount = 1;
+    background->meta = g_ptr_array_new_with_free_func(g_free);
+    background->array_names = g_ptr_array_new_with_free_func(g_free);
+    background->arrays
+        = g_ptr_array_new_with_free_func((GDestroyNotify)g_array_unref);
+
+    for (subNode = node->children; subNode; subNode = subNode->next) {
+        if (subNode->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlChildElementCount((xmlNode*)subNode)) {
+            values = g_array_new(FALSE, FALSE, sizeof(gdouble));
+            for (itemNode = subNode->children;
+                 itemNode;
+                 itemNode = itemNode->next) {
+                if (itemNode->type != XML_ELEMENT_NODE)
+                    continue;
+                text = peek_text(doc, itemNode->children, &copy);
+                value = text ? g_ascii_strtod(text, NULL) : 0.0;
+                g_array_append_val(values, value);
+                xmlFree(copy);
+            }
+        }
+        else if (g_str_has_suffix((const gchar*)subNode->name, "Base64")) {
+            /* Single precision, like all the other payloads. */
+            values = g_array_new(FALSE, FALSE, sizeof(gdouble));
+            text = peek_text(doc, subNode->children, &copy);
+            floats = text ? (gfloat*)g_base64_decode(text, &len) : NULL;
+            len = floats ? len/sizeof(gfloat) : 0;
+            floats_from_le(floats, len);
+            for (i = 0; i < len; i++) {
+                value = floats[i];
+                g_array_append_val(values, value);
+            }
+            g_free(floats);
+            xmlFree(copy);
+        }
+        else {
+            if (name_lookup(subNode->name) == NAME_ID) {
+                g_free(background->id);
+                background->id = get_node_text(doc, subNode);
+            }
+            g_ptr_array_add(background->meta,
+                            g_strdup((const gchar*)subNode->name));
+            g_ptr_array_add(background->meta, get_node_text(doc, subNode));
+            continue;
+        }
+        g_ptr_array_add(background->array_names,
+                        g_strdup((const gchar*)subNode->name));
+        g_ptr_array_add(background->arrays, values);
+    }
+    return background;
+}
+
+static gchar*
+read_primary_channel(xmlDoc *doc, const xmlNode *curNode)
+{
+    const xmlNode *viewNode, *subNode;
+    gchar *datatype;
+
+    for (viewNode = curNode->children; viewNode; viewNode = viewNode->next) {
+        for (subNode = viewNode->children; subNode; subNode = subNode->next) {
+            if (subNode->type != XML_ELEMENT_NODE
+                || name_lookup(subNode->name) != NAME_DATA_TYPE)
+                continue;
+            if ((datatype = get_node_text(doc, subNode)))
+                return datatype;
+        }
+    }
+    return NULL;
+}
+
+/* Index the spectrum Locations once, for all spatial queries. */
+static AnasysGrid*
+index_spectra(const AnasysFile *file)
+{
+    const AnasysSpectrum *spectrum;
+    AnasysGrid *grid;
+    gdouble *xy;
+    guint i, n = file->spectra->len;
+
+    xy = g_new(gdouble, 2*MAX(n, 1));
+    for (i = 0; i < n; i++) {
+        spectrum = g_ptr_array_index(file->spectra, i);
+        xy[2*i] = spectrum->x;
+        xy[2*i + 1] = spectrum->y;
+    }
+    grid = anasys_grid_new(xy, n);
+    g_free(xy);
+    return grid;
+}
+
+/* The scanned area is the Size centred at the Position, turned by the
+ * ScanAngle counterclockwise, as the module orients the data. */
+static gboolean
+channel_contains(const AnasysChannel *channel, gdouble x, gdouble y)
+{
+    gdouble a = channel->scan_angle*G_PI/180.0;
+    gdouble u = x - channel->x, v = y - channel->y;
+    gdouble eps = 1e-9*(channel->xreal + channel->yreal);
+
+    return (fabs(u*cos(a) + v*sin(a)) <= 0.5*channel->xreal + eps
+            && fabs(v*cos(a) - u*sin(a)) <= 0.5*channel->yreal + eps);
+}
+
+/* Half the sides of the bounding box of the scanned area. */
+static void
+channel_get_extent(const AnasysChannel *channel, gdouble *ex, gdouble *ey)
+{
+    gdouble a = channel->scan_angle*G_PI/180.0;
+    gdouble eps = 1e-9*(channel->xreal + channel->yreal);
+
+    *ex = 0.5*(fabs(channel->xreal*cos(a)) + fabs(channel->yreal*sin(a)))
+          + eps;
+    *ey = 0.5*(fabs(channel->xreal*sin(a)) + fabs(channel->yreal*cos(a)))
+          + eps;
+}
+
+/* The grid finds indices cell by cell, they are sorted back into file
+ * order. */
+static gint
+compare_indices(gconstpointer a, gconstpointer b)
+{
+    guint ia = *(const guint*)a, ib = *(const guint*)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+static void
+channel_free(gpointer p)
+{
+    AnasysChannel *channel = (AnasysChannel*)p;
+
+    g_free(channel->datachannel);
+    g_free(channel->label);
+    g_free(channel->unit);
+    g_ptr_array_free(channel->meta, TRUE);
+    xmlFree(channel->payload.copy);
+    buffer_free(channel->file, &channel->buffer,
+                (gsize)channel->xres*channel->yres);
+    g_free(channel);
+}
+
+static void
+spectrum_free(gpointer p)
+{
+    AnasysSpectrum *spectrum = (AnasysSpectrum*)p;
+
+    g_free(spectrum->datachannel);
+    g_free(spectrum->label);
+    g_free(spectrum->polarization);
+    g_free(spectrum->background_id);
+    xmlFree(spectrum->payload.copy);
+    anasys_spectrum_free_data(spectrum);
+    g_free(spectrum);
+}
+
+static void
+background_unref(gpointer p)
+{
+    AnasysBackground *background = (AnasysBackground*)p;
+
+    if (!g_atomic_int_dec_and_test(&background->refcount))
+        return;
+    g_free(background->id);
+    g_ptr_array_free(background->meta, TRUE);
+    g_ptr_array_free(background->array_names, TRUE);
+    g_ptr_array_free(background->arrays, TRUE);
+    g_free(background);
+}
+
+/* Called from the parsing threads. */
+static gpointer
+background_cache_lookup(const gchar *checksum)
+{
+    AnasysBackground *background = NULL;
+
+    g_mutex_lock(&background_lock);
+    if (background_cache
+        && (background = g_hash_table_lookup(background_cache, checksum)))
+        g_atomic_int_inc(&background->refcount);
+    g_mutex_unlock(&background_lock);
+    return background;
+}
+
+/* If another file put the same background in the cache meanwhile, use that
+ * one. */
+static AnasysBackground*
+background_cache_insert(const gchar *checksum, AnasysBackground *background)
+{
+    AnasysBackground *cached;
+    gchar *key;
+
+    g_mutex_lock(&background_lock);
+    if (!background_cache)
+        background_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, background_unref);
+    if ((cached = g_hash_table_lookup(background_cache, checksum))) {
+        g_atomic_int_inc(&cached->refcount);
+        g_mutex_unlock(&background_lock);
+        background_unref(background);
+        return cached;
+    }
+    key = g_strdup(checksum);
+    g_atomic_int_inc(&background->refcount);
+    g_hash_table_insert(background_cache, key, background);
+    g_queue_push_tail(&background_order, key);
+    while (g_queue_get_length(&background_order) > BACKGROUND_CACHE_SIZE) {
+        key = g_queue_pop_head(&background_order);
+        g_hash_table_remove(background_cache, key);
+    }
+    g_mutex_unlock(&background_lock);
+    return background;
+}
+
+static void
+free_parsed_backgrounds(GArray *parsed)
+{
+    AnasysParsedBackground *item;
+    guint i;
+
+    if (!parsed)
+        return;
+    for (i = 0; i < parsed->len; i++) {
+        item = &g_array_index(parsed, AnasysParsedBackground, i);
+        g_free(item->checksum);
+        xmlFreeDoc(item->doc);
+        if (item->known)
+            background_unref(item->known);
+    }
+    g_array_free(parsed, TRUE);
+}
+
+static gchar*
+get_node_text(xmlDoc *doc, const xmlNode *node)
+{
+    xmlChar *copy;
+    gchar *text = g_strdup(peek_text(doc, node->children, &copy));
+
+    xmlFree(copy);
+    return text;
+}
+
+/* A copy is made only if the text is not one text node, which it nearly
+ * always is; the caller frees *copy. */
+static const gchar*
+peek_text(xmlDoc *doc, const xmlNode *children, xmlChar **copy)
+{
+    *copy = NULL;
+    if (!children)
+        return NULL;
+    if (!children->next && children->type == XML_TEXT_NODE)
+        return (const gchar*)children->content;
+    *copy = xmlNodeListGetString(doc, children, 1);
+    return (const gchar*)*copy;
+}
+
+/* Take the base64 text of node and find how many bytes it holds.  The text
+ * is regular if it is one unbroken string, so that any bytes can be located
+ * and decoded directly.  For payloads left out, the index knows. */
+static void
+get_payload(const AnasysFile *file, const xmlNode *node,
+            AnasysPayload *payload)
+{
+    const xmlNode *child = node->children;
+    const AnasysGzPayload *deferred;
+    const gchar *p;
+    gchar *end;
+    gsize i, n = 0, pad = 0;
+
+    xmlFree(payload->copy);
+    payload->copy = NULL;
+    if (child && !child->next && child->type == XML_TEXT_NODE)
+        payload->text = (const gchar*)child->content;
+    else {
+        payload->copy = xmlNodeListGetString(file->doc,
+                                             node->xmlChildrenNode, 1);
+        payload->text = (const gchar*)payload->copy;
+    }
+
+    p = payload->text;
+    if (file->index && p && p[0] == '#') {
+        i = strtoul(p + 1, &end, 10);
+        if (end != p + 1 && !*end
+            && i < anasys_gz_index_get_n_payloads(file->index)) {
+            deferred = anasys_gz_index_get_payload(file->index, i);
+            payload->index = file->index;
+            payload->offset = deferred->offset;
+            payload->len = deferred->length/2;
+            payload->size = deferred->size;
+            payload->regular = deferred->regular;
+            return;
+        }
+    }
+
+    p = payload->text;
+    payload->len = p ? strlen(p) : 0;
+    for (i = 0; i < payload->len; i++) {
+        if (g_ascii_isspace(p[i]))
+            continue;
+        n++;
+        pad = (p[i] == '=') ? pad + 1 : 0;
+    }
+    payload->regular = (n == payload->len && n % 4 == 0);
+    payload->size = (n/4*3 > MIN(pad, 2)) ? n/4*3 - MIN(pad, 2) : 0;
+}
+
+/* Decode 4-character groups [g0, g1) of regular base64 text into dest. */
+static inline gboolean
+decode_groups(const gchar *text, gsize g0, gsize g1, guchar *dest)
+{
+    gint state = 0;
+    guint save = 0;
+
+    return g_base64_decode_step(text + 4*g0, 4*(g1 - g0), dest,
+                                &state, &save) == 3*(g1 - g0);
+}
+
+/* Decode the bytes [from, to) of a payload into dest, which has room for
+ * just them.  For regular text only the groups covering them are decoded,
+ * whole groups straight into dest.  Groups cut at either end, including a
+ * padded last group, go through a small buffer. */
+static gboolean
+read_payload(const AnasysPayload *payload, gsize from, gsize to,
+             guchar *dest, GError **error)
+{
+    Base64Stream stream;
+    guchar group[3];
+    gsize first = (from + 2)/3, last = to/3, g, n;
+    gint state;
+    guint save;
+
+    if (to > payload->size || from > to) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                    "Requested data lie outside the payload.");
+        return FALSE;
+    }
+    if (from == to)
+        return TRUE;
+    if (payload->raw) {
+        memcpy(dest, payload->raw + from, to - from);
+        return TRUE;
+    }
+    if (payload->index)
+        return read_deferred_payload(payload, from, to, dest, error);
+
+    if (!payload->regular) {
+        memset(&stream, 0, sizeof(stream));
+        decode_stream(&stream, payload->text, payload->len, from, to, dest);
+        g_free(stream.chunk);
+        if (stream.pos < to) {
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                        "Data payload is corrupted.");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    if (first < last && !decode_groups(payload->text, first, last,
+                                       dest + (3*first - from))) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                    "Data payload is corrupted.");
+        return FALSE;
+    }
+    for (g = from/3; g < (to + 2)/3; g++) {
+        if (g >= first && g < last)
+            continue;
+        state = 0;
+        save = 0;
+        n = g_base64_decode_step(payload->text + 4*g, 4, group,
+                                 &state, &save);
+        if (n < MIN(to, 3*g + 3) - 3*g) {
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                        "Data payload is corrupted.");
+            return FALSE;
+        }
+        n = MIN(to, 3*g + 3) - MAX(from, 3*g);
+        memcpy(dest + (MAX(from, 3*g) - from), group + (MAX(from, 3*g) - 3*g),
+               n);
+    }
+    return TRUE;
+}
+
+/* Inflate the text of a payload left out of the document and decode it,
+ * DECODE_GROUPS groups at a time through one stream, which inflates each
+ * piece on from the previous one.  Of regular text only the groups
+ * covering the bytes are inflated. */
+static gboolean
+read_deferred_payload(const AnasysPayload *payload, gsize from, gsize to,
+                      guchar *dest, GError **error)
+{
+    AnasysPayload part;
+    AnasysGzStream *gz;
+    Base64Stream stream;
+    gsize a, b, g0, g1, p, n;
+    gchar *text;
+    gboolean ok = TRUE;
+
+    if (!(gz = anasys_gz_stream_open(payload->index, error)))
+        return FALSE;
+    text = g_new(gchar, 4*DECODE_GROUPS + 1);
+    if (payload->regular) {
+        memset(&part, 0, sizeof(part));
+        part.regular = TRUE;
+        part.text = text;
+        for (a = from; ok && a < to; a = b) {
+            b = MIN(to, 3*(a/3 + DECODE_GROUPS));
+            g0 = a/3;
+            g1 = (b + 2)/3;
+            part.len = 4*(g1 - g0);
+            part.size = MIN(payload->size, 3*g1) - 3*g0;
+            ok = anasys_gz_stream_read_text(gz, payload->offset + 2*4*g0,
+                                            part.len, text, error);
+            text[part.len] = '\0';
+            ok = ok && read_payload(&part, a - 3*g0, b - 3*g0,
+                                    dest + (a - from), error);
+        }
+        anasys_gz_stream_close(gz);
+        g_free(text);
+        return ok;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    for (p = 0; ok && p < payload->len && stream.pos < to; p += n) {
+        n = MIN(payload->len - p, 4*DECODE_GROUPS);
+        ok = anasys_gz_stream_read_text(gz, payload->offset + 2*p, n, text,
+                                        error);
+        if (ok)
+            decode_stream(&stream, text, n, from, to, dest);
+    }
+    anasys_gz_stream_close(gz);
+    g_free(stream.chunk);
+    g_free(text);
+    if (ok && stream.pos < to) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                    "Data payload is corrupted.");
+        return FALSE;
+    }
+    return ok;
+}
+
+/* Decode the next len characters of text in pieces of DECODE_GROUPS groups
+ * through a chunk buffer, keeping the bytes [from, to) of the whole in
+ * dest.  Stops early once they are all there. */
+static void
+decode_stream(Base64Stream *stream, const gchar *text, gsize len,
+              gsize from, gsize to, guchar *dest)
+{
+    gsize p, n, m, lo, hi;
+
+    if (!stream->chunk)
+        stream->chunk = g_new(guchar, 3*DECODE_GROUPS + 3);
+    for (p = 0; p < len && stream->pos < to; p += n) {
+        n = MIN(len - p, 4*DECODE_GROUPS);
+        m = g_base64_decode_step(text + p, n, stream->chunk,
+                                 &stream->state, &stream->save);
+        lo = MAX(from, stream->pos);
+        hi = MIN(to, stream->pos + m);
+        if (lo < hi)
+            memcpy(dest + (lo - from), stream->chunk + (lo - stream->pos),
+                   hi - lo);
+        stream->pos += m;
+    }
+}
+
+/* Get a buffer for n values on the heap while the budget allows, otherwise
+ * in the scratch file.  If the scratch file cannot be used, the budget is
+ * exceeded rather than failing. */
+static gfloat*
+buffer_alloc(AnasysFile *file, AnasysBuffer *buffer, gsize n)
+{
+    gsize bytes = MAX(n, 1)*sizeof(gfloat);
+
+    g_mutex_lock(&file->lock);
+    if (file->resident + bytes > file->budget
+        && scratch_map(file, buffer, bytes)) {
+        g_mutex_unlock(&file->lock);
+        return buffer->data;
+    }
+    file->resident += bytes;
+    g_mutex_unlock(&file->lock);
+    buffer->size = 0;
+    return buffer->data = g_new(gfloat, MAX(n, 1));
+}
+
+static void
+buffer_free(AnasysFile *file, AnasysBuffer *buffer, gsize n)
+{
+    if (!buffer->data)
+        return;
+    g_mutex_lock(&file->lock);
+    if (buffer->size)
+        scratch_unmap(file, buffer);
+    else {
+        g_free(buffer->data);
+        file->resident -= MAX(n, 1)*sizeof(gfloat);
+    }
+    g_mutex_unlock(&file->lock);
+    buffer->data = NULL;
+    buffer->size = 0;
+}
+
+#ifdef G_OS_UNIX
+/* Map whole pages of the scratch file for bytes, reusing the first hole
+ * large enough or growing the file.  The file is created on first use and
+ * unlinked at once, so it goes away with the process.  Called locked. */
+static gboolean
+scratch_map(AnasysFile *file, AnasysBuffer *buffer, gsize bytes)
+{
+    ScratchExtent *hole, extent;
+    glong pagesize = sysconf(_SC_PAGESIZE);
+    gchar *filename;
+    gpointer p;
+    guint i;
+
+    if (pagesize <= 0)
+        return FALSE;
+    if (file->scratch < 0) {
+        file->scratch = g_file_open_tmp("anasys-XXXXXX", &filename, NULL);
+        if (file->scratch < 0)
+            return FALSE;
+        unlink(filename);
+        g_free(filename);
+    }
+
+    extent.size = (bytes + pagesize-1)/pagesize*pagesize;
+    for (i = 0; i < file->holes->len; i++) {
+        hole = &g_array_index(file->holes, ScratchExtent, i);
+        if (hole->size >= extent.size)
+            break;
+    }
+    if (i < file->holes->len) {
+        extent.offset = hole->offset;
+        hole->offset += extent.size;
+        hole->size -= extent.size;
+        if (!hole->size)
+            g_array_remove_index_fast(file->holes, i);
+    }
+    else {
+        extent.offset = file->scratch_size;
+        if (ftruncate(file->scratch, extent.offset + extent.size) != 0)
+            return FALSE;
+        file->scratch_size += extent.size;
+    }
+
+    p = mmap(NULL, extent.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             file->scratch, extent.offset);
+    if (p == MAP_FAILED) {
+        g_array_append_val(file->holes, extent);
+        return FALSE;
+    }
+    buffer->data = (gfloat*)p;
+    buffer->size = extent.size;
+    buffer->offset = extent.offset;
+    return TRUE;
+}
+
+/* Unmap a buffer and give its pages back as a hole.  The file itself never
+ * shrinks.  Called locked. */
+static void
+scratch_unmap(AnasysFile *file, AnasysBuffer *buffer)
+{
+    ScratchExtent extent;
+
+    munmap(buffer->data, buffer->size);
+    extent.offset = buffer->offset;
+    extent.size = buffer->size;
+    g_array_append_val(file->holes, extent);
+}
+#else
+static gboolean
+scratch_map(G_GNUC_UNUSED AnasysFile *file,
+            G_GNUC_UNUSED AnasysBuffer *buffer,
+            G_GNUC_UNUSED gsize bytes)
+{
+    return FALSE;
+}
+
+static void
+scratch_unmap(G_GNUC_UNUSED AnasysFile *file,
+              G_GNUC_UNUSED AnasysBuffer *buffer)
+{
+}
+#endif
+
+/* The files store little endian floats. */
+static void
+floats_from_le(gfloat *data, gsize n)
+{
+    guint32 *p = (guint32*)data;
+    gsize i;
+
+    if (G_BYTE_ORDER == G_LITTLE_ENDIAN)
+        return;
+    for (i = 0; i < n; i++)
+        p[i] = GUINT32_SWAP_LE_BE(p[i]);
+}
+
+static gdouble
+unit_prefix_multiplier(const gchar *prefix)
+{
+    if (!prefix || !prefix[0] || prefix[1])
+        return 1.0;
+    if (prefix[0] == 'f')
+        return 1.0e-15;
+    if (prefix[0] == 'p')
+        return 1.0e-12;
+    if (prefix[0] == 'n')
+        return 1.0e-9;
+    if (prefix[0] == 'u')
+        return 1.0e-6;
+    if (prefix[0] == 'm')
+        return 1.0e-3;
+    return 1.0;
+}
+
+/* The angle is given with units, such as "90 deg".  Normalise it to the
+ * interval (-180, 180]. */
+static gdouble
+parse_scan_angle(const gchar *value)
+{
+    gdouble scan_angle;
+
+    if (!value || !strchr(value, ' '))
+        return 0.0;
+    scan_angle = g_ascii_strtod(value, NULL);
+    while (scan_angle > 180.0)
+        scan_angle -= 360.0;
+    while (scan_angle <= -180.0)
+        scan_angle += 360.0;
+    return scan_angle;
+}
+
+/* Everything but the data, with zero for the header size.  Each payload
+ * is given by its offset in the data and its size. */
+static void
+write_segment_header(const AnasysFile *file, GByteArray *header)
+{
+    const AnasysChannel *channel;
+    const AnasysSpectrum *spectrum;
+    const AnasysBackground *background;
+    const GArray *values;
+    guint64 offset = 0;
+    guint i, j, k;
+
+    g_byte_array_append(header, (const guint8*)SEGMENT_MAGIC,
+                        SEGMENT_MAGIC_SIZE);
+    put_u32(header, SEGMENT_VERSION);
+    put_u64(header, 0);
+    put_string(header, file->primary_channel);
+    put_u32(header, file->channels->len);
+    for (i = 0; i < file->channels->len; i++) {
+        channel = g_ptr_array_index(file->channels, i);
+        put_u32(header, channel->id);
+        put_string(header, channel->datachannel);
+        put_string(header, channel->label);
+        put_string(header, channel->unit);
+        put_double(header, channel->unit_multiplier);
+        put_u32(header, channel->xres);
+        put_u32(header, channel->yres);
+        put_double(header, channel->xreal);
+        put_double(header, channel->yreal);
+        put_double(header, channel->x);
+        put_double(header, channel->y);
+        put_double(header, channel->scan_angle);
+        put_u32(header, channel->meta->len);
+        for (j = 0; j < channel->meta->len; j++)
+            put_string(header, g_ptr_array_index(channel->meta, j));
+        put_u64(header, offset);
+        put_u64(header, channel->payload.size);
+        offset += (channel->payload.size + SEGMENT_ALIGN-1)
+                  /SEGMENT_ALIGN*SEGMENT_ALIGN;
+    }
+    put_u32(header, file->spectra->len);
+    for (i = 0; i < file->spectra->len; i++) {
+        spectrum = g_ptr_array_index(file->spectra, i);
+        put_u32(header, spectrum->id);
+        put_string(header, spectrum->datachannel);
+        put_string(header, spectrum->label);
+        put_string(header, spectrum->polarization);
+        put_double(header, spectrum->x);
+        put_double(header, spectrum->y);
+        put_double(header, spectrum->start);
+        put_double(header, spectrum->end);
+        put_u32(header, spectrum->npoints);
+        put_string(header, spectrum->background_id);
+        put_u64(header, offset);
+        put_u64(header, spectrum->payload.size);
+        offset += (spectrum->payload.size + SEGMENT_ALIGN-1)
+                  /SEGMENT_ALIGN*SEGMENT_ALIGN;
+    }
+    put_u32(header, file->backgrounds->len);
+    for (i = 0; i < file->backgrounds->len; i++) {
+        background = g_ptr_array_index(file->backgrounds, i);
+        put_string(header, background->id);
+        put_u32(header, background->meta->len);
+        for (j = 0; j < background->meta->len; j++)
+            put_string(header, g_ptr_array_index(background->meta, j));
+        put_u32(header, background->arrays->len);
+        for (j = 0; j < background->arrays->len; j++) {
+            put_string(header, g_ptr_array_index(background->array_names, j));
+            values = g_ptr_array_index(background->arrays, j);
+            put_u32(header, values->len);
+            for (k = 0; k < values->len; k++)
+                put_double(header, g_array_index(values, gdouble, k));
+        }
+    }
+}
+
+/* Decode a payload into the segment DECODE_GROUPS groups at a time and pad
+ * it to the alignment. */
+static gboolean
+write_segment_data(FILE *fh, const AnasysPayload *payload, GError **error)
+{
+    guchar *buffer = g_new0(guchar, MAX(3*DECODE_GROUPS, SEGMENT_ALIGN));
+    gsize pos, n;
+    gboolean ok = TRUE;
+
+    for (pos = 0; ok && pos < payload->size; pos += n) {
+        n = MIN(3*DECODE_GROUPS, payload->size - pos);
+        if (!(ok = read_payload(payload, pos, pos + n, buffer, error)))
+            break;
+        if (!(ok = (fwrite(buffer, 1, n, fh) == n)))
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                        "Cannot write segment data.");
+    }
+    if (ok) {
+        n = (SEGMENT_ALIGN - payload->size % SEGMENT_ALIGN) % SEGMENT_ALIGN;
+        memset(buffer, 0, n);
+        if (!(ok = (fwrite(buffer, 1, n, fh) == n)))
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                        "Cannot write segment data.");
+    }
+    g_free(buffer);
+    return ok;
+}
+
+/* Read what write_segment_header() wrote after the header size, which must
+ * end exactly at end.  The data following take datasize bytes. */
+static gboolean
+read_segment_header(AnasysFile *file, const guchar **p, const guchar *end,
+                    gsize datasize)
+{
+    AnasysChannel *channel;
+    AnasysSpectrum *spectrum;
+    AnasysBackground *background;
+    GArray *values;
+    guint32 n, nmeta, narrays, len, i, j, k;
+    gdouble value;
+    gchar *name;
+
+    if (!get_string(p, end, &file->primary_channel)
+        || !get_u32(p, end, &n))
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        channel = g_new0(AnasysChannel, 1);
+        channel->file = file;
+        channel->meta = g_ptr_array_new_with_free_func(g_free);
+        g_ptr_array_add(file->channels, channel);
+        if (!get_u32(p, end, &channel->id)
+            || !get_string(p, end, &channel->datachannel)
+            || !get_string(p, end, &channel->label)
+            || !get_string(p, end, &channel->unit)
+            || !get_double(p, end, &channel->unit_multiplier)
+            || !get_u32(p, end, &channel->xres)
+            || !get_u32(p, end, &channel->yres)
+            || !get_double(p, end, &channel->xreal)
+            || !get_double(p, end, &channel->yreal)
+            || !get_double(p, end, &channel->x)
+            || !get_double(p, end, &channel->y)
+            || !get_double(p, end, &channel->scan_angle)
+            || !get_u32(p, end, &nmeta) || nmeta % 2
+            || (gsize)(end - *p)/sizeof(guint32) < nmeta)
+            return FALSE;
+        for (j = 0; j < nmeta; j++) {
+            if (!get_strings(p, end, channel->meta))
+                return FALSE;
+        }
+        if (!read_segment_payload(file, p, end, datasize, &channel->payload))
+            return FALSE;
+    }
+
+    if (!get_u32(p, end, &n))
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        spectrum = g_new0(AnasysSpectrum, 1);
+        spectrum->file = file;
+        g_ptr_array_add(file->spectra, spectrum);
+        if (!get_u32(p, end, &spectrum->id)
+            || !get_string(p, end, &spectrum->datachannel)
+            || !get_string(p, end, &spectrum->label)
+            || !get_string(p, end, &spectrum->polarization)
+            || !get_double(p, end, &spectrum->x)
+            || !get_double(p, end, &spectrum->y)
+            || !get_double(p, end, &spectrum->start)
+            || !get_double(p, end, &spectrum->end)
+            || !get_u32(p, end, &spectrum->npoints)
+            || !get_string(p, end, &spectrum->background_id)
+            || !read_segment_payload(file, p, end, datasize,
+                                     &spectrum->payload))
+            return FALSE;
+    }
+
+    if (!get_u32(p, end, &n))
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        background = g_new0(AnasysBackground, 1);
+        background->refcount = 1;
+        background->meta = g_ptr_array_new_with_free_func(g_free);
+        background->array_names = g_ptr_array_new_with_free_func(g_free);
+        background->arrays
+            = g_ptr_array_new_with_free_func((GDestroyNotify)g_array_unref);
+        g_ptr_array_add(file->backgrounds, background);
+        if (!get_string(p, end, &background->id)
+            || !get_u32(p, end, &nmeta) || nmeta % 2
+            || (gsize)(end - *p)/sizeof(guint32) < nmeta)
+            return FALSE;
+        for (j = 0; j < nmeta; j++) {
+            if (!get_strings(p, end, background->meta))
+                return FALSE;
+        }
+        if (!get_u32(p, end, &narrays))
+            return FALSE;
+        for (j = 0; j < narrays; j++) {
+            if (!get_string(p, end, &name))
+                return FALSE;
+            g_ptr_array_add(background->array_names, name);
+            if (!get_u32(p, end, &len)
+                || (gsize)(end - *p)/sizeof(gdouble) < len)
+                return FALSE;
+            values = g_array_sized_new(FALSE, FALSE, sizeof(gdouble), len);
+            for (k = 0; k < len; k++) {
+                get_double(p, end, &value);
+                g_array_append_val(values, value);
+            }
+            g_ptr_array_add(background->arrays, values);
+        }
+    }
+    return *p == end;
+}
+
+static gboolean
+read_segment_payload(AnasysFile *file, const guchar **p, const guchar *end,
+                     gsize datasize, AnasysPayload *payload)
+{
+    const gchar *data;
+    guint64 offset, size;
+
+    if (!get_u64(p, end, &offset) || !get_u64(p, end, &size)
+        || offset % SEGMENT_ALIGN
+        || offset > datasize || size > datasize - offset)
+        return FALSE;
+    data = (const gchar*)file->segment + (file->segment_size - datasize);
+    payload->raw = data + offset;
+    payload->size = size;
+    return TRUE;
+}
+
+static inline void
+put_u32(GByteArray *buffer, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static inline void
+put_u64(GByteArray *buffer, guint64 value)
+{
+    value = GUINT64_TO_LE(value);
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static inline void
+put_double(GByteArray *buffer, gdouble value)
+{
+    union { gdouble d; guint64 u; } number;
+
+    number.d = value;
+    put_u64(buffer, number.u);
+}
+
+/* Strings are their length and bytes; NULL has length SEGMENT_NO_STRING. */
+static void
+put_string(GByteArray *buffer, const gchar *str)
+{
+    guint32 len = str ? strlen(str) : SEGMENT_NO_STRING;
+
+    put_u32(buffer, len);
+    if (str)
+        g_byte_array_append(buffer, (const guint8*)str, len);
+}
+
+static inline gboolean
+get_u32(const guchar **p, const guchar *end, guint32 *value)
+{
+    if ((gsize)(end - *p) < sizeof(guint32))
+        return FALSE;
+    memcpy(value, *p, sizeof(guint32));
+    *value = GUINT32_FROM_LE(*value);
+    *p += sizeof(guint32);
+    return TRUE;
+}
+
+static inline gboolean
+get_u64(const guchar **p, const guchar *end, guint64 *value)
+{
+    if ((gsize)(end - *p) < sizeof(guint64))
+        return FALSE;
+    memcpy(value, *p, sizeof(guint64));
+    *value = GUINT64_FROM_LE(*value);
+    *p += sizeof(guint64);
+    return TRUE;
+}
+
+static inline gboolean
+get_double(const guchar **p, const guchar *end, gdouble *value)
+{
+    union { gdouble d; guint64 u; } number;
+
+    if (!get_u64(p, end, &number.u))
+        return FALSE;
+    *value = number.d;
+    return TRUE;
+}
+
+static gboolean
+get_string(const guchar **p, const guchar *end, gchar **str)
+{
+    guint32 len;
+
+    *str = NULL;
+    if (!get_u32(p, end, &len))
+        return FALSE;
+    if (len == SEGMENT_NO_STRING)
+        return TRUE;
+    if (len > (gsize)(end - *p))
+        return FALSE;
+    *str = g_strndup((const gchar*)*p, len);
+    *p += len;
+    return TRUE;
+}
+
+/* Read a string into an array, which then owns it. */
+static gboolean
+get_strings(const guchar **p, const guchar *end, GPtrArray *strings)
+{
+    gchar *str;
+
+    if (!get_string(p, end, &str))
+        return FALSE;
+    g_ptr_array_add(strings, str);
+    return TRUE;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
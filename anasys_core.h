@@ -0,0 +1,228 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Reading of Anasys Instruments / Analysis Studio XML files (.axd, .axz)
+ * without Gwyddion, needing only GLib, libxml2 and zlib.
+ *
+ * A file is parsed once by anasys_file_open(); the HeightMaps with data
+ * become channels and the IRRenderedSpectra data channels spectra.  The
+ * encoded payloads are not copied out of the document, they are only
+ * decoded when asked for, either into buffers owned by the library and
+ * kept until the file is released (get_data) or into buffers given by the
+ * caller (read_data, read_rows for a part of a channel).  Nothing but the
+ * destination has to fit in memory, payloads are decoded in small pieces.
+ * Data are single precision floats in native byte order; values of
+ * channels are in units of the unit multiplier.
+ *
+ * Lengths are in micrometres, as in the files, angles in degrees and
+ * wavenumbers in cm^-1.  Returned strings belong to the file.
+ *
+ * Compressed (.axz) files can be opened with ANASYS_OPEN_INDEX to keep a
+ * seek index of the gzip stream in a sidecar file next to them, written on
+ * the first open.  Later opens leave the large payloads out of the parsed
+ * document and inflate each from the nearest checkpoint only when its data
+ * are read, so channels and spectra that are never read are never inflated.
+ *
+ * With ANASYS_OPEN_PARALLEL large documents are parsed on all cores, each
+ * HeightMap and IRRenderedSpectra on its own, from the whole text read (and
+ * inflated) into memory first.  Documents that do not split cleanly are
+ * parsed the usual way.  The index takes precedence when both are given.
+ *
+ * The IRBackground elements become backgrounds, which are immutable and
+ * may be shared between files.  With ANASYS_OPEN_SHARE_BACKGROUNDS they are
+ * kept in a cache for the whole process, keyed by a checksum of their text,
+ * and ones met again in later files, as in the files of a series, are
+ * taken from it without being parsed.  This also reads the whole text into
+ * memory first.
+ *
+ * The spectrum Locations are indexed when the file is opened, so that the
+ * spectra in a rectangle, within a radius or nearest to a point, and those
+ * within the area of a channel, are found without looking at all of them.
+ *
+ * With anasys_file_set_memory_budget() the library keeps only so much
+ * decoded data on the heap; the rest is decoded into a temporary scratch
+ * file mapped into memory, which the system pages in and out as the data
+ * are used.
+ *
+ * A file can be written with all its payloads decoded into a segment by
+ * anasys_file_write_segment().  Opened by anasys_file_open_segment(), it is
+ * mapped read-only and its data are used where they lie, so processes
+ * opening the same segment share the memory and decode nothing; this is
+ * what the anasys-service daemon gives out, see anasys_service.h.
+ *
+ * Work done in parallel, by the library or by anasys_run_parallel(), runs
+ * on one pool of threads for the whole process.
+ *
+ * Different files can be used from different threads.  The read_data
+ * functions can also be called concurrently for one file, and so can the
+ * get_data and free_data functions for different channels or spectra;
+ * everything else must not run concurrently for the same file.
+ */
+
+#ifndef __ANASYS_CORE_H__
+#define __ANASYS_CORE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define ANASYS_ERROR anasys_error_quark()
+
+typedef enum {
+    ANASYS_ERROR_IO,
+    ANASYS_ERROR_FORMAT,
+    ANASYS_ERROR_DATA,
+} AnasysError;
+
+typedef enum {
+    ANASYS_OPEN_INDEX             = 1 << 0,
+    ANASYS_OPEN_PARALLEL          = 1 << 1,
+    ANASYS_OPEN_SHARE_BACKGROUNDS = 1 << 2,
+} AnasysOpenFlags;
+
+typedef struct _AnasysFile       AnasysFile;
+typedef struct _AnasysChannel    AnasysChannel;
+typedef struct _AnasysSpectrum   AnasysSpectrum;
+typedef struct _AnasysBackground AnasysBackground;
+
+GQuark          anasys_error_quark             (void);
+void            anasys_init                    (void);
+void            anasys_run_workers             (GThreadFunc worker,
+                                                gpointer data,
+                                                guint nworkers);
+void            anasys_run_parallel            (GFunc func,
+                                                gpointer *items,
+                                                guint n,
+                                                gpointer user_data);
+
+AnasysFile*     anasys_file_open               (const gchar *filename,
+                                                GError **error);
+AnasysFile*     anasys_file_open_full          (const gchar *filename,
+                                                AnasysOpenFlags flags,
+                                                GError **error);
+AnasysFile*     anasys_file_ref                (AnasysFile *file);
+void            anasys_file_unref              (AnasysFile *file);
+gboolean        anasys_file_write_segment      (const AnasysFile *file,
+                                                const gchar *filename,
+                                                GError **error);
+AnasysFile*     anasys_file_open_segment       (const gchar *filename,
+                                                GError **error);
+void            anasys_file_set_memory_budget  (AnasysFile *file,
+                                                guint64 bytes);
+const gchar*    anasys_file_get_primary_channel(const AnasysFile *file);
+guint           anasys_file_get_n_channels     (const AnasysFile *file);
+AnasysChannel*  anasys_file_get_channel        (const AnasysFile *file,
+                                                guint i);
+guint           anasys_file_get_n_spectra      (const AnasysFile *file);
+AnasysSpectrum* anasys_file_get_spectrum       (const AnasysFile *file,
+                                                guint i);
+guint           anasys_file_get_n_backgrounds  (const AnasysFile *file);
+const AnasysBackground* anasys_file_get_background(const AnasysFile *file,
+                                                   guint i);
+GArray*         anasys_file_find_spectra       (const AnasysFile *file,
+                                                gdouble xmin,
+                                                gdouble ymin,
+                                                gdouble xmax,
+                                                gdouble ymax);
+GArray*         anasys_file_find_spectra_near  (const AnasysFile *file,
+                                                gdouble x,
+                                                gdouble y,
+                                                gdouble radius);
+gint            anasys_file_find_nearest_spectrum(const AnasysFile *file,
+                                                  gdouble x,
+                                                  gdouble y);
+
+guint           anasys_channel_get_id          (const AnasysChannel *channel);
+const gchar*    anasys_channel_get_data_channel(const AnasysChannel *channel);
+const gchar*    anasys_channel_get_label       (const AnasysChannel *channel);
+const gchar*    anasys_channel_get_unit        (const AnasysChannel *channel);
+gdouble         anasys_channel_get_unit_multiplier(const AnasysChannel *channel);
+void            anasys_channel_get_resolution  (const AnasysChannel *channel,
+                                                guint *xres,
+                                                guint *yres);
+void            anasys_channel_get_size        (const AnasysChannel *channel,
+                                                gdouble *xreal,
+                                                gdouble *yreal);
+void            anasys_channel_get_position    (const AnasysChannel *channel,
+                                                gdouble *x,
+                                                gdouble *y);
+gdouble         anasys_channel_get_scan_angle  (const AnasysChannel *channel);
+guint           anasys_channel_get_n_meta      (const AnasysChannel *channel);
+void            anasys_channel_get_meta        (const AnasysChannel *channel,
+                                                guint i,
+                                                const gchar **key,
+                                                const gchar **value);
+const gchar*    anasys_channel_find_meta       (const AnasysChannel *channel,
+                                                const gchar *key);
+gsize           anasys_channel_get_payload_size(const AnasysChannel *channel);
+const gfloat*   anasys_channel_get_data        (AnasysChannel *channel,
+                                                GError **error);
+void            anasys_channel_free_data       (AnasysChannel *channel);
+gboolean        anasys_channel_read_data       (const AnasysChannel *channel,
+                                                gfloat *buffer,
+                                                GError **error);
+gboolean        anasys_channel_read_rows       (const AnasysChannel *channel,
+                                                guint row,
+                                                guint nrows,
+                                                gfloat *buffer,
+                                                GError **error);
+GArray*         anasys_channel_find_spectra    (const AnasysChannel *channel);
+
+guint           anasys_spectrum_get_id         (const AnasysSpectrum *spectrum);
+const gchar*    anasys_spectrum_get_data_channel(const AnasysSpectrum *spectrum);
+const gchar*    anasys_spectrum_get_label      (const AnasysSpectrum *spectrum);
+const gchar*    anasys_spectrum_get_polarization(const AnasysSpectrum *spectrum);
+void            anasys_spectrum_get_location   (const AnasysSpectrum *spectrum,
+                                                gdouble *x,
+                                                gdouble *y);
+void            anasys_spectrum_get_wavenumbers(const AnasysSpectrum *spectrum,
+                                                gdouble *start,
+                                                gdouble *end);
+guint           anasys_spectrum_get_n_points   (const AnasysSpectrum *spectrum);
+const AnasysBackground* anasys_spectrum_get_background(const AnasysSpectrum *spectrum);
+GArray*         anasys_spectrum_find_channels  (const AnasysSpectrum *spectrum);
+const gfloat*   anasys_spectrum_get_data       (AnasysSpectrum *spectrum,
+                                                GError **error);
+void            anasys_spectrum_free_data      (AnasysSpectrum *spectrum);
+gboolean        anasys_spectrum_read_data      (const AnasysSpectrum *spectrum,
+                                                guint from,
+                                                guint to,
+                                                gfloat *buffer,
+                                                GError **error);
+
+const gchar*    anasys_background_get_id       (const AnasysBackground *background);
+guint           anasys_background_get_n_meta   (const AnasysBackground *background);
+void            anasys_background_get_meta     (const AnasysBackground *background,
+                                                guint i,
+                                                const gchar **key,
+                                                const gchar **value);
+const gchar*    anasys_background_find_meta    (const AnasysBackground *background,
+                                                const gchar *key);
+const gdouble*  anasys_background_find_array   (const AnasysBackground *background,
+                                                const gchar *name,
+                                                guint *n);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
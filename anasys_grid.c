@@ -0,0 +1,316 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include "anasys_grid.h"
+
+/* Average number of points per cell the grid is sized for. */
+#define GRID_FILL 2
+
+/* Cell k holds the points start[k] to start[k+1]-1; xy are their
+ * coordinates and ids their indices among the points given. */
+struct _AnasysGrid {
+    gdouble xmin;
+    gdouble ymin;
+    gdouble dx;
+    gdouble dy;
+    gint ncols;
+    gint nrows;
+    guint *start;
+    gdouble *xy;
+    guint *ids;
+};
+
+static gint     grid_column       (const AnasysGrid *grid,
+                                   gdouble x);
+static gint     grid_row          (const AnasysGrid *grid,
+                                   gdouble y);
+static void     grid_size         (guint n,
+                                   gdouble width,
+                                   gdouble height,
+                                   gint *ncols,
+                                   gint *nrows);
+static void     search_cell       (const AnasysGrid *grid,
+                                   gint col,
+                                   gint row,
+                                   gdouble x,
+                                   gdouble y,
+                                   gint *best,
+                                   gdouble *bestd2);
+
+/* Index n points, xy holding x and y of each in turn.  Returns NULL when
+ * there is no point to index. */
+AnasysGrid*
+anasys_grid_new(const gdouble *xy, guint n)
+{
+    AnasysGrid *grid;
+    gdouble xmin = G_MAXDOUBLE, xmax = -G_MAXDOUBLE;
+    gdouble ymin = G_MAXDOUBLE, ymax = -G_MAXDOUBLE;
+    guint *cell, *fill;
+    guint i, k, m, ncells;
+
+    cell = g_new(guint, MAX(n, 1));
+    for (i = m = 0; i < n; i++) {
+        if (!isfinite(xy[2*i]) || !isfinite(xy[2*i + 1]))
+            continue;
+        xmin = MIN(xmin, xy[2*i]);
+        xmax = MAX(xmax, xy[2*i]);
+        ymin = MIN(ymin, xy[2*i + 1]);
+        ymax = MAX(ymax, xy[2*i + 1]);
+        m++;
+    }
+    if (!m) {
+        g_free(cell);
+        return NULL;
+    }
+
+    grid = g_new0(AnasysGrid, 1);
+    grid->xmin = xmin;
+    grid->ymin = ymin;
+    grid_size(m, xmax - xmin, ymax - ymin, &grid->ncols, &grid->nrows);
+    grid->dx = (xmax > xmin) ? (xmax - xmin)/grid->ncols : 1.0;
+    grid->dy = (ymax > ymin) ? (ymax - ymin)/grid->nrows : 1.0;
+    ncells = grid->ncols*grid->nrows;
+
+    /* Counting sort by cell, which keeps the points of each cell in the
+     * order given. */
+    grid->start = g_new0(guint, ncells + 1);
+    for (i = 0; i < n; i++) {
+        if (!isfinite(xy[2*i]) || !isfinite(xy[2*i + 1])) {
+            cell[i] = G_MAXUINT;
+            continue;
+        }
+        cell[i] = (grid_row(grid, xy[2*i + 1])*grid->ncols
+                   + grid_column(grid, xy[2*i]));
+        grid->start[cell[i] + 1]++;
+    }
+    for (k = 0; k < ncells; k++)
+        grid->start[k + 1] += grid->start[k];
+    fill = g_new(guint, ncells);
+    memcpy(fill, grid->start, ncells*sizeof(guint));
+    grid->xy = g_new(gdouble, 2*m);
+    grid->ids = g_new(guint, m);
+    for (i = 0; i < n; i++) {
+        if (cell[i] == G_MAXUINT)
+            continue;
+        k = fill[cell[i]]++;
+        grid->xy[2*k] = xy[2*i];
+        grid->xy[2*k + 1] = xy[2*i + 1];
+        grid->ids[k] = i;
+    }
+    g_free(fill);
+    g_free(cell);
+
+    return grid;
+}
+
+void
+anasys_grid_free(AnasysGrid *grid)
+{
+    if (!grid)
+        return;
+    g_free(grid->start);
+    g_free(grid->xy);
+    g_free(grid->ids);
+    g_free(grid);
+}
+
+/* Append the indices of the points with xmin <= x <= xmax and
+ * ymin <= y <= ymax to found, cell by cell. */
+void
+anasys_grid_find_rect(const AnasysGrid *grid,
+                      gdouble xmin, gdouble ymin, gdouble xmax, gdouble ymax,
+                      GArray *found)
+{
+    const gdouble *p;
+    gint col, row, col0, col1, row0, row1;
+    guint k;
+
+    if (!grid || !(xmin <= xmax) || !(ymin <= ymax))
+        return;
+    col0 = grid_column(grid, xmin);
+    col1 = grid_column(grid, xmax);
+    row0 = grid_row(grid, ymin);
+    row1 = grid_row(grid, ymax);
+    for (row = row0; row <= row1; row++) {
+        for (col = col0; col <= col1; col++) {
+            for (k = grid->start[row*grid->ncols + col];
+                 k < grid->start[row*grid->ncols + col + 1];
+                 k++) {
+                p = grid->xy + 2*k;
+                if (p[0] >= xmin && p[0] <= xmax
+                    && p[1] >= ymin && p[1] <= ymax)
+                    g_array_append_val(found, grid->ids[k]);
+            }
+        }
+    }
+}
+
+/* Append the indices of the points at most radius from (x, y) to found. */
+void
+anasys_grid_find_near(const AnasysGrid *grid,
+                      gdouble x, gdouble y, gdouble radius,
+                      GArray *found)
+{
+    const gdouble *p;
+    gint col, row, col0, col1, row0, row1;
+    guint k;
+
+    if (!grid || !(radius >= 0.0))
+        return;
+    col0 = grid_column(grid, x - radius);
+    col1 = grid_column(grid, x + radius);
+    row0 = grid_row(grid, y - radius);
+    row1 = grid_row(grid, y + radius);
+    for (row = row0; row <= row1; row++) {
+        for (col = col0; col <= col1; col++) {
+            for (k = grid->start[row*grid->ncols + col];
+                 k < grid->start[row*grid->ncols + col + 1];
+                 k++) {
+                p = grid->xy + 2*k;
+                if ((p[0] - x)*(p[0] - x) + (p[1] - y)*(p[1] - y)
+                    <= radius*radius)
+                    g_array_append_val(found, grid->ids[k]);
+            }
+        }
+    }
+}
+
+/* Index of the point nearest to (x, y), the lowest of equally near ones, or
+ * -1 when there is none.  Rings of cells around the cell of (x, y) are
+ * searched until no cell outside them can hold a nearer point. */
+gint
+anasys_grid_find_nearest(const AnasysGrid *grid, gdouble x, gdouble y)
+{
+    gdouble bestd2 = G_MAXDOUBLE, bound, d;
+    gint best = -1, col, row, r, i;
+
+    if (!grid || !isfinite(x) || !isfinite(y))
+        return -1;
+    col = grid_column(grid, x);
+    row = grid_row(grid, y);
+    for (r = 0; ; r++) {
+        for (i = -r; i <= r; i++) {
+            search_cell(grid, col + i, row - r, x, y, &best, &bestd2);
+            if (r)
+                search_cell(grid, col + i, row + r, x, y, &best, &bestd2);
+        }
+        for (i = 1 - r; i <= r - 1; i++) {
+            search_cell(grid, col - r, row + i, x, y, &best, &bestd2);
+            search_cell(grid, col + r, row + i, x, y, &best, &bestd2);
+        }
+
+        /* Distance from (x, y) to the cells not searched yet, on the sides
+         * where any are left. */
+        bound = G_MAXDOUBLE;
+        if (col - r > 0) {
+            d = x - (grid->xmin + (col - r)*grid->dx);
+            bound = MIN(bound, MAX(d, 0.0));
+        }
+        if (col + r < grid->ncols - 1) {
+            d = grid->xmin + (col + r + 1)*grid->dx - x;
+            bound = MIN(bound, MAX(d, 0.0));
+        }
+        if (row - r > 0) {
+            d = y - (grid->ymin + (row - r)*grid->dy);
+            bound = MIN(bound, MAX(d, 0.0));
+        }
+        if (row + r < grid->nrows - 1) {
+            d = grid->ymin + (row + r + 1)*grid->dy - y;
+            bound = MIN(bound, MAX(d, 0.0));
+        }
+        if (bound == G_MAXDOUBLE || (best >= 0 && bound*bound > bestd2))
+            break;
+    }
+    return best;
+}
+
+static void
+search_cell(const AnasysGrid *grid, gint col, gint row, gdouble x, gdouble y,
+            gint *best, gdouble *bestd2)
+{
+    const gdouble *p;
+    gdouble d2;
+    guint k;
+
+    if (col < 0 || col >= grid->ncols || row < 0 || row >= grid->nrows)
+        return;
+    for (k = grid->start[row*grid->ncols + col];
+         k < grid->start[row*grid->ncols + col + 1];
+         k++) {
+        p = grid->xy + 2*k;
+        d2 = (p[0] - x)*(p[0] - x) + (p[1] - y)*(p[1] - y);
+        if (d2 < *bestd2 || (d2 == *bestd2 && (gint)grid->ids[k] < *best)) {
+            *bestd2 = d2;
+            *best = grid->ids[k];
+        }
+    }
+}
+
+/* Column of the cell containing x, clamped to the grid. */
+static gint
+grid_column(const AnasysGrid *grid, gdouble x)
+{
+    gdouble c = floor((x - grid->xmin)/grid->dx);
+
+    if (!(c > 0.0))
+        return 0;
+    return (c >= grid->ncols) ? grid->ncols - 1 : (gint)c;
+}
+
+static gint
+grid_row(const AnasysGrid *grid, gdouble y)
+{
+    gdouble r = floor((y - grid->ymin)/grid->dy);
+
+    if (!(r > 0.0))
+        return 0;
+    return (r >= grid->nrows) ? grid->nrows - 1 : (gint)r;
+}
+
+/* Split the bounding box into about n/GRID_FILL cells as square as its
+ * sides allow.  Points on a line get a single row or column. */
+static void
+grid_size(guint n, gdouble width, gdouble height, gint *ncols, gint *nrows)
+{
+    guint ncells = MAX(n/GRID_FILL, 1);
+    gdouble c;
+
+    if (width > 0.0 && height > 0.0) {
+        c = ceil(sqrt(ncells*width/height));
+        *ncols = (gint)CLAMP(c, 1.0, (gdouble)ncells);
+        *nrows = (gint)MAX((ncells + *ncols - 1)/(guint)*ncols, 1);
+    }
+    else if (width > 0.0) {
+        *ncols = ncells;
+        *nrows = 1;
+    }
+    else if (height > 0.0) {
+        *ncols = 1;
+        *nrows = ncells;
+    }
+    else
+        *ncols = *nrows = 1;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
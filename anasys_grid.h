@@ -0,0 +1,68 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Spatial index of points, private to anasys_core.
+ *
+ * The points, spectrum Locations, are sorted into a uniform grid of about
+ * two points per cell over their bounding box, stored cell after cell.
+ * Queries only look at the cells overlapping the region asked for, and the
+ * nearest point is found by searching rings of cells around the cell of the
+ * query point.  Points with non-finite coordinates are left out.
+ */
+
+#ifndef __ANASYS_GRID_H__
+#define __ANASYS_GRID_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _AnasysGrid AnasysGrid;
+
+G_GNUC_INTERNAL
+AnasysGrid* anasys_grid_new         (const gdouble *xy,
+                                     guint n);
+G_GNUC_INTERNAL
+void        anasys_grid_free        (AnasysGrid *grid);
+G_GNUC_INTERNAL
+void        anasys_grid_find_rect   (const AnasysGrid *grid,
+                                     gdouble xmin,
+                                     gdouble ymin,
+                                     gdouble xmax,
+                                     gdouble ymax,
+                                     GArray *found);
+G_GNUC_INTERNAL
+void        anasys_grid_find_near   (const AnasysGrid *grid,
+                                     gdouble x,
+                                     gdouble y,
+                                     gdouble radius,
+                                     GArray *found);
+G_GNUC_INTERNAL
+gint        anasys_grid_find_nearest(const AnasysGrid *grid,
+                                     gdouble x,
+                                     gdouble y);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,806 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "anasys_core.h"
+#include "anasys_gzindex.h"
+
+/* Size of the deflate window and of the input buffer. */
+#define WINSIZE 32768
+#define CHUNK 16384
+
+/* Uncompressed distance between checkpoints.  Resuming anywhere costs
+ * inflating at most this much. */
+#define INDEX_SPAN (1 << 20)
+
+/* Payloads shorter than this many bytes of UTF-16 text stay in the
+ * document, resuming at a checkpoint for them costs more than parsing. */
+#define INDEX_MIN_PAYLOAD (256 << 10)
+
+#define INDEX_MAGIC "ANASYSIX"
+#define INDEX_MAGIC_SIZE (sizeof(INDEX_MAGIC) - 1)
+#define INDEX_VERSION 1
+
+/* A place inflate can resume at: the compressed and uncompressed offsets,
+ * the bits of the byte before in, if any, and the preceding window,
+ * compressed. */
+typedef struct {
+    guint64 in;
+    guint64 out;
+    gint bits;
+    guchar *zwindow;
+    gsize zsize;
+} IndexPoint;
+
+struct _AnasysGzIndex {
+    gchar *filename;
+    guint64 file_size;
+    gint64 file_mtime;
+    GArray *points;
+    GArray *payloads;
+};
+
+/* Inflate state.  Output goes round the window, the pending part of it is
+ * data, avail bytes long, ending at the uncompressed offset out. */
+typedef struct {
+    FILE *fh;
+    z_stream strm;
+    gboolean started;
+    gboolean ended;
+    gboolean boundary;
+    guint64 in;
+    guint64 out;
+    const guchar *data;
+    gsize avail;
+    guchar input[CHUNK];
+    guchar window[WINSIZE];
+} GzStream;
+
+/* Text of deferred payloads being read, from any checkpoint of the index. */
+struct _AnasysGzStream {
+    GzStream gz;
+    const AnasysGzIndex *index;
+};
+
+/* Search for <SampleBase64> text in the UTF-16LE output. */
+typedef struct {
+    guint match;
+    gboolean inside;
+    gboolean lt;
+    gboolean bad;
+    guint lo;
+    guint64 start;
+    guint64 end;
+    guint64 n;
+    guint64 pad;
+    guint64 len;
+} PayloadScan;
+
+struct _AnasysGzReader {
+    GzStream gz;
+    AnasysGzIndex *index;
+    gboolean building;
+    guint next;
+    PayloadScan scan;
+    guchar placeholder[48];
+    gsize nplaceholder;
+    gsize placeholder_pos;
+    GError *error;
+};
+
+static AnasysGzIndex* index_new         (const gchar *filename);
+static void           index_add_point   (AnasysGzIndex *index,
+                                         const GzStream *gz);
+static const IndexPoint* index_find_point(const AnasysGzIndex *index,
+                                          guint64 offset);
+static gboolean       gz_stream_open    (GzStream *gz,
+                                         const gchar *filename,
+                                         GError **error);
+static gboolean       gz_stream_start   (GzStream *gz,
+                                         const IndexPoint *point,
+                                         GError **error);
+static gint           gz_stream_fill    (GzStream *gz,
+                                         GError **error);
+static gboolean       gz_stream_skip    (GzStream *gz,
+                                         guint64 n,
+                                         GError **error);
+static void           gz_stream_close   (GzStream *gz);
+static void           scan_payloads     (AnasysGzReader *reader,
+                                         const guchar *data,
+                                         gsize n,
+                                         guint64 pos);
+static gboolean       skip_payload      (AnasysGzReader *reader,
+                                         const AnasysGzPayload *payload);
+static gchar*         index_filename    (const gchar *filename);
+static gboolean       get_file_stamp    (const gchar *filename,
+                                         guint64 *size,
+                                         gint64 *mtime);
+
+/* Check for the gzip magic, telling .axz from .axd by content. */
+gboolean
+anasys_gz_is_compressed(const gchar *filename)
+{
+    guchar head[2];
+    FILE *fh;
+    gboolean ok;
+
+    if (!(fh = g_fopen(filename, "rb")))
+        return FALSE;
+    ok = (fread(head, 1, 2, fh) == 2 && head[0] == 0x1f && head[1] == 0x8b);
+    fclose(fh);
+    return ok;
+}
+
+static AnasysGzIndex*
+index_new(const gchar *filename)
+{
+    AnasysGzIndex *index = g_new0(AnasysGzIndex, 1);
+
+    index->filename = g_strdup(filename);
+    index->points = g_array_new(FALSE, FALSE, sizeof(IndexPoint));
+    index->payloads = g_array_new(FALSE, FALSE, sizeof(AnasysGzPayload));
+    return index;
+}
+
+void
+anasys_gz_index_free(AnasysGzIndex *index)
+{
+    guint i;
+
+    if (!index)
+        return;
+    for (i = 0; i < index->points->len; i++)
+        g_free(g_array_index(index->points, IndexPoint, i).zwindow);
+    g_array_free(index->points, TRUE);
+    g_array_free(index->payloads, TRUE);
+    g_free(index->filename);
+    g_free(index);
+}
+
+guint
+anasys_gz_index_get_n_payloads(const AnasysGzIndex *index)
+{
+    return index->payloads->len;
+}
+
+const AnasysGzPayload*
+anasys_gz_index_get_payload(const AnasysGzIndex *index, guint i)
+{
+    g_return_val_if_fail(i < index->payloads->len, NULL);
+    return &g_array_index(index->payloads, AnasysGzPayload, i);
+}
+
+/* Record a checkpoint at the current block boundary.  The window is the
+ * last WINSIZE bytes of output, which the circular output buffer holds
+ * starting at the write position. */
+static void
+index_add_point(AnasysGzIndex *index, const GzStream *gz)
+{
+    guchar window[WINSIZE];
+    IndexPoint point;
+    uLongf zsize;
+    gsize left = gz->strm.avail_out;
+
+    if (left)
+        memcpy(window, gz->window + WINSIZE - left, left);
+    if (left < WINSIZE)
+        memcpy(window + left, gz->window, WINSIZE - left);
+
+    point.in = gz->in;
+    point.out = gz->out;
+    point.bits = gz->strm.data_type & 7;
+    zsize = compressBound(WINSIZE);
+    point.zwindow = g_new(guchar, zsize);
+    if (compress2(point.zwindow, &zsize, window, WINSIZE, 6) != Z_OK) {
+        g_free(point.zwindow);
+        return;
+    }
+    point.zsize = zsize;
+    g_array_append_val(index->points, point);
+}
+
+/* The last checkpoint at or before offset. */
+static const IndexPoint*
+index_find_point(const AnasysGzIndex *index, guint64 offset)
+{
+    const IndexPoint *points = (const IndexPoint*)index->points->data;
+    guint lo = 0, hi = index->points->len, mid;
+
+    if (!hi || points[0].out > offset)
+        return NULL;
+    while (hi - lo > 1) {
+        mid = (lo + hi)/2;
+        if (points[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return points + lo;
+}
+
+AnasysGzStream*
+anasys_gz_stream_open(const AnasysGzIndex *index, GError **error)
+{
+    AnasysGzStream *stream = g_new0(AnasysGzStream, 1);
+
+    if (!gz_stream_open(&stream->gz, index->filename, error)) {
+        g_free(stream);
+        return NULL;
+    }
+    stream->index = index;
+    return stream;
+}
+
+/* Inflate nchars characters of UTF-16LE text at offset into text, keeping
+ * the low bytes.  The text is known to be ASCII.  Reading on from where the
+ * previous read ended, or a little further, continues inflating; otherwise
+ * it resumes at the last checkpoint before offset. */
+gboolean
+anasys_gz_stream_read_text(AnasysGzStream *stream,
+                           guint64 offset, guint64 nchars, gchar *text,
+                           GError **error)
+{
+    GzStream *gz = &stream->gz;
+    const IndexPoint *point = index_find_point(stream->index, offset);
+    guint64 pos = gz->out - gz->avail, k = 0, nbytes = 2*nchars;
+    gsize i, n;
+
+    if (!gz->started || offset < pos
+        || (point && point->out > pos)) {
+        if (!gz_stream_start(gz, point, error))
+            return FALSE;
+        pos = point ? point->out : 0;
+    }
+    if (!gz_stream_skip(gz, offset - pos, error))
+        return FALSE;
+    while (k < nbytes) {
+        if (!gz->avail) {
+            if (gz_stream_fill(gz, error) < 0)
+                return FALSE;
+            if (!gz->avail && gz->ended) {
+                g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                            "Compressed data end prematurely.");
+                return FALSE;
+            }
+            continue;
+        }
+        n = MIN(gz->avail, nbytes - k);
+        for (i = 0; i < n; i++, k++) {
+            if (!(k & 1))
+                text[k/2] = gz->data[i];
+        }
+        gz->data += n;
+        gz->avail -= n;
+    }
+    return TRUE;
+}
+
+void
+anasys_gz_stream_close(AnasysGzStream *stream)
+{
+    if (!stream)
+        return;
+    gz_stream_close(&stream->gz);
+    g_free(stream);
+}
+
+static gboolean
+gz_stream_open(GzStream *gz, const gchar *filename, GError **error)
+{
+    if (!(gz->fh = g_fopen(filename, "rb"))) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot open file `%s'.", filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Start inflating at the beginning, with the gzip header, or raw deflate
+ * data at a checkpoint. */
+static gboolean
+gz_stream_start(GzStream *gz, const IndexPoint *point, GError **error)
+{
+    guchar window[WINSIZE];
+    uLongf wsize = WINSIZE;
+    gint ret, ch;
+
+    if (gz->started)
+        inflateEnd(&gz->strm);
+    gz->started = gz->ended = gz->boundary = FALSE;
+    memset(&gz->strm, 0, sizeof(gz->strm));
+    gz->data = NULL;
+    gz->avail = 0;
+
+    if (!point) {
+        if (fseek(gz->fh, 0, SEEK_SET) != 0
+            || inflateInit2(&gz->strm, 15 + 32) != Z_OK)
+            goto fail;
+        gz->started = TRUE;
+        gz->in = gz->out = 0;
+    }
+    else {
+        if (uncompress(window, &wsize, point->zwindow, point->zsize) != Z_OK
+            || wsize != WINSIZE
+            || fseek(gz->fh, point->in - (point->bits ? 1 : 0), SEEK_SET) != 0
+            || inflateInit2(&gz->strm, -15) != Z_OK)
+            goto fail;
+        gz->started = TRUE;
+        if (point->bits) {
+            if ((ch = getc(gz->fh)) == EOF)
+                goto fail;
+            inflatePrime(&gz->strm, point->bits, ch >> (8 - point->bits));
+        }
+        if ((ret = inflateSetDictionary(&gz->strm, window, WINSIZE)) != Z_OK)
+            goto fail;
+        gz->in = point->in;
+        gz->out = point->out;
+    }
+    gz->strm.next_out = gz->window;
+    gz->strm.avail_out = WINSIZE;
+    return TRUE;
+
+fail:
+    g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                "Cannot start decompression.");
+    return FALSE;
+}
+
+/* Run inflate once, up to the next block boundary.  Returns 1 on progress,
+ * which need not produce any data, 0 at the end of the stream and -1 on
+ * error. */
+static gint
+gz_stream_fill(GzStream *gz, GError **error)
+{
+    z_stream *strm = &gz->strm;
+    guchar *start;
+    gsize n, avail_in;
+    gint ret;
+
+    if (gz->ended)
+        return 0;
+    if (!strm->avail_out) {
+        strm->next_out = gz->window;
+        strm->avail_out = WINSIZE;
+    }
+    if (!strm->avail_in) {
+        n = fread(gz->input, 1, CHUNK, gz->fh);
+        if (ferror(gz->fh) || !n) {
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                        "Compressed data end prematurely.");
+            return -1;
+        }
+        strm->next_in = gz->input;
+        strm->avail_in = n;
+    }
+
+    start = strm->next_out;
+    avail_in = strm->avail_in;
+    ret = inflate(strm, Z_BLOCK);
+    gz->in += avail_in - strm->avail_in;
+    gz->data = start;
+    gz->avail = strm->next_out - start;
+    gz->out += gz->avail;
+    if (ret == Z_STREAM_END)
+        gz->ended = TRUE;
+    else if (ret != Z_OK) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Compressed data are corrupted.");
+        return -1;
+    }
+    gz->boundary = (strm->data_type & 128) && !(strm->data_type & 64);
+    return 1;
+}
+
+/* Throw away the next n bytes of output. */
+static gboolean
+gz_stream_skip(GzStream *gz, guint64 n, GError **error)
+{
+    gsize k;
+
+    while (n) {
+        if (!gz->avail) {
+            if (gz_stream_fill(gz, error) < 0)
+                return FALSE;
+            if (!gz->avail && gz->ended) {
+                g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                            "Compressed data end prematurely.");
+                return FALSE;
+            }
+            continue;
+        }
+        k = MIN(gz->avail, n);
+        gz->data += k;
+        gz->avail -= k;
+        n -= k;
+    }
+    return TRUE;
+}
+
+static void
+gz_stream_close(GzStream *gz)
+{
+    if (gz->started)
+        inflateEnd(&gz->strm);
+    if (gz->fh)
+        fclose(gz->fh);
+    gz->started = FALSE;
+    gz->fh = NULL;
+}
+
+/* Reader of the uncompressed document for xmlCtxtReadIO().  Without an
+ * index it builds one on the way; with an index it leaves out the indexed
+ * payloads, putting #N, the number of the payload, in place of each. */
+AnasysGzReader*
+anasys_gz_reader_new(const gchar *filename, AnasysGzIndex *index,
+                     GError **error)
+{
+    AnasysGzReader *reader = g_new0(AnasysGzReader, 1);
+
+    if (!(reader->index = index)) {
+        reader->index = index_new(filename);
+        reader->building = TRUE;
+    }
+    if (!gz_stream_open(&reader->gz, filename, error)
+        || !gz_stream_start(&reader->gz, NULL, error)
+        || (reader->building
+            && !get_file_stamp(filename, &reader->index->file_size,
+                               &reader->index->file_mtime))) {
+        anasys_gz_reader_free(reader, NULL);
+        return NULL;
+    }
+    return reader;
+}
+
+gint
+anasys_gz_reader_read(gpointer user_data, gchar *buffer, gint len)
+{
+    AnasysGzReader *reader = (AnasysGzReader*)user_data;
+    GzStream *gz = &reader->gz;
+    const AnasysGzPayload *payload;
+    GArray *points;
+    guint64 pos, n;
+    gint written = 0;
+
+    if (reader->error)
+        return -1;
+    while (written < len) {
+        if (reader->placeholder_pos < reader->nplaceholder) {
+            n = MIN((gsize)(len - written),
+                    reader->nplaceholder - reader->placeholder_pos);
+            memcpy(buffer + written,
+                   reader->placeholder + reader->placeholder_pos, n);
+            reader->placeholder_pos += n;
+            written += n;
+            continue;
+        }
+        if (!gz->avail) {
+            if (gz->ended)
+                break;
+            if (gz_stream_fill(gz, &reader->error) < 0)
+                return -1;
+            if (reader->building) {
+                points = reader->index->points;
+                if (gz->boundary
+                    && (!points->len
+                        || gz->out - g_array_index(points, IndexPoint,
+                                                   points->len - 1).out
+                           > INDEX_SPAN))
+                    index_add_point(reader->index, gz);
+                scan_payloads(reader, gz->data, gz->avail,
+                              gz->out - gz->avail);
+            }
+            continue;
+        }
+
+        pos = gz->out - gz->avail;
+        n = gz->avail;
+        if (!reader->building
+            && reader->next < reader->index->payloads->len) {
+            payload = anasys_gz_index_get_payload(reader->index,
+                                                  reader->next);
+            if (pos == payload->offset) {
+                if (!skip_payload(reader, payload))
+                    return -1;
+                continue;
+            }
+            n = MIN(n, payload->offset - pos);
+        }
+        n = MIN(n, (guint64)(len - written));
+        memcpy(buffer + written, gz->data, n);
+        gz->data += n;
+        gz->avail -= n;
+        written += n;
+    }
+    return written;
+}
+
+/* Replace the payload text with a placeholder and get past it, jumping to
+ * the last checkpoint inside if there is one. */
+static gboolean
+skip_payload(AnasysGzReader *reader, const AnasysGzPayload *payload)
+{
+    GzStream *gz = &reader->gz;
+    guint64 end = payload->offset + payload->length;
+    const IndexPoint *point = index_find_point(reader->index, end);
+    gchar text[24];
+    gsize i, n;
+
+    n = g_snprintf(text, sizeof(text), "#%u", reader->next);
+    for (i = 0; i < n; i++) {
+        reader->placeholder[2*i] = text[i];
+        reader->placeholder[2*i + 1] = 0;
+    }
+    reader->nplaceholder = 2*n;
+    reader->placeholder_pos = 0;
+    reader->next++;
+
+    if (point && point->out > gz->out) {
+        return (gz_stream_start(gz, point, &reader->error)
+                && gz_stream_skip(gz, end - point->out, &reader->error));
+    }
+    return gz_stream_skip(gz, payload->length, &reader->error);
+}
+
+/* Finish reading.  Returns the index built during reading, if the whole
+ * document was read.  An index given to anasys_gz_reader_new() is left
+ * alone. */
+AnasysGzIndex*
+anasys_gz_reader_free(AnasysGzReader *reader, GError **error)
+{
+    AnasysGzIndex *index = NULL;
+
+    if (reader->error)
+        g_propagate_error(error, reader->error);
+    else if (reader->building && reader->gz.ended)
+        index = reader->index;
+    if (reader->building && !index)
+        anasys_gz_index_free(reader->index);
+    gz_stream_close(&reader->gz);
+    g_free(reader);
+    return index;
+}
+
+static inline void
+add_payload(AnasysGzIndex *index, const PayloadScan *scan)
+{
+    AnasysGzPayload payload;
+    guint64 pad = MIN(scan->pad, 2);
+
+    payload.offset = scan->start;
+    payload.length = scan->end - scan->start;
+    payload.size = (scan->n/4*3 > pad) ? scan->n/4*3 - pad : 0;
+    payload.regular = (scan->n == scan->len && scan->n % 4 == 0);
+    g_array_append_val(index->payloads, payload);
+}
+
+/* Find the text of SampleBase64 elements in UTF-16LE output at offset pos.
+ * Only plain base64 text long enough to be worth skipping is recorded;
+ * the counts are the same get_payload() takes from the document. */
+static void
+scan_payloads(AnasysGzReader *reader, const guchar *data, gsize n,
+              guint64 pos)
+{
+    static const gchar open_tag[] = "<SampleBase64>";
+    PayloadScan *scan = &reader->scan;
+    guint c;
+    gsize i;
+
+    for (i = 0; i < n; i++, pos++) {
+        if (!scan->inside) {
+            c = (scan->match & 1) ? 0 : (guchar)open_tag[scan->match/2];
+            if (data[i] == c && (scan->match || !(pos & 1))) {
+                if (++scan->match < 2*(sizeof(open_tag) - 1))
+                    continue;
+                memset(scan, 0, sizeof(PayloadScan));
+                scan->inside = TRUE;
+                scan->start = pos + 1;
+            }
+            else
+                scan->match = (data[i] == '<' && !(pos & 1));
+            continue;
+        }
+        if (!(pos & 1)) {
+            scan->lo = data[i];
+            continue;
+        }
+        c = scan->lo | (data[i] << 8);
+        if (scan->lt) {
+            if (c == '/' && !scan->bad
+                && scan->end - scan->start >= INDEX_MIN_PAYLOAD)
+                add_payload(reader->index, scan);
+            scan->inside = scan->lt = FALSE;
+            scan->match = 0;
+        }
+        else if (c == '<') {
+            scan->lt = TRUE;
+            scan->end = pos - 1;
+        }
+        else if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            scan->len++;
+        else if (c < 0x80 && (g_ascii_isalnum(c)
+                              || c == '+' || c == '/' || c == '=')) {
+            scan->n++;
+            scan->len++;
+            scan->pad = (c == '=') ? scan->pad + 1 : 0;
+        }
+        else
+            scan->bad = TRUE;
+    }
+}
+
+static gchar*
+index_filename(const gchar *filename)
+{
+    return g_strconcat(filename, ANASYS_GZ_INDEX_SUFFIX, NULL);
+}
+
+static gboolean
+get_file_stamp(const gchar *filename, guint64 *size, gint64 *mtime)
+{
+    GStatBuf st;
+
+    if (g_stat(filename, &st) != 0)
+        return FALSE;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return TRUE;
+}
+
+static inline void
+put_u64(GByteArray *buffer, guint64 value)
+{
+    value = GUINT64_TO_LE(value);
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static inline gboolean
+get_u64(const guchar **p, const guchar *end, guint64 *value)
+{
+    if ((gsize)(end - *p) < sizeof(guint64))
+        return FALSE;
+    memcpy(value, *p, sizeof(guint64));
+    *value = GUINT64_FROM_LE(*value);
+    *p += sizeof(guint64);
+    return TRUE;
+}
+
+/* The sidecar holds the magic, version, the size and modification time of
+ * the document, then the checkpoints and payloads, all numbers as 64bit
+ * little endian. */
+gboolean
+anasys_gz_index_save(const AnasysGzIndex *index, GError **error)
+{
+    GByteArray *buffer = g_byte_array_new();
+    const IndexPoint *point;
+    const AnasysGzPayload *payload;
+    gchar *sidecar;
+    gboolean ok;
+    guint i;
+
+    g_byte_array_append(buffer, (const guint8*)INDEX_MAGIC,
+                        INDEX_MAGIC_SIZE);
+    put_u64(buffer, INDEX_VERSION);
+    put_u64(buffer, index->file_size);
+    put_u64(buffer, index->file_mtime);
+    put_u64(buffer, index->points->len);
+    for (i = 0; i < index->points->len; i++) {
+        point = &g_array_index(index->points, IndexPoint, i);
+        put_u64(buffer, point->in);
+        put_u64(buffer, point->out);
+        put_u64(buffer, point->bits);
+        put_u64(buffer, point->zsize);
+        g_byte_array_append(buffer, point->zwindow, point->zsize);
+    }
+    put_u64(buffer, index->payloads->len);
+    for (i = 0; i < index->payloads->len; i++) {
+        payload = &g_array_index(index->payloads, AnasysGzPayload, i);
+        put_u64(buffer, payload->offset);
+        put_u64(buffer, payload->length);
+        put_u64(buffer, payload->size);
+        put_u64(buffer, payload->regular);
+    }
+
+    sidecar = index_filename(index->filename);
+    ok = g_file_set_contents(sidecar, (const gchar*)buffer->data, buffer->len,
+                             error);
+    g_free(sidecar);
+    g_byte_array_free(buffer, TRUE);
+    return ok;
+}
+
+/* Load the sidecar index of a document.  Returns NULL if there is none or
+ * it does not belong to the document as it is now. */
+AnasysGzIndex*
+anasys_gz_index_load(const gchar *filename)
+{
+    AnasysGzIndex *index = NULL;
+    IndexPoint point;
+    AnasysGzPayload payload;
+    const guchar *p, *end;
+    guint64 version, size, mtime, n, i, value, last_out = 0, last_end = 0;
+    gchar *sidecar, *buffer = NULL;
+    gsize len;
+    gboolean ok = FALSE;
+
+    sidecar = index_filename(filename);
+    if (!g_file_get_contents(sidecar, &buffer, &len, NULL)) {
+        g_free(sidecar);
+        return NULL;
+    }
+    g_free(sidecar);
+
+    p = (const guchar*)buffer;
+    end = p + len;
+    if (len < INDEX_MAGIC_SIZE || memcmp(p, INDEX_MAGIC, INDEX_MAGIC_SIZE))
+        goto end;
+    p += INDEX_MAGIC_SIZE;
+    index = index_new(filename);
+    if (!get_u64(&p, end, &version) || version != INDEX_VERSION
+        || !get_u64(&p, end, &size) || !get_u64(&p, end, &mtime)
+        || !get_file_stamp(filename, &index->file_size, &index->file_mtime)
+        || size != index->file_size || (gint64)mtime != index->file_mtime
+        || !get_u64(&p, end, &n))
+        goto end;
+
+    for (i = 0; i < n; i++) {
+        if (!get_u64(&p, end, &point.in) || !get_u64(&p, end, &point.out)
+            || !get_u64(&p, end, &value) || value > 7
+            || !get_u64(&p, end, &size) || size > (guint64)(end - p)
+            || (i && point.out <= last_out))
+            goto end;
+        point.bits = value;
+        point.zsize = size;
+        point.zwindow = g_new(guchar, size);
+        memcpy(point.zwindow, p, size);
+        p += size;
+        g_array_append_val(index->points, point);
+        last_out = point.out;
+    }
+    if (!get_u64(&p, end, &n))
+        goto end;
+    for (i = 0; i < n; i++) {
+        if (!get_u64(&p, end, &payload.offset)
+            || !get_u64(&p, end, &payload.length)
+            || !get_u64(&p, end, &payload.size)
+            || !get_u64(&p, end, &value)
+            || payload.offset < last_end || payload.offset % 2
+            || payload.length % 2)
+            goto end;
+        payload.regular = (value != 0);
+        g_array_append_val(index->payloads, payload);
+        last_end = payload.offset + payload.length;
+    }
+    ok = (p == end);
+
+end:
+    g_free(buffer);
+    if (!ok) {
+        anasys_gz_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
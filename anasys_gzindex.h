@@ -0,0 +1,104 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Random access into gzip-compressed (.axz) documents, private to
+ * anasys_core.
+ *
+ * The first pass over a file records inflate checkpoints, with the 32 kB
+ * window needed to resume there, and the places of the large base64
+ * payloads in the uncompressed UTF-16 text.  The index is kept in a sidecar
+ * file next to the document.  With an index the reader hands the parser
+ * the document with these payloads left out, skipping over them from
+ * checkpoint to checkpoint, and they are inflated from the nearest
+ * checkpoint only when decoded.  A payload read in pieces keeps a stream
+ * open, which resumes at a checkpoint only when a piece does not follow
+ * the previous one.
+ */
+
+#ifndef __ANASYS_GZINDEX_H__
+#define __ANASYS_GZINDEX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Suffix of the sidecar file appended to the name of the document. */
+#define ANASYS_GZ_INDEX_SUFFIX ".idx"
+
+typedef struct _AnasysGzIndex  AnasysGzIndex;
+typedef struct _AnasysGzStream AnasysGzStream;
+typedef struct _AnasysGzReader AnasysGzReader;
+
+/* A payload left out of the parsed document.  Offset and length are of its
+ * text in the uncompressed document, in bytes; size is the number of bytes
+ * it encodes. */
+typedef struct {
+    guint64 offset;
+    guint64 length;
+    guint64 size;
+    gboolean regular;
+} AnasysGzPayload;
+
+G_GNUC_INTERNAL
+gboolean               anasys_gz_is_compressed   (const gchar *filename);
+G_GNUC_INTERNAL
+AnasysGzIndex*         anasys_gz_index_load      (const gchar *filename);
+G_GNUC_INTERNAL
+gboolean               anasys_gz_index_save      (const AnasysGzIndex *index,
+                                                  GError **error);
+G_GNUC_INTERNAL
+void                   anasys_gz_index_free      (AnasysGzIndex *index);
+G_GNUC_INTERNAL
+guint                  anasys_gz_index_get_n_payloads(const AnasysGzIndex *index);
+G_GNUC_INTERNAL
+const AnasysGzPayload* anasys_gz_index_get_payload(const AnasysGzIndex *index,
+                                                  guint i);
+
+G_GNUC_INTERNAL
+AnasysGzStream*        anasys_gz_stream_open     (const AnasysGzIndex *index,
+                                                  GError **error);
+G_GNUC_INTERNAL
+gboolean               anasys_gz_stream_read_text(AnasysGzStream *stream,
+                                                  guint64 offset,
+                                                  guint64 nchars,
+                                                  gchar *text,
+                                                  GError **error);
+G_GNUC_INTERNAL
+void                   anasys_gz_stream_close    (AnasysGzStream *stream);
+
+G_GNUC_INTERNAL
+AnasysGzReader*        anasys_gz_reader_new      (const gchar *filename,
+                                                  AnasysGzIndex *index,
+                                                  GError **error);
+G_GNUC_INTERNAL
+gint                   anasys_gz_reader_read     (gpointer reader,
+                                                  gchar *buffer,
+                                                  gint len);
+G_GNUC_INTERNAL
+AnasysGzIndex*         anasys_gz_reader_free     (AnasysGzReader *reader,
+                                                  GError **error);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
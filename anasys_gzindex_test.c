@@ -0,0 +1,340 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Test of the gzip index sidecar, run by make check.
+ *
+ * A synthetic .axz with large HeightMaps is opened with ANASYS_OPEN_INDEX,
+ * which must write the sidecar.  The sidecar must load with the payloads
+ * of the channels, save to the same bytes and give their text through a
+ * stream; opens using it must give the data written.  A sidecar whose
+ * stamp does not match the document, after the document was touched or
+ * when it belongs to another document, must be rejected, and opening with
+ * the index must then still give the right data and write a new one.
+ */
+
+#include <string.h>
+#include <utime.h>
+#include <glib/gstdio.h>
+#include "anasys_core.h"
+#include "anasys_gzindex.h"
+#include "anasys_test_document.h"
+
+#define TEST_XRES 512
+#define TEST_YRES 384
+#define TEST_NCHANNELS 3
+#define TEST_NSPECTRA 5
+#define TEST_NPOINTS 200
+
+static gboolean check_open      (const gchar *filename,
+                                 guint nchannels,
+                                 AnasysOpenFlags flags);
+static gboolean check_index     (const gchar *filename,
+                                 guint nchannels);
+static gboolean check_stream    (const AnasysGzIndex *index,
+                                 const gchar *filename,
+                                 guint k);
+static gboolean check_roundtrip (AnasysGzIndex *index,
+                                 const gchar *filename);
+static gboolean check_rejected  (const gchar *filename,
+                                 const gchar *why);
+
+int
+main(void)
+{
+    AnasysTestDocument document = {
+        ANASYS_TEST_UTF16_BOM, TRUE, TEST_NCHANNELS, TEST_XRES, TEST_YRES,
+        TEST_NSPECTRA, TEST_NPOINTS, 2, FALSE, FALSE,
+    };
+    GError *error = NULL;
+    gchar *dirname, *filename, *other, *sidecar, *othersidecar;
+    gchar *buffer = NULL;
+    gsize len;
+    GStatBuf st;
+    struct utimbuf times;
+    gboolean ok = TRUE;
+
+    if (!(dirname = g_dir_make_tmp("anasys-test-XXXXXX", &error))) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    filename = g_build_filename(dirname, "indexed.axz", NULL);
+    other = g_build_filename(dirname, "other.axz", NULL);
+    sidecar = g_strconcat(filename, ANASYS_GZ_INDEX_SUFFIX, NULL);
+    othersidecar = g_strconcat(other, ANASYS_GZ_INDEX_SUFFIX, NULL);
+    if (!anasys_test_document_write(&document, filename)) {
+        g_printerr("%s: cannot write the test file\n", filename);
+        ok = FALSE;
+        goto end;
+    }
+    document.nchannels--;
+    if (!anasys_test_document_write(&document, other)) {
+        g_printerr("%s: cannot write the test file\n", other);
+        ok = FALSE;
+        goto end;
+    }
+
+    /* The first open writes the sidecar, later ones use it. */
+    ok &= check_open(filename, TEST_NCHANNELS, ANASYS_OPEN_INDEX);
+    if (!g_file_test(sidecar, G_FILE_TEST_IS_REGULAR)) {
+        g_printerr("%s: no index was written\n", sidecar);
+        ok = FALSE;
+        goto end;
+    }
+    ok &= check_index(filename, TEST_NCHANNELS);
+    ok &= check_open(filename, TEST_NCHANNELS, ANASYS_OPEN_INDEX);
+
+    /* The document touched after the sidecar was written. */
+    if (g_stat(filename, &st) != 0) {
+        g_printerr("%s: cannot stat\n", filename);
+        ok = FALSE;
+        goto end;
+    }
+    times.actime = st.st_atime;
+    times.modtime = st.st_mtime + 100;
+    g_utime(filename, &times);
+    ok &= check_rejected(filename, "after the document was touched");
+    ok &= check_open(filename, TEST_NCHANNELS, ANASYS_OPEN_INDEX);
+    ok &= check_index(filename, TEST_NCHANNELS);
+
+    /* The sidecar of another document. */
+    ok &= check_open(other, TEST_NCHANNELS - 1, ANASYS_OPEN_INDEX);
+    if (!g_file_get_contents(othersidecar, &buffer, &len, &error)
+        || !g_file_set_contents(sidecar, buffer, len, &error)) {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        ok = FALSE;
+    }
+    else {
+        ok &= check_rejected(filename, "of another document");
+        ok &= check_open(filename, TEST_NCHANNELS, ANASYS_OPEN_INDEX);
+        ok &= check_index(filename, TEST_NCHANNELS);
+    }
+    g_free(buffer);
+
+end:
+    g_unlink(sidecar);
+    g_unlink(othersidecar);
+    g_unlink(filename);
+    g_unlink(other);
+    g_rmdir(dirname);
+    g_free(sidecar);
+    g_free(othersidecar);
+    g_free(filename);
+    g_free(other);
+    g_free(dirname);
+    return ok ? 0 : 1;
+}
+
+/* Open the file and compare all its data with what was written. */
+static gboolean
+check_open(const gchar *filename, guint nchannels, AnasysOpenFlags flags)
+{
+    AnasysFile *file;
+    AnasysChannel *channel;
+    AnasysSpectrum *spectrum;
+    GError *error = NULL;
+    gfloat *buffer;
+    gboolean ok = TRUE;
+    guint i, j, k, xres, yres;
+
+    if (!(file = anasys_file_open_full(filename, flags, &error))) {
+        g_printerr("%s: %s\n", filename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    if (anasys_file_get_n_channels(file) != nchannels
+        || anasys_file_get_n_spectra(file) != TEST_NSPECTRA) {
+        g_printerr("%s: %u channels and %u spectra instead of %u and %u\n",
+                   filename, anasys_file_get_n_channels(file),
+                   anasys_file_get_n_spectra(file), nchannels,
+                   TEST_NSPECTRA);
+        anasys_file_unref(file);
+        return FALSE;
+    }
+    buffer = g_new(gfloat, TEST_XRES*TEST_YRES);
+    for (k = 0; ok && k < nchannels; k++) {
+        channel = anasys_file_get_channel(file, k);
+        anasys_channel_get_resolution(channel, &xres, &yres);
+        if (xres != TEST_XRES || yres != TEST_YRES
+            || !anasys_channel_read_data(channel, buffer, &error)) {
+            g_printerr("%s: channel %u cannot be read%s%s\n", filename, k,
+                       error ? ": " : "", error ? error->message : "");
+            g_clear_error(&error);
+            ok = FALSE;
+            break;
+        }
+        for (i = 0; ok && i < yres; i++) {
+            for (j = 0; ok && j < xres; j++) {
+                if (buffer[i*xres + j] != anasys_test_channel_value(k, i, j)) {
+                    g_printerr("%s: channel %u differs at %u,%u\n",
+                               filename, k, j, i);
+                    ok = FALSE;
+                }
+            }
+        }
+    }
+    for (k = 0; ok && k < TEST_NSPECTRA; k++) {
+        spectrum = anasys_file_get_spectrum(file, k);
+        if (anasys_spectrum_get_n_points(spectrum) != TEST_NPOINTS
+            || !anasys_spectrum_read_data(spectrum, 0, TEST_NPOINTS, buffer,
+                                          &error)) {
+            g_printerr("%s: spectrum %u cannot be read%s%s\n", filename, k,
+                       error ? ": " : "", error ? error->message : "");
+            g_clear_error(&error);
+            ok = FALSE;
+            break;
+        }
+        for (i = 0; ok && i < TEST_NPOINTS; i++) {
+            if (buffer[i] != anasys_test_spectrum_value(k, i)) {
+                g_printerr("%s: spectrum %u differs at %u\n",
+                           filename, k, i);
+                ok = FALSE;
+            }
+        }
+    }
+    g_free(buffer);
+    anasys_file_unref(file);
+    return ok;
+}
+
+/* The sidecar must hold the payloads of the channels, the spectra being
+ * too small to be left out of the document. */
+static gboolean
+check_index(const gchar *filename, guint nchannels)
+{
+    const AnasysGzPayload *payload;
+    AnasysGzIndex *index;
+    gboolean ok = TRUE;
+    guint k;
+
+    if (!(index = anasys_gz_index_load(filename))) {
+        g_printerr("%s: the index does not load\n", filename);
+        return FALSE;
+    }
+    if (anasys_gz_index_get_n_payloads(index) != nchannels) {
+        g_printerr("%s: %u payloads indexed instead of %u\n", filename,
+                   anasys_gz_index_get_n_payloads(index), nchannels);
+        anasys_gz_index_free(index);
+        return FALSE;
+    }
+    for (k = 0; k < nchannels; k++) {
+        payload = anasys_gz_index_get_payload(index, k);
+        if (payload->size != TEST_XRES*TEST_YRES*sizeof(gfloat)
+            || !payload->regular) {
+            g_printerr("%s: payload %u has size %" G_GUINT64_FORMAT "\n",
+                       filename, k, payload->size);
+            ok = FALSE;
+        }
+        else
+            ok &= check_stream(index, filename, k);
+    }
+    ok &= check_roundtrip(index, filename);
+    anasys_gz_index_free(index);
+    return ok;
+}
+
+/* The text of a payload read through a stream must be the base64 of the
+ * channel as written. */
+static gboolean
+check_stream(const AnasysGzIndex *index, const gchar *filename, guint k)
+{
+    const AnasysGzPayload *payload = anasys_gz_index_get_payload(index, k);
+    AnasysGzStream *stream;
+    GError *error = NULL;
+    guint32 *data;
+    gchar *expected, *text;
+    gboolean ok = FALSE;
+    guint i, j;
+
+    data = g_new(guint32, TEST_XRES*TEST_YRES);
+    for (i = 0; i < TEST_YRES; i++) {
+        for (j = 0; j < TEST_XRES; j++) {
+            union { gfloat f; guint32 u; } value;
+
+            value.f = anasys_test_channel_value(k, i, j);
+            data[i*TEST_XRES + j] = GUINT32_TO_LE(value.u);
+        }
+    }
+    expected = g_base64_encode((const guchar*)data,
+                               TEST_XRES*TEST_YRES*sizeof(gfloat));
+    g_free(data);
+    text = g_new0(gchar, payload->length/2 + 1);
+    if (!(stream = anasys_gz_stream_open(index, &error))
+        || !anasys_gz_stream_read_text(stream, payload->offset,
+                                       payload->length/2, text, &error)) {
+        g_printerr("%s: payload %u cannot be read: %s\n", filename, k,
+                   error->message);
+        g_error_free(error);
+    }
+    else if (strcmp(text, expected) != 0)
+        g_printerr("%s: payload %u text differs\n", filename, k);
+    else
+        ok = TRUE;
+    if (stream)
+        anasys_gz_stream_close(stream);
+    g_free(text);
+    g_free(expected);
+    return ok;
+}
+
+/* Saving a loaded index must give the same sidecar again. */
+static gboolean
+check_roundtrip(AnasysGzIndex *index, const gchar *filename)
+{
+    gchar *sidecar, *before = NULL, *after = NULL;
+    GError *error = NULL;
+    gsize nbefore, nafter;
+    gboolean ok = FALSE;
+
+    sidecar = g_strconcat(filename, ANASYS_GZ_INDEX_SUFFIX, NULL);
+    if (!g_file_get_contents(sidecar, &before, &nbefore, &error)
+        || g_unlink(sidecar) != 0
+        || !anasys_gz_index_save(index, &error)
+        || !g_file_get_contents(sidecar, &after, &nafter, &error)) {
+        g_printerr("%s: %s\n", sidecar,
+                   error ? error->message : "cannot remove");
+        g_clear_error(&error);
+    }
+    else if (nbefore != nafter || memcmp(before, after, nbefore) != 0)
+        g_printerr("%s: saved index differs from the loaded one\n", sidecar);
+    else
+        ok = TRUE;
+    g_free(before);
+    g_free(after);
+    g_free(sidecar);
+    return ok;
+}
+
+static gboolean
+check_rejected(const gchar *filename, const gchar *why)
+{
+    AnasysGzIndex *index;
+
+    if (!(index = anasys_gz_index_load(filename)))
+        return TRUE;
+    g_printerr("%s: the index is accepted %s\n", filename, why);
+    anasys_gz_index_free(index);
+    return FALSE;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,425 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Memory regression test of the loader, run by make check.
+ *
+ * The module just built is registered and a synthetic file with large
+ * HeightMaps, above the 64 MB from which documents are parsed in parallel,
+ * is loaded through it as .axd and .axz with memory_report.  The peak RSS
+ * of the process, measured by the module and reset before each load, must
+ * not grow by more than the ledger accounts for, and the ledger peaks must
+ * stay within what the loader is meant to hold: the fields exactly, at
+ * most a decoding chunk per channel, and the document with its text.  A
+ * load with a budget below the reported peak must fail, one with a budget
+ * above it must not.
+ *
+ * With drift correction each channel is decoded whole.  A budget with room
+ * for the fields but not for these decoded payloads must fail the load,
+ * unless they are spilled to the scratch file, and the spilled load must
+ * give the same fields.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <glib/gstdio.h>
+#include <gmodule.h>
+#include <libgwyddion/gwyddion.h>
+#include <libgwymodule/gwymodule.h>
+#include <libgwymodule/gwymodule-file.h>
+#include <app/settings.h>
+#include "anasys_test_document.h"
+
+#define TEST_XRES 1024
+#define TEST_YRES 1024
+#define TEST_NCHANNELS 7
+#define TEST_SPILL_NCHANNELS 4
+
+/* As PARALLEL_MIN_DOCUMENT and DECODE_CHUNK in the module. */
+#define TEST_PARALLEL_MIN ((guint64)64 << 20)
+#define TEST_DECODE_CHUNK (1 << 20)
+
+/* Allowance for what the ledger does not count: libxml and GLib
+ * bookkeeping, thread stacks and the like. */
+#define TEST_RSS_SLACK ((guint64)32 << 20)
+
+static gboolean      setup_module  (const gchar *argv0,
+                                    const gchar *dirname);
+static gboolean      check_file    (const gchar *filename,
+                                    guint64 document);
+static gboolean      check_spill   (const gchar *filename);
+static gboolean      check_at_most (const gchar *filename,
+                                    const gchar *kind,
+                                    gint64 bytes,
+                                    guint64 limit);
+static gint64        get_peak_rss  (GwyContainer *container);
+static gboolean      reset_peak_rss(void);
+static guint64       read_peak_rss (void);
+static GwyContainer* load          (const gchar *filename,
+                                    gint32 budget,
+                                    GError **error);
+
+int
+main(int argc, char *argv[])
+{
+    static const gchar *names[] = { "large.axd", "large.axz" };
+    AnasysTestDocument document = {
+        ANASYS_TEST_UTF16_BOM, FALSE, TEST_NCHANNELS, TEST_XRES, TEST_YRES,
+        0, 0, 0, FALSE, FALSE,
+    };
+    GError *error = NULL;
+    gchar *dirname, *filename;
+    GStatBuf st;
+    guint64 size = 0;
+    gboolean ok = TRUE;
+    guint i;
+
+    g_return_val_if_fail(argc > 0, 1);
+    if (!(dirname = g_dir_make_tmp("anasys-test-XXXXXX", &error))) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    if (!setup_module(argv[0], dirname))
+        ok = FALSE;
+    for (i = 0; ok && i < G_N_ELEMENTS(names); i++) {
+        filename = g_build_filename(dirname, names[i], NULL);
+        document.compress = (i == 1);
+        if (!anasys_test_document_write(&document, filename)) {
+            g_printerr("%s: cannot write the test file\n", filename);
+            ok = FALSE;
+        }
+        else {
+            /* The .axz holds the same text as the .axd. */
+            if (!i && g_stat(filename, &st) == 0)
+                size = st.st_size;
+            if (size < TEST_PARALLEL_MIN) {
+                g_printerr("%s: the document is too small to be parsed "
+                           "in parallel\n", filename);
+                ok = FALSE;
+            }
+            else if (!check_file(filename, size))
+                ok = FALSE;
+        }
+        g_unlink(filename);
+        g_free(filename);
+    }
+    if (ok) {
+        filename = g_build_filename(dirname, "drift.axd", NULL);
+        document.compress = FALSE;
+        document.nchannels = TEST_SPILL_NCHANNELS;
+        document.drift = TRUE;
+        if (!anasys_test_document_write(&document, filename)) {
+            g_printerr("%s: cannot write the test file\n", filename);
+            ok = FALSE;
+        }
+        else if (!check_spill(filename))
+            ok = FALSE;
+        g_unlink(filename);
+        g_free(filename);
+    }
+    filename = g_build_filename(dirname, "settings", NULL);
+    g_unlink(filename);
+    g_free(filename);
+    filename = g_build_filename(dirname, "anasys_xml." G_MODULE_SUFFIX, NULL);
+    g_unlink(filename);
+    g_free(filename);
+    g_rmdir(dirname);
+    g_free(dirname);
+    return ok ? 0 : 1;
+}
+
+/* Load settings asking for the memory report, so that none are created
+ * empty with a warning, and register the module libtool built next to the
+ * test.  It is copied alone into the directory, which Gwyddion scans for
+ * modules. */
+static gboolean
+setup_module(const gchar *argv0, const gchar *dirname)
+{
+    static const gchar settings[] = "Gwyddion Settings 1.0\n"
+                                    "\"/module/anasys_xml/memory_report\" "
+                                    "boolean True\n";
+    const gchar *paths[2] = { dirname, NULL };
+    gchar *filename, *builddir, *module, *buffer = NULL;
+    GError *error = NULL;
+    gboolean ok = FALSE;
+    gsize len;
+
+    gwy_type_init();
+    filename = g_build_filename(dirname, "settings", NULL);
+    if (!g_file_set_contents(filename, settings, -1, &error)
+        || !gwy_app_settings_load(filename, &error)) {
+        g_printerr("%s: %s\n", filename, error->message);
+        g_error_free(error);
+        g_free(filename);
+        return FALSE;
+    }
+    g_free(filename);
+
+    builddir = g_path_get_dirname(argv0);
+    module = g_build_filename(builddir, ".libs",
+                              "anasys_xml." G_MODULE_SUFFIX, NULL);
+    filename = g_build_filename(dirname, "anasys_xml." G_MODULE_SUFFIX, NULL);
+    if (!g_file_get_contents(module, &buffer, &len, &error)
+        || !g_file_set_contents(filename, buffer, len, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+    }
+    else {
+        gwy_module_register_modules(paths);
+        if (!(ok = gwy_file_func_exists("anasys_xml")))
+            g_printerr("%s: the module does not register\n", module);
+    }
+    g_free(buffer);
+    g_free(filename);
+    g_free(module);
+    g_free(builddir);
+    return ok;
+}
+
+static gboolean
+check_file(const gchar *filename, guint64 document)
+{
+    guint64 fields = (guint64)TEST_NCHANNELS*TEST_XRES*TEST_YRES
+                     *sizeof(gdouble);
+    guint64 chunks = (guint64)TEST_NCHANNELS*TEST_DECODE_CHUNK;
+    gint64 peak, bytes, rss;
+    GwyContainer *container;
+    GError *error = NULL;
+    gboolean ok = TRUE, measured;
+    guint64 before;
+    gint32 budget;
+
+    /* Only Linux measures the peak RSS and lets it be reset. */
+    measured = reset_peak_rss();
+    before = measured ? read_peak_rss() : 0;
+    if (!(container = load(filename, 0, &error))) {
+        g_printerr("%s: %s\n", filename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    bytes = gwy_container_get_int64_by_name(container,
+                                            "/anasys/memory/fields");
+    if (bytes != (gint64)fields) {
+        g_printerr("%s: fields peak %" G_GINT64_FORMAT " is not "
+                   "%" G_GUINT64_FORMAT "\n", filename, bytes, fields);
+        ok = FALSE;
+    }
+    bytes = gwy_container_get_int64_by_name(container,
+                                            "/anasys/memory/decoded");
+    ok &= check_at_most(filename, "decoded", bytes, chunks);
+    /* The tree and the whole text, twice, while parsing in parallel. */
+    bytes = gwy_container_get_int64_by_name(container,
+                                            "/anasys/memory/document");
+    ok &= check_at_most(filename, "document", bytes, 3*document);
+    peak = gwy_container_get_int64_by_name(container, "/anasys/memory/peak");
+    ok &= check_at_most(filename, "total", peak,
+                        3*document + fields + chunks);
+
+    /* What the process really took must be within the estimate. */
+    rss = get_peak_rss(container);
+    if (!measured)
+        g_printerr("%s: peak RSS not measured on this system\n", filename);
+    else if (!before || rss <= 0) {
+        g_printerr("%s: no peak RSS measured\n", filename);
+        ok = FALSE;
+    }
+    else if (rss < (gint64)before) {
+        g_printerr("%s: peak RSS %" G_GINT64_FORMAT " is below the "
+                   "%" G_GUINT64_FORMAT " before the load\n",
+                   filename, rss, before);
+        ok = FALSE;
+    }
+    else
+        ok &= check_at_most(filename, "RSS growth", rss - before,
+                            peak + TEST_RSS_SLACK);
+    g_object_unref(container);
+
+    /* Budgets are whole MiB. */
+    budget = peak/2 >> 20;
+    if ((container = load(filename, budget, &error))) {
+        g_printerr("%s: loaded within a budget of %d MiB below the peak\n",
+                   filename, budget);
+        g_object_unref(container);
+        ok = FALSE;
+    }
+    g_clear_error(&error);
+    budget = (peak >> 20) + 1;
+    if (!(container = load(filename, budget, &error))) {
+        g_printerr("%s: not loaded within a budget of %d MiB above the "
+                   "peak: %s\n", filename, budget, error->message);
+        g_error_free(error);
+        ok = FALSE;
+    }
+    GWY_OBJECT_UNREF(container);
+    return ok;
+}
+
+static gboolean
+check_spill(const gchar *filename)
+{
+    guint64 payloads = (guint64)TEST_SPILL_NCHANNELS*TEST_XRES*TEST_YRES
+                       *sizeof(gfloat);
+    GwyContainer *settings = gwy_app_settings_get();
+    GwyContainer *container = NULL, *spilled = NULL;
+    GwyDataField *dfield, *sfield;
+    GError *error = NULL;
+    gint64 peak, bytes;
+    gboolean ok = FALSE;
+    gint32 budget;
+    gchar key[32];
+    guint k;
+
+    gwy_container_set_boolean_by_name(settings,
+                                      "/module/anasys_xml/correct_drift",
+                                      TRUE);
+    if (!(container = load(filename, 0, &error))) {
+        g_printerr("%s: %s\n", filename, error->message);
+        g_clear_error(&error);
+        goto end;
+    }
+    peak = gwy_container_get_int64_by_name(container, "/anasys/memory/peak");
+    bytes = gwy_container_get_int64_by_name(container,
+                                            "/anasys/memory/decoded");
+    if (bytes != (gint64)payloads) {
+        g_printerr("%s: decoded peak %" G_GINT64_FORMAT " is not "
+                   "%" G_GUINT64_FORMAT "\n", filename, bytes, payloads);
+        goto end;
+    }
+
+    /* Room for a MiB or two of the payloads. */
+    budget = ((peak - bytes) >> 20) + 2;
+    if ((spilled = load(filename, budget, &error))) {
+        g_printerr("%s: loaded within a budget of %d MiB below the peak "
+                   "without spilling\n", filename, budget);
+        goto end;
+    }
+    g_clear_error(&error);
+    gwy_container_set_boolean_by_name(settings,
+                                      "/module/anasys_xml/spill_decoded",
+                                      TRUE);
+    if (!(spilled = load(filename, budget, &error))) {
+        g_printerr("%s: not loaded within a budget of %d MiB with "
+                   "spilling: %s\n", filename, budget, error->message);
+        g_clear_error(&error);
+        goto end;
+    }
+    bytes = gwy_container_get_int64_by_name(spilled,
+                                            "/anasys/memory/decoded");
+    if (!check_at_most(filename, "spilled decoded", bytes, 2 << 20))
+        goto end;
+    for (k = 1; k <= TEST_SPILL_NCHANNELS; k++) {
+        g_snprintf(key, sizeof(key), "/%u/data", k);
+        dfield = gwy_container_get_object_by_name(container, key);
+        sfield = gwy_container_get_object_by_name(spilled, key);
+        if (memcmp(gwy_data_field_get_data_const(dfield),
+                   gwy_data_field_get_data_const(sfield),
+                   TEST_XRES*TEST_YRES*sizeof(gdouble)) != 0) {
+            g_printerr("%s: channel %u differs when spilled\n",
+                       filename, k);
+            goto end;
+        }
+    }
+    ok = TRUE;
+
+end:
+    gwy_container_set_boolean_by_name(settings,
+                                      "/module/anasys_xml/correct_drift",
+                                      FALSE);
+    gwy_container_set_boolean_by_name(settings,
+                                      "/module/anasys_xml/spill_decoded",
+                                      FALSE);
+    GWY_OBJECT_UNREF(spilled);
+    GWY_OBJECT_UNREF(container);
+    return ok;
+}
+
+static gboolean
+check_at_most(const gchar *filename, const gchar *kind, gint64 bytes,
+              guint64 limit)
+{
+    if (bytes >= 0 && (guint64)bytes <= limit)
+        return TRUE;
+    g_printerr("%s: %s peak %" G_GINT64_FORMAT " exceeds "
+               "%" G_GUINT64_FORMAT "\n", filename, kind, bytes, limit);
+    return FALSE;
+}
+
+/* The peak RSS only grows, the last phase has the highest. */
+static gint64
+get_peak_rss(GwyContainer *container)
+{
+    static const gchar *phases[] = {
+        "parse", "heightmaps", "spectra", "series", "matrix",
+    };
+    gint64 rss = 0, value;
+    gchar *key;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(phases); i++) {
+        key = g_strconcat("/anasys/memory/peak-rss/", phases[i], NULL);
+        if (gwy_container_gis_int64_by_name(container, key, &value))
+            rss = MAX(rss, value);
+        g_free(key);
+    }
+    return rss;
+}
+
+/* Linux resets VmHWM to the current RSS on writing 5 to clear_refs. */
+static gboolean
+reset_peak_rss(void)
+{
+    FILE *fh;
+    gboolean ok;
+
+    if (!(fh = fopen("/proc/self/clear_refs", "w")))
+        return FALSE;
+    ok = (fputs("5", fh) >= 0);
+    return (fclose(fh) == 0) && ok;
+}
+
+static guint64
+read_peak_rss(void)
+{
+    gchar *buffer = NULL, *line;
+    guint64 value = 0;
+
+    if (!g_file_get_contents("/proc/self/status", &buffer, NULL, NULL))
+        return 0;
+    if ((line = strstr(buffer, "\nVmHWM:")))
+        sscanf(line + 1, "VmHWM: %" G_GUINT64_FORMAT, &value);
+    g_free(buffer);
+    return value << 10;
+}
+
+static GwyContainer*
+load(const gchar *filename, gint32 budget, GError **error)
+{
+    GwyContainer *settings = gwy_app_settings_get();
+
+    gwy_container_set_int32_by_name(settings,
+                                    "/module/anasys_xml/memory_budget",
+                                    budget);
+    return gwy_file_func_run_load("anasys_xml", filename,
+                                  GWY_RUN_NONINTERACTIVE, error);
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
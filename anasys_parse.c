@@ -0,0 +1,579 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <zlib.h>
+#include <glib.h>
+#include "anasys_core.h"
+#include "anasys_parse.h"
+
+#define strequal(a, b) xmlStrEqual((a), (const xmlChar*)(b))
+
+/* HeightMaps and spectra of documents smaller than this are not split; the
+ * threads would cost more than they save. */
+#define PARALLEL_MIN_SIZE (4 << 20)
+
+/* Output is inflated in steps of at least this many bytes. */
+#define INFLATE_CHUNK (1 << 20)
+
+enum {
+    SECTION_HEIGHT_MAPS,
+    SECTION_SPECTRA,
+    SECTION_BACKGROUNDS,
+    NSECTIONS
+};
+
+typedef struct {
+    const gchar *name;
+    const gchar *child;
+    const gchar *marker;
+} SectionInfo;
+
+static const SectionInfo section_info[NSECTIONS] = {
+    { "HeightMaps", "HeightMap", ANASYS_HEIGHT_MAPS_MARKER, },
+    { "RenderedSpectra", "IRRenderedSpectra", ANASYS_SPECTRA_MARKER, },
+    { "Backgrounds", "IRBackground", ANASYS_BACKGROUNDS_MARKER, },
+};
+
+/* A part of the text, as byte offsets. */
+typedef struct {
+    gsize start;
+    gsize end;
+} TextSpan;
+
+/* The text in UTF-16LE (unit 2) or an ASCII compatible encoding (unit 1),
+ * after a byte order mark bom bytes long; encoding is only set when there
+ * is no mark.  Each enabled section is the content of its element, cut out
+ * of the skeleton; the elements in it are parsed into docs, in order,
+ * sections one after another.  Backgrounds also get checksums, and those
+ * found by lookup are known instead of parsed. */
+typedef struct {
+    const guchar *text;
+    gsize len;
+    guint unit;
+    gsize bom;
+    const gchar *encoding;
+    gboolean enabled[NSECTIONS];
+    AnasysParseLookupFunc lookup;
+    TextSpan root;
+    TextSpan section[NSECTIONS];
+    GArray *elements[NSECTIONS];
+    guint nelements;
+    xmlDoc **docs;
+    gchar **checksums;
+    gpointer *known;
+    volatile gint next;
+} SplitDocument;
+
+static guchar*   inflate_document  (const guchar *data,
+                                    gsize size,
+                                    gsize *len);
+static gboolean  split_document    (SplitDocument *split);
+static gboolean  split_section     (SplitDocument *split,
+                                    guint s);
+static guint     sort_sections     (const SplitDocument *split,
+                                    guint *order);
+static gpointer  parse_elements    (gpointer user_data);
+static gboolean  check_skeleton    (const SplitDocument *split,
+                                    xmlDoc *doc);
+static void      append_widened    (GByteArray *buffer,
+                                    const gchar *ascii,
+                                    guint unit);
+static gboolean  match_at          (const SplitDocument *split,
+                                    gsize pos,
+                                    const gchar *ascii);
+static gboolean  space_at          (const SplitDocument *split,
+                                    gsize pos);
+static gboolean  find_text         (const SplitDocument *split,
+                                    gsize from,
+                                    const gchar *ascii,
+                                    gsize *pos);
+
+/* Parse the file, splitting it among threads if parallel and it is large
+ * enough, and cutting out the backgrounds if there is a lookup.  The
+ * elements cut out are returned, in document order, in height_maps and
+ * spectra, and in backgrounds as AnasysParsedBackground; the arrays are NULL
+ * when the document was parsed whole.  Known backgrounds not returned are
+ * given to release. */
+xmlDoc*
+anasys_parse_document(xmlParserCtxt *ctxt, const gchar *filename,
+                      gboolean parallel,
+                      AnasysParseLookupFunc lookup, GDestroyNotify release,
+                      GPtrArray **height_maps, GPtrArray **spectra,
+                      GArray **backgrounds)
+{
+    SplitDocument split;
+    AnasysParsedBackground background;
+    GMappedFile *mfile;
+    GByteArray *skeleton;
+    xmlDoc *doc = NULL;
+    const guchar *data;
+    guchar *inflated = NULL;
+    gsize size, len;
+    guint s, i, k, n, order[NSECTIONS];
+    gboolean ok = FALSE;
+
+    /* Whatever cannot be handled here is left to libxml. */
+    *height_maps = *spectra = NULL;
+    *backgrounds = NULL;
+    if (!(mfile = g_mapped_file_new(filename, FALSE, NULL)))
+        return xmlCtxtReadFile(ctxt, filename, NULL,
+                               ANASYS_PARSE_OPTIONS);
+    data = (const guchar*)g_mapped_file_get_contents(mfile);
+    size = len = g_mapped_file_get_length(mfile);
+    if (size >= 18 && data[0] == 0x1f && data[1] == 0x8b)
+        data = inflated = inflate_document(data, size, &len);
+    if (!data || len > G_MAXINT) {
+        g_free(inflated);
+        g_mapped_file_unref(mfile);
+        return xmlCtxtReadFile(ctxt, filename, NULL,
+                               ANASYS_PARSE_OPTIONS);
+    }
+
+    memset(&split, 0, sizeof(split));
+    split.text = data;
+    split.len = len;
+    parallel = parallel && len >= PARALLEL_MIN_SIZE;
+    split.enabled[SECTION_HEIGHT_MAPS] = parallel;
+    split.enabled[SECTION_SPECTRA] = parallel;
+    split.enabled[SECTION_BACKGROUNDS] = (lookup != NULL);
+    split.lookup = lookup;
+    if (!split_document(&split) || !split.nelements)
+        goto whole;
+
+    /* Each thread takes the next element until there are none left. */
+    split.docs = g_new0(xmlDoc*, split.nelements);
+    split.checksums = g_new0(gchar*, split.nelements);
+    split.known = g_new0(gpointer, split.nelements);
+    anasys_run_workers(parse_elements, &split,
+                       parallel ? split.nelements : 1);
+
+    for (k = 0; k < split.nelements; k++) {
+        if (!split.docs[k] && !split.known[k])
+            goto whole;
+    }
+
+    skeleton = g_byte_array_new();
+    n = sort_sections(&split, order);
+    for (i = k = 0; i < n; i++) {
+        s = order[i];
+        g_byte_array_append(skeleton, data + k, split.section[s].start - k);
+        append_widened(skeleton, "<?", split.unit);
+        append_widened(skeleton, section_info[s].marker, split.unit);
+        append_widened(skeleton, "?>", split.unit);
+        k = split.section[s].end;
+    }
+    g_byte_array_append(skeleton, data + k, len - k);
+    doc = xmlCtxtReadMemory(ctxt, (const gchar*)skeleton->data,
+                            skeleton->len, filename, split.encoding,
+                            ANASYS_PARSE_OPTIONS);
+    g_byte_array_free(skeleton, TRUE);
+    if (!check_skeleton(&split, doc)) {
+        xmlFreeDoc(doc);
+        doc = NULL;
+        goto whole;
+    }
+
+    *height_maps = g_ptr_array_new_with_free_func((GDestroyNotify)xmlFreeDoc);
+    *spectra = g_ptr_array_new_with_free_func((GDestroyNotify)xmlFreeDoc);
+    *backgrounds = g_array_new(FALSE, FALSE, sizeof(AnasysParsedBackground));
+    for (s = k = 0; s < NSECTIONS; s++) {
+        for (i = 0; i < split.elements[s]->len; i++, k++) {
+            if (s == SECTION_BACKGROUNDS) {
+                background.checksum = split.checksums[k];
+                background.doc = split.docs[k];
+                background.known = split.known[k];
+                g_array_append_val(*backgrounds, background);
+                split.checksums[k] = NULL;
+                split.known[k] = NULL;
+            }
+            else
+                g_ptr_array_add(s == SECTION_HEIGHT_MAPS
+                                ? *height_maps : *spectra,
+                                split.docs[k]);
+            split.docs[k] = NULL;
+        }
+    }
+    ok = TRUE;
+
+whole:
+    if (split.docs) {
+        for (k = 0; k < split.nelements; k++) {
+            xmlFreeDoc(split.docs[k]);
+            g_free(split.checksums[k]);
+            if (split.known[k])
+                release(split.known[k]);
+        }
+        g_free(split.docs);
+        g_free(split.checksums);
+        g_free(split.known);
+    }
+    for (s = 0; s < NSECTIONS; s++) {
+        if (split.elements[s])
+            g_array_free(split.elements[s], TRUE);
+    }
+    if (!ok)
+        doc = xmlCtxtReadMemory(ctxt, (const gchar*)data, len, filename,
+                                NULL, ANASYS_PARSE_OPTIONS);
+    g_free(inflated);
+    g_mapped_file_unref(mfile);
+    return doc;
+}
+
+/* The HeightMap, IRRenderedSpectra or IRBackground element of a document
+ * parsed from a part of the file. */
+xmlNode*
+anasys_parse_get_element(xmlDoc *fragment)
+{
+    xmlNode *node;
+
+    for (node = xmlDocGetRootElement(fragment)->children;
+         node;
+         node = node->next) {
+        if (node->type == XML_ELEMENT_NODE)
+            return node;
+    }
+    return NULL;
+}
+
+/* Inflate all gzip members of data.  The size stored in the trailer, when
+ * it is right, saves growing the output. */
+static guchar*
+inflate_document(const guchar *data, gsize size, gsize *len)
+{
+    z_stream strm;
+    guchar *out;
+    gsize alloc, remaining = size, n = 0;
+    gint status;
+
+    alloc = data[size-4] | data[size-3] << 8 | data[size-2] << 16
+            | (gsize)data[size-1] << 24;
+    alloc = MAX(alloc, INFLATE_CHUNK) + 1;
+    out = g_malloc(alloc);
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+        g_free(out);
+        return NULL;
+    }
+    strm.next_in = (Bytef*)data;
+    do {
+        if (!strm.avail_in) {
+            strm.avail_in = MIN(remaining, G_MAXUINT32);
+            remaining -= strm.avail_in;
+        }
+        if (n == alloc) {
+            alloc = 2*alloc;
+            out = g_realloc(out, alloc);
+        }
+        strm.next_out = out + n;
+        strm.avail_out = MIN(alloc - n, G_MAXUINT32);
+        status = inflate(&strm, Z_NO_FLUSH);
+        n = strm.next_out - out;
+        /* Another member may follow. */
+        if (status == Z_STREAM_END && (strm.avail_in || remaining))
+            status = inflateReset(&strm);
+    } while (status == Z_OK);
+    inflateEnd(&strm);
+    if (status != Z_STREAM_END) {
+        g_free(out);
+        return NULL;
+    }
+    *len = n;
+    return out;
+}
+
+static gboolean
+split_document(SplitDocument *split)
+{
+    const guchar *t = split->text;
+    gsize pos;
+    guint s, i, n, order[NSECTIONS];
+
+    if (split->len >= 2 && t[0] == 0xff && t[1] == 0xfe) {
+        split->unit = 2;
+        split->bom = 2;
+    }
+    else if (split->len >= 2 && t[0] == '<' && t[1] == 0) {
+        /* Nothing to tell libxml the encoding of the parts. */
+        split->unit = 2;
+        split->encoding = "UTF-16LE";
+    }
+    else if (split->len >= 3 && t[0] == 0xef && t[1] == 0xbb && t[2] == 0xbf) {
+        split->unit = 1;
+        split->bom = 3;
+    }
+    else if (split->len >= 2 && t[0] == 0xfe && t[1] == 0xff)
+        return FALSE;
+    else
+        split->unit = 1;
+
+    if (!find_text(split, split->bom, "<Document", &pos))
+        return FALSE;
+    split->root.start = pos;
+    if (!find_text(split, pos, ">", &pos))
+        return FALSE;
+    split->root.end = pos + split->unit;
+
+    for (s = 0; s < NSECTIONS; s++) {
+        split->elements[s] = g_array_new(FALSE, FALSE, sizeof(TextSpan));
+        if (split->enabled[s] && !split_section(split, s))
+            return FALSE;
+        split->nelements += split->elements[s]->len;
+    }
+    /* The sections must follow the root tag and each other. */
+    n = sort_sections(split, order);
+    for (i = 0, pos = split->root.end; i < n; i++) {
+        if (split->section[order[i]].start < pos)
+            return FALSE;
+        pos = split->section[order[i]].end;
+    }
+    return TRUE;
+}
+
+/* The sections with elements, in the order they are in the text. */
+static guint
+sort_sections(const SplitDocument *split, guint *order)
+{
+    guint s, i, n = 0;
+
+    for (s = 0; s < NSECTIONS; s++) {
+        if (!split->elements[s]->len)
+            continue;
+        for (i = n++;
+             i && split->section[order[i-1]].start > split->section[s].start;
+             i--)
+            order[i] = order[i-1];
+        order[i] = s;
+    }
+    return n;
+}
+
+/* Find the elements in the first element of the section, which must be
+ * separated by nothing but whitespace.  A section that is not there is
+ * fine, it just has no elements. */
+static gboolean
+split_section(SplitDocument *split, guint s)
+{
+    const SectionInfo *info = section_info + s;
+    guint unit = split->unit;
+    gsize pos, end, namelen = strlen(info->child);
+    gchar *open, *close, *closechild;
+    TextSpan element;
+    gboolean ok = FALSE;
+
+    open = g_strconcat("<", info->name, NULL);
+    close = g_strconcat("</", info->name, NULL);
+    closechild = g_strconcat("</", info->child, ">", NULL);
+    if (!find_text(split, split->bom, open, &pos)) {
+        ok = TRUE;
+        goto end;
+    }
+    pos += strlen(open)*unit;
+    if (!match_at(split, pos, ">") && !space_at(split, pos))
+        goto end;
+    if (!find_text(split, pos, ">", &end))
+        goto end;
+    if (match_at(split, end - unit, "/")) {
+        ok = TRUE;
+        goto end;
+    }
+    pos = end + unit;
+    split->section[s].start = pos;
+    while (TRUE) {
+        while (pos < split->len && space_at(split, pos))
+            pos += unit;
+        if (match_at(split, pos, close)) {
+            split->section[s].end = pos;
+            ok = TRUE;
+            goto end;
+        }
+        if (!match_at(split, pos, "<")
+            || !match_at(split, pos + unit, info->child)
+            || !(match_at(split, pos + (namelen + 1)*unit, ">")
+                 || match_at(split, pos + (namelen + 1)*unit, "/")
+                 || space_at(split, pos + (namelen + 1)*unit))
+            || !find_text(split, pos, ">", &end))
+            goto end;
+        if (match_at(split, end - unit, "/"))
+            end += unit;
+        else if (find_text(split, end, closechild, &end))
+            end += strlen(closechild)*unit;
+        else
+            goto end;
+        element.start = pos;
+        element.end = end;
+        g_array_append_val(split->elements[s], element);
+        pos = end;
+    }
+
+end:
+    g_free(open);
+    g_free(close);
+    g_free(closechild);
+    return ok;
+}
+
+/* Worker: parse elements, each wrapped in the byte order mark and the
+ * Document start tag, until none are left.  Backgrounds are only parsed if
+ * the lookup does not know them.  Warnings about the start tag are left to
+ * the skeleton, which has it too. */
+static gpointer
+parse_elements(gpointer user_data)
+{
+    SplitDocument *split = (SplitDocument*)user_data;
+    xmlParserCtxt *ctxt = xmlNewParserCtxt();
+    GByteArray *buffer = g_byte_array_new();
+    const TextSpan *element;
+    guint i, k, s;
+
+    while ((k = g_atomic_int_add(&split->next, 1)) < split->nelements) {
+        for (s = 0, i = k; i >= split->elements[s]->len; s++)
+            i -= split->elements[s]->len;
+        element = &g_array_index(split->elements[s], TextSpan, i);
+        if (s == SECTION_BACKGROUNDS) {
+            split->checksums[k]
+                = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+                                              split->text + element->start,
+                                              element->end - element->start);
+            if ((split->known[k] = split->lookup(split->checksums[k])))
+                continue;
+        }
+        g_byte_array_set_size(buffer, 0);
+        g_byte_array_append(buffer, split->text, split->bom);
+        g_byte_array_append(buffer, split->text + split->root.start,
+                            split->root.end - split->root.start);
+        g_byte_array_append(buffer, split->text + element->start,
+                            element->end - element->start);
+        append_widened(buffer, "</Document>", split->unit);
+        if (ctxt)
+            split->docs[k] = xmlCtxtReadMemory(ctxt,
+                                               (const gchar*)buffer->data,
+                                               buffer->len, NULL,
+                                               split->encoding,
+                                               ANASYS_PARSE_OPTIONS
+                                               | XML_PARSE_NOWARNING);
+        if (split->docs[k]) {
+            xmlNode *node = anasys_parse_get_element(split->docs[k]);
+
+            /* Exactly the one element, of the expected name. */
+            if (!node || !strequal(node->name, section_info[s].child)
+                || xmlChildElementCount(node->parent) != 1) {
+                xmlFreeDoc(split->docs[k]);
+                split->docs[k] = NULL;
+            }
+        }
+    }
+    g_byte_array_free(buffer, TRUE);
+    xmlFreeParserCtxt(ctxt);
+    return NULL;
+}
+
+/* Each marker must be the only thing, besides whitespace, in its section
+ * element, which must be a child of the root. */
+static gboolean
+check_skeleton(const SplitDocument *split, xmlDoc *doc)
+{
+    xmlNode *root, *node, *child;
+    guint s, found[NSECTIONS];
+
+    if (!doc || !(root = xmlDocGetRootElement(doc)))
+        return FALSE;
+    for (s = 0; s < NSECTIONS; s++)
+        found[s] = 0;
+    for (node = root->children; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        for (s = 0; s < NSECTIONS; s++) {
+            if (!split->elements[s]->len
+                || !strequal(node->name, section_info[s].name))
+                continue;
+            for (child = node->children; child; child = child->next) {
+                if (child->type == XML_PI_NODE
+                    && strequal(child->name, section_info[s].marker))
+                    found[s]++;
+                else if (child->type != XML_TEXT_NODE)
+                    return FALSE;
+            }
+        }
+    }
+    for (s = 0; s < NSECTIONS; s++) {
+        if (found[s] != (split->elements[s]->len ? 1 : 0))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+append_widened(GByteArray *buffer, const gchar *ascii, guint unit)
+{
+    static const guint8 zero = 0;
+
+    while (*ascii) {
+        g_byte_array_append(buffer, (const guint8*)ascii, 1);
+        if (unit == 2)
+            g_byte_array_append(buffer, &zero, 1);
+        ascii++;
+    }
+}
+
+static gboolean
+match_at(const SplitDocument *split, gsize pos, const gchar *ascii)
+{
+    const guchar *t = split->text;
+    guint unit = split->unit;
+
+    for (; *ascii; ascii++, pos += unit) {
+        if (pos + unit > split->len || t[pos] != (guchar)*ascii
+            || (unit == 2 && t[pos+1]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+space_at(const SplitDocument *split, gsize pos)
+{
+    return (match_at(split, pos, " ") || match_at(split, pos, "\t")
+            || match_at(split, pos, "\r") || match_at(split, pos, "\n"));
+}
+
+/* Find ascii at a code unit boundary from from on. */
+static gboolean
+find_text(const SplitDocument *split, gsize from, const gchar *ascii,
+          gsize *pos)
+{
+    const guchar *p;
+
+    while (from < split->len) {
+        if (!(p = memchr(split->text + from, ascii[0], split->len - from)))
+            return FALSE;
+        from = p - split->text;
+        if ((from - split->bom) % split->unit == 0
+            && match_at(split, from, ascii)) {
+            *pos = from;
+            return TRUE;
+        }
+        from++;
+    }
+    return FALSE;
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,82 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Parsing of documents in parts, private to anasys_core.
+ *
+ * The whole (inflated) text is scanned for the elements of a few sections:
+ * the HeightMap elements in HeightMaps and the IRRenderedSpectra elements in
+ * RenderedSpectra, to parse large documents in parallel, and the
+ * IRBackground elements in Backgrounds, to skip those already known.  Each
+ * element is parsed as a document of its own, inside a copy of the Document
+ * start tag so that namespaces resolve.  The rest, the skeleton, is parsed
+ * with a processing instruction where the elements were cut out.  If
+ * anything about the split does not check out, the text is parsed whole
+ * instead.
+ */
+
+#ifndef __ANASYS_PARSE_H__
+#define __ANASYS_PARSE_H__
+
+#include <glib.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+G_BEGIN_DECLS
+
+/* Payloads of large channels are single text nodes well over the 10 MB
+ * libxml allows by default. */
+#define ANASYS_PARSE_OPTIONS (XML_PARSE_NOERROR | XML_PARSE_HUGE)
+
+/* Processing instructions standing for the elements cut out. */
+#define ANASYS_HEIGHT_MAPS_MARKER "anasys-height-maps"
+#define ANASYS_SPECTRA_MARKER "anasys-spectra"
+#define ANASYS_BACKGROUNDS_MARKER "anasys-backgrounds"
+
+/* Called from the parsing threads with the checksum of the text of each
+ * IRBackground.  Anything returned, owned by the caller, stands for the
+ * element, which is then not parsed. */
+typedef gpointer (*AnasysParseLookupFunc)(const gchar *checksum);
+
+/* An IRBackground cut out of the document, either parsed or known. */
+typedef struct {
+    gchar *checksum;
+    xmlDoc *doc;
+    gpointer known;
+} AnasysParsedBackground;
+
+G_GNUC_INTERNAL
+xmlDoc*  anasys_parse_document   (xmlParserCtxt *ctxt,
+                                  const gchar *filename,
+                                  gboolean parallel,
+                                  AnasysParseLookupFunc lookup,
+                                  GDestroyNotify release,
+                                  GPtrArray **height_maps,
+                                  GPtrArray **spectra,
+                                  GArray **backgrounds);
+G_GNUC_INTERNAL
+xmlNode* anasys_parse_get_element(xmlDoc *fragment);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,365 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Test of parsing documents in parts, run by make check.
+ *
+ * Synthetic documents well above the 4 MB below which documents are never
+ * split are written in each encoding the splitter knows, UTF-16 with and
+ * without byte order mark and UTF-8 with one, and with self-closing empty
+ * sections.  Each must really be split into its elements, and opening it
+ * in parallel, also with shared backgrounds, must give the same channels,
+ * spectra and backgrounds as opening it whole.
+ */
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include "anasys_core.h"
+#include "anasys_parse.h"
+#include "anasys_test_document.h"
+
+typedef struct {
+    const gchar *name;
+    AnasysTestDocument document;
+} TestCase;
+
+static gboolean check_split      (const gchar *filename,
+                                  const AnasysTestDocument *document);
+static gboolean check_same       (const gchar *filename,
+                                  const AnasysTestDocument *document,
+                                  AnasysOpenFlags flags);
+static gboolean compare_channels (const AnasysChannel *whole,
+                                  const AnasysChannel *split);
+static gboolean compare_spectra  (const AnasysSpectrum *whole,
+                                  const AnasysSpectrum *split);
+static gboolean compare_backgrounds(const AnasysBackground *whole,
+                                    const AnasysBackground *split);
+static gboolean compare_strings  (const gchar *a,
+                                  const gchar *b);
+
+static const TestCase cases[] = {
+    {
+        "utf16-bom.axd",
+        {
+            ANASYS_TEST_UTF16_BOM, FALSE, 4, 512, 512, 300, 200, 3,
+            FALSE, FALSE,
+        },
+    },
+    {
+        "utf16.axz",
+        {
+            ANASYS_TEST_UTF16, TRUE, 4, 512, 512, 300, 200, 3,
+            FALSE, FALSE,
+        },
+    },
+    {
+        "utf8-bom.axd",
+        {
+            ANASYS_TEST_UTF8_BOM, FALSE, 6, 512, 512, 300, 200, 3,
+            FALSE, FALSE,
+        },
+    },
+    {
+        "no-spectra.axd",
+        {
+            ANASYS_TEST_UTF16_BOM, FALSE, 4, 512, 512, 0, 0, 0,
+            TRUE, FALSE,
+        },
+    },
+    {
+        "no-channels.axz",
+        {
+            ANASYS_TEST_UTF8_BOM, TRUE, 0, 0, 0, 1000, 1000, 3,
+            TRUE, FALSE,
+        },
+    },
+};
+
+int
+main(void)
+{
+    static const AnasysOpenFlags flags[] = {
+        ANASYS_OPEN_PARALLEL,
+        ANASYS_OPEN_PARALLEL | ANASYS_OPEN_SHARE_BACKGROUNDS,
+    };
+    GError *error = NULL;
+    gchar *dirname, *filename;
+    gboolean ok = TRUE;
+    guint i, j;
+
+    if (!(dirname = g_dir_make_tmp("anasys-test-XXXXXX", &error))) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    for (i = 0; i < G_N_ELEMENTS(cases); i++) {
+        filename = g_build_filename(dirname, cases[i].name, NULL);
+        if (!anasys_test_document_write(&cases[i].document, filename)) {
+            g_printerr("%s: cannot write the test file\n", filename);
+            ok = FALSE;
+        }
+        else if (check_split(filename, &cases[i].document)) {
+            for (j = 0; j < G_N_ELEMENTS(flags); j++)
+                ok &= check_same(filename, &cases[i].document, flags[j]);
+        }
+        else
+            ok = FALSE;
+        g_unlink(filename);
+        g_free(filename);
+    }
+    g_rmdir(dirname);
+    g_free(dirname);
+    return ok ? 0 : 1;
+}
+
+/* The document must be split into all its elements, not fall back to
+ * being parsed whole. */
+static gboolean
+check_split(const gchar *filename, const AnasysTestDocument *document)
+{
+    xmlParserCtxt *ctxt;
+    xmlDoc *doc;
+    GPtrArray *height_maps, *spectra;
+    GArray *backgrounds;
+    gboolean ok = FALSE;
+
+    ctxt = xmlNewParserCtxt();
+    doc = anasys_parse_document(ctxt, filename, TRUE, NULL, NULL,
+                                &height_maps, &spectra, &backgrounds);
+    xmlFreeParserCtxt(ctxt);
+    if (!doc)
+        g_printerr("%s: not parsed\n", filename);
+    else if (!height_maps)
+        g_printerr("%s: parsed whole\n", filename);
+    else if (height_maps->len != document->nchannels
+             || spectra->len != document->nspectra)
+        g_printerr("%s: split into %u HeightMaps and %u IRRenderedSpectra "
+                   "instead of %u and %u\n", filename, height_maps->len,
+                   spectra->len, document->nchannels, document->nspectra);
+    else
+        ok = TRUE;
+    if (height_maps) {
+        g_ptr_array_free(height_maps, TRUE);
+        g_ptr_array_free(spectra, TRUE);
+        g_array_free(backgrounds, TRUE);
+    }
+    xmlFreeDoc(doc);
+    return ok;
+}
+
+static gboolean
+check_same(const gchar *filename, const AnasysTestDocument *document,
+           AnasysOpenFlags flags)
+{
+    AnasysFile *whole, *split;
+    GError *error = NULL;
+    gboolean ok = TRUE;
+    guint i, n;
+
+    if (!(whole = anasys_file_open(filename, &error))) {
+        g_printerr("%s: %s\n", filename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    if (!(split = anasys_file_open_full(filename, flags, &error))) {
+        g_printerr("%s: %s\n", filename, error->message);
+        g_error_free(error);
+        anasys_file_unref(whole);
+        return FALSE;
+    }
+
+    n = anasys_file_get_n_channels(whole);
+    if (n != document->nchannels || anasys_file_get_n_channels(split) != n) {
+        g_printerr("%s: %u and %u channels instead of %u\n", filename, n,
+                   anasys_file_get_n_channels(split), document->nchannels);
+        ok = FALSE;
+    }
+    for (i = 0; ok && i < n; i++) {
+        if (!compare_channels(anasys_file_get_channel(whole, i),
+                              anasys_file_get_channel(split, i))) {
+            g_printerr("%s: channel %u differs\n", filename, i);
+            ok = FALSE;
+        }
+    }
+
+    n = anasys_file_get_n_spectra(whole);
+    if (n != document->nspectra || anasys_file_get_n_spectra(split) != n) {
+        g_printerr("%s: %u and %u spectra instead of %u\n", filename, n,
+                   anasys_file_get_n_spectra(split), document->nspectra);
+        ok = FALSE;
+    }
+    for (i = 0; ok && i < n; i++) {
+        if (!compare_spectra(anasys_file_get_spectrum(whole, i),
+                             anasys_file_get_spectrum(split, i))) {
+            g_printerr("%s: spectrum %u differs\n", filename, i);
+            ok = FALSE;
+        }
+    }
+
+    n = anasys_file_get_n_backgrounds(whole);
+    if (n != document->nbackgrounds
+        || anasys_file_get_n_backgrounds(split) != n) {
+        g_printerr("%s: %u and %u backgrounds instead of %u\n", filename, n,
+                   anasys_file_get_n_backgrounds(split),
+                   document->nbackgrounds);
+        ok = FALSE;
+    }
+    for (i = 0; ok && i < n; i++) {
+        if (!compare_backgrounds(anasys_file_get_background(whole, i),
+                                 anasys_file_get_background(split, i))) {
+            g_printerr("%s: background %u differs\n", filename, i);
+            ok = FALSE;
+        }
+    }
+
+    anasys_file_unref(split);
+    anasys_file_unref(whole);
+    return ok;
+}
+
+static gboolean
+compare_channels(const AnasysChannel *whole, const AnasysChannel *split)
+{
+    const gchar *key1, *value1, *key2, *value2;
+    gdouble x1, y1, x2, y2;
+    guint xres1, yres1, xres2, yres2, i, n;
+    gfloat *data1, *data2;
+    gboolean ok;
+
+    if (!compare_strings(anasys_channel_get_data_channel(whole),
+                         anasys_channel_get_data_channel(split))
+        || !compare_strings(anasys_channel_get_label(whole),
+                            anasys_channel_get_label(split))
+        || !compare_strings(anasys_channel_get_unit(whole),
+                            anasys_channel_get_unit(split))
+        || anasys_channel_get_unit_multiplier(whole)
+           != anasys_channel_get_unit_multiplier(split)
+        || anasys_channel_get_scan_angle(whole)
+           != anasys_channel_get_scan_angle(split))
+        return FALSE;
+    anasys_channel_get_size(whole, &x1, &y1);
+    anasys_channel_get_size(split, &x2, &y2);
+    if (x1 != x2 || y1 != y2)
+        return FALSE;
+    anasys_channel_get_position(whole, &x1, &y1);
+    anasys_channel_get_position(split, &x2, &y2);
+    if (x1 != x2 || y1 != y2)
+        return FALSE;
+
+    n = anasys_channel_get_n_meta(whole);
+    if (anasys_channel_get_n_meta(split) != n)
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        anasys_channel_get_meta(whole, i, &key1, &value1);
+        anasys_channel_get_meta(split, i, &key2, &value2);
+        if (!compare_strings(key1, key2) || !compare_strings(value1, value2))
+            return FALSE;
+    }
+
+    anasys_channel_get_resolution(whole, &xres1, &yres1);
+    anasys_channel_get_resolution(split, &xres2, &yres2);
+    if (xres1 != xres2 || yres1 != yres2)
+        return FALSE;
+    data1 = g_new(gfloat, xres1*yres1);
+    data2 = g_new(gfloat, xres1*yres1);
+    ok = (anasys_channel_read_data(whole, data1, NULL)
+          && anasys_channel_read_data(split, data2, NULL)
+          && !memcmp(data1, data2, xres1*yres1*sizeof(gfloat)));
+    g_free(data1);
+    g_free(data2);
+    return ok;
+}
+
+static gboolean
+compare_spectra(const AnasysSpectrum *whole, const AnasysSpectrum *split)
+{
+    const AnasysBackground *background1, *background2;
+    gdouble x1, y1, x2, y2;
+    gfloat *data1, *data2;
+    gboolean ok;
+    guint n;
+
+    if (!compare_strings(anasys_spectrum_get_data_channel(whole),
+                         anasys_spectrum_get_data_channel(split))
+        || !compare_strings(anasys_spectrum_get_label(whole),
+                            anasys_spectrum_get_label(split))
+        || !compare_strings(anasys_spectrum_get_polarization(whole),
+                            anasys_spectrum_get_polarization(split)))
+        return FALSE;
+    anasys_spectrum_get_location(whole, &x1, &y1);
+    anasys_spectrum_get_location(split, &x2, &y2);
+    if (x1 != x2 || y1 != y2)
+        return FALSE;
+    anasys_spectrum_get_wavenumbers(whole, &x1, &y1);
+    anasys_spectrum_get_wavenumbers(split, &x2, &y2);
+    if (x1 != x2 || y1 != y2)
+        return FALSE;
+    background1 = anasys_spectrum_get_background(whole);
+    background2 = anasys_spectrum_get_background(split);
+    if (!background1 != !background2
+        || (background1
+            && !compare_strings(anasys_background_get_id(background1),
+                                anasys_background_get_id(background2))))
+        return FALSE;
+
+    n = anasys_spectrum_get_n_points(whole);
+    if (anasys_spectrum_get_n_points(split) != n)
+        return FALSE;
+    data1 = g_new(gfloat, n);
+    data2 = g_new(gfloat, n);
+    ok = (anasys_spectrum_read_data(whole, 0, n, data1, NULL)
+          && anasys_spectrum_read_data(split, 0, n, data2, NULL)
+          && !memcmp(data1, data2, n*sizeof(gfloat)));
+    g_free(data1);
+    g_free(data2);
+    return ok;
+}
+
+static gboolean
+compare_backgrounds(const AnasysBackground *whole,
+                    const AnasysBackground *split)
+{
+    const gchar *key1, *value1, *key2, *value2;
+    const gdouble *table1, *table2;
+    guint i, n, n1, n2;
+
+    n = anasys_background_get_n_meta(whole);
+    if (anasys_background_get_n_meta(split) != n)
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        anasys_background_get_meta(whole, i, &key1, &value1);
+        anasys_background_get_meta(split, i, &key2, &value2);
+        if (!compare_strings(key1, key2) || !compare_strings(value1, value2))
+            return FALSE;
+    }
+    table1 = anasys_background_find_array(whole, "Table", &n1);
+    table2 = anasys_background_find_array(split, "Table", &n2);
+    return (table1 && table2 && n1 == n2
+            && !memcmp(table1, table2, n1*sizeof(gdouble)));
+}
+
+static gboolean
+compare_strings(const gchar *a, const gchar *b)
+{
+    return !g_strcmp0(a, b);
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,549 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "anasys_core.h"
+#include "anasys_service.h"
+
+#ifdef G_OS_UNIX
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Longest request or answer line. */
+#define SERVICE_LINE_MAX 8192
+
+/* How often the service checks whether to stop, in milliseconds. */
+#define SERVICE_POLL_INTERVAL 500
+
+/* How long the service waits for a request, in seconds. */
+#define SERVICE_REQUEST_TIMEOUT 10
+
+/* A file known to the service, stamped with the size and modification time
+ * it had when opened.  While loading, the segment is being written and all
+ * others asking for the file wait.  Used is the time of the last request. */
+typedef struct {
+    gchar *filename;
+    gchar *segment;
+    guint64 file_size;
+    gint64 file_mtime;
+    guint64 size;
+    gint64 used;
+    gboolean loading;
+} ServiceEntry;
+
+/* The lock guards everything but the directory; the condition is signalled
+ * when a file is loaded and when a client is done. */
+typedef struct {
+    gchar *directory;
+    GHashTable *entries;
+    GMutex lock;
+    GCond cond;
+    guint64 limit;
+    guint64 total;
+    guint serial;
+    guint nclients;
+} Service;
+
+typedef struct {
+    Service *service;
+    gint fd;
+} ServiceClient;
+
+#ifdef G_OS_UNIX
+static gpointer      serve_client  (gpointer data);
+static gchar*        service_get   (Service *service,
+                                    const gchar *filename,
+                                    GError **error);
+static gboolean      write_segment (const gchar *filename,
+                                    const gchar *segment,
+                                    guint64 *size,
+                                    GError **error);
+static void          evict         (Service *service,
+                                    const ServiceEntry *keep);
+static void          entry_free    (gpointer p);
+static gint          listen_socket (const gchar *path,
+                                    GError **error);
+static gint          connect_socket(const gchar *path,
+                                    GError **error);
+static gboolean      fill_address  (struct sockaddr_un *addr,
+                                    const gchar *path,
+                                    GError **error);
+static gchar*        read_line     (gint fd);
+static gboolean      write_all     (gint fd,
+                                    const gchar *data,
+                                    gsize len);
+#endif
+
+static volatile gint stop_requested;
+
+/* The default socket, anasys/service.sock in the user's runtime
+ * directory. */
+gchar*
+anasys_service_get_socket_path(void)
+{
+    return g_build_filename(g_get_user_runtime_dir(), "anasys",
+                            "service.sock", NULL);
+}
+
+/* Make anasys_service_run() return soon.  It only sets a flag, so it can
+ * be called from signal handlers. */
+void
+anasys_service_stop(void)
+{
+    g_atomic_int_set(&stop_requested, 1);
+}
+
+/* Open a file through the service.  The service may remove the segment
+ * before it is opened, which then just fails like a missing service. */
+AnasysFile*
+anasys_service_open(const gchar *socket_path, const gchar *filename,
+                    GError **error)
+{
+    AnasysFile *file;
+    gchar *segment;
+
+    if (!(segment = anasys_service_lookup(socket_path, filename, error)))
+        return NULL;
+    file = anasys_file_open_segment(segment, error);
+    g_free(segment);
+    return file;
+}
+
+#ifdef G_OS_UNIX
+/* Serve requests on the socket, NULL for the default one, until
+ * anasys_service_stop(), keeping segments of at most limit bytes in total
+ * (G_MAXUINT64 for no limit) but always the last one.  Each request is
+ * served by a thread of its own, so known files are answered while others
+ * are opened.  It fails if the socket cannot be created, also when another
+ * service listens on it already.  All segments are removed on return. */
+gboolean
+anasys_service_run(const gchar *socket_path, guint64 limit, GError **error)
+{
+    Service service;
+    ServiceClient *client;
+    struct pollfd pfd;
+    struct timeval timeout;
+    gchar *path;
+    gint fd, cfd;
+
+    path = socket_path ? g_strdup(socket_path)
+                       : anasys_service_get_socket_path();
+    memset(&service, 0, sizeof(service));
+    service.directory = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(service.directory, 0700) != 0) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot create directory `%s'.", service.directory);
+        g_free(service.directory);
+        g_free(path);
+        return FALSE;
+    }
+    if ((fd = listen_socket(path, error)) < 0) {
+        g_free(service.directory);
+        g_free(path);
+        return FALSE;
+    }
+
+    service.entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            NULL, entry_free);
+    g_mutex_init(&service.lock);
+    g_cond_init(&service.cond);
+    service.limit = limit;
+    g_atomic_int_set(&stop_requested, 0);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    timeout.tv_sec = SERVICE_REQUEST_TIMEOUT;
+    timeout.tv_usec = 0;
+    while (!g_atomic_int_get(&stop_requested)) {
+        if (poll(&pfd, 1, SERVICE_POLL_INTERVAL) <= 0
+            || (cfd = accept(fd, NULL, NULL)) < 0)
+            continue;
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        client = g_new(ServiceClient, 1);
+        client->service = &service;
+        client->fd = cfd;
+        g_mutex_lock(&service.lock);
+        service.nclients++;
+        g_mutex_unlock(&service.lock);
+        g_thread_unref(g_thread_new("anasys-service", serve_client, client));
+    }
+    close(fd);
+    g_unlink(path);
+
+    g_mutex_lock(&service.lock);
+    while (service.nclients)
+        g_cond_wait(&service.cond, &service.lock);
+    g_mutex_unlock(&service.lock);
+    g_hash_table_destroy(service.entries);
+    g_mutex_clear(&service.lock);
+    g_cond_clear(&service.cond);
+    g_free(service.directory);
+    g_free(path);
+    return TRUE;
+}
+
+/* Ask the service on the socket, NULL for the default one, for the segment
+ * of a file, which it opens first if it does not know it yet.  Errors of
+ * the service come back as they were. */
+gchar*
+anasys_service_lookup(const gchar *socket_path, const gchar *filename,
+                      GError **error)
+{
+    gchar *path, *absolute, *request, *answer, *message, *segment = NULL;
+    glong code;
+    gint fd;
+
+    if (!(absolute = realpath(filename, NULL))) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot open file `%s'.", filename);
+        return NULL;
+    }
+    if (strchr(absolute, '\n')) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "File name `%s' cannot be sent to the service.",
+                    filename);
+        free(absolute);
+        return NULL;
+    }
+    path = socket_path ? g_strdup(socket_path)
+                       : anasys_service_get_socket_path();
+    fd = connect_socket(path, error);
+    g_free(path);
+    if (fd < 0) {
+        free(absolute);
+        return NULL;
+    }
+
+    request = g_strconcat("OPEN ", absolute, "\n", NULL);
+    free(absolute);
+    answer = NULL;
+    if (!write_all(fd, request, strlen(request))
+        || !(answer = read_line(fd)))
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "The service did not answer.");
+    else if (g_str_has_prefix(answer, "OK /"))
+        segment = g_strdup(answer + 3);
+    else if (g_str_has_prefix(answer, "ERROR ")
+             && (code = strtol(answer + 6, &message, 10)) >= ANASYS_ERROR_IO
+             && code <= ANASYS_ERROR_DATA && *message == ' ')
+        g_set_error(error, ANASYS_ERROR, code, "%s", message + 1);
+    else
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_FORMAT,
+                    "The service gave an invalid answer.");
+    close(fd);
+    g_free(request);
+    g_free(answer);
+    return segment;
+}
+
+static gpointer
+serve_client(gpointer data)
+{
+    ServiceClient *client = (ServiceClient*)data;
+    Service *service = client->service;
+    GError *error = NULL;
+    gchar *request, *segment = NULL, *answer;
+
+    request = read_line(client->fd);
+    if (!request || !g_str_has_prefix(request, "OPEN /"))
+        g_set_error(&error, ANASYS_ERROR, ANASYS_ERROR_FORMAT,
+                    "Invalid request.");
+    else
+        segment = service_get(service, request + 5, &error);
+    if (segment)
+        answer = g_strconcat("OK ", segment, "\n", NULL);
+    else
+        answer = g_strdup_printf("ERROR %d %s\n", error->code,
+                                 g_strdelimit(error->message, "\n", ' '));
+    write_all(client->fd, answer, strlen(answer));
+    close(client->fd);
+    g_clear_error(&error);
+    g_free(answer);
+    g_free(segment);
+    g_free(request);
+    g_free(client);
+
+    g_mutex_lock(&service->lock);
+    service->nclients--;
+    g_cond_broadcast(&service->cond);
+    g_mutex_unlock(&service->lock);
+    return NULL;
+}
+
+/* The segment of a file, opening it unless known and unchanged.  The lock
+ * is not held while the file is opened. */
+static gchar*
+service_get(Service *service, const gchar *filename, GError **error)
+{
+    ServiceEntry *entry;
+    GStatBuf st;
+    gchar *segment = NULL, *name;
+    gboolean ok;
+
+    if (g_stat(filename, &st) != 0) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot open file `%s'.", filename);
+        return NULL;
+    }
+
+    g_mutex_lock(&service->lock);
+    while ((entry = g_hash_table_lookup(service->entries, filename))
+           && entry->loading)
+        g_cond_wait(&service->cond, &service->lock);
+    if (entry && entry->file_size == (guint64)st.st_size
+        && entry->file_mtime == st.st_mtime) {
+        entry->used = g_get_monotonic_time();
+        segment = g_strdup(entry->segment);
+        g_mutex_unlock(&service->lock);
+        return segment;
+    }
+    if (entry) {
+        service->total -= entry->size;
+        g_hash_table_remove(service->entries, filename);
+    }
+    entry = g_new0(ServiceEntry, 1);
+    entry->filename = g_strdup(filename);
+    entry->file_size = st.st_size;
+    entry->file_mtime = st.st_mtime;
+    entry->loading = TRUE;
+    name = g_strdup_printf("segment-%ld-%u", (glong)getpid(),
+                           ++service->serial);
+    entry->segment = g_build_filename(service->directory, name, NULL);
+    g_free(name);
+    g_hash_table_insert(service->entries, entry->filename, entry);
+    g_mutex_unlock(&service->lock);
+
+    ok = write_segment(filename, entry->segment, &entry->size, error);
+
+    g_mutex_lock(&service->lock);
+    entry->loading = FALSE;
+    if (ok) {
+        entry->used = g_get_monotonic_time();
+        segment = g_strdup(entry->segment);
+        service->total += entry->size;
+        evict(service, entry);
+    }
+    else
+        g_hash_table_remove(service->entries, filename);
+    g_cond_broadcast(&service->cond);
+    g_mutex_unlock(&service->lock);
+    return segment;
+}
+
+/* Backgrounds are shared by all files the service opens. */
+static gboolean
+write_segment(const gchar *filename, const gchar *segment, guint64 *size,
+              GError **error)
+{
+    AnasysFile *file;
+    GStatBuf st;
+    gboolean ok;
+
+    if (!(file = anasys_file_open_full(filename,
+                                       ANASYS_OPEN_PARALLEL
+                                       | ANASYS_OPEN_SHARE_BACKGROUNDS,
+                                       error)))
+        return FALSE;
+    ok = anasys_file_write_segment(file, segment, error);
+    anasys_file_unref(file);
+    if (ok && g_stat(segment, &st) != 0) {
+        g_unlink(segment);
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot write file `%s'.", segment);
+        ok = FALSE;
+    }
+    if (ok)
+        *size = st.st_size;
+    return ok;
+}
+
+/* Forget the files used longest ago, all but keep and those loading, while
+ * the segments take more than the limit.  Called locked. */
+static void
+evict(Service *service, const ServiceEntry *keep)
+{
+    GHashTableIter iter;
+    ServiceEntry *entry, *oldest;
+    gpointer value;
+
+    while (service->total > service->limit) {
+        oldest = NULL;
+        g_hash_table_iter_init(&iter, service->entries);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            entry = (ServiceEntry*)value;
+            if (entry != keep && !entry->loading
+                && (!oldest || entry->used < oldest->used))
+                oldest = entry;
+        }
+        if (!oldest)
+            break;
+        service->total -= oldest->size;
+        g_hash_table_remove(service->entries, oldest->filename);
+    }
+}
+
+/* Processes having the segment open keep it until they close it. */
+static void
+entry_free(gpointer p)
+{
+    ServiceEntry *entry = (ServiceEntry*)p;
+
+    if (entry->size)
+        g_unlink(entry->segment);
+    g_free(entry->filename);
+    g_free(entry->segment);
+    g_free(entry);
+}
+
+/* A socket left behind by a service that is gone is replaced. */
+static gint
+listen_socket(const gchar *path, GError **error)
+{
+    struct sockaddr_un addr;
+    gint fd, saved_errno;
+
+    if (!fill_address(&addr, path, error))
+        return -1;
+    if ((fd = connect_socket(path, NULL)) >= 0) {
+        close(fd);
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "A service already listens on `%s'.", path);
+        return -1;
+    }
+    g_unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        saved_errno = errno;
+        if (fd >= 0)
+            close(fd);
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot listen on `%s': %s.", path,
+                    g_strerror(saved_errno));
+        return -1;
+    }
+    return fd;
+}
+
+static gint
+connect_socket(const gchar *path, GError **error)
+{
+    struct sockaddr_un addr;
+    gint fd;
+
+    if (!fill_address(&addr, path, error))
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (fd >= 0)
+            close(fd);
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Cannot connect to the service on `%s'.", path);
+        return -1;
+    }
+    return fd;
+}
+
+static gboolean
+fill_address(struct sockaddr_un *addr, const gchar *path, GError **error)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                    "Socket name `%s' is too long.", path);
+        return FALSE;
+    }
+    strcpy(addr->sun_path, path);
+    return TRUE;
+}
+
+/* A line without the newline, or NULL if the peer sends none. */
+static gchar*
+read_line(gint fd)
+{
+    GString *line = g_string_new(NULL);
+    gchar buffer[512], *newline;
+    gssize n;
+
+    while (line->len < SERVICE_LINE_MAX) {
+        if ((n = recv(fd, buffer, sizeof(buffer), 0)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        g_string_append_len(line, buffer, n);
+        if ((newline = memchr(line->str, '\n', line->len))) {
+            g_string_truncate(line, newline - line->str);
+            return g_string_free(line, FALSE);
+        }
+    }
+    g_string_free(line, TRUE);
+    return NULL;
+}
+
+static gboolean
+write_all(gint fd, const gchar *data, gsize len)
+{
+    gssize n;
+
+    while (len) {
+        if ((n = send(fd, data, len, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        data += n;
+        len -= n;
+    }
+    return TRUE;
+}
+#else
+gboolean
+anasys_service_run(G_GNUC_UNUSED const gchar *socket_path,
+                   G_GNUC_UNUSED guint64 limit,
+                   GError **error)
+{
+    g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                "The service needs Unix sockets.");
+    return FALSE;
+}
+
+gchar*
+anasys_service_lookup(G_GNUC_UNUSED const gchar *socket_path,
+                      G_GNUC_UNUSED const gchar *filename,
+                      GError **error)
+{
+    g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_IO,
+                "The service needs Unix sockets.");
+    return NULL;
+}
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
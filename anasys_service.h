@@ -0,0 +1,67 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * A local service opening files once for all processes of a user.
+ *
+ * The service, run by anasys-service, listens on a Unix socket, by default
+ * anasys/service.sock in the user's runtime directory, which only the user
+ * can reach.  Asked for a file, it opens it, writes it with all payloads
+ * decoded into a segment (see anasys_file_write_segment()) next to the
+ * socket and answers with the name of the segment.  Asked again while the
+ * file has the same size and modification time, it answers at once.  The
+ * segments used longest ago are removed beyond a limit on their total
+ * size; processes that have them open keep them until they close them.
+ *
+ * anasys_service_open() asks the service and opens the segment, so that a
+ * file already known costs a round trip on the socket and a mapping; the
+ * processes opening it share the same pages.  It fails when no service is
+ * running, and callers are expected to open the file the usual way then.
+ *
+ * The protocol is a line "OPEN <absolute file name>" answered by a line
+ * "OK <segment>" or "ERROR <message>", a connection per request.
+ */
+
+#ifndef __ANASYS_SERVICE_H__
+#define __ANASYS_SERVICE_H__
+
+#include <glib.h>
+#include "anasys_core.h"
+
+G_BEGIN_DECLS
+
+gchar*      anasys_service_get_socket_path(void);
+gboolean    anasys_service_run            (const gchar *socket_path,
+                                           guint64 limit,
+                                           GError **error);
+void        anasys_service_stop           (void);
+gchar*      anasys_service_lookup         (const gchar *socket_path,
+                                           const gchar *filename,
+                                           GError **error);
+AnasysFile* anasys_service_open           (const gchar *socket_path,
+                                           const gchar *filename,
+                                           GError **error);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,84 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * anasys-service [-s SOCKET] [-m MEGABYTES]
+ *     Open files for the processes of the user once and hand them out
+ *     decoded in shared segments, until interrupted.  SOCKET defaults to
+ *     anasys/service.sock in the user's runtime directory; the segments,
+ *     next to it, take at most MEGABYTES (default unlimited) besides the
+ *     last one.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "anasys_core.h"
+#include "anasys_service.h"
+
+static void stop (int signum);
+
+int
+main(int argc, char *argv[])
+{
+    const gchar *socket_path = NULL;
+    guint64 limit = G_MAXUINT64;
+    GError *error = NULL;
+    gchar *end;
+    gint i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-s"))
+            socket_path = argv[i+1];
+        else if (!strcmp(argv[i], "-m")) {
+            limit = g_ascii_strtoull(argv[i+1], &end, 10);
+            if (end == argv[i+1] || *end || limit > G_MAXUINT64 >> 20)
+                break;
+            limit <<= 20;
+        }
+        else
+            break;
+    }
+    if (i < argc) {
+        fprintf(stderr, "Usage: %s [-s SOCKET] [-m MEGABYTES]\n", argv[0]);
+        return 2;
+    }
+
+    anasys_init();
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    if (!anasys_service_run(socket_path, limit, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+stop(G_GNUC_UNUSED int signum)
+{
+    anasys_service_stop();
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,389 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include "anasys_core.h"
+#include "anasys_spectral.h"
+
+typedef struct {
+    guint file;
+    guint spectrum;
+    gdouble x;
+    gdouble y;
+} SpectralRow;
+
+/* Row r of data starts at r*npoints. */
+struct _AnasysSpectralMatrix {
+    gchar **files;
+    guint npoints;
+    gdouble start;
+    gdouble end;
+    GArray *rows;
+    gfloat *data;
+};
+
+/* Where the grid points fall in spectra with this axis: grid point k lies
+ * between decoded points index[k] and index[k]+1, at frac[k] of the way,
+ * or outside if index[k] is negative.  Only points from to to-1 are
+ * decoded, index counting from there.  The tables are set up for the axis
+ * only once valid is set. */
+typedef struct {
+    gboolean valid;
+    gdouble start;
+    gdouble end;
+    guint n;
+    guint from;
+    guint to;
+    gint *index;
+    gfloat *frac;
+} SpectralAxis;
+
+/* The rows of one file, gathered by a worker. */
+typedef struct {
+    GArray *rows;
+    GArray *values;
+    GError *error;
+} SpectralBlock;
+
+typedef struct {
+    const gchar *const *filenames;
+    guint nfiles;
+    const gchar *datachannel;
+    const gdouble *grid;
+    guint npoints;
+    SpectralBlock *blocks;
+    volatile gint next;
+} SpectralJob;
+
+static gpointer read_files        (gpointer user_data);
+static void     read_file         (const SpectralJob *job,
+                                   guint i,
+                                   SpectralAxis *axis,
+                                   GArray *buffer);
+static void     axis_setup        (SpectralAxis *axis,
+                                   const gdouble *grid,
+                                   guint npoints);
+static void     resample          (const SpectralAxis *axis,
+                                   const gfloat *values,
+                                   gfloat *row,
+                                   guint npoints);
+
+/* Read the spectra of the files, those with the DataChannel only unless it
+ * is NULL, resampled onto npoints wavenumbers from start to end.  Fails if
+ * any file cannot be read. */
+AnasysSpectralMatrix*
+anasys_spectral_matrix_read(const gchar *const *filenames, guint nfiles,
+                            const gchar *datachannel,
+                            gdouble start, gdouble end, guint npoints,
+                            GError **error)
+{
+    AnasysSpectralMatrix *matrix;
+    SpectralJob job;
+    SpectralBlock *block;
+    gdouble *grid;
+    gsize nrows = 0, r;
+    guint i, k;
+
+    g_return_val_if_fail(npoints > 0, NULL);
+    g_return_val_if_fail(isfinite(start) && isfinite(end), NULL);
+    grid = g_new(gdouble, npoints);
+    for (k = 0; k < npoints; k++)
+        grid[k] = (npoints > 1) ? start + k*(end - start)/(npoints - 1.0)
+                                : start;
+
+    memset(&job, 0, sizeof(job));
+    job.filenames = filenames;
+    job.nfiles = nfiles;
+    job.datachannel = datachannel;
+    job.grid = grid;
+    job.npoints = npoints;
+    job.blocks = g_new0(SpectralBlock, MAX(nfiles, 1));
+    anasys_run_workers(read_files, &job, nfiles);
+    g_free(grid);
+
+    matrix = g_new0(AnasysSpectralMatrix, 1);
+    matrix->npoints = npoints;
+    matrix->start = start;
+    matrix->end = end;
+    matrix->files = g_new0(gchar*, nfiles + 1);
+    matrix->rows = g_array_new(FALSE, FALSE, sizeof(SpectralRow));
+    for (i = 0; i < nfiles; i++) {
+        matrix->files[i] = g_strdup(filenames[i]);
+        block = job.blocks + i;
+        if (block->error && error && !*error)
+            g_propagate_error(error, block->error);
+        else if (block->error)
+            g_error_free(block->error);
+        block->error = NULL;
+        if (block->rows)
+            nrows += block->rows->len;
+    }
+    if (error && *error)
+        goto fail;
+    if (nrows <= G_MAXSIZE/sizeof(gfloat)/npoints)
+        matrix->data = g_try_new(gfloat, MAX(nrows*npoints, 1));
+    if (!matrix->data) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                    "Cannot allocate a matrix of %" G_GSIZE_FORMAT
+                    " spectra of %u points.", nrows, npoints);
+        goto fail;
+    }
+
+    /* The files are done, their rows only have to be put together. */
+    for (i = r = 0; i < nfiles; i++) {
+        block = job.blocks + i;
+        if (!block->rows)
+            continue;
+        if (block->rows->len) {
+            g_array_append_vals(matrix->rows, block->rows->data,
+                                block->rows->len);
+            memcpy(matrix->data + r*npoints, block->values->data,
+                   (gsize)block->rows->len*npoints*sizeof(gfloat));
+            r += block->rows->len;
+        }
+        g_array_free(block->rows, TRUE);
+        g_array_free(block->values, TRUE);
+    }
+    g_free(job.blocks);
+    return matrix;
+
+fail:
+    for (i = 0; i < nfiles; i++) {
+        if (job.blocks[i].rows) {
+            g_array_free(job.blocks[i].rows, TRUE);
+            g_array_free(job.blocks[i].values, TRUE);
+        }
+    }
+    g_free(job.blocks);
+    anasys_spectral_matrix_free(matrix);
+    return NULL;
+}
+
+void
+anasys_spectral_matrix_free(AnasysSpectralMatrix *matrix)
+{
+    if (!matrix)
+        return;
+    g_strfreev(matrix->files);
+    g_array_free(matrix->rows, TRUE);
+    g_free(matrix->data);
+    g_free(matrix);
+}
+
+guint
+anasys_spectral_matrix_get_n_rows(const AnasysSpectralMatrix *matrix)
+{
+    return matrix->rows->len;
+}
+
+guint
+anasys_spectral_matrix_get_n_points(const AnasysSpectralMatrix *matrix)
+{
+    return matrix->npoints;
+}
+
+/* Wavenumbers of the first and last point of the common grid. */
+void
+anasys_spectral_matrix_get_wavenumbers(const AnasysSpectralMatrix *matrix,
+                                       gdouble *start, gdouble *end)
+{
+    if (start)
+        *start = matrix->start;
+    if (end)
+        *end = matrix->end;
+}
+
+/* All rows, row r starting at r*npoints. */
+const gfloat*
+anasys_spectral_matrix_get_data(const AnasysSpectralMatrix *matrix)
+{
+    return matrix->data;
+}
+
+const gchar*
+anasys_spectral_matrix_get_file(const AnasysSpectralMatrix *matrix,
+                                guint row)
+{
+    g_return_val_if_fail(row < matrix->rows->len, NULL);
+    return matrix->files[g_array_index(matrix->rows, SpectralRow,
+                                       row).file];
+}
+
+/* Index of the spectrum of the row in its file, as for
+ * anasys_file_get_spectrum(). */
+guint
+anasys_spectral_matrix_get_spectrum(const AnasysSpectralMatrix *matrix,
+                                    guint row)
+{
+    g_return_val_if_fail(row < matrix->rows->len, 0);
+    return g_array_index(matrix->rows, SpectralRow, row).spectrum;
+}
+
+void
+anasys_spectral_matrix_get_location(const AnasysSpectralMatrix *matrix,
+                                    guint row, gdouble *x, gdouble *y)
+{
+    const SpectralRow *r;
+
+    g_return_if_fail(row < matrix->rows->len);
+    r = &g_array_index(matrix->rows, SpectralRow, row);
+    if (x)
+        *x = r->x;
+    if (y)
+        *y = r->y;
+}
+
+/* Spectral worker: take the next file until there are none left.  The
+ * axis is kept from spectrum to spectrum, which mostly share it. */
+static gpointer
+read_files(gpointer user_data)
+{
+    SpectralJob *job = (SpectralJob*)user_data;
+    SpectralAxis axis;
+    GArray *buffer = g_array_new(FALSE, FALSE, sizeof(gfloat));
+    guint i;
+
+    memset(&axis, 0, sizeof(axis));
+    axis.index = g_new(gint, job->npoints);
+    axis.frac = g_new(gfloat, job->npoints);
+    while ((i = g_atomic_int_add(&job->next, 1)) < job->nfiles)
+        read_file(job, i, &axis, buffer);
+    g_free(axis.index);
+    g_free(axis.frac);
+    g_array_free(buffer, TRUE);
+    return NULL;
+}
+
+static void
+read_file(const SpectralJob *job, guint i, SpectralAxis *axis,
+          GArray *buffer)
+{
+    SpectralBlock *block = job->blocks + i;
+    const AnasysSpectrum *spectrum;
+    AnasysFile *file;
+    SpectralRow row;
+    gdouble start, end;
+    guint k, n, len;
+
+    if (!(file = anasys_file_open(job->filenames[i], &block->error)))
+        return;
+    block->rows = g_array_new(FALSE, FALSE, sizeof(SpectralRow));
+    block->values = g_array_new(FALSE, FALSE, sizeof(gfloat));
+    row.file = i;
+    for (k = 0; k < anasys_file_get_n_spectra(file); k++) {
+        spectrum = anasys_file_get_spectrum(file, k);
+        if (job->datachannel
+            && g_strcmp0(anasys_spectrum_get_data_channel(spectrum),
+                         job->datachannel))
+            continue;
+        anasys_spectrum_get_wavenumbers(spectrum, &start, &end);
+        n = anasys_spectrum_get_n_points(spectrum);
+        if (!axis->valid
+            || start != axis->start || end != axis->end || n != axis->n) {
+            axis->start = start;
+            axis->end = end;
+            axis->n = n;
+            axis_setup(axis, job->grid, job->npoints);
+            axis->valid = TRUE;
+        }
+        /* One more value repeating the last, for grid points right on the
+         * last point, and at least two for resample() to read. */
+        len = axis->to - axis->from;
+        g_array_set_size(buffer, MAX(len + 1, 2));
+        if (!len)
+            memset(buffer->data, 0, 2*sizeof(gfloat));
+        else if (anasys_spectrum_read_data(spectrum, axis->from, axis->to,
+                                           (gfloat*)buffer->data,
+                                           &block->error))
+            g_array_index(buffer, gfloat, len) = g_array_index(buffer, gfloat,
+                                                               len - 1);
+        else {
+            g_prefix_error(&block->error, "%s: ", job->filenames[i]);
+            break;
+        }
+        row.spectrum = k;
+        anasys_spectrum_get_location(spectrum, &row.x, &row.y);
+        g_array_append_val(block->rows, row);
+        g_array_set_size(block->values, block->values->len + job->npoints);
+        resample(axis, (const gfloat*)buffer->data,
+                 &g_array_index(block->values, gfloat,
+                                block->values->len - job->npoints),
+                 job->npoints);
+    }
+    anasys_file_unref(file);
+}
+
+/* Locate the grid points among the points of the axis, which may run
+ * either way. */
+static void
+axis_setup(SpectralAxis *axis, const gdouble *grid, guint npoints)
+{
+    gdouble step = 0.0, t;
+    guint k, i, from = G_MAXUINT, to = 0;
+
+    if (axis->n > 1)
+        step = (axis->end - axis->start)/(axis->n - 1.0);
+    for (k = 0; k < npoints; k++) {
+        if (step != 0.0)
+            t = (grid[k] - axis->start)/step;
+        else
+            t = (axis->n && grid[k] == axis->start) ? 0.0 : -1.0;
+        if (!(t >= 0.0 && t <= axis->n - 1.0)) {
+            axis->index[k] = -1;
+            axis->frac[k] = 0.0;
+            continue;
+        }
+        i = MIN((guint)t, axis->n - 1);
+        axis->index[k] = i;
+        axis->frac[k] = (i < axis->n - 1) ? t - i : 0.0;
+        from = MIN(from, i);
+        to = MAX(to, MIN(i + 2, axis->n));
+    }
+    axis->from = (to > 0) ? from : 0;
+    axis->to = to;
+    for (k = 0; k < npoints; k++) {
+        if (axis->index[k] >= 0)
+            axis->index[k] -= axis->from;
+    }
+}
+
+/* A gather and a multiply-add per grid point, with nothing in the loop
+ * depending on the previous point, so that it vectorises. */
+static void
+resample(const SpectralAxis *axis, const gfloat *values, gfloat *row,
+         guint npoints)
+{
+    const gint *index = axis->index;
+    const gfloat *frac = axis->frac;
+    guint k;
+    gint i;
+
+    for (k = 0; k < npoints; k++) {
+        i = MAX(index[k], 0);
+        row[k] = values[i] + frac[k]*(values[i+1] - values[i]);
+        if (index[k] < 0)
+            row[k] = NAN;
+    }
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
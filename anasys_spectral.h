@@ -0,0 +1,70 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * IRRenderedSpectra of many files gathered into one matrix.
+ *
+ * Spectra from different sessions have their own StartWavenumber,
+ * EndWavenumber and number of points.  A spectral matrix holds them all
+ * resampled onto one common grid of wavenumbers given by the caller, a row
+ * per spectrum, rows of a file consecutive and in file order.  Values are
+ * interpolated linearly; grid points outside the range of a spectrum are
+ * NaN.  The files are read in parallel, each spectrum resampled as it is
+ * decoded, and only the part of its payload the grid covers is decoded.
+ */
+
+#ifndef __ANASYS_SPECTRAL_H__
+#define __ANASYS_SPECTRAL_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _AnasysSpectralMatrix AnasysSpectralMatrix;
+
+AnasysSpectralMatrix* anasys_spectral_matrix_read(const gchar *const *filenames,
+                                                  guint nfiles,
+                                                  const gchar *datachannel,
+                                                  gdouble start,
+                                                  gdouble end,
+                                                  guint npoints,
+                                                  GError **error);
+void          anasys_spectral_matrix_free        (AnasysSpectralMatrix *matrix);
+guint         anasys_spectral_matrix_get_n_rows  (const AnasysSpectralMatrix *matrix);
+guint         anasys_spectral_matrix_get_n_points(const AnasysSpectralMatrix *matrix);
+void          anasys_spectral_matrix_get_wavenumbers(const AnasysSpectralMatrix *matrix,
+                                                     gdouble *start,
+                                                     gdouble *end);
+const gfloat* anasys_spectral_matrix_get_data    (const AnasysSpectralMatrix *matrix);
+const gchar*  anasys_spectral_matrix_get_file    (const AnasysSpectralMatrix *matrix,
+                                                  guint row);
+guint         anasys_spectral_matrix_get_spectrum(const AnasysSpectralMatrix *matrix,
+                                                  guint row);
+void          anasys_spectral_matrix_get_location(const AnasysSpectralMatrix *matrix,
+                                                  guint row,
+                                                  gdouble *x,
+                                                  gdouble *y);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,380 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "anasys_core.h"
+#include "anasys_stack.h"
+
+#ifdef G_OS_WIN32
+#include <malloc.h>
+#endif
+
+/* Alignment of the buffer and of each plane: a cache line, and the widest
+ * vector loads. */
+#define STACK_ALIGN 64
+
+/* Channels are decoded this many bytes, but at least a row, at a time. */
+#define STACK_CHUNK (1 << 20)
+
+/* Resolution is that of the stack, turned when oriented.  Planes are
+ * stride values apart. */
+struct _AnasysStack {
+    AnasysStackFlags flags;
+    guint n;
+    guint *channels;
+    guint xres;
+    guint yres;
+    gsize stride;
+    gfloat *data;
+};
+
+/* Value j of row i of a scan goes to pixel base + i*si + j*sj of the
+ * stack, whose rows are the scan columns if transposed. */
+typedef struct {
+    gssize base;
+    gssize si;
+    gssize sj;
+    gboolean transposed;
+} StackMapping;
+
+/* Work item k decodes block k % nblocks of channel k / nblocks. */
+typedef struct {
+    AnasysStack *stack;
+    const AnasysChannel **sources;
+    StackMapping map;
+    guint xres;
+    guint yres;
+    guint block_rows;
+    guint nblocks;
+    guint nitems;
+    volatile gint next;
+    GError **errors;
+} StackJob;
+
+static gboolean     coregistered      (const AnasysChannel *a,
+                                       const AnasysChannel *b);
+static StackMapping stack_mapping     (guint xres,
+                                       guint yres,
+                                       gdouble scan_angle,
+                                       gboolean oriented);
+static gpointer     decode_blocks     (gpointer user_data);
+static gfloat*      stack_alloc       (gsize size);
+static void         stack_free_data   (gfloat *p);
+
+/* Indices of the channels co-registered with channel i, itself included,
+ * in file order. */
+GArray*
+anasys_stack_find_channels(const AnasysFile *file, guint i)
+{
+    const AnasysChannel *channel;
+    GArray *indices;
+    guint k, n = anasys_file_get_n_channels(file);
+
+    g_return_val_if_fail(i < n, NULL);
+    channel = anasys_file_get_channel(file, i);
+    indices = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (k = 0; k < n; k++) {
+        if (coregistered(channel, anasys_file_get_channel(file, k)))
+            g_array_append_val(indices, k);
+    }
+    return indices;
+}
+
+/* Decode n co-registered channels, given by their indices, into a stack.
+ * Planes are in the order given. */
+AnasysStack*
+anasys_stack_read(const AnasysFile *file, const guint *channels, guint n,
+                  AnasysStackFlags flags, GError **error)
+{
+    AnasysStack *stack;
+    StackJob job;
+    gsize npixels;
+    guint xres, yres, k;
+    gboolean ok = TRUE;
+
+    g_return_val_if_fail(n > 0, NULL);
+    for (k = 0; k < n; k++) {
+        g_return_val_if_fail(channels[k] < anasys_file_get_n_channels(file),
+                             NULL);
+    }
+    memset(&job, 0, sizeof(job));
+    job.sources = g_new(const AnasysChannel*, n);
+    for (k = 0; k < n; k++) {
+        job.sources[k] = anasys_file_get_channel(file, channels[k]);
+        if (!coregistered(job.sources[0], job.sources[k])) {
+            g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                        "Channel %u is not co-registered with channel %u.",
+                        anasys_channel_get_id(job.sources[k]),
+                        anasys_channel_get_id(job.sources[0]));
+            g_free(job.sources);
+            return NULL;
+        }
+    }
+
+    anasys_channel_get_resolution(job.sources[0], &xres, &yres);
+    npixels = (gsize)xres*yres;
+    stack = g_new0(AnasysStack, 1);
+    stack->flags = flags;
+    stack->n = n;
+    stack->channels = g_new(guint, n);
+    memcpy(stack->channels, channels, n*sizeof(guint));
+    job.map = stack_mapping(xres, yres,
+                            anasys_channel_get_scan_angle(job.sources[0]),
+                            flags & ANASYS_STACK_ORIENTED);
+    stack->xres = job.map.transposed ? yres : xres;
+    stack->yres = job.map.transposed ? xres : yres;
+    stack->stride = npixels;
+    if (!(flags & ANASYS_STACK_INTERLEAVED)) {
+        k = STACK_ALIGN/sizeof(gfloat);
+        stack->stride = (npixels + k-1)/k*k;
+    }
+    if (stack->stride <= G_MAXSIZE/sizeof(gfloat)/n)
+        stack->data = stack_alloc(stack->stride*n*sizeof(gfloat));
+    if (!stack->data) {
+        g_set_error(error, ANASYS_ERROR, ANASYS_ERROR_DATA,
+                    "Cannot allocate a stack of %u channels of %ux%u.",
+                    n, xres, yres);
+        g_free(job.sources);
+        anasys_stack_free(stack);
+        return NULL;
+    }
+
+    job.stack = stack;
+    job.xres = xres;
+    job.yres = yres;
+    job.block_rows = CLAMP(STACK_CHUNK/(xres*sizeof(gfloat)), 1, yres);
+    job.nblocks = (yres + job.block_rows-1)/job.block_rows;
+    job.nitems = n*job.nblocks;
+    job.errors = g_new0(GError*, job.nitems);
+    anasys_run_workers(decode_blocks, &job, job.nitems);
+
+    for (k = 0; k < job.nitems; k++) {
+        if (job.errors[k] && ok) {
+            g_propagate_error(error, job.errors[k]);
+            ok = FALSE;
+        }
+        else if (job.errors[k])
+            g_error_free(job.errors[k]);
+    }
+    g_free(job.errors);
+    g_free(job.sources);
+    if (!ok) {
+        anasys_stack_free(stack);
+        return NULL;
+    }
+    return stack;
+}
+
+void
+anasys_stack_free(AnasysStack *stack)
+{
+    if (!stack)
+        return;
+    stack_free_data(stack->data);
+    g_free(stack->channels);
+    g_free(stack);
+}
+
+guint
+anasys_stack_get_n_channels(const AnasysStack *stack)
+{
+    return stack->n;
+}
+
+/* Index in the file of the channel in plane k. */
+guint
+anasys_stack_get_channel(const AnasysStack *stack, guint k)
+{
+    g_return_val_if_fail(k < stack->n, 0);
+    return stack->channels[k];
+}
+
+/* Resolution of the planes, swapped from that of the channels when they
+ * were turned by 90 degrees. */
+void
+anasys_stack_get_resolution(const AnasysStack *stack,
+                            guint *xres, guint *yres)
+{
+    if (xres)
+        *xres = stack->xres;
+    if (yres)
+        *yres = stack->yres;
+}
+
+AnasysStackFlags
+anasys_stack_get_flags(const AnasysStack *stack)
+{
+    return stack->flags;
+}
+
+/* The whole buffer.  Interleaved, the value of plane k at pixel p is
+ * data[p*n + k]. */
+const gfloat*
+anasys_stack_get_data(const AnasysStack *stack)
+{
+    return stack->data;
+}
+
+/* Plane k of a planar stack, aligned like the buffer, or NULL for an
+ * interleaved one. */
+const gfloat*
+anasys_stack_get_plane(const AnasysStack *stack, guint k)
+{
+    g_return_val_if_fail(k < stack->n, NULL);
+    if (stack->flags & ANASYS_STACK_INTERLEAVED)
+        return NULL;
+    return stack->data + k*stack->stride;
+}
+
+/* Same Resolution, Size, Position and ScanAngle.  The values come from the
+ * same kind of text, so they are compared exactly. */
+static gboolean
+coregistered(const AnasysChannel *a, const AnasysChannel *b)
+{
+    guint axres, ayres, bxres, byres;
+    gdouble ax, ay, bx, by;
+
+    anasys_channel_get_resolution(a, &axres, &ayres);
+    anasys_channel_get_resolution(b, &bxres, &byres);
+    if (axres != bxres || ayres != byres
+        || anasys_channel_get_scan_angle(a)
+           != anasys_channel_get_scan_angle(b))
+        return FALSE;
+    anasys_channel_get_size(a, &ax, &ay);
+    anasys_channel_get_size(b, &bx, &by);
+    if (ax != bx || ay != by)
+        return FALSE;
+    anasys_channel_get_position(a, &ax, &ay);
+    anasys_channel_get_position(b, &bx, &by);
+    return ax == bx && ay == by;
+}
+
+/* The flips and turns the module does with orient_field(): rows reversed
+ * at 0 degrees, columns at 180, and at 90 and -90 the data rotated
+ * anticlockwise and clockwise and then rows reversed. */
+static StackMapping
+stack_mapping(guint xres, guint yres, gdouble scan_angle, gboolean oriented)
+{
+    StackMapping map;
+
+    map.base = 0;
+    map.si = xres;
+    map.sj = 1;
+    map.transposed = FALSE;
+    if (!oriented)
+        return map;
+    if (scan_angle == 0.0) {
+        map.base = (gssize)(yres - 1)*xres;
+        map.si = -(gssize)xres;
+    }
+    else if (scan_angle == 180.0) {
+        map.base = xres - 1;
+        map.sj = -1;
+    }
+    else if (scan_angle == 90.0) {
+        map.si = 1;
+        map.sj = yres;
+        map.transposed = TRUE;
+    }
+    else if (scan_angle == -90.0) {
+        map.base = (gssize)(xres - 1)*yres + yres - 1;
+        map.si = -1;
+        map.sj = -(gssize)yres;
+        map.transposed = TRUE;
+    }
+    return map;
+}
+
+/* Stack worker: take the next block of rows until there are none left.
+ * Rows that stay rows of a plane are decoded in place, the rest through a
+ * buffer. */
+static gpointer
+decode_blocks(gpointer user_data)
+{
+    StackJob *job = (StackJob*)user_data;
+    AnasysStack *stack = job->stack;
+    gfloat *buffer = NULL, *plane;
+    const gfloat *row;
+    gssize pix;
+    guint k, c, i, j, i0, nrows, n = stack->n;
+    gboolean interleaved = stack->flags & ANASYS_STACK_INTERLEAVED;
+
+    while ((k = g_atomic_int_add(&job->next, 1)) < job->nitems) {
+        c = k/job->nblocks;
+        i0 = (k % job->nblocks)*job->block_rows;
+        nrows = MIN(job->block_rows, job->yres - i0);
+        plane = stack->data + c*stack->stride;
+        if (!interleaved && !job->map.transposed
+            && job->map.base == 0 && job->map.sj == 1) {
+            anasys_channel_read_rows(job->sources[c], i0, nrows,
+                                     plane + (gsize)i0*job->xres,
+                                     job->errors + k);
+            continue;
+        }
+        if (!buffer)
+            buffer = g_new(gfloat, (gsize)job->block_rows*job->xres);
+        if (!anasys_channel_read_rows(job->sources[c], i0, nrows, buffer,
+                                      job->errors + k))
+            continue;
+        for (i = 0; i < nrows; i++) {
+            row = buffer + (gsize)i*job->xres;
+            pix = job->map.base + (gssize)(i0 + i)*job->map.si;
+            if (interleaved) {
+                for (j = 0; j < job->xres; j++, pix += job->map.sj)
+                    stack->data[pix*n + c] = row[j];
+            }
+            else {
+                for (j = 0; j < job->xres; j++, pix += job->map.sj)
+                    plane[pix] = row[j];
+            }
+        }
+    }
+    g_free(buffer);
+    return NULL;
+}
+
+static gfloat*
+stack_alloc(gsize size)
+{
+    gpointer p;
+
+#ifdef G_OS_WIN32
+    p = _aligned_malloc(MAX(size, 1), STACK_ALIGN);
+#else
+    if (posix_memalign(&p, STACK_ALIGN, MAX(size, 1)))
+        p = NULL;
+#endif
+    return (gfloat*)p;
+}
+
+static void
+stack_free_data(gfloat *p)
+{
+#ifdef G_OS_WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
@@ -0,0 +1,75 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Co-registered channels of a file decoded into one buffer.
+ *
+ * The HeightMaps of one scan, height, deflection, IR amplitude and so on,
+ * share their Position, Size, Resolution and ScanAngle.  A stack holds such
+ * channels in a single allocation aligned to 64 bytes, either plane after
+ * plane, each plane aligned too, or interleaved, the values of all channels
+ * at a pixel next to each other.  With ANASYS_STACK_ORIENTED the data are
+ * turned for the ScanAngle as Gwyddion shows them, first row at the top;
+ * the mapping is worked out once for the common geometry and applied to
+ * every channel.  Only multiples of 90 degrees are turned, other angles
+ * keep the scan order.  Channels are decoded in parallel, a block of rows
+ * at a time, straight into their places.
+ */
+
+#ifndef __ANASYS_STACK_H__
+#define __ANASYS_STACK_H__
+
+#include <glib.h>
+#include "anasys_core.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+    ANASYS_STACK_INTERLEAVED = 1 << 0,
+    ANASYS_STACK_ORIENTED    = 1 << 1,
+} AnasysStackFlags;
+
+typedef struct _AnasysStack AnasysStack;
+
+GArray*        anasys_stack_find_channels (const AnasysFile *file,
+                                           guint i);
+AnasysStack*   anasys_stack_read          (const AnasysFile *file,
+                                           const guint *channels,
+                                           guint n,
+                                           AnasysStackFlags flags,
+                                           GError **error);
+void           anasys_stack_free          (AnasysStack *stack);
+guint          anasys_stack_get_n_channels(const AnasysStack *stack);
+guint          anasys_stack_get_channel   (const AnasysStack *stack,
+                                           guint k);
+void           anasys_stack_get_resolution(const AnasysStack *stack,
+                                           guint *xres,
+                                           guint *yres);
+AnasysStackFlags anasys_stack_get_flags   (const AnasysStack *stack);
+const gfloat*  anasys_stack_get_data      (const AnasysStack *stack);
+const gfloat*  anasys_stack_get_plane     (const AnasysStack *stack,
+                                           guint k);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
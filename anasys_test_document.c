@@ -0,0 +1,231 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+#include "anasys_test_document.h"
+
+static void     put_text        (gzFile gz,
+                                 AnasysTestEncoding encoding,
+                                 const gchar *text);
+static void     put_payload     (gzFile gz,
+                                 AnasysTestEncoding encoding,
+                                 gfloat *data,
+                                 gsize n);
+static void     put_section     (gzFile gz,
+                                 const AnasysTestDocument *document,
+                                 const gchar *name,
+                                 guint nelements,
+                                 gboolean start);
+
+/* Written through zlib in both cases so that the .axd is the same text
+ * uncompressed. */
+gboolean
+anasys_test_document_write(const AnasysTestDocument *document,
+                           const gchar *filename)
+{
+    static const guchar utf16_bom[] = { 0xff, 0xfe };
+    static const guchar utf8_bom[] = { 0xef, 0xbb, 0xbf };
+    AnasysTestEncoding encoding = document->encoding;
+    guint xres = document->xres, yres = document->yres;
+    gfloat *data;
+    gchar *text;
+    gzFile gz;
+    guint i, j, k;
+
+    if (!(gz = gzopen(filename, document->compress ? "wb6" : "wbT")))
+        return FALSE;
+    if (encoding == ANASYS_TEST_UTF16_BOM)
+        gzwrite(gz, utf16_bom, sizeof(utf16_bom));
+    else if (encoding == ANASYS_TEST_UTF8_BOM)
+        gzwrite(gz, utf8_bom, sizeof(utf8_bom));
+    text = g_strdup_printf("<?xml version=\"1.0\" encoding=\"%s\"?>\r\n"
+                           "<Document Version=\"1.0\" DocType=\"IR\" "
+                           "xmlns=\"www.anasysinstruments.com\">\r\n",
+                           encoding == ANASYS_TEST_UTF8_BOM
+                           ? "utf-8" : "utf-16");
+    put_text(gz, encoding, text);
+    g_free(text);
+
+    put_section(gz, document, "HeightMaps", document->nchannels, TRUE);
+    data = g_new(gfloat, (gsize)xres*yres);
+    for (k = 0; k < document->nchannels; k++) {
+        for (i = 0; i < yres; i++) {
+            for (j = 0; j < xres; j++)
+                data[(gsize)i*xres + j] = anasys_test_channel_value(k, i, j);
+        }
+        text = g_strdup_printf("    <HeightMap DataChannel=\"channel%u\" "
+                               "Label=\"Channel %u\">\r\n"
+                               "      <Position><X>%u</X><Y>%u</Y>"
+                               "</Position>\r\n"
+                               "      <Size><X>50</X><Y>50</Y></Size>\r\n"
+                               "      <Resolution><X>%u</X><Y>%u</Y>"
+                               "</Resolution>\r\n"
+                               "      <Units>m</Units>\r\n"
+                               "      <UnitPrefix>n</UnitPrefix>\r\n"
+                               "      <Tags>\r\n"
+                               "        <Tag Name=\"ScanAngle\" "
+                               "Value=\"0 deg\" />\r\n"
+                               "        <Tag Name=\"ScanRate\" "
+                               "Value=\"%u Hz\" />\r\n",
+                               k, k, 25 + k, 25, xres, yres, k + 1);
+        put_text(gz, encoding, text);
+        g_free(text);
+        if (document->drift)
+            put_text(gz, encoding, "        <Tag Name=\"DriftCorrectionX\" "
+                     "Value=\"1.5\" />\r\n"
+                     "        <Tag Name=\"DriftCorrectionY\" "
+                     "Value=\"-0.5\" />\r\n");
+        put_text(gz, encoding, "      </Tags>\r\n"
+                 "      <SampleBase64>");
+        put_payload(gz, encoding, data, (gsize)xres*yres);
+        put_text(gz, encoding, "</SampleBase64>\r\n"
+                 "    </HeightMap>\r\n");
+    }
+    put_section(gz, document, "HeightMaps", document->nchannels, FALSE);
+
+    put_section(gz, document, "RenderedSpectra", document->nspectra, TRUE);
+    data = g_renew(gfloat, data, MAX(document->npoints, 1));
+    for (k = 0; k < document->nspectra; k++) {
+        for (i = 0; i < document->npoints; i++)
+            data[i] = anasys_test_spectrum_value(k, i);
+        text = g_strdup_printf("    <IRRenderedSpectra>\r\n"
+                               "      <Label>Spectrum %u</Label>\r\n"
+                               "      <DataPoints>%u</DataPoints>\r\n"
+                               "      <StartWavenumber>900"
+                               "</StartWavenumber>\r\n"
+                               "      <EndWavenumber>1900"
+                               "</EndWavenumber>\r\n"
+                               "      <Location><X>%u</X><Y>%u</Y>"
+                               "</Location>\r\n"
+                               "      <Polarization>0 Deg</Polarization>\r\n",
+                               k, document->npoints, k % 50, k/50 % 50);
+        put_text(gz, encoding, text);
+        g_free(text);
+        if (document->nbackgrounds) {
+            text = g_strdup_printf("      <BackgroundID>background%u"
+                                   "</BackgroundID>\r\n",
+                                   k % document->nbackgrounds);
+            put_text(gz, encoding, text);
+            g_free(text);
+        }
+        put_text(gz, encoding, "      <DataChannels "
+                 "DataChannel=\"amplitude2\">\r\n"
+                 "        <SampleBase64>");
+        put_payload(gz, encoding, data, document->npoints);
+        put_text(gz, encoding, "</SampleBase64>\r\n"
+                 "      </DataChannels>\r\n"
+                 "    </IRRenderedSpectra>\r\n");
+    }
+    put_section(gz, document, "RenderedSpectra", document->nspectra, FALSE);
+    g_free(data);
+
+    put_section(gz, document, "Backgrounds", document->nbackgrounds, TRUE);
+    for (k = 0; k < document->nbackgrounds; k++) {
+        text = g_strdup_printf("    <IRBackground>\r\n"
+                               "      <ID>background%u</ID>\r\n"
+                               "      <StartWavenumber>900"
+                               "</StartWavenumber>\r\n"
+                               "      <EndWavenumber>1900"
+                               "</EndWavenumber>\r\n"
+                               "      <Units>mV</Units>\r\n"
+                               "      <Table>\r\n"
+                               "        <double>%u</double>\r\n"
+                               "        <double>%u.5</double>\r\n"
+                               "      </Table>\r\n"
+                               "    </IRBackground>\r\n",
+                               k, k, k);
+        put_text(gz, encoding, text);
+        g_free(text);
+    }
+    put_section(gz, document, "Backgrounds", document->nbackgrounds, FALSE);
+
+    put_text(gz, encoding, "</Document>\r\n");
+    return gzclose(gz) == Z_OK;
+}
+
+gfloat
+anasys_test_channel_value(guint k, guint i, guint j)
+{
+    return sin(0.01*j + 0.02*i + k);
+}
+
+gfloat
+anasys_test_spectrum_value(guint k, guint i)
+{
+    return cos(0.005*i + 0.1*k);
+}
+
+/* Write ASCII text, widened to UTF-16LE for the UTF-16 encodings. */
+static void
+put_text(gzFile gz, AnasysTestEncoding encoding, const gchar *text)
+{
+    gchar buffer[8192];
+    gsize n;
+
+    if (encoding == ANASYS_TEST_UTF8_BOM) {
+        gzwrite(gz, text, strlen(text));
+        return;
+    }
+    while (*text) {
+        for (n = 0; n < sizeof(buffer) && text[n/2]; n += 2) {
+            buffer[n] = text[n/2];
+            buffer[n+1] = '\0';
+        }
+        gzwrite(gz, buffer, n);
+        text += n/2;
+    }
+}
+
+/* Payloads are little endian floats; the data are swapped in place. */
+static void
+put_payload(gzFile gz, AnasysTestEncoding encoding, gfloat *data, gsize n)
+{
+    guint32 *raw = (guint32*)data;
+    gchar *base64;
+    gsize i;
+
+    for (i = 0; i < n; i++)
+        raw[i] = GUINT32_TO_LE(raw[i]);
+    base64 = g_base64_encode((const guchar*)data, n*sizeof(gfloat));
+    put_text(gz, encoding, base64);
+    g_free(base64);
+}
+
+static void
+put_section(gzFile gz, const AnasysTestDocument *document, const gchar *name,
+            guint nelements, gboolean start)
+{
+    gchar *text;
+
+    if (!nelements && document->empty_sections) {
+        if (!start)
+            return;
+        text = g_strdup_printf("  <%s />\r\n", name);
+    }
+    else
+        text = g_strdup_printf(start ? "  <%s>\r\n" : "  </%s>\r\n", name);
+    put_text(gz, document->encoding, text);
+    g_free(text);
+}
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
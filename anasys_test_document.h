@@ -0,0 +1,73 @@
+/*
+ *  $Id$
+ *  Copyright (C) 2018 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Synthetic Analysis Studio documents for the tests run by make check.
+ *
+ * The documents have HeightMaps, IRRenderedSpectra with one data channel
+ * each and IRBackgrounds they refer to, in the layout Analysis Studio
+ * writes, with data that are a smooth function of the position and of the
+ * channel or spectrum number.  They can be made as large as needed.
+ */
+
+#ifndef __ANASYS_TEST_DOCUMENT_H__
+#define __ANASYS_TEST_DOCUMENT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    ANASYS_TEST_UTF16_BOM,
+    ANASYS_TEST_UTF16,
+    ANASYS_TEST_UTF8_BOM,
+} AnasysTestEncoding;
+
+/* Spectrum k refers to background k % nbackgrounds.  With empty_sections,
+ * sections without elements are written as self-closing tags instead of
+ * start and end tags with only whitespace between them.  With drift, the
+ * HeightMaps have DriftCorrectionX/Y tags. */
+typedef struct {
+    AnasysTestEncoding encoding;
+    gboolean compress;
+    guint nchannels;
+    guint xres;
+    guint yres;
+    guint nspectra;
+    guint npoints;
+    guint nbackgrounds;
+    gboolean empty_sections;
+    gboolean drift;
+} AnasysTestDocument;
+
+gboolean anasys_test_document_write(const AnasysTestDocument *document,
+                                    const gchar *filename);
+gfloat   anasys_test_channel_value (guint k,
+                                    guint i,
+                                    guint j);
+gfloat   anasys_test_spectrum_value(guint k,
+                                    guint i);
+
+G_END_DECLS
+
+#endif
+
+/* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */
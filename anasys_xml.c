@@ -26,6 +26,66 @@
  * and spectra (RenderedSpectra) import.  No file export is supported;
  * it is assumed that no changes will be saved, or if so then another
  * file format will be used.
+ * Parsing and decoding are done by anasys_core, which needs only GLib,
+ * libxml2 and zlib and is also built as the standalone libanasys.
+ * Optional import behaviour is controlled by keys under /module/anasys_xml
+ * in the settings, see load_args():
+ *   build_pyramid  attach 2x2 averaged overview levels of large channels
+ *                  to their data fields as object data "anasys-pyramid-1",
+ *                  "anasys-pyramid-2", ..., which are not saved with them
+ *   compute_stats  put Stats_* values into channel metadata and attach the
+ *                  value histogram to the data field as object data
+ *                  "anasys-histogram", computed while decoding
+ *   correct_drift  apply DriftCorrectionX/Y, in um in the frame of the
+ *                  image as imported, while decoding, shifting rows
+ *                  linearly in time up to the full correction at the last
+ *                  row
+ *   load_series    also stack the file with others of the same layout
+ *                  into volume data, one brick per channel, ordered by
+ *                  TimeStamp
+ *   series_files   semicolon-separated file names or glob patterns in the
+ *                  directory of the opened file (default *.axd or *.axz)
+ *   filter_channels, filter_labels
+ *                  semicolon-separated DataChannel names and Labels of
+ *                  HeightMaps and spectra to import (default all)
+ *   filter_polarizations
+ *                  semicolon-separated spectrum Polarizations to import
+ *   filter_xmin, filter_xmax, filter_ymin, filter_ymax
+ *                  bounding box of spectrum Locations to import, in um
+ *   filter_wavenumber_min, filter_wavenumber_max
+ *                  import only this part of spectra, in cm^-1
+ *   progressive    when loading interactively, decode the channel selected
+ *                  by AFMChannelViews (or the first one) before returning
+ *                  and add the others to the file from the main loop as
+ *                  background workers finish them; they are dropped when
+ *                  the file is closed first, and failures are logged
+ *   memory_report  put the estimated peak memory use of the load by kind
+ *                  and the process RSS after each phase, in bytes, under
+ *                  /anasys/memory into the container
+ *   memory_budget  fail the load instead of exceeding this many MiB of
+ *                  estimated memory use (default 0, unlimited)
+ *   gzip_index     keep a seek index of AXZ files in FILE.idx next to them,
+ *                  written by the first load; later loads only inflate the
+ *                  payloads of channels and spectra actually imported
+ *   spill_decoded  with memory_budget, decode HeightMaps whose decoding
+ *                  buffers would exceed it once the fields are accounted
+ *                  for into a temporary memory-mapped scratch file, which
+ *                  the system can page out, instead of failing the load
+ *   decode_service open the file and the series files through a running
+ *                  anasys-service, which decodes each file once and shares
+ *                  it with all processes (see anasys_service.h); without a
+ *                  service files are opened as usual
+ *   spectral_matrix
+ *                  also gather the spectra of the series files (see
+ *                  series_files) with the DataChannel of the first spectrum
+ *                  into /0/data, a row per spectrum resampled onto a common
+ *                  wavenumber grid from filter_wavenumber_min to
+ *                  filter_wavenumber_max, or over the range of the first
+ *                  spectrum; grid points outside a spectrum are masked
+ *   spectral_points
+ *                  number of points of that grid (default 0, as many as
+ *                  the first spectrum has)
+ * Payloads of filtered out data are never decoded.
  */
 
 /**
@@ -65,9 +125,9 @@
 #include <string.h>
 #include "err.h"
 #include "get.h"
-
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include "anasys_core.h"
+#include "anasys_service.h"
+#include "anasys_spectral.h"
 
 #define EXTENSION ".axd"
 #define EXTENSION2 ".axz"
@@ -78,10 +138,212 @@
 #define MAGIC_SIZE (sizeof(MAGIC) - 1)
 #define MAGIC2_SIZE (sizeof(MAGIC2) - 1)
 
-/* Only ever pass ASCII strings.  So the typecasting, mean to catch signed vs.
- * unsigned char problems, is not useful, just annoying. */
-#define strequal(a, b) xmlStrEqual((a), (const xmlChar*)(b))
-#define getprop(elem, name) xmlGetProp((elem), (const xmlChar*)(name))
+/* Pyramid levels are only worth building for big fields, and halving stops
+ * once a level would become smaller than this in either dimension. */
+#define PYRAMID_MIN_RES 256
+
+/* Spectra are decoded in chunks of this many, to amortise the per-task
+ * overhead of the thread pool over many short spectra. */
+#define SPECTRA_CHUNK 64
+
+/* HeightMaps are decoded this many bytes, but at least a row, at a time
+ * unless drift correction needs all rows at once. */
+#define DECODE_CHUNK (1 << 20)
+
+/* Number of bins of the histogram computed during decoding. */
+#define HISTOGRAM_BINS 256
+
+/* Single documents are parsed in parallel only from this size, as that
+ * reads their whole text into memory besides the tree. */
+#define PARALLEL_MIN_DOCUMENT ((guint64)64 << 20)
+
+/* Flags making anasys_core parse from the whole text in memory. */
+#define TEXT_OPEN_FLAGS (ANASYS_OPEN_PARALLEL | ANASYS_OPEN_SHARE_BACKGROUNDS)
+
+/* Kinds of memory accounted for during a load. */
+typedef enum {
+    MEM_DOCUMENT = 0,
+    MEM_DECODED,
+    MEM_FIELDS,
+    MEM_ROTATED,
+    MEM_SPECTRA,
+    MEM_NKINDS
+} MemoryKind;
+
+/* Phases of a load after which the process RSS is sampled. */
+typedef enum {
+    PHASE_PARSE = 0,
+    PHASE_HEIGHTMAPS,
+    PHASE_SPECTRA,
+    PHASE_SERIES,
+    PHASE_MATRIX,
+    PHASE_NPHASES
+} LoadPhase;
+
+typedef struct {
+    gboolean build_pyramid;
+    gboolean compute_stats;
+    gboolean correct_drift;
+    gboolean load_series;
+    gboolean progressive;
+    gboolean memory_report;
+    gboolean gzip_index;
+    gboolean spill_decoded;
+    gboolean decode_service;
+    gboolean spectral_matrix;
+    gint32 memory_budget;
+    gint32 spectral_points;
+    gchar *series_files;
+    gchar *filter_channels;
+    gchar *filter_labels;
+    gchar *filter_polarizations;
+    gdouble filter_xmin;
+    gdouble filter_xmax;
+    gdouble filter_ymin;
+    gdouble filter_ymax;
+    gdouble filter_wavenumber_min;
+    gdouble filter_wavenumber_max;
+} AnasysArgs;
+
+/* The common wavenumber grid of the spectral matrix and the DataChannel of
+ * its spectra, taken from the opened file unless given. */
+typedef struct {
+    gdouble start;
+    gdouble end;
+    guint npoints;
+    gchar *datachannel;
+} SpectralGrid;
+
+/* Estimated memory held by the load, charged and released by the main
+ * thread only.  Sizes are those of the buffers the loader allocates itself,
+ * the document tree is only approximated from the file size. */
+typedef struct {
+    guint64 budget;
+    guint64 total;
+    guint64 peak;
+    guint64 bytes[MEM_NKINDS];
+    guint64 peak_bytes[MEM_NKINDS];
+    guint64 rss[PHASE_NPHASES];
+    guint64 hwm[PHASE_NPHASES];
+    gboolean exceeded;
+} MemoryLedger;
+
+/* One HeightMap of a series file, with its payload still encoded in the
+ * document of the file. */
+typedef struct {
+    const AnasysChannel *source;
+    const gchar *datachannel;
+    const gchar *label;
+    const gchar *unit;
+    gdouble q;
+    guint xres;
+    guint yres;
+    gdouble xreal;
+    gdouble yreal;
+    gdouble pos_x;
+    gdouble pos_y;
+    gdouble scan_angle;
+} SeriesChannel;
+
+typedef struct {
+    gchar *filename;
+    guint64 docsize;
+    AnasysOpenFlags flags;
+    AnasysFile *file;
+    GError *error;
+    gboolean has_timestamp;
+    gint64 timestamp;
+    GPtrArray *channels;
+} SeriesFile;
+
+/* Statistics accumulated row by row during decoding.  The histogram starts
+ * at hmin with bins of width hbin; its range doubles whenever a value falls
+ * outside, so that one pass over the data suffices. */
+typedef struct {
+    gdouble min;
+    gdouble max;
+    gdouble sum;
+    gdouble sum2;
+    gsize n;
+    gsize nnan;
+    gsize ninf;
+    gdouble hmin;
+    gdouble hbin;
+    gsize hist[HISTOGRAM_BINS];
+} ChannelStats;
+
+typedef struct {
+    SeriesChannel *channel;
+    gdouble *plane;
+    gboolean ok;
+} SeriesFrame;
+
+/* HeightMaps still being decoded after the load has returned.  The
+ * container is only weakly referenced and becomes NULL, and the load
+ * cancelled, when it is destroyed.  Everything but cancelled is only
+ * touched by the main thread. */
+typedef struct {
+    GwyContainer *container;
+    gchar *filename;
+    GPtrArray *jobs;
+    guint npending;
+    volatile gint cancelled;
+} BackgroundLoad;
+
+/* One HeightMap, set up by the main thread and decoded separately, possibly
+ * by a worker.  The worker only fills in dfield, its pyramid, the rotated
+ * copy and the statistics.  The strings belong to the file. */
+typedef struct {
+    guint32 id;
+    AnasysFile *file;
+    AnasysChannel *channel;
+    const gchar *datachannel;
+    const gchar *label;
+    const gchar *unit;
+    GwyContainer *meta;
+    guint64 decoded_size;
+    guint64 buffer_size;
+    guint64 field_size;
+    guint64 rotated_size;
+    guint xres;
+    guint yres;
+    guint chunk_rows;
+    gdouble range_x;
+    gdouble range_y;
+    gdouble pos_x;
+    gdouble pos_y;
+    gdouble scan_angle;
+    gdouble q;
+    gdouble drift_x;
+    gdouble drift_y;
+    gboolean build_pyramid;
+    gboolean compute_stats;
+    gboolean spill;
+    GwyDataField *dfield;
+    GwyDataField *rotated;
+    GwyDataField *pyramid[32];
+    guint nlevels;
+    ChannelStats stats;
+    BackgroundLoad *background;
+} HeightMapJob;
+
+/* One spectrum collected by readSpectra() for batch decoding. */
+typedef struct {
+    guint id;
+    const AnasysSpectrum *spectrum;
+    const gchar *channel;
+    gchar *title;
+    gdouble x;
+    gdouble y;
+    GwyDataLine *dataline;
+    GwyDataLine *copy;
+} SpectrumItem;
+
+typedef struct {
+    SpectrumItem *items;
+    guint n;
+    const AnasysArgs *args;
+} SpectraChunk;
 
 static gboolean      module_register(void);
 static gint          anasys_detect  (const GwyFileDetectInfo *fileinfo,
@@ -90,16 +352,154 @@ static GwyContainer* anasys_load    (const gchar *filename,
                                      GwyRunType mode,
                                      GError **error);
 static guint32       readHeightMaps (GwyContainer *container,
-                                     xmlDoc *doc,
-                                     const xmlNode *curNode,
+                                     AnasysFile *file,
                                      const gchar *filename,
+                                     const AnasysArgs *args,
+                                     GwyRunType mode,
+                                     MemoryLedger *mem,
+                                     gboolean *cancelled,
+                                     BackgroundLoad **background,
                                      GError **error);
+static HeightMapJob* read_height_map(AnasysFile *file,
+                                     AnasysChannel *channel,
+                                     const AnasysArgs *args,
+                                     MemoryLedger *mem);
+static gdouble       estimate_rotated_pixels(const HeightMapJob *job);
+static void          decode_height_map(gpointer item,
+                                       gpointer user_data);
+static gboolean      publish_height_map(GwyContainer *container,
+                                        HeightMapJob *job,
+                                        const gchar *filename,
+                                        MemoryLedger *mem,
+                                        GError **error);
+static void          height_map_job_free(HeightMapJob *job);
+static void          start_background(BackgroundLoad *background,
+                                      GwyContainer *container);
+static void          background_free(BackgroundLoad *background);
+static void          background_container_gone(gpointer data,
+                                               GObject *where);
+static gpointer      decode_in_background(gpointer data);
+static void          decode_and_schedule(gpointer item,
+                                         gpointer user_data);
+static gboolean      publish_in_idle(gpointer data);
 static gboolean      readSpectra    (GwyContainer *container,
-                                     xmlDoc *doc,
-                                     const xmlNode *curNode);
+                                     AnasysFile *file,
+                                     const AnasysArgs *args,
+                                     MemoryLedger *mem);
+static void          load_args      (GwyContainer *settings,
+                                     AnasysArgs *args);
+static void          free_args      (AnasysArgs *args);
+static AnasysOpenFlags open_flags   (const AnasysArgs *args,
+                                     guint64 docsize);
+static AnasysFile*   open_file      (const gchar *filename,
+                                     AnasysOpenFlags flags,
+                                     const AnasysArgs *args,
+                                     GError **error);
+static void          convert_data   (const gfloat *buffer,
+                                     guint row,
+                                     guint nrows,
+                                     GwyDataField *dfield,
+                                     gdouble q,
+                                     gdouble drift_x,
+                                     gdouble drift_y,
+                                     GwyDataField *half,
+                                     ChannelStats *stats);
+static gdouble       get_meta_double(GwyContainer *meta,
+                                     const gchar *key);
+static void          to_scan_frame  (gdouble scan_angle,
+                                     gdouble *x,
+                                     gdouble *y);
+static void          stats_init     (ChannelStats *stats,
+                                     GwyContainer *meta,
+                                     gdouble q);
+static void          stats_finish   (ChannelStats *stats,
+                                     GwyDataField *dfield,
+                                     GwyContainer *meta,
+                                     const gchar *unit);
+static GwyDataField* new_half_field (GwyDataField *dfield);
+static GwyDataField* downsample     (GwyDataField *dfield);
+static GwyDataField* orient_field   (GwyDataField *dfield,
+                                     gdouble scan_angle);
+static guint         load_series    (GwyContainer *container,
+                                     const gchar *filename,
+                                     AnasysFile *file,
+                                     const AnasysArgs *args,
+                                     MemoryLedger *mem,
+                                     GError **error);
+static gboolean      spectral_grid  (AnasysFile *file,
+                                     const AnasysArgs *args,
+                                     SpectralGrid *grid);
+static gboolean      load_spectral_matrix(GwyContainer *container,
+                                          const gchar *filename,
+                                          const AnasysArgs *args,
+                                          const SpectralGrid *grid,
+                                          MemoryLedger *mem,
+                                          GError **error);
+static gboolean      mem_charge     (MemoryLedger *mem,
+                                     MemoryKind kind,
+                                     guint64 bytes);
+static gboolean      mem_try_charge (MemoryLedger *mem,
+                                     MemoryKind kind,
+                                     guint64 bytes);
+static void          mem_release    (MemoryLedger *mem,
+                                     MemoryKind kind,
+                                     guint64 bytes);
+static void          mem_phase_done (MemoryLedger *mem,
+                                     LoadPhase phase);
+static void          mem_report     (const MemoryLedger *mem,
+                                     GwyContainer *container);
+static guint64       estimate_document_size(const gchar *filename);
+static void          err_MEMORY_BUDGET(GError **error,
+                                       gint32 budget);
+static gboolean      list_matches   (const gchar *list,
+                                     const gchar *value);
+static gboolean      polarization_matches(const gchar *list,
+                                          const gchar *value);
+static void          decode_spectra_chunk(gpointer item,
+                                          gpointer user_data);
+static GwyDataLine*  decode_spectrum(const AnasysSpectrum *spectrum,
+                                     const AnasysArgs *args);
 
 const gdouble PI_over_180          = G_PI / 180.0;
 
+static const gchar build_pyramid_key[] = "/module/anasys_xml/build_pyramid";
+static const gchar compute_stats_key[] = "/module/anasys_xml/compute_stats";
+static const gchar correct_drift_key[] = "/module/anasys_xml/correct_drift";
+static const gchar load_series_key[]   = "/module/anasys_xml/load_series";
+static const gchar series_files_key[]  = "/module/anasys_xml/series_files";
+static const gchar progressive_key[]   = "/module/anasys_xml/progressive";
+static const gchar memory_report_key[] = "/module/anasys_xml/memory_report";
+static const gchar memory_budget_key[] = "/module/anasys_xml/memory_budget";
+static const gchar gzip_index_key[]    = "/module/anasys_xml/gzip_index";
+static const gchar spill_decoded_key[] = "/module/anasys_xml/spill_decoded";
+static const gchar decode_service_key[]
+    = "/module/anasys_xml/decode_service";
+static const gchar spectral_matrix_key[]
+    = "/module/anasys_xml/spectral_matrix";
+static const gchar spectral_points_key[]
+    = "/module/anasys_xml/spectral_points";
+static const gchar filter_channels_key[] = "/module/anasys_xml/filter_channels";
+static const gchar filter_labels_key[] = "/module/anasys_xml/filter_labels";
+static const gchar filter_polarizations_key[]
+    = "/module/anasys_xml/filter_polarizations";
+static const gchar filter_xmin_key[]   = "/module/anasys_xml/filter_xmin";
+static const gchar filter_xmax_key[]   = "/module/anasys_xml/filter_xmax";
+static const gchar filter_ymin_key[]   = "/module/anasys_xml/filter_ymin";
+static const gchar filter_ymax_key[]   = "/module/anasys_xml/filter_ymax";
+static const gchar filter_wavenumber_min_key[]
+    = "/module/anasys_xml/filter_wavenumber_min";
+static const gchar filter_wavenumber_max_key[]
+    = "/module/anasys_xml/filter_wavenumber_max";
+
+static const AnasysArgs anasys_defaults = {
+    FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE,
+    0, 0,
+    NULL,
+    NULL, NULL, NULL,
+    -G_MAXDOUBLE, G_MAXDOUBLE, -G_MAXDOUBLE, G_MAXDOUBLE,
+    -G_MAXDOUBLE, G_MAXDOUBLE,
+};
+
 static GwyModuleInfo module_info = {
     GWY_MODULE_ABI_VERSION,
     &module_register,
@@ -115,6 +515,9 @@ GWY_MODULE_QUERY(module_info)
 static gboolean
 module_register(void)
 {
+    /* Initialise libxml once, from the main thread.  It is never cleaned up
+     * by the module as other modules or threads may be using it. */
+    anasys_init();
     gwy_file_func_register("anasys_xml",
                            N_("Analysis Studio XML (.axz, .axd)"),
                            (GwyFileDetectFunc)&anasys_detect,
@@ -148,619 +551,1982 @@ anasys_detect(const GwyFileDetectInfo *fileinfo,
 }
 
 static GwyContainer*
-anasys_load(const gchar *filename,
-            G_GNUC_UNUSED GwyRunType mode, GError **error)
+anasys_load(const gchar *filename, GwyRunType mode, GError **error)
 {
     guint32 valid_images = 0;
-    GwyContainer *container = gwy_container_new();
-    xmlDoc *doc = xmlReadFile(filename, NULL, XML_PARSE_NOERROR);
-    xmlNode *curNode, *rootElement = xmlDocGetRootElement(doc);
-    xmlChar *ptDocType = NULL;
-    xmlChar *ptVersion = NULL;
-
-    if (rootElement != NULL) {
-        if (rootElement->type == XML_ELEMENT_NODE &&
-            strequal(rootElement->name, "Document")) {
-            ptDocType = getprop(rootElement, "DocType");
-            ptVersion = getprop(rootElement, "Version");
-            if (strequal(ptDocType, "IR") - strequal(ptVersion, "1.0")) {
-                err_FILE_TYPE(error, "Analysis Studio");
-                return NULL;
-            }
+    GwyContainer *container = NULL;
+    AnasysFile *file;
+    gboolean cancelled = FALSE, matrix = FALSE;
+    AnasysArgs args;
+    MemoryLedger mem;
+    SpectralGrid grid;
+    BackgroundLoad *background = NULL;
+    AnasysOpenFlags flags;
+    guint64 docsize, textsize = 0;
+
+    load_args(gwy_app_settings_get(), &args);
+    gwy_clear(&mem, 1);
+    gwy_clear(&grid, 1);
+    mem.budget = (guint64)args.memory_budget << 20;
+    docsize = estimate_document_size(filename);
+    if (!mem_charge(&mem, MEM_DOCUMENT, docsize)) {
+        err_MEMORY_BUDGET(error, args.memory_budget);
+        free_args(&args);
+        return NULL;
+    }
+    /* The text is held inflated, and again without the split elements,
+     * while it is parsed.  Without room for it the document is parsed the
+     * usual way. */
+    flags = open_flags(&args, docsize);
+    if (flags & TEXT_OPEN_FLAGS) {
+        textsize = 2*docsize;
+        if (!mem_try_charge(&mem, MEM_DOCUMENT, textsize)) {
+            flags &= ~TEXT_OPEN_FLAGS;
+            textsize = 0;
         }
     }
-    xmlFree(ptDocType);
-    xmlFree(ptVersion);
-    for (curNode = rootElement->children; curNode; curNode = curNode->next) {
-        if (curNode->type != XML_ELEMENT_NODE)
-            continue;
-        if (strequal(curNode->name, "HeightMaps"))
-            valid_images = readHeightMaps(container, doc, curNode,
-                                          filename, error);
-        else if (strequal(curNode->name, "RenderedSpectra")) {
-            if (!readSpectra(container, doc, curNode))
-                valid_images = 0;
-        }
-    }
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
-    if (valid_images == 0) {
-        g_object_unref(container);
-        err_NO_DATA(error);
+    file = open_file(filename, flags, &args, NULL);
+    mem_release(&mem, MEM_DOCUMENT, textsize);
+    if (!file) {
+        free_args(&args);
+        err_FILE_TYPE(error, "Analysis Studio");
         return NULL;
     }
+    mem_phase_done(&mem, PHASE_PARSE);
+
+    if (mode == GWY_RUN_INTERACTIVE)
+        gwy_app_wait_start(NULL, _("Reading channels..."));
+    container = gwy_container_new();
+    if (anasys_file_get_n_channels(file)) {
+        valid_images = readHeightMaps(container, file, filename, &args, mode,
+                                      &mem, &cancelled, &background, error);
+        mem_phase_done(&mem, PHASE_HEIGHTMAPS);
+    }
+    if (anasys_file_get_n_spectra(file) && !mem.exceeded && !cancelled) {
+        if (mode == GWY_RUN_INTERACTIVE
+            && !gwy_app_wait_set_message(_("Reading spectra...")))
+            cancelled = TRUE;
+        else if (!readSpectra(container, file, &args, &mem))
+            valid_images = 0;
+        mem_phase_done(&mem, PHASE_SPECTRA);
+    }
+    if (args.spectral_matrix)
+        matrix = spectral_grid(file, &args, &grid);
+    /* The series reuses the opened file as its first member. */
+    if (!mem.exceeded && !cancelled && args.load_series) {
+        if (mode == GWY_RUN_INTERACTIVE
+            && !gwy_app_wait_set_message(_("Reading series...")))
+            cancelled = TRUE;
+        else if (!load_series(container, filename, file, &args, &mem, error)
+                 && !mem.exceeded) {
+            anasys_file_unref(file);
+            mem_release(&mem, MEM_DOCUMENT, docsize);
+            GWY_OBJECT_UNREF(container);
+            goto end;
+        }
+        mem_phase_done(&mem, PHASE_SERIES);
+        valid_images++;
+    }
+    anasys_file_unref(file);
+    mem_release(&mem, MEM_DOCUMENT, docsize);
+    if (!mem.exceeded && !cancelled && matrix) {
+        if (mode == GWY_RUN_INTERACTIVE
+            && !gwy_app_wait_set_message(_("Reading spectral matrix...")))
+            cancelled = TRUE;
+        else if (!load_spectral_matrix(container, filename, &args, &grid,
+                                       &mem, error)
+                 && !mem.exceeded) {
+            GWY_OBJECT_UNREF(container);
+            goto end;
+        }
+        mem_phase_done(&mem, PHASE_MATRIX);
+        valid_images++;
+    }
+    if (cancelled) {
+        g_clear_error(error);
+        err_CANCELLED(error);
+        GWY_OBJECT_UNREF(container);
+    }
+    else if (mem.exceeded) {
+        g_clear_error(error);
+        err_MEMORY_BUDGET(error, args.memory_budget);
+        GWY_OBJECT_UNREF(container);
+    }
+    else if (valid_images == 0) {
+        err_NO_DATA(error);
+        GWY_OBJECT_UNREF(container);
+    }
+    else if (args.memory_report)
+        mem_report(&mem, container);
+
+end:
+    /* The remaining HeightMaps are only decoded if the load succeeded. */
+    if (background && container)
+        start_background(background, container);
+    else if (background)
+        background_free(background);
+    if (mode == GWY_RUN_INTERACTIVE)
+        gwy_app_wait_finish();
+    g_free(grid.datachannel);
+    free_args(&args);
     return container;
 }
 
-static guint32
-readHeightMaps(GwyContainer *container, xmlDoc *doc, const xmlNode *curNode,
-               const gchar *filename, GError **error)
+/* The arguments are a private copy, the settings are not touched again
+ * during the load. */
+static void
+load_args(GwyContainer *settings, AnasysArgs *args)
 {
-    gchar id[40];
-    guint32 imageNum = 0;
-    guint32 valid_images = 0;
+    const guchar *str;
 
-    gsize decoded_size;
-    gdouble *data;
-    gdouble width;
-    gdouble height;
-    gdouble pos_x;
-    gdouble pos_y;
-    gdouble range_x;
-    gdouble range_y;
-    gdouble scan_angle;
-    gdouble zUnitMultiplier;
-    guint32 resolution_x;
-    guint32 resolution_y;
-    guint32 num_px;
-    gboolean oblique_angle;
-    gchar *zUnit;
-    gchar *tempStr;
-    gchar **endptr;
-    guchar *decodedData;
-    guchar *base64DataString;
-    GwyDataField *dfield;
-    GwyDataField *dfield_rotate;
-    GwyDataField *dfield_temp;
-    GwyContainer *meta;
-    xmlChar *key, *xmlPropValue1, *xmlPropValue2;
-    xmlNode *childNode, *posNode, *sizeNode, *resNode, *subNode, *tempNode,
-            *tagNode;
-
-    for (childNode = curNode->children;
-         childNode;
-         childNode = childNode->next) {
-        if (childNode->type != XML_ELEMENT_NODE)
-            continue;
-        ++imageNum;
-
-        decoded_size = 0;
-        width = 0.0;
-        height = 0.0;
-        pos_x = 0.0;
-        pos_y = 0.0;
-        range_x = 0.0;
-        range_y = 0.0;
-        scan_angle = 0.0;
-        zUnitMultiplier = 1.0;
-        resolution_x = 0;
-        resolution_y = 0;
-        num_px = 0;
-        oblique_angle = FALSE;
-        zUnit = NULL;
-        tempStr = NULL;
-        endptr = NULL;
-        decodedData = NULL;
-        base64DataString = NULL;
-        xmlPropValue1 = NULL;
-        xmlPropValue2 = NULL;
-
-        xmlPropValue1 = getprop(childNode, "DataChannel");
-        meta = gwy_container_new();
-        gwy_container_set_const_string_by_name(meta, "DataChannel",
-                                               (const guchar*)xmlPropValue1);
-        xmlFree(xmlPropValue1);
-
-        for (tempNode = childNode->children;
-             tempNode;
-             tempNode = tempNode->next) {
-            if (tempNode->type != XML_ELEMENT_NODE)
-                continue;
-            if (strequal(tempNode->name, "Position")) {
-                for (posNode = tempNode->children;
-                     posNode;
-                     posNode = posNode->next) {
-                    if (posNode->type != XML_ELEMENT_NODE)
-                        continue;
-                    key = xmlNodeListGetString(doc,
-                                               posNode->xmlChildrenNode, 1);
-                    if (strequal(posNode->name, "X"))
-                        pos_x = g_ascii_strtod((const gchar*)key, endptr);
-                    else if (strequal(posNode->name, "Y"))
-                        pos_y = g_ascii_strtod((const gchar*)key, endptr);
-                    tempStr = g_strdup_printf("Position_%s", posNode->name);
-                    gwy_container_set_const_string_by_name(meta, tempStr,
-                                                           (guchar *)key);
-                    xmlFree(key);
-                    g_free(tempStr);
-                }
-            }
-            else if (strequal(tempNode->name, "Size")) {
-                for (sizeNode = tempNode->children;
-                     sizeNode;
-                     sizeNode = sizeNode->next) {
-                    if (sizeNode->type != XML_ELEMENT_NODE)
-                        continue;
-                    key = xmlNodeListGetString(doc,
-                                               sizeNode->xmlChildrenNode, 1);
-                    if (strequal(sizeNode->name, "X"))
-                        range_x = g_ascii_strtod((const gchar*)key, endptr);
-                    else if (strequal(sizeNode->name, "Y"))
-                        range_y = g_ascii_strtod((const gchar*)key, endptr);
-                    tempStr = g_strdup_printf("Size_%s", sizeNode->name);
-                    gwy_container_set_const_string_by_name(meta, tempStr,
-                                                           (guchar *)key);
-                    xmlFree(key);
-                    g_free(tempStr);
-                }
-            }
-            else if (strequal(tempNode->name, "Resolution")) {
-                for (resNode = tempNode->children;
-                     resNode;
-                     resNode = resNode->next) {
-                    if (resNode->type != XML_ELEMENT_NODE)
-                        continue;
-                    key = xmlNodeListGetString(doc,
-                                               resNode->xmlChildrenNode, 1);
-                    if (strequal(resNode->name, "X"))
-                        resolution_x = (gint32)atoi((char *)key);
-                    else if (strequal(resNode->name, "Y"))
-                        resolution_y = (gint32)atoi((char *)key);
-                    tempStr = g_strdup_printf("Resolution_%s", resNode->name);
-                    gwy_container_set_const_string_by_name(meta, tempStr,
-                                                           (guchar *)key);
-                    xmlFree(key);
-                    g_free(tempStr);
-                }
-            }
-            else if (strequal(tempNode->name, "Units")) {
-                key = xmlNodeListGetString(doc,
-                                           tempNode->xmlChildrenNode, 1);
-                zUnit = g_strdup((gchar*)key);
-                gwy_container_set_const_string_by_name(meta,
-                                                   "Units", (guchar *)zUnit);
-                xmlFree(key);
-            }
-            else if (strequal(tempNode->name, "UnitPrefix")) {
-                key = xmlNodeListGetString(doc,
-                                           tempNode->xmlChildrenNode, 1);
-                if (strequal(key, "f"))
-                    zUnitMultiplier = 1.0e-15;
-                else if (strequal(key, "p"))
-                    zUnitMultiplier = 1.0e-12;
-                else if (strequal(key, "n"))
-                    zUnitMultiplier = 1.0e-9;
-                else if (strequal(key, "u"))
-                    zUnitMultiplier = 1.0e-6;
-                else if (strequal(key, "m"))
-                    zUnitMultiplier = 1.0e-3;
-                xmlFree(key);
-            }
-            else if (strequal(tempNode->name, "Tags")) {
-                for (tagNode = tempNode->children;
-                     tagNode;
-                     tagNode = tagNode->next) {
-                    if (tagNode->type != XML_ELEMENT_NODE)
-                        continue;
-                    xmlPropValue1 = getprop(tagNode, "Name");
-                    if (strequal(xmlPropValue1, "ScanAngle")) {
-                        gchar *p;
-                        xmlPropValue2 = getprop(tagNode, "Value");
-                        p = strchr((const gchar*)xmlPropValue2, ' ');
-                        if (p) {
-                            p = '\0';
-                            scan_angle = g_ascii_strtod(
-                                                  (const gchar*)xmlPropValue2,
-                                                  endptr);
-                            while (scan_angle > 180.0)
-                                scan_angle -= 360.0;
-                            while (scan_angle <= -180.0)
-                                scan_angle += 360.0;
-                        }
-                        else
-                            scan_angle = 0.0;
-                        xmlFree(xmlPropValue2);
-                    }
-                    xmlFree(xmlPropValue1);
-                    xmlPropValue1 = getprop(tagNode, "Name");
-                    xmlPropValue2 = getprop(tagNode, "Value");
-                    gwy_container_set_const_string_by_name(meta,
-                                                  (const gchar*)xmlPropValue1,
-                                                  (guchar*)xmlPropValue2);
-                    xmlFree(xmlPropValue1);
-                    xmlFree(xmlPropValue2);
-                }
-            }
-            else if (strequal(tempNode->name, "SampleBase64")) {
-                key = xmlNodeListGetString(doc, tempNode->xmlChildrenNode, 1);
-                base64DataString = (guchar*)g_strdup((gchar*)key);
-                xmlFree(key);
-            }
-            else {
-                if (xmlChildElementCount(tempNode) == 0) {
-                    key = xmlNodeListGetString(doc,
-                                        tempNode->xmlChildrenNode, 1);
-                    gwy_container_set_const_string_by_name(meta,
-                                  (const gchar*)tempNode->name, (guchar*)key);
-                    xmlFree(key);
-                }
-                else {
-                    for (subNode = tempNode->children;
-                         subNode;
-                         subNode = subNode->next) {
-                        if (subNode->type != XML_ELEMENT_NODE)
-                            continue;
-                        key = xmlNodeListGetString(doc,
-                                        subNode->xmlChildrenNode, 1);
-                        tempStr = g_strdup_printf("%s_%s",
-                                                  tempNode->name,
-                                                  subNode->name);
-                        gwy_container_set_const_string_by_name(meta, tempStr,
-                                                               (guchar*)key);
-                        g_free(tempStr);
-                        xmlFree(key);
-                    }
-                }
-            }
-        }
+    *args = anasys_defaults;
+    gwy_container_gis_boolean_by_name(settings, build_pyramid_key,
+                                      &args->build_pyramid);
+    gwy_container_gis_boolean_by_name(settings, compute_stats_key,
+                                      &args->compute_stats);
+    gwy_container_gis_boolean_by_name(settings, correct_drift_key,
+                                      &args->correct_drift);
+    gwy_container_gis_boolean_by_name(settings, load_series_key,
+                                      &args->load_series);
+    gwy_container_gis_boolean_by_name(settings, progressive_key,
+                                      &args->progressive);
+    gwy_container_gis_boolean_by_name(settings, memory_report_key,
+                                      &args->memory_report);
+    gwy_container_gis_boolean_by_name(settings, gzip_index_key,
+                                      &args->gzip_index);
+    gwy_container_gis_boolean_by_name(settings, spill_decoded_key,
+                                      &args->spill_decoded);
+    gwy_container_gis_boolean_by_name(settings, decode_service_key,
+                                      &args->decode_service);
+    gwy_container_gis_boolean_by_name(settings, spectral_matrix_key,
+                                      &args->spectral_matrix);
+    gwy_container_gis_int32_by_name(settings, memory_budget_key,
+                                    &args->memory_budget);
+    args->memory_budget = MAX(args->memory_budget, 0);
+    gwy_container_gis_int32_by_name(settings, spectral_points_key,
+                                    &args->spectral_points);
+    args->spectral_points = MAX(args->spectral_points, 0);
+    if (gwy_container_gis_string_by_name(settings, series_files_key, &str))
+        args->series_files = g_strdup((const gchar*)str);
+    if (gwy_container_gis_string_by_name(settings, filter_channels_key, &str))
+        args->filter_channels = g_strdup((const gchar*)str);
+    if (gwy_container_gis_string_by_name(settings, filter_labels_key, &str))
+        args->filter_labels = g_strdup((const gchar*)str);
+    if (gwy_container_gis_string_by_name(settings, filter_polarizations_key,
+                                         &str))
+        args->filter_polarizations = g_strdup((const gchar*)str);
+    gwy_container_gis_double_by_name(settings, filter_xmin_key,
+                                     &args->filter_xmin);
+    gwy_container_gis_double_by_name(settings, filter_xmax_key,
+                                     &args->filter_xmax);
+    gwy_container_gis_double_by_name(settings, filter_ymin_key,
+                                     &args->filter_ymin);
+    gwy_container_gis_double_by_name(settings, filter_ymax_key,
+                                     &args->filter_ymax);
+    gwy_container_gis_double_by_name(settings, filter_wavenumber_min_key,
+                                     &args->filter_wavenumber_min);
+    gwy_container_gis_double_by_name(settings, filter_wavenumber_max_key,
+                                     &args->filter_wavenumber_max);
+}
 
-        if (!base64DataString) {
-            g_object_unref(meta);
-            g_free(zUnit);
-            continue;
-        }
+/* Both parsing in parallel and sharing backgrounds read the whole text into
+ * memory, so they are only used where they pay for it: for large documents
+ * and for series, whose files repeat the backgrounds. */
+static AnasysOpenFlags
+open_flags(const AnasysArgs *args, guint64 docsize)
+{
+    AnasysOpenFlags flags = args->gzip_index ? ANASYS_OPEN_INDEX : 0;
 
-        num_px = resolution_x * resolution_y;
-        if (num_px < 1) {
-            g_free(base64DataString);
-            g_object_unref(meta);
-            g_free(zUnit);
-            continue;
-        }
+    if (docsize >= PARALLEL_MIN_DOCUMENT)
+        flags |= ANASYS_OPEN_PARALLEL;
+    if (args->load_series)
+        flags |= ANASYS_OPEN_SHARE_BACKGROUNDS;
+    return flags;
+}
 
-        dfield = gwy_data_field_new(resolution_x, resolution_y,
-                                    range_x*1.0e-6, range_y*1.0e-6, FALSE);
-        gwy_si_unit_set_from_string(gwy_data_field_get_si_unit_xy(dfield),
-                                    "m");
-        gwy_si_unit_set_from_string(gwy_data_field_get_si_unit_z(dfield),
-                                    zUnit);
+/* Files from the service are already decoded, the flags do not matter. */
+static AnasysFile*
+open_file(const gchar *filename, AnasysOpenFlags flags,
+          const AnasysArgs *args, GError **error)
+{
+    AnasysFile *file;
 
-        data = gwy_data_field_get_data(dfield);
+    if (args->decode_service
+        && (file = anasys_service_open(NULL, filename, NULL)))
+        return file;
+    return anasys_file_open_full(filename, flags, error);
+}
 
-        decodedData = g_base64_decode((const gchar*)base64DataString,
-                                      &decoded_size);
-        if (err_SIZE_MISMATCH(error, sizeof(gfloat)*num_px, decoded_size,
-                              TRUE)) {
-            g_object_unref(dfield);
-            g_free(zUnit);
-            g_free(decodedData);
-            g_free(base64DataString);
+static void
+free_args(AnasysArgs *args)
+{
+    g_free(args->series_files);
+    g_free(args->filter_channels);
+    g_free(args->filter_labels);
+    g_free(args->filter_polarizations);
+}
+
+/* Charge bytes of the given kind to the ledger.  Fails, and marks the load
+ * as over budget, if the total would exceed the budget. */
+static gboolean
+mem_charge(MemoryLedger *mem, MemoryKind kind, guint64 bytes)
+{
+    if (mem->budget && mem->total + bytes > mem->budget) {
+        mem->exceeded = TRUE;
+        return FALSE;
+    }
+    mem->total += bytes;
+    mem->bytes[kind] += bytes;
+    mem->peak = MAX(mem->peak, mem->total);
+    mem->peak_bytes[kind] = MAX(mem->peak_bytes[kind], mem->bytes[kind]);
+    return TRUE;
+}
+
+/* Charge memory the load can do without, failing without marking the load
+ * as over budget. */
+static gboolean
+mem_try_charge(MemoryLedger *mem, MemoryKind kind, guint64 bytes)
+{
+    if (mem->budget && mem->total + bytes > mem->budget)
+        return FALSE;
+    return mem_charge(mem, kind, bytes);
+}
+
+static void
+mem_release(MemoryLedger *mem, MemoryKind kind, guint64 bytes)
+{
+    bytes = MIN(bytes, mem->bytes[kind]);
+    mem->bytes[kind] -= bytes;
+    mem->total -= bytes;
+}
+
+/* Sample the current and peak RSS of the process.  Only Linux provides
+ * them, elsewhere they stay zero. */
+static void
+mem_phase_done(MemoryLedger *mem, LoadPhase phase)
+{
+    gchar *buffer = NULL, *line;
+    guint64 value;
+
+    if (!g_file_get_contents("/proc/self/status", &buffer, NULL, NULL))
+        return;
+    for (line = buffer; line; line = strchr(line, '\n')) {
+        if (*line == '\n')
+            line++;
+        if (sscanf(line, "VmRSS: %" G_GUINT64_FORMAT, &value) == 1)
+            mem->rss[phase] = value << 10;
+        else if (sscanf(line, "VmHWM: %" G_GUINT64_FORMAT, &value) == 1)
+            mem->hwm[phase] = value << 10;
+    }
+    g_free(buffer);
+}
+
+static void
+mem_report(const MemoryLedger *mem, GwyContainer *container)
+{
+    static const gchar *kinds[MEM_NKINDS] = {
+        "document", "decoded", "fields", "rotated", "spectra",
+    };
+    static const gchar *phases[PHASE_NPHASES] = {
+        "parse", "heightmaps", "spectra", "series", "matrix",
+    };
+    gchar key[64];
+    guint i;
+
+    gwy_container_set_int64_by_name(container, "/anasys/memory/peak",
+                                    mem->peak);
+    for (i = 0; i < MEM_NKINDS; i++) {
+        g_snprintf(key, sizeof(key), "/anasys/memory/%s", kinds[i]);
+        gwy_container_set_int64_by_name(container, key, mem->peak_bytes[i]);
+    }
+    for (i = 0; i < PHASE_NPHASES; i++) {
+        if (!mem->rss[i])
             continue;
+        g_snprintf(key, sizeof(key), "/anasys/memory/rss/%s", phases[i]);
+        gwy_container_set_int64_by_name(container, key, mem->rss[i]);
+        g_snprintf(key, sizeof(key), "/anasys/memory/peak-rss/%s", phases[i]);
+        gwy_container_set_int64_by_name(container, key, mem->hwm[i]);
+    }
+}
+
+/* Rough size of the parsed document: the uncompressed file size, taken from
+ * the gzip trailer for AXZ.  UTF-16 text takes about twice the memory of
+ * the UTF-8 in the tree, which leaves the rest for the nodes. */
+static guint64
+estimate_document_size(const gchar *filename)
+{
+    GStatBuf st;
+    FILE *fh;
+    guchar head[2], trailer[4];
+    guint64 size;
+
+    if (g_stat(filename, &st) != 0)
+        return 0;
+    size = st.st_size;
+    if (!(fh = g_fopen(filename, "rb")))
+        return size;
+    if (fread(head, 1, 2, fh) == 2
+        && head[0] == 0x1f && head[1] == 0x8b
+        && fseek(fh, -4, SEEK_END) == 0
+        && fread(trailer, 1, 4, fh) == 4) {
+        /* ISIZE is only stored modulo 2^32, but XML compresses well enough
+         * that the uncompressed size never falls below the compressed. */
+        size = trailer[0] | trailer[1] << 8 | trailer[2] << 16
+               | (guint64)trailer[3] << 24;
+        while (size < (guint64)st.st_size)
+            size += G_GUINT64_CONSTANT(1) << 32;
+    }
+    fclose(fh);
+    return size;
+}
+
+static void
+err_MEMORY_BUDGET(GError **error, gint32 budget)
+{
+    g_set_error(error, GWY_MODULE_FILE_ERROR, GWY_MODULE_FILE_ERROR_DATA,
+                _("Loading the file would exceed the memory budget "
+                  "of %d MiB."), budget);
+}
+
+/* Set up the decoding of a HeightMap, charging what it will need.  Returns
+ * NULL for filtered out channels and when the budget would be exceeded. */
+static HeightMapJob*
+read_height_map(AnasysFile *file, AnasysChannel *channel,
+                const AnasysArgs *args, MemoryLedger *mem)
+{
+    HeightMapJob *job;
+    guint64 num_px, field_size, rotated_size = 0;
+    const gchar *key, *value;
+    GwyContainer *meta;
+    gdouble drift_x, drift_y;
+    guint i, n;
+
+    /* Filtered out channels keep their number, but nothing in them is
+     * decoded. */
+    if (!list_matches(args->filter_channels,
+                      anasys_channel_get_data_channel(channel))
+        || !list_matches(args->filter_labels,
+                         anasys_channel_get_label(channel)))
+        return NULL;
+
+    job = g_new0(HeightMapJob, 1);
+    job->id = anasys_channel_get_id(channel);
+    job->file = anasys_file_ref(file);
+    job->channel = channel;
+    job->datachannel = anasys_channel_get_data_channel(channel);
+    job->label = anasys_channel_get_label(channel);
+    job->unit = anasys_channel_get_unit(channel);
+    meta = job->meta = gwy_container_new();
+    gwy_container_set_const_string_by_name(meta, "DataChannel",
+                                           (const guchar*)job->datachannel);
+    n = anasys_channel_get_n_meta(channel);
+    for (i = 0; i < n; i++) {
+        anasys_channel_get_meta(channel, i, &key, &value);
+        gwy_container_set_const_string_by_name(meta, key,
+                                               (const guchar*)value);
+    }
+
+    anasys_channel_get_resolution(channel, &job->xres, &job->yres);
+    anasys_channel_get_size(channel, &job->range_x, &job->range_y);
+    anasys_channel_get_position(channel, &job->pos_x, &job->pos_y);
+    job->scan_angle = anasys_channel_get_scan_angle(channel);
+    job->q = anasys_channel_get_unit_multiplier(channel);
+
+    /* The decoded payload only lives until conversion, the field and its
+     * pyramid (under 1/3 of the field) stay.  The encoded payload is read
+     * in place from the document. */
+    num_px = (guint64)job->xres*job->yres;
+    job->decoded_size = num_px*sizeof(gfloat);
+    field_size = num_px*sizeof(gdouble);
+    job->build_pyramid = (args->build_pyramid
+                          && job->xres >= 2*PYRAMID_MIN_RES
+                          && job->yres >= 2*PYRAMID_MIN_RES);
+    if (job->build_pyramid)
+        field_size += field_size/3;
+    job->field_size = field_size;
+    if (job->scan_angle != 0.0 && job->scan_angle != 180.0
+        && job->scan_angle != 90.0 && job->scan_angle != -90.0)
+        rotated_size = MIN(estimate_rotated_pixels(job), 2048*2048)
+                       *sizeof(gdouble);
+    job->rotated_size = rotated_size;
+    /* The rows are shifted as decoded, before the field is oriented. */
+    if (args->correct_drift) {
+        drift_x = get_meta_double(meta, "DriftCorrectionX");
+        drift_y = get_meta_double(meta, "DriftCorrectionY");
+        to_scan_frame(job->scan_angle, &drift_x, &drift_y);
+        job->drift_x = drift_x*job->xres/job->range_x;
+        job->drift_y = drift_y*job->yres/job->range_y;
+    }
+    /* Rows are only decoded all at once for drift correction, which
+     * shifts them by whole parts of the image. */
+    job->chunk_rows = job->yres;
+    if (job->drift_x == 0.0 && job->drift_y == 0.0)
+        job->chunk_rows = CLAMP(DECODE_CHUNK/(job->xres*sizeof(gfloat)),
+                                1, job->yres);
+    job->buffer_size = (guint64)job->chunk_rows*job->xres*sizeof(gfloat);
+    /* The decoding buffer is charged by readHeightMaps() once all fields
+     * are, as it may be spilled. */
+    if (!mem_charge(mem, MEM_FIELDS, field_size)
+        || !mem_charge(mem, MEM_ROTATED, rotated_size)) {
+        height_map_job_free(job);
+        return NULL;
+    }
+
+    if ((job->compute_stats = args->compute_stats))
+        stats_init(&job->stats, meta, job->q);
+
+    /* Units are set here as the worker should not touch anything shared. */
+    job->dfield = gwy_data_field_new(job->xres, job->yres,
+                                     job->range_x*1.0e-6, job->range_y*1.0e-6,
+                                     FALSE);
+    gwy_si_unit_set_from_string(gwy_data_field_get_si_unit_xy(job->dfield),
+                                "m");
+    gwy_si_unit_set_from_string(gwy_data_field_get_si_unit_z(job->dfield),
+                                job->unit);
+    return job;
+}
+
+/* Estimate the number of pixels in the image rotation with
+ * GWY_ROTATE_RESIZE_EXPAND will produce. */
+static gdouble
+estimate_rotated_pixels(const HeightMapJob *job)
+{
+    gdouble rot_angle = PI_over_180 * job->scan_angle;
+    gdouble casa = fabs(cos(rot_angle)*sin(rot_angle));
+    gdouble Lx = job->range_x, Ly = job->range_y;
+    gdouble nx = job->xres, ny = job->yres;
+    gdouble q = nx*ny/MIN(Lx*ny, Ly*nx);
+
+    return (Lx*Ly + (Lx*Lx + Ly*Ly)*casa)*q*q;
+}
+
+/* HeightMap worker: decode and convert the payload, build the pyramid and
+ * orient the field.  On a size mismatch the job is left without a field. */
+static void
+decode_height_map(gpointer item, G_GNUC_UNUSED gpointer user_data)
+{
+    HeightMapJob *job = (HeightMapJob*)item;
+    GwyDataField *dfield = job->dfield, *reduced_field, *half;
+    ChannelStats *stats = job->compute_stats ? &job->stats : NULL;
+    const gfloat *decoded = NULL, *rows;
+    gfloat *buffer = NULL;
+    gdouble width, height;
+    guint i, row, n;
+
+    /* The first pyramid level is filled by the conversion itself, while
+     * the rows are still in cache; the coarser ones are cheap. */
+    if (job->build_pyramid)
+        job->pyramid[job->nlevels++] = new_half_field(dfield);
+    half = job->nlevels ? job->pyramid[0] : NULL;
+
+    /* Spilled payloads are decoded whole by the library, which puts them
+     * into the scratch file once its budget is used up, and their rows are
+     * read back from there as they are converted.  Others are decoded into
+     * a buffer a chunk of rows at a time. */
+    if (job->spill) {
+        if (!(decoded = anasys_channel_get_data(job->channel, NULL))) {
+            GWY_OBJECT_UNREF(job->dfield);
+            return;
         }
-        gwy_convert_raw_data(decodedData, num_px, 1,
-                             GWY_RAW_DATA_FLOAT, GWY_BYTE_ORDER_LITTLE_ENDIAN,
-                             data, zUnitMultiplier, 0.0);
-
-        if (scan_angle == 0.0) {
-            gwy_data_field_invert(dfield, TRUE, FALSE, FALSE);
-            width = range_x;
-            height = range_y;
-        }
-        else if (scan_angle == 180.0) {
-            gwy_data_field_invert(dfield, FALSE, TRUE, FALSE);
-            width = range_x;
-            height = range_y;
-        }
-        else if (scan_angle == 90.0) {
-            dfield_temp = dfield;
-            dfield = gwy_data_field_new_rotated_90(dfield, FALSE);
-            g_object_unref(dfield_temp);
-            gwy_data_field_invert(dfield, TRUE, FALSE, FALSE);
-            width = range_y;
-            height = range_x;
-        }
-        else if (scan_angle == -90.0) {
-            dfield_temp = dfield;
-            dfield = gwy_data_field_new_rotated_90(dfield, TRUE);
-            g_object_unref(dfield_temp);
-            gwy_data_field_invert(dfield, TRUE, FALSE, FALSE);
-            width = range_y;
-            height = range_x;
+    }
+    else
+        buffer = g_new(gfloat, (gsize)job->chunk_rows*job->xres);
+    for (row = 0; row < job->yres; row += n) {
+        n = MIN(job->chunk_rows, job->yres - row);
+        if (decoded)
+            rows = decoded + (gsize)row*job->xres;
+        else if (anasys_channel_read_rows(job->channel, row, n, buffer, NULL))
+            rows = buffer;
+        else
+            break;
+        convert_data(rows, row, n, dfield, job->q,
+                     job->drift_x, job->drift_y, half, stats);
+    }
+    if (decoded)
+        anasys_channel_free_data(job->channel);
+    g_free(buffer);
+    if (row < job->yres) {
+        GWY_OBJECT_UNREF(job->dfield);
+        return;
+    }
+    while (job->nlevels && job->nlevels < G_N_ELEMENTS(job->pyramid)
+           && gwy_data_field_get_xres(job->pyramid[job->nlevels-1])
+              >= 2*PYRAMID_MIN_RES
+           && gwy_data_field_get_yres(job->pyramid[job->nlevels-1])
+              >= 2*PYRAMID_MIN_RES) {
+        job->pyramid[job->nlevels] = downsample(job->pyramid[job->nlevels-1]);
+        job->nlevels++;
+    }
+
+    if (job->scan_angle == 0.0 || job->scan_angle == 180.0) {
+        dfield = orient_field(dfield, job->scan_angle);
+        width = job->range_x;
+        height = job->range_y;
+    }
+    else if (job->scan_angle == 90.0 || job->scan_angle == -90.0) {
+        dfield = orient_field(dfield, job->scan_angle);
+        width = job->range_y;
+        height = job->range_x;
+    }
+    else {
+        const gdouble rot_angle = PI_over_180 * job->scan_angle;
+        /* How much we need to reduce the size for a rotated image with
+         * sane pixel dimensions. */
+        gdouble reduction = sqrt(2048*2048/estimate_rotated_pixels(job));
+
+        if (reduction < 1.0) {
+            gint reduced_xres = GWY_ROUND(reduction*job->xres);
+            gint reduced_yres = GWY_ROUND(reduction*job->yres);
+            reduced_xres = MAX(reduced_xres, 2);
+            reduced_yres = MAX(reduced_yres, 2);
+            reduced_field = gwy_data_field_new_resampled(dfield,
+                                                         reduced_xres,
+                                                         reduced_yres,
+                                                         GWY_INTERPOLATION_BSPLINE);
+            job->rotated = gwy_data_field_new_rotated(reduced_field,
+                                                      NULL, rot_angle,
+                                                      GWY_INTERPOLATION_BSPLINE,
+                                                      GWY_ROTATE_RESIZE_EXPAND);
+            g_object_unref(reduced_field);
         }
         else {
-            const gdouble rot_angle = PI_over_180 * scan_angle;
-            /* Estimate the number of pixels in the image rotation with
-             * GWY_ROTATE_RESIZE_EXPAND will produce. */
-            gdouble casa = fabs(cos(rot_angle)*sin(rot_angle));
-            gdouble Lx = range_x, Ly = range_y;
-            gdouble nx = resolution_x, ny = resolution_y;
-            gdouble q = nx*ny/MIN(Lx*ny, Ly*nx);
-            gdouble estim_npixels = (Lx*Ly + (Lx*Lx + Ly*Ly)*casa)*q*q;
-            /* How much we need to reduce the size for a rotated image with
-             * sane pixel dimensions. */
-            gdouble reduction = sqrt(2048*2048/estim_npixels);
-
-            if (reduction < 1.0) {
-                GwyDataField *reduced_field;
-                gint reduced_xres = GWY_ROUND(reduction*resolution_x);
-                gint reduced_yres = GWY_ROUND(reduction*resolution_y);
-                reduced_xres = MAX(reduced_xres, 2);
-                reduced_yres = MAX(reduced_yres, 2);
-                reduced_field = gwy_data_field_new_resampled(dfield,
-                                                             reduced_xres,
-                                                             reduced_yres,
-                                                             GWY_INTERPOLATION_BSPLINE);
-                dfield_rotate = gwy_data_field_new_rotated(reduced_field,
-                                                           NULL, rot_angle,
-                                                           GWY_INTERPOLATION_BSPLINE,
-                                                           GWY_ROTATE_RESIZE_EXPAND);
-                g_object_unref(reduced_field);
-            }
-            else {
-                dfield_rotate = gwy_data_field_new_rotated(dfield,
-                                                           NULL, rot_angle,
-                                                           GWY_INTERPOLATION_BSPLINE,
-                                                           GWY_ROTATE_RESIZE_EXPAND);
-            }
-            gwy_data_field_invert(dfield_rotate, TRUE, FALSE, FALSE);
-            width = gwy_data_field_get_xreal(dfield_rotate);
-            height = gwy_data_field_get_yreal(dfield_rotate);
-            oblique_angle = TRUE;
+            job->rotated = gwy_data_field_new_rotated(dfield,
+                                                      NULL, rot_angle,
+                                                      GWY_INTERPOLATION_BSPLINE,
+                                                      GWY_ROTATE_RESIZE_EXPAND);
         }
+        gwy_data_field_invert(job->rotated, TRUE, FALSE, FALSE);
+        width = gwy_data_field_get_xreal(job->rotated);
+        height = gwy_data_field_get_yreal(job->rotated);
+    }
 
-        if (oblique_angle) {
-            gwy_data_field_set_xoffset(dfield, 1.0);
-            gwy_data_field_set_yoffset(dfield, 1.0);
-            gwy_data_field_set_xoffset(dfield_rotate,
-                                        pos_x*1.0e-6 - 0.5*width);
-            gwy_data_field_set_yoffset(dfield_rotate,
-                                        pos_y*1.0e-6 - 0.5*height);
-        }
-        else {
-            gwy_data_field_set_xoffset(dfield,
-                                        (pos_x - 0.5*width)*1.0e-6);
-            gwy_data_field_set_yoffset(dfield,
-                                        (pos_y - 0.5*height)*1.0e-6);
+    if (job->rotated) {
+        gwy_data_field_set_xoffset(dfield, 1.0);
+        gwy_data_field_set_yoffset(dfield, 1.0);
+        gwy_data_field_set_xoffset(job->rotated,
+                                   job->pos_x*1.0e-6 - 0.5*width);
+        gwy_data_field_set_yoffset(job->rotated,
+                                   job->pos_y*1.0e-6 - 0.5*height);
+    }
+    else {
+        gwy_data_field_set_xoffset(dfield, (job->pos_x - 0.5*width)*1.0e-6);
+        gwy_data_field_set_yoffset(dfield, (job->pos_y - 0.5*height)*1.0e-6);
+    }
+    job->dfield = dfield;
+
+    for (i = 0; i < job->nlevels; i++) {
+        job->pyramid[i] = orient_field(job->pyramid[i], job->scan_angle);
+        gwy_data_field_set_xoffset(job->pyramid[i],
+                                   gwy_data_field_get_xoffset(dfield));
+        gwy_data_field_set_yoffset(job->pyramid[i],
+                                   gwy_data_field_get_yoffset(dfield));
+    }
+}
+
+/* Put a decoded HeightMap into the container.  The ledger may be NULL once
+ * the load has returned. */
+static gboolean
+publish_height_map(GwyContainer *container, HeightMapJob *job,
+                   const gchar *filename, MemoryLedger *mem, GError **error)
+{
+    gchar id[40];
+    gchar *tempStr;
+    guint i;
+
+    if (mem && !job->spill)
+        mem_release(mem, MEM_DECODED, job->buffer_size);
+    if (!job->dfield) {
+        if (mem) {
+            mem_release(mem, MEM_FIELDS, job->field_size);
+            mem_release(mem, MEM_ROTATED, job->rotated_size);
         }
+        err_SIZE_MISMATCH(error, job->decoded_size,
+                          anasys_channel_get_payload_size(job->channel),
+                          TRUE);
+        return FALSE;
+    }
 
-        g_snprintf(id, sizeof(id), "/%i/data", imageNum);
-        gwy_container_set_object_by_name(container, id, dfield);
-        g_snprintf(id, sizeof(id), "/%i/meta", imageNum);
-        gwy_container_set_object_by_name(container, id, meta);
+    if (job->compute_stats)
+        stats_finish(&job->stats, job->dfield, job->meta, job->unit);
+    g_snprintf(id, sizeof(id), "/%i/data", job->id);
+    gwy_container_set_object_by_name(container, id, job->dfield);
+    g_snprintf(id, sizeof(id), "/%i/meta", job->id);
+    gwy_container_set_object_by_name(container, id, job->meta);
 
-        if (oblique_angle) {
-            g_snprintf(id, sizeof(id), "/%i/data", 1000000 + imageNum);
-            gwy_container_set_object_by_name(container, id, dfield_rotate);
-            g_snprintf(id, sizeof(id), "/%i/meta", 1000000 + imageNum);
-            gwy_container_set_object_by_name(container, id, meta);
-            g_snprintf(id, sizeof(id), "/%i/data/title", 1000000 + imageNum);
-            xmlPropValue1 = getprop(childNode, "Label");
-            tempStr = g_strdup_printf("%s (Rotated)", xmlPropValue1);
-            gwy_container_set_const_string_by_name(container, id,
-                                                   (guchar*)tempStr);
-            xmlFree(xmlPropValue1);
-            g_free(tempStr);
-            g_snprintf(id, sizeof(id), "/%i/data/title", imageNum);
-            xmlPropValue1 = getprop(childNode, "Label");
-            tempStr = g_strdup_printf("%s (Offset)", xmlPropValue1);
-            gwy_container_set_const_string_by_name(container, id,
-                                                   (guchar*)tempStr);
-            xmlFree(xmlPropValue1);
-            g_free(tempStr);
-            g_object_unref(dfield_rotate);
+    /* Level i has 2^(i+1) times coarser pixels than the channel.  They are
+     * previews, not data, so they go with the field and not into the
+     * container, which would save them into files. */
+    for (i = 0; i < job->nlevels; i++) {
+        g_snprintf(id, sizeof(id), "anasys-pyramid-%u", i+1);
+        g_object_set_data_full(G_OBJECT(job->dfield), id,
+                               g_object_ref(job->pyramid[i]),
+                               g_object_unref);
+    }
+
+    if (job->rotated) {
+        g_snprintf(id, sizeof(id), "/%i/data", 1000000 + job->id);
+        gwy_container_set_object_by_name(container, id, job->rotated);
+        g_snprintf(id, sizeof(id), "/%i/meta", 1000000 + job->id);
+        gwy_container_set_object_by_name(container, id, job->meta);
+        g_snprintf(id, sizeof(id), "/%i/data/title", 1000000 + job->id);
+        tempStr = g_strdup_printf("%s (Rotated)", job->label);
+        gwy_container_set_const_string_by_name(container, id,
+                                               (guchar*)tempStr);
+        g_free(tempStr);
+        g_snprintf(id, sizeof(id), "/%i/data/title", job->id);
+        tempStr = g_strdup_printf("%s (Offset)", job->label);
+        gwy_container_set_const_string_by_name(container, id,
+                                               (guchar*)tempStr);
+        g_free(tempStr);
+    }
+    else {
+        g_snprintf(id, sizeof(id), "/%i/data/title", job->id);
+        gwy_container_set_const_string_by_name(container, id,
+                                               (const guchar*)job->label);
+    }
+    gwy_app_channel_check_nonsquare(container, job->id);
+    gwy_file_channel_import_log_add(container, job->id, NULL, filename);
+    return TRUE;
+}
+
+static void
+height_map_job_free(HeightMapJob *job)
+{
+    guint i;
+
+    GWY_OBJECT_UNREF(job->meta);
+    GWY_OBJECT_UNREF(job->dfield);
+    GWY_OBJECT_UNREF(job->rotated);
+    for (i = 0; i < job->nlevels; i++)
+        g_object_unref(job->pyramid[i]);
+    anasys_file_unref(job->file);
+    g_free(job);
+}
+
+/* Hand the remaining HeightMaps of a successful load over to a background
+ * thread. */
+static void
+start_background(BackgroundLoad *background, GwyContainer *container)
+{
+    GPtrArray *jobs = background->jobs;
+    guint i;
+
+    background->container = container;
+    g_object_weak_ref(G_OBJECT(container), background_container_gone,
+                      background);
+    background->jobs = NULL;
+    background->npending = jobs->len;
+    for (i = 0; i < jobs->len; i++)
+        ((HeightMapJob*)g_ptr_array_index(jobs, i))->background = background;
+    g_thread_unref(g_thread_new("anasys-decode", decode_in_background,
+                                jobs));
+}
+
+/* Free a background load, either never started or with no job pending. */
+static void
+background_free(BackgroundLoad *background)
+{
+    guint i;
+
+    if (background->jobs) {
+        for (i = 0; i < background->jobs->len; i++)
+            height_map_job_free(g_ptr_array_index(background->jobs, i));
+        g_ptr_array_free(background->jobs, TRUE);
+    }
+    if (background->container)
+        g_object_weak_unref(G_OBJECT(background->container),
+                            background_container_gone, background);
+    g_free(background->filename);
+    g_free(background);
+}
+
+static void
+background_container_gone(gpointer data, G_GNUC_UNUSED GObject *where)
+{
+    BackgroundLoad *background = (BackgroundLoad*)data;
+
+    background->container = NULL;
+    g_atomic_int_set(&background->cancelled, TRUE);
+}
+
+/* Background worker: decode the remaining HeightMaps and hand each over to
+ * the main loop as soon as it is done. */
+static gpointer
+decode_in_background(gpointer data)
+{
+    GPtrArray *jobs = (GPtrArray*)data;
+
+    anasys_run_parallel(decode_and_schedule, jobs->pdata, jobs->len, NULL);
+    g_ptr_array_free(jobs, TRUE);
+    return NULL;
+}
+
+/* Jobs of a cancelled load are not decoded, only handed over to be freed. */
+static void
+decode_and_schedule(gpointer item, gpointer user_data)
+{
+    HeightMapJob *job = (HeightMapJob*)item;
+
+    if (!g_atomic_int_get(&job->background->cancelled))
+        decode_height_map(item, user_data);
+    g_idle_add(publish_in_idle, item);
+}
+
+/* Nobody is left to report to after the load has returned, so channels
+ * that fail to decode are logged. */
+static gboolean
+publish_in_idle(gpointer data)
+{
+    HeightMapJob *job = (HeightMapJob*)data;
+    BackgroundLoad *background = job->background;
+    GError *error = NULL;
+
+    if (background->container
+        && !publish_height_map(background->container, job,
+                               background->filename, NULL, &error)) {
+        g_warning("%s: %s", background->filename, error->message);
+        g_clear_error(&error);
+    }
+    height_map_job_free(job);
+    if (!--background->npending)
+        background_free(background);
+    return FALSE;
+}
+
+/* Co-registered channels are not read as stacks (anasys_stack.h): a stack
+ * holds the whole decoded payloads of its channels at once, while here each
+ * channel is decoded a chunk of rows at a time straight into its field and
+ * only the fields are oriented, which is what the memory ledger and the
+ * budget count on.  The stacks are for programs using the library. */
+static guint32
+readHeightMaps(GwyContainer *container, AnasysFile *file,
+               const gchar *filename, const AnasysArgs *args,
+               GwyRunType mode, MemoryLedger *mem,
+               gboolean *cancelled, BackgroundLoad **background,
+               GError **error)
+{
+    const gchar *primary = anasys_file_get_primary_channel(file);
+    guint32 valid_images = 0;
+    guint i, j, n, batch, start = 0;
+    GPtrArray *jobs;
+    HeightMapJob *job;
+
+    jobs = g_ptr_array_new();
+    n = anasys_file_get_n_channels(file);
+    for (i = 0; i < n && !mem->exceeded; i++) {
+        job = read_height_map(file, anasys_file_get_channel(file, i),
+                              args, mem);
+        if (job)
+            g_ptr_array_add(jobs, job);
+    }
+    n = jobs->len;
+    /* The fields must fit in the budget; decoding buffers that do not fit
+     * beside them are spilled instead. */
+    for (i = 0; i < n && !mem->exceeded; i++) {
+        job = g_ptr_array_index(jobs, i);
+        if (args->spill_decoded && mem->budget)
+            job->spill = !mem_try_charge(mem, MEM_DECODED, job->buffer_size);
+        else
+            mem_charge(mem, MEM_DECODED, job->buffer_size);
+    }
+    if (mem->exceeded) {
+        for (i = 0; i < n; i++)
+            height_map_job_free(g_ptr_array_index(jobs, i));
+        g_ptr_array_free(jobs, TRUE);
+        return 0;
+    }
+    /* Whatever the budget has left is for spilled payloads in flight. */
+    if (args->spill_decoded && mem->budget)
+        anasys_file_set_memory_budget(file, mem->budget - mem->total);
+
+    /* Decode the channel the file is shown with first.  The ids stay. */
+    for (i = 0; primary && i < n; i++) {
+        job = g_ptr_array_index(jobs, i);
+        if (g_strcmp0(job->datachannel, primary) == 0) {
+            memmove(jobs->pdata + 1, jobs->pdata, i*sizeof(gpointer));
+            jobs->pdata[0] = job;
+            break;
         }
-        else {
-            xmlPropValue1 = getprop(childNode, "Label");
-            g_snprintf(id, sizeof(id), "/%i/data/title", imageNum);
-            gwy_container_set_const_string_by_name(container, id,
-                                                  (const guchar*)xmlPropValue1);
-            xmlFree(xmlPropValue1);
+    }
+
+    /* Progressively, only the first channel is decoded now.  The others
+     * are left for anasys_load() to decode in the background once the load
+     * has succeeded, and put into the container from the main loop as they
+     * finish.  If the first one fails, all are decoded now. */
+    if (args->progressive && mode == GWY_RUN_INTERACTIVE && n > 1) {
+        job = g_ptr_array_index(jobs, 0);
+        decode_height_map(job, NULL);
+        start = 1;
+        if (publish_height_map(container, job, filename, mem, error)) {
+            height_map_job_free(job);
+            g_ptr_array_remove_index(jobs, 0);
+            *background = g_new0(BackgroundLoad, 1);
+            (*background)->filename = g_strdup(filename);
+            (*background)->jobs = jobs;
+            return 1;
         }
-        gwy_app_channel_check_nonsquare(container, imageNum);
-        gwy_file_channel_import_log_add(container, imageNum, NULL, filename);
-        ++valid_images;
+    }
 
-        g_object_unref(meta);
-        g_object_unref(dfield);
-        g_free(zUnit);
-        g_free(decodedData);
-        g_free(base64DataString);
+    /* Otherwise decode in batches of one channel per core, reporting the
+     * progress and checking for cancellation in between.  Only the first
+     * failure is reported. */
+    batch = MAX(g_get_num_processors(), 1);
+    for (i = start; i < n && !*cancelled; i += batch) {
+        batch = MIN(batch, n - i);
+        anasys_run_parallel(decode_height_map, jobs->pdata + i, batch, NULL);
+        for (j = i; j < i + batch; j++) {
+            job = g_ptr_array_index(jobs, j);
+            if (publish_height_map(container, job, filename, mem,
+                                   error && *error ? NULL : error))
+                valid_images++;
+        }
+        if (mode == GWY_RUN_INTERACTIVE
+            && !gwy_app_wait_set_fraction((gdouble)(i + batch)/n))
+            *cancelled = TRUE;
     }
+    for (i = 0; i < n; i++)
+        height_map_job_free(g_ptr_array_index(jobs, i));
+    g_ptr_array_free(jobs, TRUE);
 
     return valid_images;
 }
 
 static gboolean
-readSpectra(GwyContainer *container, xmlDoc *doc,
-            const xmlNode *curNode)
+readSpectra(GwyContainer *container, AnasysFile *file,
+            const AnasysArgs *args, MemoryLedger *mem)
 {
     gchar id[40];
-    guint32 specID = 0;
-
-    xmlChar *key;
-    xmlChar *xmlPropValue1;
-    xmlNode *dcNode;
-    xmlNode *locNode;
-    xmlNode *subNode;
-    xmlNode *childNode;
-    gsize decoded_size;
+    const AnasysSpectrum *source;
+    const gchar *label, *polarization;
     gdouble location_x;
     gdouble location_y;
-    gdouble startWavenum;
-    gdouble endWavenum;
-    guint32 numDataPoints;
-    guchar *base64SpecString;
-    guchar *decodedData;
-    gchar *tempStr;
-    gchar *label = NULL;
-    gchar *polarization = NULL;
-    gchar *channelName = NULL;
-    gchar **endptr;
-    gdouble *ydata;
-    GwyDataLine *dataline;
-    GwyDataLine *copy_dataline;
     GwySpectra *spectra;
+    GArray *batch, *located = NULL;
+    SpectrumItem item, *itemptr;
+    SpectraChunk *chunks;
+    gpointer *pdata;
+    guint i, n, nchunks;
 
     GwySpectra *spectra_all = gwy_spectra_new();
     gwy_si_unit_set_from_string(gwy_spectra_get_si_unit_xy(spectra_all), "m");
     gwy_spectra_set_spectrum_x_label(spectra_all,
                                      "Wavenumber (cm<sup>-1</sup>)");
     gwy_spectra_set_title(spectra_all, "All Spectra (Polarization): DataChannel");
-    for (childNode = curNode->children;
-         childNode;
-         childNode = childNode->next) {
-        if (childNode->type != XML_ELEMENT_NODE)
-            continue;
-        if (strequal(childNode->name, "IRRenderedSpectra") == 0)
+    batch = g_array_new(FALSE, TRUE, sizeof(SpectrumItem));
+    gwy_clear(&item, 1);
+    /* Only spectra the index finds in the bounding box are looked at. */
+    if (args->filter_xmin > -G_MAXDOUBLE || args->filter_xmax < G_MAXDOUBLE
+        || args->filter_ymin > -G_MAXDOUBLE || args->filter_ymax < G_MAXDOUBLE)
+        located = anasys_file_find_spectra(file,
+                                           args->filter_xmin,
+                                           args->filter_ymin,
+                                           args->filter_xmax,
+                                           args->filter_ymax);
+    n = located ? located->len : anasys_file_get_n_spectra(file);
+    for (i = 0; i < n; i++) {
+        source = anasys_file_get_spectrum(file,
+                                          located
+                                          ? g_array_index(located, guint, i)
+                                          : i);
+        label = anasys_spectrum_get_label(source);
+        polarization = anasys_spectrum_get_polarization(source);
+        anasys_spectrum_get_location(source, &location_x, &location_y);
+        if (!list_matches(args->filter_channels,
+                          anasys_spectrum_get_data_channel(source))
+            || !list_matches(args->filter_labels, label)
+            || !polarization_matches(args->filter_polarizations,
+                                     polarization))
             continue;
+        /* Each spectrum is kept twice, alone and in /sps/0. */
+        if (!mem_charge(mem, MEM_SPECTRA,
+                        2*(guint64)anasys_spectrum_get_n_points(source)
+                        *sizeof(gdouble)))
+            break;
 
-        endptr = 0;
-        xmlPropValue1 = NULL;
-        decoded_size = 0;
-        location_x = 0.0;
-        location_y = 0.0;
-        startWavenum = 0.0;
-        endWavenum = 0.0;
-        numDataPoints = 0;
-
-        for (subNode = childNode->children; subNode; subNode = subNode->next) {
-            if (subNode->type != XML_ELEMENT_NODE)
-                continue;
-            if (strequal(subNode->name, "Label")) {
-                key = xmlNodeListGetString(doc, subNode->xmlChildrenNode, 1);
-                label = g_strdup((gchar*)key);
-                xmlFree(key);
-            }
-            else if (strequal(subNode->name, "DataPoints")) {
-                key = xmlNodeListGetString(doc,
-                                           subNode->xmlChildrenNode, 1);
-                numDataPoints = (guint32)atoi((char*)key);
-                xmlFree(key);
-            }
-            else if (strequal(subNode->name, "StartWavenumber")) {
-                key = xmlNodeListGetString(doc, subNode->xmlChildrenNode, 1);
-                startWavenum = g_ascii_strtod((const gchar*)key, endptr);
-                xmlFree(key);
-            }
-            else if (strequal(subNode->name, "EndWavenumber")) {
-                key = xmlNodeListGetString(doc, subNode->xmlChildrenNode, 1);
-                endWavenum = g_ascii_strtod((const gchar*)key, endptr);
-                xmlFree(key);
-            }
-            else if (strequal(subNode->name, "Polarization")) {
-                key = xmlNodeListGetString(doc, subNode->xmlChildrenNode, 1);
-                polarization = g_strdup((gchar*)key);
-                xmlFree(key);
+        /* Only collect the spectrum here, decoding is done for the whole
+         * batch at once below. */
+        item.id = anasys_spectrum_get_id(source);
+        item.spectrum = source;
+        item.channel = anasys_spectrum_get_data_channel(source);
+        item.title = g_strdup_printf("%s (%s): %s",
+                                     label, polarization, item.channel);
+        item.x = location_x*1.0e-6;
+        item.y = location_y*1.0e-6;
+        g_array_append_val(batch, item);
+    }
+    if (located)
+        g_array_free(located, TRUE);
+
+    if (mem->exceeded) {
+        for (i = 0; i < batch->len; i++) {
+            itemptr = &g_array_index(batch, SpectrumItem, i);
+            g_free(itemptr->title);
+        }
+        g_array_free(batch, TRUE);
+        g_object_unref(spectra_all);
+        return FALSE;
+    }
+
+    /* Decode in chunks on all cores; creating the data lines and their
+     * copies is part of the parallel work too. */
+    nchunks = (batch->len + SPECTRA_CHUNK-1)/SPECTRA_CHUNK;
+    chunks = g_new(SpectraChunk, nchunks);
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].items = &g_array_index(batch, SpectrumItem, i*SPECTRA_CHUNK);
+        chunks[i].n = MIN(SPECTRA_CHUNK, batch->len - i*SPECTRA_CHUNK);
+        chunks[i].args = args;
+    }
+    pdata = g_new(gpointer, nchunks);
+    for (i = 0; i < nchunks; i++)
+        pdata[i] = chunks + i;
+    anasys_run_parallel(decode_spectra_chunk, pdata, nchunks, NULL);
+    g_free(pdata);
+    g_free(chunks);
+
+    /* Insert the results in document order with the original ids. */
+    for (i = 0; i < batch->len; i++) {
+        itemptr = &g_array_index(batch, SpectrumItem, i);
+        if (itemptr->dataline) {
+            spectra = gwy_spectra_new();
+            gwy_si_unit_set_from_string(gwy_spectra_get_si_unit_xy(spectra),
+                                        "m");
+            gwy_spectra_set_spectrum_x_label(spectra,
+                                             "Wavenumber (cm<sup>-1</sup>)");
+            gwy_spectra_set_spectrum_y_label(spectra, itemptr->channel);
+            gwy_spectra_set_title(spectra, itemptr->title);
+            gwy_spectra_add_spectrum(spectra, itemptr->dataline,
+                                     itemptr->x, itemptr->y);
+            gwy_spectra_add_spectrum(spectra_all, itemptr->copy,
+                                     itemptr->x, itemptr->y);
+            g_snprintf(id, sizeof(id), "/sps/%i", itemptr->id);
+            gwy_container_set_object_by_name(container, id, spectra);
+            g_object_unref(spectra);
+            g_object_unref(itemptr->dataline);
+            g_object_unref(itemptr->copy);
+        }
+        g_free(itemptr->title);
+    }
+    g_array_free(batch, TRUE);
+
+    if (gwy_spectra_get_n_spectra(spectra_all))
+        gwy_container_set_object_by_name(container, "/sps/0", spectra_all);
+
+    g_object_unref(spectra_all);
+
+    return TRUE;
+}
+
+/* Spectra worker: decode a chunk of collected spectra. */
+static void
+decode_spectra_chunk(gpointer item, G_GNUC_UNUSED gpointer user_data)
+{
+    SpectraChunk *chunk = (SpectraChunk*)item;
+    SpectrumItem *spectrum;
+    guint i;
+
+    for (i = 0; i < chunk->n; i++) {
+        spectrum = chunk->items + i;
+        spectrum->dataline = decode_spectrum(spectrum->spectrum,
+                                             chunk->args);
+        if (spectrum->dataline)
+            spectrum->copy = gwy_data_line_duplicate(spectrum->dataline);
+    }
+}
+
+/* Decode a spectrum, cropped to the wavenumber filter range.  Only the
+ * part of the payload inside the range is decoded.  Returns NULL if nothing
+ * is left. */
+static GwyDataLine*
+decode_spectrum(const AnasysSpectrum *spectrum, const AnasysArgs *args)
+{
+    GwyDataLine *dataline;
+    gfloat *decodedData;
+    gsize npoints, from, to;
+    gdouble startWavenum, endWavenum, step, lo, hi;
+
+    npoints = anasys_spectrum_get_n_points(spectrum);
+    if (npoints < 1)
+        return NULL;
+    anasys_spectrum_get_wavenumbers(spectrum, &startWavenum, &endWavenum);
+
+    from = 0;
+    to = npoints;
+    step = (endWavenum - startWavenum)/(npoints - 1.0);
+    if ((args->filter_wavenumber_min > -G_MAXDOUBLE
+         || args->filter_wavenumber_max < G_MAXDOUBLE)
+        && npoints > 1 && step != 0.0) {
+        lo = (args->filter_wavenumber_min - startWavenum)/step;
+        hi = (args->filter_wavenumber_max - startWavenum)/step;
+        if (lo > hi)
+            GWY_SWAP(gdouble, lo, hi);
+        if (hi < 0.0 || lo > npoints - 1.0)
+            return NULL;
+        from = (lo > 0.0) ? (gsize)ceil(lo) : 0;
+        to = (hi < npoints - 1.0) ? (gsize)floor(hi) + 1 : npoints;
+        if (from >= to)
+            return NULL;
+    }
+
+    decodedData = g_new(gfloat, to - from);
+    if (!anasys_spectrum_read_data(spectrum, from, to, decodedData, NULL)) {
+        g_free(decodedData);
+        return NULL;
+    }
+    dataline = gwy_data_line_new(to - from, step*(to - from), TRUE);
+    gwy_data_line_set_offset(dataline, startWavenum + from*step);
+    gwy_convert_raw_data(decodedData, to - from, 1,
+                         GWY_RAW_DATA_FLOAT, GWY_BYTE_ORDER_NATIVE,
+                         gwy_data_line_get_data(dataline), 1.0, 0.0);
+    g_free(decodedData);
+    return dataline;
+}
+
+/* Check whether value is among the semicolon-separated items of list.  An
+ * empty list lets everything through. */
+static gboolean
+list_matches(const gchar *list, const gchar *value)
+{
+    const gchar *item, *end;
+    gsize len;
+
+    if (!list || !*list)
+        return TRUE;
+    if (!value)
+        return FALSE;
+
+    len = strlen(value);
+    for (item = list; item; item = end ? end + 1 : NULL) {
+        end = strchr(item, ';');
+        if ((end ? (gsize)(end - item) : strlen(item)) == len
+            && strncmp(item, value, len) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Like list_matches(), but compare the polarizations as angles. */
+static gboolean
+polarization_matches(const gchar *list, const gchar *value)
+{
+    const gchar *item;
+    gchar *end;
+    gdouble angle;
+
+    if (!list || !*list)
+        return TRUE;
+    if (!value)
+        return FALSE;
+
+    angle = g_ascii_strtod(value, NULL);
+    for (item = list; item; item = strchr(item, ';')) {
+        if (*item == ';')
+            item++;
+        if (fabs(g_ascii_strtod(item, &end) - angle) < 1e-6 && end != item)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+series_file_free(SeriesFile *sfile)
+{
+    g_free(sfile->filename);
+    if (sfile->channels)
+        g_ptr_array_free(sfile->channels, TRUE);
+    anasys_file_unref(sfile->file);
+    g_clear_error(&sfile->error);
+    g_free(sfile);
+}
+
+static gboolean
+parse_timestamp(const gchar *str, gint64 *timestamp)
+{
+    GDateTime *datetime;
+
+    if (!str || !(datetime = g_date_time_new_from_iso8601(str, NULL)))
+        return FALSE;
+    *timestamp = g_date_time_to_unix(datetime)*G_USEC_PER_SEC
+                 + g_date_time_get_microsecond(datetime);
+    g_date_time_unref(datetime);
+    return TRUE;
+}
+
+/* Series worker: parse one file, unless it is the one already opened, and
+ * take what is needed to stack its HeightMaps.  The payloads stay encoded in
+ * the document until the frames are decoded. */
+static void
+read_series_file(gpointer item, gpointer user_data)
+{
+    const AnasysArgs *args = (const AnasysArgs*)user_data;
+    SeriesFile *sfile = (SeriesFile*)item;
+    SeriesChannel *channel;
+    const AnasysChannel *source;
+    guint i, n;
+
+    sfile->channels = g_ptr_array_new_with_free_func(g_free);
+    if (!sfile->file
+        && !(sfile->file = open_file(sfile->filename, sfile->flags, args,
+                                     &sfile->error)))
+        return;
+
+    n = anasys_file_get_n_channels(sfile->file);
+    for (i = 0; i < n; i++) {
+        source = anasys_file_get_channel(sfile->file, i);
+        channel = g_new0(SeriesChannel, 1);
+        channel->source = source;
+        channel->datachannel = anasys_channel_get_data_channel(source);
+        channel->label = anasys_channel_get_label(source);
+        channel->unit = anasys_channel_get_unit(source);
+        channel->q = anasys_channel_get_unit_multiplier(source);
+        anasys_channel_get_resolution(source, &channel->xres, &channel->yres);
+        anasys_channel_get_size(source, &channel->xreal, &channel->yreal);
+        anasys_channel_get_position(source, &channel->pos_x, &channel->pos_y);
+        channel->scan_angle = anasys_channel_get_scan_angle(source);
+        if (!sfile->has_timestamp) {
+            sfile->has_timestamp
+                = parse_timestamp(anasys_channel_find_meta(source,
+                                                           "TimeStamp"),
+                                  &sfile->timestamp);
+        }
+        g_ptr_array_add(sfile->channels, channel);
+    }
+}
+
+/* Series worker: decode one frame straight into its plane of the brick,
+ * flipped the same way orient_field() flips channels. */
+static void
+decode_series_frame(gpointer item, G_GNUC_UNUSED gpointer user_data)
+{
+    SeriesFrame *frame = (SeriesFrame*)item;
+    SeriesChannel *channel = frame->channel;
+    guint xres = channel->xres, yres = channel->yres, i, j, r, n, nrows;
+    GwyDataField *dfield = NULL;
+    gfloat *buffer;
+    gdouble *row;
+
+    /* Turned frames are converted into a field first, the others straight
+     * into the plane, a chunk of rows at a time. */
+    if (channel->scan_angle == 90.0 || channel->scan_angle == -90.0)
+        dfield = gwy_data_field_new(xres, yres, xres, yres, FALSE);
+    nrows = CLAMP(DECODE_CHUNK/(xres*sizeof(gfloat)), 1, yres);
+    buffer = g_new(gfloat, (gsize)nrows*xres);
+    for (r = 0; r < yres; r += n) {
+        n = MIN(nrows, yres - r);
+        if (!anasys_channel_read_rows(channel->source, r, n, buffer, NULL))
+            break;
+        if (dfield) {
+            convert_data(buffer, r, n, dfield, channel->q, 0.0, 0.0,
+                         NULL, NULL);
+            continue;
+        }
+        for (i = r; i < r + n; i++) {
+            /* Flipping rows is free when writing them in reverse order. */
+            row = frame->plane
+                  + (gsize)(channel->scan_angle == 0.0 ? yres-1 - i : i)*xres;
+            gwy_convert_raw_data(buffer + (gsize)(i - r)*xres, xres, 1,
+                                 GWY_RAW_DATA_FLOAT,
+                                 GWY_BYTE_ORDER_NATIVE,
+                                 row, channel->q, 0.0);
+            if (channel->scan_angle == 180.0) {
+                for (j = 0; j < xres/2; j++)
+                    GWY_SWAP(gdouble, row[j], row[xres-1 - j]);
             }
-            else if (strequal(subNode->name, "Location")) {
-                for (locNode = subNode->children;
-                     locNode;
-                     locNode = locNode->next) {
-                    if (locNode->type != XML_ELEMENT_NODE)
-                        continue;
-                    key = xmlNodeListGetString(doc,
-                                               locNode->xmlChildrenNode, 1);
-                    if (strequal(locNode->name, "X"))
-                        location_x = g_ascii_strtod((const gchar*)key, endptr);
-                    else if (strequal(locNode->name, "Y"))
-                        location_y = g_ascii_strtod((const gchar*)key, endptr);
-                    xmlFree(key);
-                }
+        }
+    }
+    g_free(buffer);
+    if (r < yres) {
+        GWY_OBJECT_UNREF(dfield);
+        return;
+    }
+    frame->ok = TRUE;
+
+    if (dfield) {
+        dfield = orient_field(dfield, channel->scan_angle);
+        memcpy(frame->plane, gwy_data_field_get_data_const(dfield),
+               (gsize)xres*yres*sizeof(gdouble));
+        g_object_unref(dfield);
+    }
+}
+
+static gint
+compare_series_files(gconstpointer pa, gconstpointer pb)
+{
+    const SeriesFile *a = *(const SeriesFile**)pa;
+    const SeriesFile *b = *(const SeriesFile**)pb;
+
+    if (a->has_timestamp != b->has_timestamp)
+        return a->has_timestamp ? -1 : 1;
+    if (a->timestamp != b->timestamp)
+        return a->timestamp < b->timestamp ? -1 : 1;
+    return strcmp(a->filename, b->filename);
+}
+
+static gboolean
+series_layouts_match(const SeriesFile *a, const SeriesFile *b)
+{
+    const SeriesChannel *ca, *cb;
+    guint i;
+
+    if (a->channels->len != b->channels->len)
+        return FALSE;
+    for (i = 0; i < a->channels->len; i++) {
+        ca = g_ptr_array_index(a->channels, i);
+        cb = g_ptr_array_index(b->channels, i);
+        if (g_strcmp0(ca->datachannel, cb->datachannel)
+            || ca->xres != cb->xres || ca->yres != cb->yres
+            || ca->xreal != cb->xreal || ca->yreal != cb->yreal
+            || ca->scan_angle != cb->scan_angle)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Find the other series members: the semicolon-separated names or glob
+ * patterns are taken relative to the directory of the opened file, which is
+ * always a member itself but is not listed. */
+static GPtrArray*
+find_series_files(const gchar *filename, const gchar *series_files,
+                  GError **error)
+{
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    gchar *dirname = g_path_get_dirname(filename);
+    gchar *basename = g_path_get_basename(filename);
+    gchar *defpattern = NULL, **patterns;
+    GPatternSpec *pspec;
+    const gchar *name;
+    GError *err = NULL;
+    GDir *dir;
+    guint i;
+
+    if (!series_files || !*series_files) {
+        defpattern = g_strconcat("*",
+                                 g_str_has_suffix(filename, EXTENSION)
+                                 ? EXTENSION : EXTENSION2, NULL);
+        series_files = defpattern;
+    }
+    g_hash_table_add(seen, basename);
+
+    patterns = g_strsplit(series_files, ";", -1);
+    for (i = 0; patterns[i]; i++) {
+        g_strstrip(patterns[i]);
+        if (!*patterns[i])
+            continue;
+        if (!strchr(patterns[i], '*') && !strchr(patterns[i], '?')) {
+            if (!g_hash_table_contains(seen, patterns[i])) {
+                g_hash_table_add(seen, g_strdup(patterns[i]));
+                g_ptr_array_add(files,
+                                g_path_is_absolute(patterns[i])
+                                ? g_strdup(patterns[i])
+                                : g_build_filename(dirname, patterns[i],
+                                                   NULL));
             }
-            else if (strequal(subNode->name, "DataChannels")) {
-                ++specID;
-                base64SpecString = NULL;
-                spectra = gwy_spectra_new();
-                gwy_si_unit_set_from_string(gwy_spectra_get_si_unit_xy(spectra), "m");
-                gwy_spectra_set_spectrum_x_label(spectra,
-                                                 "Wavenumber (cm<sup>-1</sup>)");
-
-                xmlPropValue1 = getprop(subNode, "DataChannel");
-                gwy_spectra_set_spectrum_y_label(spectra,
-                                                 (gchar*)xmlPropValue1);
-                channelName = g_strdup((gchar*)xmlPropValue1);
-                xmlFree(xmlPropValue1);
-                for (dcNode = subNode->children;
-                     dcNode;
-                     dcNode = dcNode->next) {
-                    if (dcNode->type != XML_ELEMENT_NODE)
-                        continue;
-                    if (strequal(dcNode->name, "SampleBase64")) {
-                        key = xmlNodeListGetString(doc,
-                                                   dcNode->xmlChildrenNode, 1);
-                        base64SpecString = (guchar*)g_strdup((gchar*)key);
-                        xmlFree(key);
-                        break;
-                    }
-                }
-
-                tempStr = g_strdup_printf("%s (%s): %s", label, polarization, channelName);
-                gwy_spectra_set_title(spectra, tempStr);
-                g_free(channelName);
-                g_free(tempStr);
-
-                if (!base64SpecString) {
-                    g_object_unref(spectra);
-                    continue;
-                }
-                if (numDataPoints < 1) {
-                    g_object_unref(spectra);
-                    g_free(base64SpecString);
-                    continue;
-                }
-                decodedData = g_base64_decode((const gchar*)base64SpecString,
-                                              &decoded_size);
-                numDataPoints = decoded_size / sizeof(gfloat);
-                if (numDataPoints < 1) {
-                    g_object_unref(spectra);
-                    g_free(decodedData);
-                    g_free(base64SpecString);
-                    continue;
-                }
-                dataline = gwy_data_line_new(numDataPoints,
-                    (endWavenum-startWavenum)*(1.0+(1.0/((gdouble)numDataPoints-1.0))),
-                    TRUE);
-                gwy_data_line_set_offset(dataline, startWavenum);
-                ydata = gwy_data_line_get_data(dataline);
-                gwy_convert_raw_data(decodedData, numDataPoints, 1,
-                                     GWY_RAW_DATA_FLOAT, GWY_BYTE_ORDER_LITTLE_ENDIAN,
-                                     ydata, 1.0, 0.0);
-                g_free(decodedData);
-
-                copy_dataline = gwy_data_line_duplicate(dataline);
-                gwy_spectra_add_spectrum(spectra, dataline,
-                                         location_x*1.0e-6, location_y*1.0e-6);
-                gwy_spectra_add_spectrum(spectra_all, copy_dataline,
-                                         location_x*1.0e-6, location_y*1.0e-6);
-
-                g_snprintf(id, sizeof(id), "/sps/%i", specID);
-                gwy_container_set_object_by_name(container, id, spectra);
-
-                g_object_unref(spectra);
-                g_object_unref(dataline);
-                g_object_unref(copy_dataline);
-                g_free(base64SpecString);
+            continue;
+        }
+        if (!(dir = g_dir_open(dirname, 0, &err))) {
+            err_GET_FILE_CONTENTS(error, &err);
+            g_ptr_array_free(files, TRUE);
+            files = NULL;
+            break;
+        }
+        pspec = g_pattern_spec_new(patterns[i]);
+        while ((name = g_dir_read_name(dir))) {
+            if (g_pattern_match_string(pspec, name)
+                && !g_hash_table_contains(seen, name)) {
+                g_ptr_array_add(files,
+                                g_build_filename(dirname, name, NULL));
+                g_hash_table_add(seen, g_strdup(name));
             }
         }
-        g_free(label);
-        g_free(polarization);
+        g_pattern_spec_free(pspec);
+        g_dir_close(dir);
     }
-    if (specID > 0)
-        gwy_container_set_object_by_name(container, "/sps/0", spectra_all);
 
-    g_object_unref(spectra_all);
+    g_hash_table_destroy(seen);
+    g_strfreev(patterns);
+    g_free(defpattern);
+    g_free(dirname);
+    return files;
+}
+
+/* Stack the HeightMaps of a whole file series into one brick per channel.
+ * The other files are parsed concurrently, their layouts checked against
+ * each other and sorted by TimeStamp; the frames are then decoded
+ * concurrently right into the preallocated bricks.  The opened file, with
+ * its document already charged, is the first member. */
+static guint
+load_series(GwyContainer *container, const gchar *filename, AnasysFile *file,
+            const AnasysArgs *args, MemoryLedger *mem, GError **error)
+{
+    GPtrArray *files, *sfiles, *frames;
+    SeriesFile *sfile, *first;
+    SeriesChannel *channel;
+    SeriesFrame *frame;
+    GwyBrick **bricks;
+    GwyDataLine *zcal;
+    GwyDataField *preview;
+    GwyContainer *meta;
+    gdouble *zcaldata;
+    gdouble width, height;
+    guint64 doc_size, text_size, brick_size;
+    guint nfiles, nchannels, nframes, nthreads, i, k;
+    gboolean timed, ok = TRUE;
+    gchar id[40];
+    gchar *tempStr;
+
+    if (!(files = find_series_files(filename, args->series_files, error)))
+        return 0;
+
+    nfiles = files->len + 1;
+    sfiles = g_ptr_array_new();
+    sfile = g_new0(SeriesFile, 1);
+    sfile->filename = g_strdup(filename);
+    sfile->file = anasys_file_ref(file);
+    g_ptr_array_add(sfiles, sfile);
+    for (i = 1; i < nfiles; i++) {
+        sfile = g_new0(SeriesFile, 1);
+        sfile->filename = g_strdup(g_ptr_array_index(files, i-1));
+        sfile->docsize = estimate_document_size(sfile->filename);
+        g_ptr_array_add(sfiles, sfile);
+    }
+    g_ptr_array_free(files, TRUE);
+
+    /* The files are already opened in parallel.  Each holds its text twice
+     * while it is parsed, so the budget must have room for that many of the
+     * largest ones or the backgrounds are not shared. */
+    text_size = 0;
+    for (i = 1; i < nfiles; i++) {
+        sfile = g_ptr_array_index(sfiles, i);
+        sfile->flags = open_flags(args, sfile->docsize)
+                       & ~ANASYS_OPEN_PARALLEL;
+        if (sfile->flags & TEXT_OPEN_FLAGS)
+            text_size = MAX(text_size, 2*sfile->docsize);
+    }
+    nthreads = MIN(nfiles, g_get_num_processors());
+    text_size *= nthreads;
+    if (text_size && !mem_try_charge(mem, MEM_DOCUMENT, text_size)) {
+        for (i = 0; i < nfiles; i++) {
+            sfile = g_ptr_array_index(sfiles, i);
+            sfile->flags &= ~TEXT_OPEN_FLAGS;
+        }
+        text_size = 0;
+    }
+    anasys_run_parallel(read_series_file, sfiles->pdata, nfiles,
+                        (gpointer)args);
+    mem_release(mem, MEM_DOCUMENT, text_size);
+    for (i = 0; i < nfiles && ok; i++) {
+        sfile = g_ptr_array_index(sfiles, i);
+        if (sfile->error) {
+            g_set_error(error, GWY_MODULE_FILE_ERROR,
+                        GWY_MODULE_FILE_ERROR_DATA,
+                        _("Cannot read series file `%s': %s"),
+                        sfile->filename, sfile->error->message);
+            ok = FALSE;
+        }
+    }
+    g_ptr_array_sort(sfiles, compare_series_files);
+
+    first = g_ptr_array_index(sfiles, 0);
+    nchannels = first->channels->len;
+    for (i = 0; i < nfiles && ok; i++) {
+        sfile = g_ptr_array_index(sfiles, i);
+        if (!nchannels || !series_layouts_match(first, sfile)) {
+            g_set_error(error, GWY_MODULE_FILE_ERROR,
+                        GWY_MODULE_FILE_ERROR_DATA,
+                        _("File `%s' does not match the channel layout "
+                          "of the series."), sfile->filename);
+            ok = FALSE;
+        }
+    }
+    /* The documents of the other files, with the payloads, are held until
+     * the bricks are filled. */
+    doc_size = brick_size = 0;
+    for (i = 0; i < nfiles && ok; i++) {
+        sfile = g_ptr_array_index(sfiles, i);
+        doc_size += sfile->docsize;
+        for (k = 0; k < nchannels; k++) {
+            channel = g_ptr_array_index(sfile->channels, k);
+            brick_size += (guint64)channel->xres*channel->yres
+                          *sizeof(gdouble);
+        }
+    }
+    if (ok && (!mem_charge(mem, MEM_DOCUMENT, doc_size)
+               || !mem_charge(mem, MEM_FIELDS, brick_size)))
+        ok = FALSE;
+    if (!ok) {
+        for (i = 0; i < nfiles; i++)
+            series_file_free(g_ptr_array_index(sfiles, i));
+        g_ptr_array_free(sfiles, TRUE);
+        return 0;
+    }
+
+    /* The z axis is time, relative to the earliest file, if all files have
+     * a TimeStamp; the untimed ones sort last.  Otherwise it is the frame
+     * number. */
+    sfile = g_ptr_array_index(sfiles, nfiles-1);
+    timed = sfile->has_timestamp;
+    zcal = gwy_data_line_new(nfiles, nfiles, FALSE);
+    zcaldata = gwy_data_line_get_data(zcal);
+    for (i = 0; i < nfiles; i++) {
+        sfile = g_ptr_array_index(sfiles, i);
+        zcaldata[i] = timed
+                      ? (sfile->timestamp - first->timestamp)
+                        /(gdouble)G_USEC_PER_SEC
+                      : i;
+    }
+    if (timed)
+        gwy_si_unit_set_from_string(gwy_data_line_get_si_unit_y(zcal), "s");
+
+    bricks = g_new(GwyBrick*, nchannels);
+    frames = g_ptr_array_new_with_free_func(g_free);
+    for (k = 0; k < nchannels; k++) {
+        channel = g_ptr_array_index(first->channels, k);
+        if (channel->scan_angle == 90.0 || channel->scan_angle == -90.0) {
+            width = channel->yreal;
+            height = channel->xreal;
+            bricks[k] = gwy_brick_new(channel->yres, channel->xres, nfiles,
+                                      width*1.0e-6, height*1.0e-6, nfiles,
+                                      TRUE);
+        }
+        else {
+            width = channel->xreal;
+            height = channel->yreal;
+            bricks[k] = gwy_brick_new(channel->xres, channel->yres, nfiles,
+                                      width*1.0e-6, height*1.0e-6, nfiles,
+                                      TRUE);
+        }
+        /* Placed like the channel of a single file, where data at other
+         * than right angles only has its rotated copy placed. */
+        if (channel->scan_angle == 0.0 || channel->scan_angle == 180.0
+            || channel->scan_angle == 90.0 || channel->scan_angle == -90.0) {
+            gwy_brick_set_xoffset(bricks[k],
+                                  (channel->pos_x - 0.5*width)*1.0e-6);
+            gwy_brick_set_yoffset(bricks[k],
+                                  (channel->pos_y - 0.5*height)*1.0e-6);
+        }
+        else {
+            gwy_brick_set_xoffset(bricks[k], 1.0);
+            gwy_brick_set_yoffset(bricks[k], 1.0);
+        }
+        gwy_si_unit_set_from_string(gwy_brick_get_si_unit_x(bricks[k]), "m");
+        gwy_si_unit_set_from_string(gwy_brick_get_si_unit_y(bricks[k]), "m");
+        gwy_si_unit_set_from_string(gwy_brick_get_si_unit_w(bricks[k]),
+                                    channel->unit);
+        gwy_brick_set_zcalibration(bricks[k], zcal);
+
+        for (i = 0; i < nfiles; i++) {
+            sfile = g_ptr_array_index(sfiles, i);
+            frame = g_new0(SeriesFrame, 1);
+            frame->channel = g_ptr_array_index(sfile->channels, k);
+            frame->plane = gwy_brick_get_data(bricks[k])
+                           + (gsize)i*channel->xres*channel->yres;
+            g_ptr_array_add(frames, frame);
+        }
+    }
+    nframes = frames->len;
+    anasys_run_parallel(decode_series_frame, frames->pdata, nframes, NULL);
+    for (i = 0; i < nframes && ok; i++) {
+        frame = g_ptr_array_index(frames, i);
+        if (!frame->ok) {
+            sfile = g_ptr_array_index(sfiles, i % nfiles);
+            g_set_error(error, GWY_MODULE_FILE_ERROR,
+                        GWY_MODULE_FILE_ERROR_DATA,
+                        _("Data size in file `%s' does not match "
+                          "its resolution."), sfile->filename);
+            ok = FALSE;
+        }
+    }
+    g_ptr_array_free(frames, TRUE);
+
+    for (k = 0; k < nchannels; k++) {
+        if (!ok) {
+            g_object_unref(bricks[k]);
+            continue;
+        }
+        channel = g_ptr_array_index(first->channels, k);
+        g_snprintf(id, sizeof(id), "/brick/%i", k);
+        gwy_container_set_object_by_name(container, id, bricks[k]);
+        g_snprintf(id, sizeof(id), "/brick/%i/title", k);
+        tempStr = g_strdup_printf("%s (Series)", channel->label);
+        gwy_container_set_const_string_by_name(container, id,
+                                               (guchar*)tempStr);
+        g_free(tempStr);
+        preview = gwy_data_field_new(1, 1, 1.0, 1.0, FALSE);
+        gwy_brick_extract_xy_plane(bricks[k], preview, 0);
+        g_snprintf(id, sizeof(id), "/brick/%i/preview", k);
+        gwy_container_set_object_by_name(container, id, preview);
+        g_object_unref(preview);
+
+        meta = gwy_container_new();
+        gwy_container_set_const_string_by_name(meta, "DataChannel",
+                                        (const guchar*)channel->datachannel);
+        for (i = 0; i < nfiles; i++) {
+            sfile = g_ptr_array_index(sfiles, i);
+            tempStr = g_strdup_printf("Frame_%u", i);
+            gwy_container_set_const_string_by_name(meta, tempStr,
+                                            (const guchar*)sfile->filename);
+            g_free(tempStr);
+        }
+        g_snprintf(id, sizeof(id), "/brick/%i/meta", k);
+        gwy_container_set_object_by_name(container, id, meta);
+        g_object_unref(meta);
+        gwy_file_volume_import_log_add(container, k, NULL, filename);
+        g_object_unref(bricks[k]);
+    }
+
+    g_free(bricks);
+    g_object_unref(zcal);
+    for (i = 0; i < nfiles; i++)
+        series_file_free(g_ptr_array_index(sfiles, i));
+    g_ptr_array_free(sfiles, TRUE);
+    mem_release(mem, MEM_DOCUMENT, doc_size);
+    return ok ? nchannels : 0;
+}
+
+/* Complete the spectral matrix grid from the first spectrum of the opened
+ * file.  Fails if the file has none and the grid is not fully given. */
+static gboolean
+spectral_grid(AnasysFile *file, const AnasysArgs *args, SpectralGrid *grid)
+{
+    const AnasysSpectrum *first = NULL;
+
+    if (anasys_file_get_n_spectra(file)) {
+        first = anasys_file_get_spectrum(file, 0);
+        anasys_spectrum_get_wavenumbers(first, &grid->start, &grid->end);
+        grid->npoints = anasys_spectrum_get_n_points(first);
+        grid->datachannel
+            = g_strdup(anasys_spectrum_get_data_channel(first));
+    }
+    if (args->filter_wavenumber_min > -G_MAXDOUBLE
+        && args->filter_wavenumber_max < G_MAXDOUBLE) {
+        grid->start = args->filter_wavenumber_min;
+        grid->end = args->filter_wavenumber_max;
+    }
+    else if (!first)
+        return FALSE;
+    if (args->spectral_points)
+        grid->npoints = args->spectral_points;
+    return grid->npoints > 0;
+}
 
+/* Gather the spectra of the series files into one image, a row per
+ * spectrum on the common grid, in pixels as the axes have different
+ * units; the grid is in the metadata. */
+static gboolean
+load_spectral_matrix(GwyContainer *container, const gchar *filename,
+                     const AnasysArgs *args, const SpectralGrid *grid,
+                     MemoryLedger *mem, GError **error)
+{
+    AnasysSpectralMatrix *matrix;
+    GwyDataField *dfield, *mask;
+    GwyContainer *meta;
+    GPtrArray *files;
+    GError *err = NULL;
+    guint nrows, nfiles;
+    gchar *tempStr;
+
+    if (!(files = find_series_files(filename, args->series_files, error)))
+        return FALSE;
+    g_ptr_array_insert(files, 0, g_strdup(filename));
+    nfiles = files->len;
+    matrix = anasys_spectral_matrix_read((const gchar *const*)files->pdata,
+                                         nfiles, grid->datachannel,
+                                         grid->start, grid->end,
+                                         grid->npoints, &err);
+    g_ptr_array_free(files, TRUE);
+    if (!matrix) {
+        g_set_error(error, GWY_MODULE_FILE_ERROR, GWY_MODULE_FILE_ERROR_DATA,
+                    _("Cannot read the spectral matrix: %s"), err->message);
+        g_clear_error(&err);
+        return FALSE;
+    }
+    nrows = anasys_spectral_matrix_get_n_rows(matrix);
+    if (!nrows) {
+        anasys_spectral_matrix_free(matrix);
+        err_NO_DATA(error);
+        return FALSE;
+    }
+    if (!mem_charge(mem, MEM_FIELDS,
+                    (guint64)nrows*grid->npoints*sizeof(gdouble))) {
+        anasys_spectral_matrix_free(matrix);
+        return FALSE;
+    }
+
+    dfield = gwy_data_field_new(grid->npoints, nrows, grid->npoints, nrows,
+                                FALSE);
+    gwy_convert_raw_data(anasys_spectral_matrix_get_data(matrix),
+                         (gsize)nrows*grid->npoints, 1,
+                         GWY_RAW_DATA_FLOAT, GWY_BYTE_ORDER_NATIVE,
+                         gwy_data_field_get_data(dfield), 1.0, 0.0);
+    anasys_spectral_matrix_free(matrix);
+    if ((mask = gwy_app_channel_mask_of_nans(dfield, TRUE))) {
+        gwy_container_set_object_by_name(container, "/0/mask", mask);
+        g_object_unref(mask);
+    }
+    gwy_container_set_object_by_name(container, "/0/data", dfield);
+    g_object_unref(dfield);
+    tempStr = g_strdup_printf("Spectra (Matrix): %s",
+                              grid->datachannel ? grid->datachannel : "All");
+    gwy_container_set_const_string_by_name(container, "/0/data/title",
+                                           (guchar*)tempStr);
+    g_free(tempStr);
+
+    meta = gwy_container_new();
+    if (grid->datachannel)
+        gwy_container_set_const_string_by_name(meta, "DataChannel",
+                                               (guchar*)grid->datachannel);
+    gwy_container_set_string_by_name(meta, "StartWavenumber",
+                                     (guchar*)g_strdup_printf("%g cm-1",
+                                                              grid->start));
+    gwy_container_set_string_by_name(meta, "EndWavenumber",
+                                     (guchar*)g_strdup_printf("%g cm-1",
+                                                              grid->end));
+    gwy_container_set_string_by_name(meta, "Files",
+                                     (guchar*)g_strdup_printf("%u", nfiles));
+    gwy_container_set_object_by_name(container, "/0/meta", meta);
+    g_object_unref(meta);
+    gwy_file_channel_import_log_add(container, 0, NULL, filename);
     return TRUE;
 }
 
+/* Average 2x2 blocks of two adjacent rows into one row of n values. */
+static inline void
+downsample_rows(const gdouble *upper, const gdouble *lower,
+                gdouble *dest, guint n)
+{
+    guint j;
+
+    for (j = 0; j < n; j++)
+        dest[j] = 0.25*((upper[2*j] + upper[2*j + 1])
+                        + (lower[2*j] + lower[2*j + 1]));
+}
+
+/* Parse a number stored as metadata string, zero if there is none. */
+static gdouble
+get_meta_double(GwyContainer *meta, const gchar *key)
+{
+    const guchar *str;
+    gdouble value;
+
+    if (!gwy_container_gis_string_by_name(meta, key, &str))
+        return 0.0;
+    value = g_ascii_strtod((const gchar*)str, NULL);
+    return isfinite(value) ? value : 0.0;
+}
+
+/* Turn a vector in the frame of the imported image into the frame of the
+ * scan as decoded, undoing the flips and quarter turns of orient_field(), or
+ * the rotation for other scan angles.  Right angles are exact. */
+static void
+to_scan_frame(gdouble scan_angle, gdouble *x, gdouble *y)
+{
+    gdouble c, s, vx = *x, vy = *y;
+
+    if (scan_angle == 0.0 || scan_angle == 180.0
+        || scan_angle == 90.0 || scan_angle == -90.0) {
+        c = (scan_angle == 0.0) - (scan_angle == 180.0);
+        s = (scan_angle == 90.0) - (scan_angle == -90.0);
+    }
+    else {
+        c = cos(PI_over_180*scan_angle);
+        s = sin(PI_over_180*scan_angle);
+    }
+    *x = c*vx + s*vy;
+    *y = s*vx - c*vy;
+}
+
+/* Start statistics, seeding the histogram range with the finite ZMin and
+ * ZMax of the file if there are any. */
+static void
+stats_init(ChannelStats *stats, GwyContainer *meta, gdouble q)
+{
+    const guchar *str;
+    gdouble zmin = G_MAXDOUBLE, zmax = -G_MAXDOUBLE;
+
+    gwy_clear(stats, 1);
+    stats->min = G_MAXDOUBLE;
+    stats->max = -G_MAXDOUBLE;
+    if (gwy_container_gis_string_by_name(meta, "ZMin", &str))
+        zmin = q*g_ascii_strtod((const gchar*)str, NULL);
+    if (gwy_container_gis_string_by_name(meta, "ZMax", &str))
+        zmax = q*g_ascii_strtod((const gchar*)str, NULL);
+    if (isfinite(zmin) && isfinite(zmax) && zmax > zmin) {
+        stats->hmin = zmin;
+        stats->hbin = (zmax - zmin)/HISTOGRAM_BINS;
+    }
+}
+
+/* Double the histogram range, towards lower values if down is TRUE. */
+static void
+stats_widen_histogram(ChannelStats *stats, gboolean down)
+{
+    guint half = HISTOGRAM_BINS/2, k;
+    gsize *hist = stats->hist;
+
+    if (down) {
+        for (k = HISTOGRAM_BINS; k-- > half; )
+            hist[k] = hist[2*k - HISTOGRAM_BINS]
+                      + hist[2*k - HISTOGRAM_BINS + 1];
+        gwy_clear(hist, half);
+        stats->hmin -= HISTOGRAM_BINS*stats->hbin;
+    }
+    else {
+        for (k = 0; k < half; k++)
+            hist[k] = hist[2*k] + hist[2*k + 1];
+        gwy_clear(hist + half, half);
+    }
+    stats->hbin *= 2.0;
+}
+
+static void
+stats_add_row(ChannelStats *stats, const gdouble *row, guint n)
+{
+    gdouble min = G_MAXDOUBLE, max = -G_MAXDOUBLE, sum = 0.0, sum2 = 0.0;
+    gdouble v, hmin, hbin;
+    gsize nfinite = 0;
+    guint j;
+    gint k;
+
+    /* Plain reductions the compiler can vectorise. */
+    for (j = 0; j < n; j++) {
+        v = row[j];
+        if (isfinite(v)) {
+            min = MIN(min, v);
+            max = MAX(max, v);
+            sum += v;
+            sum2 += v*v;
+            nfinite++;
+        }
+    }
+    if (nfinite < n) {
+        for (j = 0; j < n; j++) {
+            if (isnan(row[j]))
+                stats->nnan++;
+            else if (isinf(row[j]))
+                stats->ninf++;
+        }
+    }
+    if (!nfinite)
+        return;
+
+    stats->min = MIN(stats->min, min);
+    stats->max = MAX(stats->max, max);
+    stats->sum += sum;
+    stats->sum2 += sum2;
+    stats->n += nfinite;
+
+    if (!stats->hbin) {
+        stats->hmin = min;
+        stats->hbin = (max > min) ? (max - min)/HISTOGRAM_BINS
+                                  : MAX(fabs(min)*1e-9, G_MINDOUBLE);
+    }
+    while (min < stats->hmin)
+        stats_widen_histogram(stats, TRUE);
+    while (max >= stats->hmin + HISTOGRAM_BINS*stats->hbin)
+        stats_widen_histogram(stats, FALSE);
+
+    hmin = stats->hmin;
+    hbin = stats->hbin;
+    for (j = 0; j < n; j++) {
+        v = row[j];
+        if (isfinite(v)) {
+            k = (gint)((v - hmin)/hbin);
+            stats->hist[CLAMP(k, 0, HISTOGRAM_BINS-1)]++;
+        }
+    }
+}
+
+static void
+set_meta_value(GwyContainer *meta, const gchar *key, gdouble value,
+               const gchar *unit)
+{
+    gchar *str = g_strdup_printf("%g%s%s", value,
+                                 unit ? " " : "", unit ? unit : "");
+
+    gwy_container_set_string_by_name(meta, key, (const guchar*)str);
+}
+
+/* Store the statistics in channel metadata and attach the histogram to the
+ * field.  Like the pyramid it is derived from the data, so it is not put
+ * into the container, which would save it into files. */
+static void
+stats_finish(ChannelStats *stats, GwyDataField *dfield, GwyContainer *meta,
+             const gchar *unit)
+{
+    GwyDataLine *histogram;
+    gdouble *hdata;
+    gdouble mean;
+    guint k;
+
+    if (stats->n) {
+        mean = stats->sum/stats->n;
+        set_meta_value(meta, "Stats_Min", stats->min, unit);
+        set_meta_value(meta, "Stats_Max", stats->max, unit);
+        set_meta_value(meta, "Stats_Mean", mean, unit);
+        set_meta_value(meta, "Stats_RMS",
+                       sqrt(MAX(stats->sum2/stats->n - mean*mean, 0.0)),
+                       unit);
+    }
+    set_meta_value(meta, "Stats_NaN", stats->nnan, NULL);
+    set_meta_value(meta, "Stats_Inf", stats->ninf, NULL);
+    if (!stats->n)
+        return;
+
+    histogram = gwy_data_line_new(HISTOGRAM_BINS,
+                                  HISTOGRAM_BINS*stats->hbin, FALSE);
+    gwy_data_line_set_offset(histogram, stats->hmin);
+    hdata = gwy_data_line_get_data(histogram);
+    for (k = 0; k < HISTOGRAM_BINS; k++)
+        hdata[k] = stats->hist[k];
+    gwy_si_unit_set_from_string(gwy_data_line_get_si_unit_x(histogram), unit);
+    g_object_set_data_full(G_OBJECT(dfield), "anasys-histogram", histogram,
+                           g_object_unref);
+}
+
+/* Produce row i of the field shifted by (sx, sy) pixels, interpolating
+ * linearly between the raw data rows.  Samples that would come from outside
+ * the field repeat its edge. */
+static void
+convert_shifted_row(const gfloat *buffer, gdouble *scratch, gdouble *row,
+                    guint xres, guint yres, guint i, gdouble q,
+                    gdouble sx, gdouble sy)
+{
+    gdouble *r0 = scratch, *r1 = scratch + xres;
+    gdouble y = CLAMP(i - sy, 0.0, yres - 1.0), fy, fx;
+    guint i0 = (guint)floor(y), i1 = MIN(i0 + 1, yres - 1), j, jlo, jhi;
+    gint j0;
+
+    fy = y - i0;
+    gwy_convert_raw_data(buffer + (gsize)i0*xres, xres, 1,
+                         GWY_RAW_DATA_FLOAT, GWY_BYTE_ORDER_NATIVE,
+                         r0, q, 0.0);
+    if (fy > 0.0) {
+        gwy_convert_raw_data(buffer + (gsize)i1*xres, xres, 1,
+                             GWY_RAW_DATA_FLOAT, GWY_BYTE_ORDER_NATIVE,
+                             r1, q, 0.0);
+        for (j = 0; j < xres; j++)
+            r0[j] = (1.0 - fy)*r0[j] + fy*r1[j];
+    }
+
+    /* Row value j comes from j + j0 + fx; only the middle part reads two
+     * neighbours and it is a plain loop the compiler can vectorise. */
+    sx = CLAMP(sx, -(gdouble)xres, (gdouble)xres);
+    j0 = (gint)floor(-sx);
+    fx = -sx - j0;
+    jlo = CLAMP(-j0, 0, (gint)xres);
+    jhi = CLAMP((gint)xres - 1 - j0, 0, (gint)xres);
+    jhi = MAX(jhi, jlo);
+    for (j = 0; j < jlo; j++)
+        row[j] = r0[0];
+    for (j = jlo; j < jhi; j++)
+        row[j] = (1.0 - fx)*r0[j + j0] + fx*r0[j + j0 + 1];
+    for (j = jhi; j < xres; j++)
+        row[j] = r0[xres-1];
+}
+
+/* Convert little endian floats to the field data row by row, buffer
+ * holding the nrows rows from row on.  The rows are shifted linearly with
+ * time, i.e. row index, up to the full drift given in pixels at the last
+ * row, which needs all rows in buffer.  If half is given, it is filled with
+ * 2x2 averages of each finished row pair; if stats is given, each row is
+ * added to them. */
+static void
+convert_data(const gfloat *buffer, guint row, guint nrows,
+             GwyDataField *dfield, gdouble q,
+             gdouble drift_x, gdouble drift_y,
+             GwyDataField *half, ChannelStats *stats)
+{
+    guint xres = gwy_data_field_get_xres(dfield);
+    guint yres = gwy_data_field_get_yres(dfield);
+    gdouble *data = gwy_data_field_get_data(dfield);
+    gdouble *hdata = NULL, *scratch = NULL;
+    guint hxres = 0, hyres = 0, i;
+    gdouble t;
+
+    if (!isfinite(drift_x) || !isfinite(drift_y))
+        drift_x = drift_y = 0.0;
+    g_return_if_fail((!drift_x && !drift_y) || (row == 0 && nrows == yres));
+    if (drift_x || drift_y)
+        scratch = g_new(gdouble, 2*xres);
+    if (half) {
+        hdata = gwy_data_field_get_data(half);
+        hxres = gwy_data_field_get_xres(half);
+        hyres = gwy_data_field_get_yres(half);
+    }
+    for (i = row; i < row + nrows; i++) {
+        if (scratch) {
+            t = (yres > 1) ? i/(yres - 1.0) : 0.0;
+            convert_shifted_row(buffer, scratch, data + (gsize)i*xres,
+                                xres, yres, i, q, t*drift_x, t*drift_y);
+        }
+        else
+            gwy_convert_raw_data(buffer + (gsize)(i - row)*xres,
+                                 xres, 1, GWY_RAW_DATA_FLOAT,
+                                 GWY_BYTE_ORDER_NATIVE,
+                                 data + (gsize)i*xres, q, 0.0);
+        if (stats)
+            stats_add_row(stats, data + (gsize)i*xres, xres);
+        if (hdata && (i & 1) && i/2 < hyres)
+            downsample_rows(data + (gsize)(i - 1)*xres, data + (gsize)i*xres,
+                            hdata + (gsize)(i/2)*hxres, hxres);
+    }
+    g_free(scratch);
+}
+
+/* Create an empty field with half the resolution and twice the pixel size.
+ * An odd last row or column is dropped, so the real size may shrink. */
+static GwyDataField*
+new_half_field(GwyDataField *dfield)
+{
+    guint xres = gwy_data_field_get_xres(dfield)/2;
+    guint yres = gwy_data_field_get_yres(dfield)/2;
+    gdouble dx = gwy_data_field_get_xreal(dfield)
+                 /gwy_data_field_get_xres(dfield);
+    gdouble dy = gwy_data_field_get_yreal(dfield)
+                 /gwy_data_field_get_yres(dfield);
+    GwyDataField *half;
+
+    half = gwy_data_field_new(xres, yres, 2.0*dx*xres, 2.0*dy*yres, FALSE);
+    gwy_data_field_copy_units(dfield, half);
+    return half;
+}
+
+static GwyDataField*
+downsample(GwyDataField *dfield)
+{
+    GwyDataField *half = new_half_field(dfield);
+    guint xres = gwy_data_field_get_xres(dfield);
+    guint hxres = gwy_data_field_get_xres(half);
+    guint hyres = gwy_data_field_get_yres(half);
+    const gdouble *data = gwy_data_field_get_data_const(dfield);
+    gdouble *hdata = gwy_data_field_get_data(half);
+    guint i;
+
+    for (i = 0; i < hyres; i++)
+        downsample_rows(data + (gsize)2*i*xres, data + (gsize)(2*i + 1)*xres,
+                        hdata + (gsize)i*hxres, hxres);
+    return half;
+}
+
+/* Flip or rotate the field for the right-angle scan angles.  The field is
+ * consumed and the result returned; other angles leave it as it is. */
+static GwyDataField*
+orient_field(GwyDataField *dfield, gdouble scan_angle)
+{
+    GwyDataField *dfield_temp;
+
+    if (scan_angle == 0.0)
+        gwy_data_field_invert(dfield, TRUE, FALSE, FALSE);
+    else if (scan_angle == 180.0)
+        gwy_data_field_invert(dfield, FALSE, TRUE, FALSE);
+    else if (scan_angle == 90.0 || scan_angle == -90.0) {
+        dfield_temp = dfield;
+        dfield = gwy_data_field_new_rotated_90(dfield, scan_angle < 0.0);
+        g_object_unref(dfield_temp);
+        gwy_data_field_invert(dfield, TRUE, FALSE, FALSE);
+    }
+    return dfield;
+}
+
 /* vim: set cin et ts=4 sw=4 cino=>1s,e0,n0,f0,{0,}0,^0,\:1s,=0,g1s,h0,t0,+1s,c3,(0,u0 : */